@@ -9,15 +9,24 @@
 #include "commands/MagnetInfoCommand.hpp"
 #include "commands/MagnetDownloadPieceCommand.hpp"
 #include "commands/MagnetDownloadCommand.hpp"
+#include "commands/BenchmarkCommand.hpp"
+#include "commands/SeedCommand.hpp"
 #include "manager/CommandManager.hpp"
 #include <iostream>
+#include <set>
+#include <csignal>
+
+// Options that take no value
+static const std::set<std::string> FLAG_OPTIONS = {"--sequential", "--io-uring", "--utp", "--suppress-have"};
 
 CommandOptions parseCommandOptions(int argc, char* argv[]) {
     CommandOptions options;
     
     for (int i = 2; i < argc; i++) {
         std::string arg = argv[i];
-        if (arg[0] == '-') {  // This is an option
+        if (FLAG_OPTIONS.contains(arg)) {
+            options.options[arg] = "";
+        } else if (arg[0] == '-') {  // This is an option
             if (i + 1 < argc) {  // Make sure we have a value after the option
                 options.options[arg] = argv[i + 1];
                 i++;  // Skip the next argument since it's the option value
@@ -36,6 +45,9 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // Peer sockets can be shut down under a sender; report EPIPE instead of dying
+    std::signal(SIGPIPE, SIG_IGN);
+
     std::string command = argv[1];
     CommandOptions options = parseCommandOptions(argc, argv);
 
@@ -51,6 +63,8 @@ int main(int argc, char* argv[]) {
     manager.registerCommand("magnet_info", std::make_unique<MagnetInfoCommand>());
     manager.registerCommand("magnet_download_piece", std::make_unique<MagnetDownloadPieceCommand>());
     manager.registerCommand("magnet_download", std::make_unique<MagnetDownloadCommand>());
+    manager.registerCommand("benchmark", std::make_unique<BenchmarkCommand>());
+    manager.registerCommand("seed", std::make_unique<SeedCommand>());
     manager.executeCommand(command, options);
 
     return 0;
@@ -0,0 +1,775 @@
+#include "BenchmarkCommand.hpp"
+#include "../manager/PieceManager.hpp"
+#include "../manager/PeerManager.hpp"
+#include "../manager/DownloadManager.hpp"
+#include "../manager/SeedManager.hpp"
+#include "SeedCommand.hpp"
+#include "../net/EpollTransport.hpp"
+#include "../net/UtpSocket.hpp"
+#include "../protocol/PeerMessageType.hpp"
+#include "../utils/PeerUtils.hpp"
+#include "../utils/SHA1.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include "../utils/ThreadPool.hpp"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+
+namespace {
+
+const int PIECE_LENGTH = 256 * 1024;
+
+bool readFull(int fd, uint8_t* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t received = recv(fd, buffer + total, length - total, 0);
+        if (received <= 0) {
+            return false;
+        }
+        total += received;
+    }
+    return true;
+}
+
+bool writeFull(int fd, const uint8_t* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t sent = send(fd, buffer + total, length - total, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        total += sent;
+    }
+    return true;
+}
+
+// Seeds an in-memory torrent on 127.0.0.1 with one thread per connection
+class LoopbackSeeder {
+public:
+    LoopbackSeeder(const std::vector<uint8_t>& data, const std::string& info_hash)
+        : data(data), info_hash(info_hash) {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_length = sizeof(addr);
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd, 64) < 0 ||
+            getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_length) < 0) {
+            if (listen_fd >= 0) close(listen_fd);
+            throw std::runtime_error("Failed to start loopback seeder");
+        }
+        port = ntohs(addr.sin_port);
+        accept_thread = std::thread(&LoopbackSeeder::acceptLoop, this);
+    }
+
+    ~LoopbackSeeder() {
+        shutdown(listen_fd, SHUT_RDWR);  // Unblocks accept
+        accept_thread.join();
+        close(listen_fd);
+        for (auto& thread : connection_threads) {
+            thread.join();  // Each ends when its client hangs up
+        }
+    }
+
+    int getPort() const { return port; }
+
+private:
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                return;
+            }
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            std::lock_guard<std::mutex> lock(mutex);
+            connection_threads.emplace_back(&LoopbackSeeder::serve, this, fd);
+        }
+    }
+
+    void serve(int fd) {
+        uint8_t handshake[68];
+        if (readFull(fd, handshake, sizeof(handshake))) {
+            std::memcpy(handshake + 48, "-BM0001-benchmarking", 20);
+            writeFull(fd, handshake, sizeof(handshake));
+
+            int total_pieces = (data.size() + PIECE_LENGTH - 1) / PIECE_LENGTH;
+            std::vector<uint8_t> bitfield(5 + (total_pieces + 7) / 8, 0);
+            PeerUtils::addIntToPayload(bitfield, bitfield.size() - 4, 0);
+            bitfield[4] = PeerMessageType::BITFIELD;
+            for (int i = 0; i < total_pieces; ++i) {
+                bitfield[5 + i / 8] |= 0x80 >> (i % 8);
+            }
+            writeFull(fd, bitfield.data(), bitfield.size());
+            serveRequests(fd);
+        }
+        close(fd);
+    }
+
+    void serveRequests(int fd) {
+        uint8_t header[4];
+        std::vector<uint8_t> body;
+        while (readFull(fd, header, 4)) {
+            uint32_t length = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+            if (length == 0) {
+                continue;
+            }
+            body.resize(length);
+            if (!readFull(fd, body.data(), length)) {
+                return;
+            }
+
+            if (body[0] == PeerMessageType::INTERESTED) {
+                uint8_t unchoke[5] = {0, 0, 0, 1, PeerMessageType::UNCHOKE};
+                writeFull(fd, unchoke, sizeof(unchoke));
+            } else if (body[0] == PeerMessageType::REQUEST && length == 13) {
+                int index = (body[1] << 24) | (body[2] << 16) | (body[3] << 8) | body[4];
+                int begin = (body[5] << 24) | (body[6] << 16) | (body[7] << 8) | body[8];
+                int block_length = (body[9] << 24) | (body[10] << 16) | (body[11] << 8) | body[12];
+
+                uint8_t piece_header[13];
+                PeerUtils::addIntToPayload(piece_header, 9 + block_length, 0);
+                piece_header[4] = PeerMessageType::PIECE;
+                PeerUtils::addIntToPayload(piece_header, index, 5);
+                PeerUtils::addIntToPayload(piece_header, begin, 9);
+                iovec parts[2] = {
+                    {piece_header, sizeof(piece_header)},
+                    {const_cast<uint8_t*>(data.data()) + static_cast<size_t>(index) * PIECE_LENGTH + begin,
+                     static_cast<size_t>(block_length)},
+                };
+                size_t expected = parts[0].iov_len + parts[1].iov_len;
+                ssize_t sent = writev(fd, parts, 2);
+                if (sent < 0) {
+                    return;
+                }
+                // Finish a short writev piecewise
+                if (static_cast<size_t>(sent) < expected) {
+                    size_t done = sent;
+                    if (done < sizeof(piece_header) &&
+                        !writeFull(fd, piece_header + done, sizeof(piece_header) - done)) {
+                        return;
+                    }
+                    size_t body_done = done > sizeof(piece_header) ? done - sizeof(piece_header) : 0;
+                    if (!writeFull(fd, static_cast<uint8_t*>(parts[1].iov_base) + body_done,
+                                   block_length - body_done)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    const std::vector<uint8_t>& data;
+    const std::string info_hash;
+    int listen_fd = -1;
+    int port = 0;
+    std::thread accept_thread;
+    std::mutex mutex;
+    std::vector<std::thread> connection_threads;
+};
+
+// Deterministic content and its piece hashes
+struct LoopbackTorrent {
+    std::vector<uint8_t> data;
+    int total_pieces;
+    std::string pieces_hash;
+    std::string info_hash;
+
+    explicit LoopbackTorrent(int size_mib) : data(static_cast<size_t>(size_mib) * 1024 * 1024) {
+        total_pieces = (data.size() + PIECE_LENGTH - 1) / PIECE_LENGTH;
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = static_cast<uint8_t>((i * 2654435761u) >> 24);
+        }
+        for (int i = 0; i < total_pieces; ++i) {
+            size_t offset = static_cast<size_t>(i) * PIECE_LENGTH;
+            auto hash = SHA1::calculate(data.data() + offset, std::min<size_t>(PIECE_LENGTH, data.size() - offset));
+            pieces_hash.append(reinterpret_cast<const char*>(hash.data()), hash.size());
+        }
+        auto info_digest = SHA1::calculate(std::string("loopback benchmark"));
+        info_hash.assign(reinterpret_cast<const char*>(info_digest.data()), info_digest.size());
+    }
+};
+
+// Seeds the torrent over uTP from an event loop of its own, through the link shim
+class UtpLoopbackSeeder {
+public:
+    UtpLoopbackSeeder(const std::vector<uint8_t>& data, const UtpSocket::LinkShim& shim)
+        : data(data), socket(std::make_unique<UtpSocket>(loop)) {
+        socket->setLinkShim(shim);
+        socket->listen([this](int handle, const PeerEndpoint&) {
+            sessions.push_back(std::make_unique<Session>(*this, handle));
+            socket->setHandler(handle, sessions.back().get());
+        });
+        thread = std::thread([this]() { loop.run(); });
+    }
+
+    ~UtpLoopbackSeeder() {
+        stop();
+        for (auto& session : sessions) {
+            socket->close(session->handle);
+            close(session->handle);
+        }
+    }
+
+    void stop() {
+        if (thread.joinable()) {
+            loop.stop();
+            thread.join();
+        }
+    }
+
+    int getPort() const { return socket->getPort(); }
+    UtpSocket::Stats getStats() const { return socket->getStats(); }  // After stop()
+
+private:
+    struct Session : TransportHandler {
+        UtpLoopbackSeeder& seeder;
+        int handle;
+        std::vector<uint8_t> input;
+        bool handshaken = false;
+
+        Session(UtpLoopbackSeeder& seeder, int handle) : seeder(seeder), handle(handle) {}
+        void onReceive(const uint8_t* bytes, size_t length) override {
+            input.insert(input.end(), bytes, bytes + length);
+            seeder.serve(*this);
+        }
+        void onTransportError(const std::string&) override { seeder.socket->close(handle); }
+    };
+
+    void serve(Session& session) {
+        size_t offset = 0;
+        std::vector<uint8_t> reply;
+        if (!session.handshaken) {
+            if (session.input.size() < 68) {
+                return;
+            }
+            reply.assign(session.input.begin(), session.input.begin() + 68);
+            std::memcpy(reply.data() + 48, "-BM0001-benchmarking", 20);
+            int total_pieces = (data.size() + PIECE_LENGTH - 1) / PIECE_LENGTH;
+            size_t bitfield_offset = reply.size();
+            reply.resize(bitfield_offset + 5 + (total_pieces + 7) / 8, 0);
+            PeerUtils::addIntToPayload(reply.data() + bitfield_offset, 1 + (total_pieces + 7) / 8, 0);
+            reply[bitfield_offset + 4] = PeerMessageType::BITFIELD;
+            for (int i = 0; i < total_pieces; ++i) {
+                reply[bitfield_offset + 5 + i / 8] |= 0x80 >> (i % 8);
+            }
+            session.handshaken = true;
+            offset = 68;
+        }
+
+        const std::vector<uint8_t>& input = session.input;
+        while (input.size() - offset >= 4) {
+            const uint8_t* frame = input.data() + offset;
+            uint32_t length = (frame[0] << 24) | (frame[1] << 16) | (frame[2] << 8) | frame[3];
+            if (input.size() - offset - 4 < length) {
+                break;
+            }
+            offset += 4 + length;
+            if (length == 0) {
+                continue;
+            }
+            const uint8_t* body = frame + 4;
+            if (body[0] == PeerMessageType::INTERESTED) {
+                reply.insert(reply.end(), {0, 0, 0, 1, PeerMessageType::UNCHOKE});
+            } else if (body[0] == PeerMessageType::REQUEST && length == 13) {
+                int index = (body[1] << 24) | (body[2] << 16) | (body[3] << 8) | body[4];
+                int begin = (body[5] << 24) | (body[6] << 16) | (body[7] << 8) | body[8];
+                int block_length = (body[9] << 24) | (body[10] << 16) | (body[11] << 8) | body[12];
+                uint8_t piece_header[13];
+                PeerUtils::addIntToPayload(piece_header, 9 + block_length, 0);
+                piece_header[4] = PeerMessageType::PIECE;
+                PeerUtils::addIntToPayload(piece_header, index, 5);
+                PeerUtils::addIntToPayload(piece_header, begin, 9);
+                const uint8_t* block = data.data() + static_cast<size_t>(index) * PIECE_LENGTH + begin;
+                reply.insert(reply.end(), piece_header, piece_header + sizeof(piece_header));
+                reply.insert(reply.end(), block, block + block_length);
+            }
+        }
+        session.input.erase(session.input.begin(), session.input.begin() + offset);
+        if (!reply.empty()) {
+            socket->send(session.handle, reply.data(), reply.size());
+        }
+    }
+
+    const std::vector<uint8_t>& data;
+    EventLoop loop;
+    std::unique_ptr<UtpSocket> socket;
+    std::vector<std::unique_ptr<Session>> sessions;
+    std::thread thread;
+};
+
+// What a seeder child process used to serve a download
+struct UploadCost {
+    bool ok = false;
+    double cpu_seconds = 0;  // User and system, every thread
+    int64_t cycles = -1;     // -1 without a readable cycle counter
+    Transport::Stats transport;
+};
+
+// Counts CPU cycles of the calling thread and every thread it starts from
+// now on; -1 where the PMU isn't available, as in most VMs
+int openCycleCounter() {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+// Seeds path in a forked process, so its CPU use is measured apart from the
+// downloader's. Writes the port to the results pipe, waits for the control
+// pipe to close, then writes its UploadCost. Returns the child's pid.
+pid_t forkSeeder(const std::string& info_hash, int fd, int64_t length, UploadPath path,
+                 const int (&control_pipe)[2], const int (&results_pipe)[2]) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    close(control_pipe[1]);
+    close(results_pipe[0]);
+    int control = control_pipe[0];
+    int results = results_pipe[1];
+    UploadCost cost;
+    int port = 0;
+    try {
+        int counter = openCycleCounter();
+        rusage before{};
+        getrusage(RUSAGE_SELF, &before);
+        {
+            SeedOptions options;
+            options.port = 0;
+            options.upload_path = path;
+            options.verbose = false;
+            SeedManager seeder(options);
+            int pieces = static_cast<int>((length + PIECE_LENGTH - 1) / PIECE_LENGTH);
+            seeder.addTorrent(info_hash, fd, PIECE_LENGTH, length, std::vector<bool>(pieces, true));
+            seeder.start();
+            port = seeder.getPort();
+            write(results, &port, sizeof(port));
+            uint8_t done;
+            while (read(control, &done, 1) < 0 && errno == EINTR) {
+            }
+            seeder.stop();
+            cost.transport = seeder.getStats().transport;
+        }  // Its threads have exited, so their cycles are in the counter
+        rusage after{};
+        getrusage(RUSAGE_SELF, &after);
+        auto seconds = [](const timeval& t) { return t.tv_sec + t.tv_usec / 1e6; };
+        cost.cpu_seconds = seconds(after.ru_utime) - seconds(before.ru_utime) +
+                           seconds(after.ru_stime) - seconds(before.ru_stime);
+        if (counter >= 0) {
+            int64_t cycles = 0;
+            if (read(counter, &cycles, sizeof(cycles)) == sizeof(cycles)) {
+                cost.cycles = cycles;
+            }
+        }
+        cost.ok = true;
+    } catch (const std::exception& e) {
+        std::cerr << "Seeder failed: " << e.what() << std::endl;
+        if (port == 0) {
+            write(results, &port, sizeof(port));
+        }
+    }
+    write(results, &cost, sizeof(cost));
+    _exit(cost.ok ? 0 : 1);
+}
+
+struct BenchmarkResult {
+    std::string path;
+    double seconds;
+    uint64_t syscalls;  // On the thread that drove the sockets
+};
+
+}
+
+void BenchmarkCommand::execute(const CommandOptions& options) {
+    if (options.args.empty()) {
+        throw std::runtime_error("Expected: benchmark <transport|utp|ratelimit|upload>");
+    }
+    try {
+        if (options.args[0] == "transport") {
+            benchmarkTransport(options);
+        } else if (options.args[0] == "utp") {
+            benchmarkUtp(options);
+        } else if (options.args[0] == "ratelimit") {
+            benchmarkRateLimit(options);
+        } else if (options.args[0] == "upload") {
+            benchmarkUpload(options);
+        } else {
+            throw std::runtime_error("Unknown benchmark: " + options.args[0]);
+        }
+    } catch (const std::exception& e) {
+        throw std::runtime_error("Benchmark failed: " + std::string(e.what()));
+    }
+}
+
+void BenchmarkCommand::benchmarkTransport(const CommandOptions& options) {
+    int size_mib = options.options.contains("--size") ? std::stoi(options.options.at("--size")) : 64;
+    int peer_count = options.options.contains("--peers") ? std::stoi(options.options.at("--peers")) : 1;
+    LoopbackTorrent torrent(size_mib);
+    const int64_t total_length = torrent.data.size();
+    const int total_pieces = torrent.total_pieces;
+    const std::string& info_hash = torrent.info_hash;
+    const std::string& pieces_hash = torrent.pieces_hash;
+
+    LoopbackSeeder seeder(torrent.data, info_hash);
+    auto connect = [&]() {
+        auto peer = std::make_unique<PeerManager>("127.0.0.1", seeder.getPort(), info_hash);
+        if (!peer->connect()) {
+            throw std::runtime_error("Failed to connect to the loopback seeder");
+        }
+        return peer;
+    };
+
+    std::vector<BenchmarkResult> results;
+
+    // Blocking path: one connection, downloadPiece in a loop, hashing off-thread
+    {
+        PieceManager piece_manager(total_pieces, PIECE_LENGTH, total_length, info_hash, pieces_hash);
+        auto peer = connect();
+        piece_manager.addPeerAvailability(peer->getAvailability());
+        ThreadPool hash_pool(1);
+
+        auto started = std::chrono::steady_clock::now();
+        uint64_t syscalls_before = SyscallCounter::threadSyscalls();
+        int index;
+        while ((index = piece_manager.getNextPiece([&peer](int i) { return peer->hasPiece(i); })) != -1) {
+            PooledBuffer buffer = piece_manager.acquireBuffer(index);
+            if (!peer->downloadPiece(index, piece_manager.getPieceLength(index), *buffer)) {
+                throw std::runtime_error("Blocking download failed");
+            }
+            piece_manager.markPieceDownloaded(index);
+            auto shared = std::make_shared<PooledBuffer>(std::move(buffer));
+            hash_pool.submit([&piece_manager, index, shared]() {
+                piece_manager.savePieceData(index, std::move(*shared));
+            });
+        }
+        if (!piece_manager.waitForCompletion()) {
+            throw std::runtime_error(piece_manager.getAbortReason());
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        results.push_back({"blocking", elapsed.count(), SyscallCounter::threadSyscalls() - syscalls_before});
+    }
+
+    // Event loop paths
+    for (bool io_uring : {false, true}) {
+        PieceManager piece_manager(total_pieces, PIECE_LENGTH, total_length, info_hash, pieces_hash);
+        std::vector<std::unique_ptr<PeerManager>> peers;
+        for (int i = 0; i < peer_count; ++i) {
+            peers.push_back(connect());
+        }
+
+        DownloadOptions download_options;
+        download_options.io_uring = io_uring;
+        download_options.verbose = false;
+        DownloadManager manager(piece_manager, peers, download_options);
+
+        auto started = std::chrono::steady_clock::now();
+        manager.start();
+        bool completed = piece_manager.waitForCompletion();
+        manager.stop();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        if (!completed) {
+            throw std::runtime_error(piece_manager.getAbortReason());
+        }
+        results.push_back({manager.getTransportName(), elapsed.count(), manager.getLoopSyscalls()});
+    }
+
+    std::cout << "Loopback transport benchmark: " << size_mib << " MiB, "
+              << PIECE_LENGTH / 1024 << " KiB pieces, " << peer_count << " connection(s) on the event loop"
+              << std::endl;
+    std::cout << std::left << std::setw(12) << "path" << std::right << std::setw(12) << "MiB/s"
+              << std::setw(16) << "syscalls/MiB" << std::endl;
+    for (const auto& result : results) {
+        std::cout << std::left << std::setw(12) << result.path << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(12) << size_mib / result.seconds
+                  << std::setw(16) << static_cast<double>(result.syscalls) / size_mib << std::endl;
+    }
+}
+
+void BenchmarkCommand::benchmarkUtp(const CommandOptions& options) {
+    auto option = [&options](const std::string& name, double fallback) {
+        return options.options.contains(name) ? std::stod(options.options.at(name)) : fallback;
+    };
+    int size_mib = static_cast<int>(option("--size", 16));
+    UtpSocket::LinkShim shim;
+    shim.delay = std::chrono::microseconds(static_cast<int64_t>(option("--delay", 0) * 1000));
+    shim.rate = option("--rate", 0) * 1024;
+    shim.loss = option("--loss", 0) / 100;
+
+    LoopbackTorrent torrent(size_mib);
+    UtpLoopbackSeeder seeder(torrent.data, shim);
+    PieceManager piece_manager(torrent.total_pieces, PIECE_LENGTH, torrent.data.size(), torrent.info_hash,
+                               torrent.pieces_hash);
+    std::vector<std::unique_ptr<PeerManager>> peers;
+    DownloadOptions download_options;
+    download_options.utp = true;
+    download_options.verbose = false;
+    DownloadManager manager(piece_manager, peers, download_options);
+    manager.addCandidates(torrent.info_hash, {{"127.0.0.1", seeder.getPort()}});
+
+    auto started = std::chrono::steady_clock::now();
+    manager.start();
+    bool completed = piece_manager.waitForCompletion();
+    manager.stop();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    seeder.stop();
+    if (!completed) {
+        throw std::runtime_error(piece_manager.getAbortReason());
+    }
+
+    // The seeder did the sending, so its side saw the congestion control work
+    UtpSocket::Stats stats = seeder.getStats();
+    double queuing_ms = stats.delay_samples > 0 ? stats.queuing_delay_total / 1000.0 / stats.delay_samples : 0;
+    std::cout << "uTP loopback benchmark: " << size_mib << " MiB, seeder link: "
+              << shim.delay.count() / 1000.0 << " ms one way, "
+              << (shim.rate > 0 ? std::to_string(static_cast<int64_t>(shim.rate / 1024)) + " KiB/s" : "unlimited")
+              << ", " << shim.loss * 100 << "% loss" << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+              << "Throughput: " << size_mib / elapsed.count() << " MiB/s in " << elapsed.count() << " s" << std::endl
+              << "Seeder: " << stats.packets_sent << " packets, " << stats.retransmits << " resent, "
+              << stats.timeouts << " timeouts, mean queuing delay " << queuing_ms << " ms (target "
+              << UtpSocket::TARGET_DELAY.count() / 1000 << " ms)" << std::endl;
+}
+
+void BenchmarkCommand::benchmarkRateLimit(const CommandOptions& options) {
+    auto option = [&options](const std::string& name, double fallback) {
+        return options.options.contains(name) ? std::stod(options.options.at(name)) : fallback;
+    };
+    int size_mib = static_cast<int>(option("--size", 8));
+    int peer_count = static_cast<int>(option("--peers", 4));
+    RateLimits limits;
+    limits.download = option("--limit", 2048) * 1024;
+    limits.upload = limits.download;
+    limits.peer_download = option("--peer-limit", 0) * 1024;
+    if (limits.download <= 0) {
+        throw std::runtime_error("--limit must be positive");
+    }
+    LoopbackTorrent torrent(size_mib);
+
+    struct Result {
+        std::string direction;
+        double target;  // Bytes per second
+        double seconds;
+    };
+    std::vector<Result> results;
+
+    // Download: every peer's session paced by its own bucket under the torrent's
+    {
+        LoopbackSeeder seeder(torrent.data, torrent.info_hash);
+        PieceManager piece_manager(torrent.total_pieces, PIECE_LENGTH, torrent.data.size(), torrent.info_hash,
+                                   torrent.pieces_hash);
+        std::vector<std::unique_ptr<PeerManager>> peers;
+        for (int i = 0; i < peer_count; ++i) {
+            peers.push_back(std::make_unique<PeerManager>("127.0.0.1", seeder.getPort(), torrent.info_hash));
+            if (!peers.back()->connect()) {
+                throw std::runtime_error("Failed to connect to the loopback seeder");
+            }
+        }
+        DownloadOptions download_options;
+        download_options.verbose = false;
+        download_options.limits = limits;
+        DownloadManager manager(piece_manager, peers, download_options);
+
+        auto started = std::chrono::steady_clock::now();
+        manager.start();
+        bool completed = piece_manager.waitForCompletion();
+        manager.stop();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        if (!completed) {
+            throw std::runtime_error(piece_manager.getAbortReason());
+        }
+        double target = limits.download;
+        if (limits.peer_download > 0) {
+            target = std::min(target, limits.peer_download * peer_count);
+        }
+        results.push_back({"download", target, elapsed.count()});
+    }
+
+    // Upload: one socket written through the transport, drained by a plain reader
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+            throw std::runtime_error("socketpair failed");
+        }
+        int flags = fcntl(fds[1], F_GETFL, 0);
+        fcntl(fds[1], F_SETFL, flags & ~O_NONBLOCK);
+
+        struct Sink : TransportHandler {
+            void onReceive(const uint8_t*, size_t) override {}
+            void onTransportError(const std::string&) override {}
+        } sink;
+        EventLoop loop;
+        EpollTransport transport(loop);
+        RateLimiter upload_limiter(nullptr, limits.upload);
+        std::vector<uint8_t> data = torrent.data;
+
+        auto started = std::chrono::steady_clock::now();
+        std::thread reader([&]() {
+            std::vector<uint8_t> buffer(256 * 1024);
+            size_t total = 0;
+            while (total < torrent.data.size()) {
+                ssize_t received = recv(fds[1], buffer.data(), buffer.size(), 0);
+                if (received <= 0) {
+                    break;
+                }
+                total += received;
+            }
+            loop.stop();
+        });
+        loop.post([&]() {
+            transport.attach(fds[0], &sink);
+            transport.setRateLimits(fds[0], nullptr, &upload_limiter);
+            transport.send(fds[0], data);
+        });
+        loop.run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        reader.join();
+        transport.detach(fds[0]);
+        close(fds[0]);
+        close(fds[1]);
+        results.push_back({"upload", limits.upload, elapsed.count()});
+    }
+
+    std::cout << "Rate limit benchmark: " << size_mib << " MiB over loopback, " << peer_count
+              << " peer(s) downloading" << std::endl;
+    std::cout << std::left << std::setw(12) << "direction" << std::right << std::setw(14) << "target KiB/s"
+              << std::setw(14) << "actual KiB/s" << std::setw(10) << "error" << std::endl;
+    for (const auto& result : results) {
+        double actual = torrent.data.size() / result.seconds;
+        std::cout << std::left << std::setw(12) << result.direction << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(14) << result.target / 1024 << std::setw(14)
+                  << actual / 1024 << std::setw(9) << (actual - result.target) / result.target * 100 << "%"
+                  << std::endl;
+    }
+}
+
+void BenchmarkCommand::benchmarkUpload(const CommandOptions& options) {
+    int size_mib = options.options.contains("--size") ? std::stoi(options.options.at("--size")) : 128;
+    int peer_count = options.options.contains("--peers") ? std::stoi(options.options.at("--peers")) : 1;
+    std::vector<std::pair<std::string, UploadPath>> paths = {
+        {"copy", UploadPath::COPY}, {"sendfile", UploadPath::SENDFILE}, {"mmap", UploadPath::MMAP}};
+    if (options.options.contains("--path")) {
+        std::string name = options.options.at("--path");
+        paths = {{name, SeedCommand::parseUploadPath(name)}};
+    }
+
+    // The seeders serve a real file, which the write leaves in the page cache
+    LoopbackTorrent torrent(size_mib);
+    char file_name[] = "/tmp/bittorrent-upload-XXXXXX";
+    int fd = mkstemp(file_name);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create a temporary file");
+    }
+    unlink(file_name);
+    const int64_t total_length = torrent.data.size();
+    for (int64_t done = 0; done < total_length;) {
+        ssize_t written = write(fd, torrent.data.data() + done, total_length - done);
+        if (written <= 0) {
+            close(fd);
+            throw std::runtime_error("Failed to write the temporary file");
+        }
+        done += written;
+    }
+
+    std::cout << "Upload benchmark: " << size_mib << " MiB from a file, " << PIECE_LENGTH / 1024
+              << " KiB pieces, " << peer_count << " connection(s)" << std::endl;
+    std::cout << std::left << std::setw(12) << "path" << std::right << std::setw(12) << "MiB/s"
+              << std::setw(16) << "CPU ms/GiB" << std::setw(16) << "Mcycles/GiB" << std::endl;
+    const double gib = total_length / (1024.0 * 1024.0 * 1024.0);
+    for (const auto& [name, path] : paths) {
+        int control[2], results[2];
+        if (pipe(control) < 0 || pipe(results) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to create pipes");
+        }
+        pid_t child = forkSeeder(torrent.info_hash, fd, total_length, path, control, results);
+        close(control[0]);
+        close(results[1]);
+        int port = 0;
+        if (read(results[0], &port, sizeof(port)) != sizeof(port)) {
+            port = 0;
+        }
+
+        double seconds = 0;
+        bool completed = false;
+        std::string error;
+        if (port > 0) {
+            try {
+                PieceManager piece_manager(torrent.total_pieces, PIECE_LENGTH, total_length, torrent.info_hash,
+                                           torrent.pieces_hash);
+                std::vector<std::unique_ptr<PeerManager>> peers;
+                for (int i = 0; i < peer_count; ++i) {
+                    peers.push_back(std::make_unique<PeerManager>("127.0.0.1", port, torrent.info_hash));
+                    if (!peers.back()->connect()) {
+                        throw std::runtime_error("Failed to connect to the seeder");
+                    }
+                }
+                DownloadOptions download_options;
+                download_options.verbose = false;
+                DownloadManager manager(piece_manager, peers, download_options);
+                auto started = std::chrono::steady_clock::now();
+                manager.start();
+                completed = piece_manager.waitForCompletion();
+                manager.stop();
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                if (!completed) {
+                    error = piece_manager.getAbortReason();
+                }
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        close(control[1]);  // Tells the seeder to stop and report
+        UploadCost cost;
+        size_t got = 0;
+        while (got < sizeof(cost)) {
+            ssize_t n = read(results[0], reinterpret_cast<uint8_t*>(&cost) + got, sizeof(cost) - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        close(results[0]);
+        waitpid(child, nullptr, 0);
+        if (!completed || !cost.ok) {
+            close(fd);
+            throw std::runtime_error(name + ": " + (error.empty() ? "seeder failed" : error));
+        }
+
+        std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(12) << size_mib / seconds << std::setw(16) << cost.cpu_seconds * 1000 / gib;
+        if (cost.cycles >= 0) {
+            std::cout << std::setw(16) << cost.cycles / 1e6 / gib;
+        } else {
+            std::cout << std::setw(16) << "n/a";
+        }
+        if (cost.transport.file_sends > 0) {
+            std::cout << "  " << cost.transport.file_sends << " sendfile calls";
+        }
+        if (cost.transport.zero_copy_sends > 0) {
+            std::cout << "  " << cost.transport.zero_copy_sends << " zero-copy sends, "
+                      << cost.transport.zero_copy_copied << " copied by the kernel";
+        }
+        std::cout << std::endl;
+    }
+    close(fd);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "Command.hpp"
+#include <string>
+
+// Loopback micro-benchmarks of the peer I/O paths:
+//   benchmark transport [--size <MiB>] [--peers <count>]
+//   benchmark utp [--size <MiB>] [--delay <ms>] [--rate <KiB/s>] [--loss <percent>]
+//   benchmark ratelimit [--size <MiB>] [--peers <count>] [--limit <KiB/s>] [--peer-limit <KiB/s>]
+//   benchmark upload [--size <MiB>] [--peers <count>] [--path <copy|sendfile|mmap>]
+// The utp link options shape what the seeder sends: a one-way delay, a
+// bottleneck with an unbounded queue, and random drops. ratelimit downloads
+// under a torrent and a per-peer cap, uploads under the same torrent cap, and
+// compares the rates reached with the targets. upload serves a file from a
+// SeedManager in a child process over each upload path (all by default) and
+// reports the child's CPU time and, where the PMU is readable, cycles per GiB.
+class BenchmarkCommand : public Command {
+public:
+    void execute(const CommandOptions& options) override;
+
+private:
+    void benchmarkTransport(const CommandOptions& options);
+    void benchmarkUtp(const CommandOptions& options);
+    void benchmarkRateLimit(const CommandOptions& options);
+    void benchmarkUpload(const CommandOptions& options);
+};
@@ -0,0 +1,48 @@
+#include "CommandOptions.hpp"
+#include <stdexcept>
+
+std::string CommandOptions::get(const std::string& flag, const std::string& fallback) const {
+    auto it = options.find(flag);
+    return it != options.end() ? it->second : fallback;
+}
+
+long long CommandOptions::getInteger(const std::string& flag, long long fallback, long long min,
+                                     long long max) const {
+    auto it = options.find(flag);
+    if (it == options.end()) {
+        return fallback;
+    }
+    const std::string& value = it->second;
+    size_t used = 0;
+    long long number = 0;
+    try {
+        number = std::stoll(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != value.size() || number < min || number > max) {
+        throw std::runtime_error("Invalid value for " + flag + ": '" + value + "', expected a whole number from " +
+                                 std::to_string(min) + " to " + std::to_string(max));
+    }
+    return number;
+}
+
+double CommandOptions::getRate(const std::string& flag) const {
+    auto it = options.find(flag);
+    if (it == options.end()) {
+        return 0;
+    }
+    const std::string& value = it->second;
+    size_t used = 0;
+    double number = -1;
+    try {
+        number = std::stod(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != value.size() || !(number >= 0) || number > 1e12) {
+        throw std::runtime_error("Invalid value for " + flag + ": '" + value +
+                                 "', expected a rate in KiB/s, 0 for unlimited");
+    }
+    return number * 1024;
+}
@@ -2,8 +2,18 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <limits>
 
 struct CommandOptions {
     std::map<std::string, std::string> options;  // Stores options like -o and their values
     std::vector<std::string> args;               // Stores regular arguments
-}; 
\ No newline at end of file
+
+    // The option's value, or fallback when it is absent
+    std::string get(const std::string& flag, const std::string& fallback = "") const;
+    // A whole number from min to max, or fallback when absent; anything else
+    // throws std::runtime_error naming the flag
+    long long getInteger(const std::string& flag, long long fallback, long long min = 1,
+                         long long max = std::numeric_limits<int>::max()) const;
+    // A rate given in KiB/s, in bytes/s; 0 (unlimited) when absent
+    double getRate(const std::string& flag) const;
+};
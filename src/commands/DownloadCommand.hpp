@@ -1,5 +1,6 @@
 #pragma once
 #include "Command.hpp"
+#include "DownloadFlags.hpp"
 #include "../bencode/BencodeDecoder.hpp"
 #include "../bencode/BencodeEncoder.hpp"
 #include "../protocol/PeerMessageType.hpp"
@@ -8,6 +9,7 @@
 #include "../utils/SHA1.hpp"
 #include "../manager/PieceManager.hpp"
 #include "../manager/PeerManager.hpp"
+#include "../manager/DownloadManager.hpp"
 #include <memory>
 #include <queue>
 
@@ -17,7 +19,7 @@ public:
 
 private:
     // Core initialization
-    void connectToPeers(const std::string& announce_url);
+    void fetchPeers(const std::string& announce_url);
     
     // Download management
     void downloadAllPieces();
@@ -26,6 +28,8 @@ private:
     // State
     std::unique_ptr<PieceManager> piece_manager;
     std::vector<std::unique_ptr<PeerManager>> peers;
+    std::vector<PeerEndpoint> candidates;  // From the tracker, not yet connected
+    DownloadOptions download_options;
     
     // Only keep info_hash as it's needed for peer connections
     std::string info_hash;
@@ -0,0 +1,39 @@
+#include "DownloadFlags.hpp"
+#include "../net/RateLimiter.hpp"
+#include "../utils/TorrentUtils.hpp"
+
+DownloadOptions DownloadFlags::parseDownloadOptions(const CommandOptions& options) {
+    DownloadOptions download_options;
+    download_options.io_uring = options.options.contains("--io-uring");
+    download_options.utp = options.options.contains("--utp");
+    download_options.suppress_have = options.options.contains("--suppress-have");
+    download_options.connect_timeout = std::chrono::milliseconds(
+        options.getInteger("--connect-timeout", download_options.connect_timeout.count()));
+    download_options.max_half_open = options.getInteger("--max-half-open", download_options.max_half_open);
+    download_options.max_peers = options.getInteger("--max-peers", download_options.max_peers);
+
+    // Read them all before any takes effect
+    double download_limit = options.getRate("--download-limit");
+    double upload_limit = options.getRate("--upload-limit");
+    download_options.limits.peer_download = options.getRate("--peer-download-limit");
+    download_options.limits.peer_upload = options.getRate("--peer-upload-limit");
+    RateLimiter::global(RateLimiter::DOWNLOAD).setRate(download_limit);
+    RateLimiter::global(RateLimiter::UPLOAD).setRate(upload_limit);
+    return download_options;
+}
+
+void DownloadFlags::applySelection(PieceManager& piece_manager, const nlohmann::json& info,
+                                   const CommandOptions& options, const std::string& output_file) {
+    // Checked before the output file is created
+    int read_ahead = static_cast<int>(options.getInteger("--read-ahead", PieceManager::DEFAULT_READ_AHEAD));
+
+    // Selective download: only schedule the pieces covering the requested bytes
+    ByteSelection selection = TorrentUtils::resolveSelection(info, options.get("--file"), options.get("--range"));
+    piece_manager.selectByteRange(selection.start, selection.end);
+    piece_manager.openOutputFile(output_file, selection.output_base);
+
+    // Streaming mode: keep deadlines on a read-ahead window
+    if (options.options.contains("--sequential")) {
+        piece_manager.enableSequential(read_ahead);
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <string>
+#include <nlohmann/json.hpp>
+#include "CommandOptions.hpp"
+#include "../manager/DownloadManager.hpp"
+#include "../manager/PieceManager.hpp"
+
+// The flags the download and magnet_download commands share. Bad values throw
+// std::runtime_error naming the flag.
+class DownloadFlags {
+public:
+    // --io-uring, --utp, --suppress-have, --connect-timeout, --max-half-open,
+    // --max-peers and the rate limits in KiB/s. --download-limit and
+    // --upload-limit cap the whole process, so they are applied right away.
+    static DownloadOptions parseDownloadOptions(const CommandOptions& options);
+    // --file/--range pick the pieces and where they land in output_file;
+    // --sequential with --read-ahead switches to streaming order
+    static void applySelection(PieceManager& piece_manager, const nlohmann::json& info,
+                               const CommandOptions& options, const std::string& output_file);
+};
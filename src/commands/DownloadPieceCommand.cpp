@@ -61,12 +61,10 @@ void DownloadPieceCommand::execute(const CommandOptions& options) {
         );
 
         nlohmann::json resp_data = decoder.decode(tracker_response);
-        std::string peers_data = resp_data["peers"].get<std::string>();
+        std::vector<PeerEndpoint> peers = TorrentUtils::parseTrackerPeers(resp_data);
         
         // Try each peer until successful
-        for (size_t i = 0; i < peers_data.length(); i += 6) {
-            auto [ip_str, port] = PeerUtils::parsePeerAddress(peers_data, i);
-                
+        for (const auto& [ip_str, port] : peers) {
             auto peer = std::make_unique<PeerManager>(ip_str, port, info_hash);
             if (!peer->connect()) {
                 continue;
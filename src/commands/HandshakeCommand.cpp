@@ -1,8 +1,6 @@
 #include "HandshakeCommand.hpp"
 #include <iostream>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "../net/PeerConnector.hpp"
 #include <unistd.h>
 #include <cstring>
 #include <sstream>
@@ -31,23 +29,8 @@ void HandshakeCommand::execute(const CommandOptions& options) {
         std::string info_hash(reinterpret_cast<char*>(hash.data()), 20);
 
         // Parse peer address and create socket
-        auto [ip, port] = PeerUtils::parsePeerAddress(peer_addr);
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            throw std::runtime_error("Failed to create socket");
-        }
-
-        // Connect to peer
-        struct sockaddr_in peer_addr_in;
-        peer_addr_in.sin_family = AF_INET;
-        peer_addr_in.sin_port = htons(port);
-        if (inet_pton(AF_INET, ip.c_str(), &peer_addr_in.sin_addr) <= 0) {
-            throw std::runtime_error("Invalid IP address");
-        }
-
-        if (connect(sock, (struct sockaddr*)&peer_addr_in, sizeof(peer_addr_in)) < 0) {
-            throw std::runtime_error("Failed to connect to peer");
-        }
+        // Connect to peer: an IPv4 or IPv6 address, or a host name raced over both
+        sock = PeerConnector::connectBlocking(PeerEndpoint::parse(peer_addr));
 
         // Perform handshake
         TorrentUtils::performHandshake(sock, info_hash);
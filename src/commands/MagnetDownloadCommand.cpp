@@ -1,12 +1,21 @@
 #include "MagnetDownloadCommand.hpp"
 #include <iostream>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <atomic>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <list>
+#include <thread>
+
+namespace {
+// A connected peer being asked for the metadata on its own thread
+struct MetadataFetch {
+    std::string ip;
+    int port;
+    int sock;
+    std::thread thread;
+    bool done = false;  // Result handled on the loop; the socket is no longer ours
+};
+}
 
 void MagnetDownloadCommand::execute(const CommandOptions& options) {
     try {
@@ -26,8 +35,12 @@ void MagnetDownloadCommand::execute(const CommandOptions& options) {
         binaryInfoHash = magnet_data["binary_info_hash"];
         std::string trackerUrl = magnet_data["tracker_url"];
 
-        // Connect to peers and start download
+        download_options = DownloadFlags::parseDownloadOptions(options);
+
+        // Connect to peers and fetch the metadata
         connectToPeers(trackerUrl);
+
+        DownloadFlags::applySelection(*piece_manager, metadata, options, output_file);
         downloadAllPieces();
 
         // Verify and save file
@@ -35,7 +48,7 @@ void MagnetDownloadCommand::execute(const CommandOptions& options) {
             throw std::runtime_error("File verification failed");
         }
 
-        if (!piece_manager->writeToFile(output_file)) {
+        if (!piece_manager->closeOutputFile()) {
             throw std::runtime_error("Failed to write output file");
         }
 
@@ -52,191 +65,160 @@ void MagnetDownloadCommand::connectToPeers(const std::string& trackerUrl) {
     );
 
     nlohmann::json resp_data = Bencode::decode(tracker_response);
-    std::string peers_data = resp_data["peers"].get<std::string>();
-
-    int sock = -1;
-
-    // Handshake with each peer, request metadata and maintain peers
-    for (size_t i = 0; i < peers_data.length(); i += 6) {
-        auto [ip, port] = PeerUtils::parsePeerAddress(peers_data, i);
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            throw std::runtime_error("Failed to create socket");
+    std::vector<PeerEndpoint> tracker_peers = TorrentUtils::parseTrackerPeers(resp_data);
+
+    // Connect to every peer at once and ask each for the metadata on its own
+    // thread; the first valid answer starts the download and the other peers
+    // join it from the download's own loop
+    EventLoop loop;
+    std::list<MetadataFetch> fetches;
+    size_t fetching = 0;
+    std::unique_ptr<PeerConnector> connector;
+    auto stopWhenExhausted = [&]() {
+        if (connector->idle() && fetching == 0) {
+            loop.stop();
         }
-
-        // Connect to peer i
-        struct sockaddr_in peer_addr_in;
-        peer_addr_in.sin_family = AF_INET;
-        peer_addr_in.sin_port = htons(port);
-        if (inet_pton(AF_INET, ip.c_str(), &peer_addr_in.sin_addr) <= 0) {
-            throw std::runtime_error("Invalid IP address");
-        }
-
-        if (connect(sock, (struct sockaddr*)&peer_addr_in, sizeof(peer_addr_in)) < 0) {
-            throw std::runtime_error("Failed to connect to peer");
-        }
-
-        // Perform handshake
-        auto [extension_id, bitfield] = MagnetUtils::performHandshake(sock, binaryInfoHash, true);
-
-        // Request metadata
-        MagnetUtils::requestMetadata(sock, extension_id);
-
-        // Receive metadata
-        nlohmann::json metadata = MagnetUtils::receiveMetadata(sock, infoHash);
-        if(!metadata.is_null()) {
-            if (piece_manager == nullptr) { 
-                int file_length = metadata["length"].get<int>();
-                int piece_length = metadata["piece length"].get<int>();
-                int total_pieces = (file_length + piece_length - 1) / piece_length;
-                std::string pieces_hash = metadata["pieces"].get<std::string>();
-
-                // Initialize piece manager
-                piece_manager = std::make_unique<PieceManager>(
-                    total_pieces, piece_length, file_length, infoHash, pieces_hash
-                );
-            }
-
-            // Initialize peer
-            auto peer = std::make_unique<PeerManager>(ip, port, infoHash);
-            if (peer -> magnetConnect(sock, bitfield)) {
-                peers.push_back(std::move(peer));
-            }
-        }
-    }
-
-    if (peers.empty()) {
-        throw std::runtime_error("No peers available");
-    }
-}
-
-class DownloadWorker {
-private:
-    struct PieceTask {
-        int index;
-        std::vector<uint8_t> data;
     };
 
-    // Thread-safe queue for completed pieces waiting to be saved
-    class SaveQueue {
-    public:
-        void push(PieceTask task) {
-            std::lock_guard<std::mutex> lock(mutex);
-            queue.push(std::move(task));
-            cv.notify_one();
-        }
-
-        bool pop(PieceTask& task) {
-            std::unique_lock<std::mutex> lock(mutex);
-            cv.wait(lock, [this] { return !queue.empty() || stop_flag; });
-            if (stop_flag && queue.empty()) return false;
-            task = std::move(queue.front());
-            queue.pop();
-            return true;
+    auto onFetched = [&](MetadataFetch& fetch, const nlohmann::json& peer_metadata,
+                         const HandshakeResult& handshake, std::string error) {
+        fetching--;
+        fetch.done = true;
+        if (error.empty() && !piece_manager) {
+            try {
+                startFromMetadata(peer_metadata);
+                // Initialize peer; it owns the socket from here, even if it won't unchoke
+                auto peer = std::make_unique<PeerManager>(fetch.ip, fetch.port, infoHash);
+                peer->setRequestQueueLimit(handshake.reqq);
+                if (peer->magnetConnect(fetch.sock, handshake)) {
+                    peers.push_back(std::move(peer));
+                } else {
+                    candidates.push_back({fetch.ip, fetch.port});  // Gets a fresh connection later
+                }
+                loop.stop();
+                return;
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
         }
-
-        void stop() {
-            std::lock_guard<std::mutex> lock(mutex);
-            stop_flag = true;
-            cv.notify_all();
+        close(fetch.sock);
+        if (error.empty()) {
+            candidates.push_back({fetch.ip, fetch.port});  // Lost the race; rejoins later
+        } else {
+            std::cerr << "Peer " << PeerEndpoint{fetch.ip, fetch.port}.toString() << " failed: " << error << std::endl;
         }
-
-    private:
-        std::queue<PieceTask> queue;
-        std::mutex mutex;
-        std::condition_variable cv;
-        bool stop_flag = false;
+        stopWhenExhausted();
     };
 
-    void downloadLoop() {
-        while (running) {
-            int next_piece = piece_manager->getNextPiece();
-            if (next_piece == -1) break;
-
-            if (!peer->hasPiece(next_piece)) {
-                piece_manager->savePieceData(next_piece, {});
-                continue;
+    connector = std::make_unique<PeerConnector>(
+        loop, download_options.max_half_open, download_options.connect_timeout,
+        [&](const PeerEndpoint&, const PeerEndpoint& peer, int sock) {
+            if (piece_manager) {
+                // Connected in the same round as the winner; rejoins later
+                close(sock);
+                candidates.push_back(peer);
+                return;
             }
+            fetching++;
+            MetadataFetch& fetch = fetches.emplace_back(MetadataFetch{peer.ip, peer.port, sock, {}, false});
+            fetch.thread = std::thread([&, sock]() {
+                nlohmann::json peer_metadata;
+                HandshakeResult handshake{};
+                std::string error;
+                try {
+                    peer_metadata = fetchMetadata(sock, handshake);
+                } catch (const std::exception& e) {
+                    error = e.what();
+                }
+                loop.post([&, peer_metadata, handshake, error]() {
+                    onFetched(fetch, peer_metadata, handshake, error);
+                });
+            });
+        },
+        [&](const PeerEndpoint& peer, const std::string& reason) {
+            std::cerr << "Peer " << peer.toString() << " connect failed: " << reason << std::endl;
+            stopWhenExhausted();
+        });
+
+    connector->add(tracker_peers);
+    if (!connector->idle()) {
+        loop.run();
+    }
 
-            std::cout << "Worker " << peer->getPeerInfo() 
-                      << " start piece " << next_piece << std::endl;
-            
-            std::vector<uint8_t> piece_data;
-            int piece_length = piece_manager->getPieceLength(next_piece);
-
-            if (peer->downloadPiece(next_piece, piece_length, piece_data)) {
-                std::cout << "Worker " << peer->getPeerInfo() 
-                          << " finish piece " << next_piece 
-                          << " (size: " << piece_data.size() << ")" << std::endl;
-                
-                // Push to save queue and continue downloading
-                save_queue.push({next_piece, std::move(piece_data)});
-            } else {
-                piece_manager->savePieceData(next_piece, {});
-            }
+    // Cut the losing exchanges short; their peers get a fresh connection later
+    auto remaining = connector->takeRemaining();
+    candidates.insert(candidates.end(), remaining.begin(), remaining.end());
+    for (auto& fetch : fetches) {
+        if (!fetch.done) {
+            shutdown(fetch.sock, SHUT_RDWR);
         }
     }
-
-    void saveLoop() {
-        PieceTask task;
-        while (save_queue.pop(task)) {
-            if (piece_manager->savePieceData(task.index, task.data)) {
-                std::cout << "Successfully saved piece " << task.index << std::endl;
-            } else {
-                std::cout << "Failed to save piece " << task.index << std::endl;
-            }
+    for (auto& fetch : fetches) {
+        fetch.thread.join();
+        if (!fetch.done) {
+            close(fetch.sock);
+            candidates.push_back({fetch.ip, fetch.port});
         }
     }
 
-public:
-    DownloadWorker(PeerManager* peer, PieceManager* piece_mgr) 
-        : peer(peer), piece_manager(piece_mgr), running(true) {}
-
-    void start() {
-        download_thread = std::thread(&DownloadWorker::downloadLoop, this);
-        save_thread = std::thread(&DownloadWorker::saveLoop, this);
+    if (!piece_manager) {
+        throw std::runtime_error("No peers available");
     }
+}
 
-    void stop() {
-        running = false;
-        save_queue.stop();
-        if (download_thread.joinable()) download_thread.join();
-        if (save_thread.joinable()) save_thread.join();
+nlohmann::json MagnetDownloadCommand::fetchMetadata(int sock, HandshakeResult& handshake) const {
+    // A short blocking exchange, bounded by socket timeouts
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    auto timeout_ms = download_options.connect_timeout.count();
+    timeval timeout{static_cast<time_t>(timeout_ms / 1000), static_cast<suseconds_t>(timeout_ms % 1000 * 1000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Perform handshake
+    handshake = MagnetUtils::performHandshake(sock, binaryInfoHash, true);
+
+    // Request metadata
+    MagnetUtils::requestMetadata(sock, handshake.extension_id);
+
+    // Receive metadata
+    nlohmann::json peer_metadata = MagnetUtils::receiveMetadata(sock, infoHash);
+    if (peer_metadata.is_null()) {
+        throw std::runtime_error("Invalid metadata");
     }
+    return peer_metadata;
+}
 
-private:
-    PeerManager* peer;
-    PieceManager* piece_manager;
-    std::thread download_thread;
-    std::thread save_thread;
-    std::atomic<bool> running;
-    SaveQueue save_queue;
-};
+void MagnetDownloadCommand::startFromMetadata(const nlohmann::json& peer_metadata) {
+    int64_t file_length = TorrentUtils::getTotalLength(peer_metadata);
+    int piece_length = peer_metadata["piece length"].get<int>();
+    int total_pieces = (file_length + piece_length - 1) / piece_length;
+    std::string pieces_hash = peer_metadata["pieces"].get<std::string>();
+
+    // Initialize piece manager
+    piece_manager = std::make_unique<PieceManager>(
+        total_pieces, piece_length, file_length, infoHash, pieces_hash
+    );
+    metadata = peer_metadata;
+}
 
 void MagnetDownloadCommand::downloadAllPieces() {
-    std::vector<std::unique_ptr<DownloadWorker>> workers;
-    
-    // Create and start workers
-    for (auto& peer : peers) {
-        if (peer->isConnected()) {
-            workers.push_back(std::make_unique<DownloadWorker>(peer.get(), piece_manager.get()));
-            workers.back()->start();
-        }
-    }
+    // One event loop thread drives every peer; hashing and disk I/O run on a pool
+    DownloadManager manager(*piece_manager, peers, download_options);
+    manager.addCandidates(binaryInfoHash, candidates);
+    manager.start();
 
-    // Wait for download to complete
-    while (!piece_manager->isDownloadComplete()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
+    // Sleep until the last piece is verified or the download can't finish
+    bool completed = piece_manager->waitForCompletion();
+
+    std::cout << (completed ? "Download complete" : "Download aborted")
+              << ", stopping event loop" << std::endl;
+    manager.stop();
 
-    std::cout << "Download complete, stopping workers" << std::endl;
-    
-    // Now safe to stop workers after download is complete
-    for (size_t i = 0; i < workers.size(); i++) {
-        std::cout << "Stopping worker " << i << "..." << std::endl;
-        workers[i]->stop();
-        std::cout << "Worker " << i << " stopped" << std::endl;
+    if (!completed) {
+        throw std::runtime_error(piece_manager->getAbortReason());
     }
 
-    std::cout << "All workers stopped, proceeding to file verification" << std::endl;
+    std::cout << "Event loop stopped, proceeding to file verification" << std::endl;
+    manager.printStats();
 }
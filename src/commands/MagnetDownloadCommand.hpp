@@ -1,12 +1,15 @@
 #pragma once
 #include "Command.hpp"
+#include "DownloadFlags.hpp"
 #include "../bencode/Bencode.hpp"
 #include "../protocol/PeerMessageType.hpp"
 #include "../utils/MagnetUtils.hpp"
+#include "../utils/TorrentUtils.hpp"
 #include "../utils/PeerUtils.hpp"
 #include "../utils/SHA1.hpp"
 #include "../manager/PieceManager.hpp"
 #include "../manager/PeerManager.hpp"
+#include "../manager/DownloadManager.hpp"
 #include <memory>
 #include <queue>
 
@@ -17,6 +20,10 @@ public:
 private:
     // Core initialization
     void connectToPeers(const std::string& announce_url);
+    // Handshake and metadata exchange on a connected socket; safe to run on
+    // several sockets at once
+    nlohmann::json fetchMetadata(int sock, HandshakeResult& handshake) const;
+    void startFromMetadata(const nlohmann::json& peer_metadata);
     
     // Download management
     void downloadAllPieces();
@@ -24,8 +31,11 @@ private:
     // State
     std::unique_ptr<PieceManager> piece_manager;
     std::vector<std::unique_ptr<PeerManager>> peers;
+    std::vector<PeerEndpoint> candidates;  // Joined once the download runs
+    DownloadOptions download_options;
     
     // Only keep info_hash as it's needed for peer connections
     std::string infoHash;
     std::string binaryInfoHash;
+    nlohmann::json metadata;  // Info dictionary from the first peer
 };
@@ -2,9 +2,8 @@
 #include "../manager/PeerManager.hpp"
 #include "../manager/PieceManager.hpp"
 #include <iostream>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "../net/PeerConnector.hpp"
+#include "../utils/TorrentUtils.hpp"
 #include <unistd.h>
 #include <cstring>
 #include <fstream>
@@ -37,35 +36,25 @@ void MagnetDownloadPieceCommand::execute(const CommandOptions& options) {
         );
 
         nlohmann::json resp_data = Bencode::decode(tracker_response);
-        std::string peers_data = resp_data["peers"].get<std::string>();
+        std::vector<PeerEndpoint> peers = TorrentUtils::parseTrackerPeers(resp_data);
 
         int sock = -1;
 
         // Handshake with each peer, request metadata and download piece
-        for (size_t i = 0; i < peers_data.length(); i += 6) {
-            auto [ip, port] = PeerUtils::parsePeerAddress(peers_data, i);
-            sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock < 0) {
-                throw std::runtime_error("Failed to create socket");
-            }
-
-            // Connect to peer i
-            struct sockaddr_in peer_addr_in;
-            peer_addr_in.sin_family = AF_INET;
-            peer_addr_in.sin_port = htons(port);
-            if (inet_pton(AF_INET, ip.c_str(), &peer_addr_in.sin_addr) <= 0) {
-                throw std::runtime_error("Invalid IP address");
-            }
-
-            if (connect(sock, (struct sockaddr*)&peer_addr_in, sizeof(peer_addr_in)) < 0) {
-                throw std::runtime_error("Failed to connect to peer");
+        for (const auto& [ip, port] : peers) {
+            // Connect to the peer; an unreachable one just isn't tried
+            try {
+                sock = PeerConnector::connectBlocking({ip, port});
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                continue;
             }
 
             // Perform handshake
-            auto [extension_id, bitfield] = MagnetUtils::performHandshake(sock, binaryInfoHash, true);
+            HandshakeResult handshake = MagnetUtils::performHandshake(sock, binaryInfoHash, true);
 
             // Request metadata
-            MagnetUtils::requestMetadata(sock, extension_id);
+            MagnetUtils::requestMetadata(sock, handshake.extension_id);
 
             // Receive metadata
             nlohmann::json metadata = MagnetUtils::receiveMetadata(sock, infoHash);
@@ -83,12 +72,13 @@ void MagnetDownloadPieceCommand::execute(const CommandOptions& options) {
 
                 // Initialize peer and piece manager
                 auto peer = std::make_unique<PeerManager>(ip, port, infoHash);
+                peer->setRequestQueueLimit(handshake.reqq);
                 auto piece_manager = std::make_unique<PieceManager>(
                     total_pieces, piece_length, file_length, infoHash, pieces_hash
                 );  
 
                 // Download piece
-                if(!peer->magnetConnect(sock, bitfield)) {
+                if(!peer->magnetConnect(sock, handshake)) {
                     continue;
                 }
 
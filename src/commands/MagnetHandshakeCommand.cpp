@@ -2,9 +2,8 @@
 #include "../utils/SHA1.hpp"
 #include <iostream>
 #include <nlohmann/json.hpp>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "../net/PeerConnector.hpp"
+#include "../utils/TorrentUtils.hpp"
 #include <unistd.h>
 #include <stdexcept>
 #include <cstring>
@@ -21,26 +20,13 @@ void MagnetHandshakeCommand::execute(const CommandOptions& options) {
         
         std::string trackerResponse = MagnetUtils::makeTrackerRequest(trackerUrl, binaryInfoHash);
         nlohmann::json resp_data = Bencode::decode(trackerResponse);
-        std::string peers_data = resp_data["peers"].get<std::string>();
-        
-        auto [ip, port] = PeerUtils::parsePeerAddress(peers_data, 0);
-                
-        sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            throw std::runtime_error("Failed to create socket");
+        std::vector<PeerEndpoint> peers = TorrentUtils::parseTrackerPeers(resp_data);
+        if (peers.empty()) {
+            throw std::runtime_error("No peers available");
         }
 
         // Connect to peer
-        struct sockaddr_in peer_addr_in;
-        peer_addr_in.sin_family = AF_INET;
-        peer_addr_in.sin_port = htons(port);
-        if (inet_pton(AF_INET, ip.c_str(), &peer_addr_in.sin_addr) <= 0) {
-            throw std::runtime_error("Invalid IP address");
-        }
-
-        if (connect(sock, (struct sockaddr*)&peer_addr_in, sizeof(peer_addr_in)) < 0) {
-            throw std::runtime_error("Failed to connect to peer");
-        }
+        sock = PeerConnector::connectBlocking(peers[0]);
 
         // Perform handshake
         MagnetUtils::performHandshake(sock, binaryInfoHash);
@@ -37,27 +37,15 @@ void PeersCommand::execute(const CommandOptions& options) {
         nlohmann::json resp_data = decoder.decode(resp_content);
         
         // Display peers
-        displayPeers(resp_data["peers"].get<std::string>());
+        displayPeers(TorrentUtils::parseTrackerPeers(resp_data));
         
     } catch (const std::exception& e) {
         throw std::runtime_error("Failed to process peers: " + std::string(e.what()));
     }
 }
 
-void PeersCommand::displayPeers(const std::string& peers_data) {
-    for (size_t i = 0; i < peers_data.length(); i += 6) {
-        // First 4 bytes are IP
-        unsigned char ip[4];
-        memcpy(ip, peers_data.c_str() + i, 4);
-        
-        // Last 2 bytes are port
-        uint16_t port = static_cast<unsigned char>(peers_data[i + 4]) << 8 | 
-                       static_cast<unsigned char>(peers_data[i + 5]);
-        
-        std::cout << static_cast<int>(ip[0]) << "."
-                 << static_cast<int>(ip[1]) << "."
-                 << static_cast<int>(ip[2]) << "."
-                 << static_cast<int>(ip[3]) << ":"
-                 << port << std::endl;
+void PeersCommand::displayPeers(const std::vector<PeerEndpoint>& peers) {
+    for (const auto& peer : peers) {
+        std::cout << peer.toString() << std::endl;
     }
-}
\ No newline at end of file
+}
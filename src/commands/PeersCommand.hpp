@@ -12,5 +12,5 @@ public:
     void execute(const CommandOptions& options) override;
 
 private:
-    void displayPeers(const std::string& peers_data);
+    void displayPeers(const std::vector<PeerEndpoint>& peers);
 }; 
\ No newline at end of file
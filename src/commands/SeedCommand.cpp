@@ -0,0 +1,179 @@
+#include "SeedCommand.hpp"
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+const std::chrono::seconds DEFAULT_ANNOUNCE_INTERVAL{1800};
+const std::chrono::seconds MIN_ANNOUNCE_INTERVAL{30};
+}
+
+void SeedCommand::execute(const CommandOptions& options) {
+    int fd = -1;
+    try {
+        if (options.args.size() != 2) {
+            throw std::runtime_error("Expected: <torrent_file> <data_file>");
+        }
+
+        // Checked before the data is hashed, which can take a while
+        SeedOptions seed_options;
+        seed_options.port = options.getInteger("--port", seed_options.port, 0, 65535);
+        if (options.options.contains("--upload-path")) {
+            seed_options.upload_path = parseUploadPath(options.options.at("--upload-path"));
+        }
+        // In MiB
+        seed_options.cache_size = options.getInteger("--cache", seed_options.cache_size / (1024 * 1024), 0,
+                                                     1024 * 1024) * 1024 * 1024;
+        seed_options.max_connections = options.getInteger("--max-peers", seed_options.max_connections);
+        // Regular slots, ranked by upload rate; 0 unchokes every interested peer
+        seed_options.upload_slots = options.getInteger("--upload-slots", seed_options.upload_slots, 0);
+        seed_options.optimistic_slots = options.getInteger("--optimistic-slots", seed_options.optimistic_slots, 0);
+        // In KiB/s, as for downloads
+        double upload_limit = options.getRate("--upload-limit");
+        seed_options.peer_upload_limit = options.getRate("--peer-upload-limit");
+        std::chrono::seconds duration{options.getInteger("--duration", 0, 0)};
+        RateLimiter::global(RateLimiter::UPLOAD).setRate(upload_limit);
+
+        std::string torrent_content = TorrentUtils::readTorrentFile(options.args[0]);
+        BencodeDecoder decoder;
+        nlohmann::json torrent_data = decoder.decode(torrent_content);
+        const auto& info = torrent_data["info"];
+        int piece_length = info["piece length"];
+        int64_t total_length = TorrentUtils::getTotalLength(info);
+
+        BencodeEncoder encoder;
+        auto hash = SHA1::calculate(encoder.encode(info));
+        info_hash = std::string(reinterpret_cast<char*>(hash.data()), 20);
+
+        fd = open(options.args[1].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open " + options.args[1]);
+        }
+        std::vector<bool> have = verifyPieces(fd, piece_length, total_length, info["pieces"].get<std::string>());
+        int64_t left = 0;
+        size_t verified = 0;
+        for (size_t i = 0; i < have.size(); i++) {
+            if (have[i]) {
+                verified++;
+            } else {
+                left += std::min<int64_t>(piece_length, total_length - static_cast<int64_t>(i) * piece_length);
+            }
+        }
+        std::cout << "Verified " << verified << "/" << have.size() << " pieces" << std::endl;
+        if (verified == 0) {
+            throw std::runtime_error("Nothing to seed");
+        }
+
+        // Blocked before any thread starts, so every thread inherits the mask
+        // and the signals wait for sigtimedwait
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        SeedManager manager(seed_options);
+        manager.addTorrent(info_hash, fd, piece_length, total_length, have);
+        manager.start();
+        std::cout << "Seeding on port " << manager.getPort() << std::endl;
+
+        waitForSignal(torrent_data["announce"].get<std::string>(), left, manager.getPort(), duration);
+
+        manager.stop();
+        manager.printStats();
+        close(fd);
+    } catch (const std::exception& e) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Seed failed: " + std::string(e.what()));
+    }
+}
+
+UploadPath SeedCommand::parseUploadPath(const std::string& name) {
+    if (name == "copy") {
+        return UploadPath::COPY;
+    } else if (name == "sendfile") {
+        return UploadPath::SENDFILE;
+    } else if (name == "mmap") {
+        return UploadPath::MMAP;
+    }
+    throw std::runtime_error("Unknown upload path: " + name + " (expected copy, sendfile or mmap)");
+}
+
+std::vector<bool> SeedCommand::verifyPieces(int fd, int piece_length, int64_t total_length,
+                                            const std::string& hashes) {
+    int piece_count = static_cast<int>((total_length + piece_length - 1) / piece_length);
+    std::vector<bool> have(piece_count);
+    std::vector<uint8_t> piece(piece_length);
+    for (int i = 0; i < piece_count; i++) {
+        int64_t offset = static_cast<int64_t>(i) * piece_length;
+        size_t length = std::min<int64_t>(piece_length, total_length - offset);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, piece.data() + done, length - done, offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        if (done == length && hashes.size() >= static_cast<size_t>(i + 1) * 20) {
+            auto hash = SHA1::calculate(piece.data(), length);
+            have[i] = std::equal(hash.begin(), hash.end(), hashes.begin() + i * 20,
+                                 [](unsigned char a, char b) { return a == static_cast<unsigned char>(b); });
+        }
+    }
+    return have;
+}
+
+std::chrono::seconds SeedCommand::announce(const std::string& url, int64_t left, int port) {
+    try {
+        std::string response = TorrentUtils::makeTrackerRequest(url, info_hash, left, port);
+        BencodeDecoder decoder;
+        nlohmann::json data = decoder.decode(response);
+        if (data.contains("failure reason")) {
+            throw std::runtime_error(data["failure reason"].get<std::string>());
+        }
+        if (data.contains("interval") && data["interval"].is_number()) {
+            return std::max(MIN_ANNOUNCE_INTERVAL, std::chrono::seconds(data["interval"].get<int64_t>()));
+        }
+    } catch (const std::exception& e) {
+        // Peers that know us already can still connect
+        std::cerr << "Announce failed: " << e.what() << std::endl;
+    }
+    return DEFAULT_ANNOUNCE_INTERVAL;
+}
+
+void SeedCommand::waitForSignal(const std::string& url, int64_t left, int port, std::chrono::seconds duration) {
+    using Clock = std::chrono::steady_clock;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    auto end = duration.count() > 0 ? Clock::now() + duration : Clock::time_point::max();
+    while (true) {
+        auto next_announce = Clock::now() + announce(url, left, port);
+        auto wake = std::min(next_announce, end);
+        while (Clock::now() < wake) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - Clock::now());
+            timespec timeout{static_cast<time_t>(wait.count() / 1000), static_cast<long>(wait.count() % 1000) * 1000000};
+            int signal = sigtimedwait(&signals, nullptr, &timeout);
+            if (signal == SIGINT || signal == SIGTERM) {
+                std::cout << "Interrupted, stopping" << std::endl;
+                return;
+            }
+        }
+        if (Clock::now() >= end) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "Command.hpp"
+#include "../bencode/BencodeDecoder.hpp"
+#include "../bencode/BencodeEncoder.hpp"
+#include "../utils/TorrentUtils.hpp"
+#include "../utils/SHA1.hpp"
+#include "../manager/SeedManager.hpp"
+#include <vector>
+
+// seed <torrent_file> <data_file>: verifies the data against the torrent's
+// piece hashes, announces itself to the tracker and uploads the verified
+// pieces until interrupted or --duration seconds have passed
+class SeedCommand : public Command {
+public:
+    void execute(const CommandOptions& options) override;
+    static UploadPath parseUploadPath(const std::string& name);  // copy, sendfile or mmap
+
+private:
+    // Pieces of fd matching their hashes
+    std::vector<bool> verifyPieces(int fd, int piece_length, int64_t total_length, const std::string& hashes);
+    // Returns the re-announce interval the tracker asked for
+    std::chrono::seconds announce(const std::string& url, int64_t left, int port);
+    void waitForSignal(const std::string& url, int64_t left, int port, std::chrono::seconds duration);
+
+    std::string info_hash;
+};
@@ -0,0 +1,163 @@
+#include "Choker.hpp"
+#include <algorithm>
+#include <vector>
+
+Choker::Choker(EventLoop& loop, size_t upload_slots, size_t optimistic_slots, ChokeCallback set_choked)
+    : loop(loop), upload_slots(upload_slots), optimistic_slots(optimistic_slots),
+      set_choked(std::move(set_choked)) {
+}
+
+Choker::~Choker() {
+    if (round_timer != 0) {
+        loop.cancelTimer(round_timer);
+    }
+}
+
+void Choker::start() {
+    last_round = EventLoop::Clock::now();
+    round_timer = loop.runAfter(ROUND_INTERVAL, [this]() { runRound(); });
+}
+
+void Choker::addPeer(uint64_t peer) {
+    peers.try_emplace(peer);
+}
+
+void Choker::removePeer(uint64_t peer) {
+    if (peers.erase(peer) > 0) {
+        fillFreeSlots();
+    }
+}
+
+void Choker::setInterested(uint64_t peer, bool interested) {
+    auto it = peers.find(peer);
+    if (it == peers.end() || it->second.interested == interested) {
+        return;
+    }
+    it->second.interested = interested;
+    if (!interested) {
+        // Stays unchoked until the next round, but no longer holds a slot
+        it->second.optimistic = false;
+    }
+    fillFreeSlots();
+}
+
+void Choker::onUploaded(uint64_t peer, size_t bytes) {
+    auto it = peers.find(peer);
+    if (it != peers.end()) {
+        it->second.uploaded += bytes;
+    }
+}
+
+void Choker::runRound() {
+    stats.rounds++;
+    auto now = EventLoop::Clock::now();
+    double elapsed = std::max(std::chrono::duration<double>(now - last_round).count(), 0.001);
+    last_round = now;
+    for (auto& [id, peer] : peers) {
+        peer.rate = peer.uploaded / elapsed;
+        peer.uploaded = 0;
+    }
+
+    if (rounds_until_optimistic == 0) {
+        rotateOptimistic();
+        rounds_until_optimistic = OPTIMISTIC_INTERVAL / ROUND_INTERVAL;
+    }
+    rounds_until_optimistic--;
+
+    // Interested peers by rate; on ties the unchoked ones keep their slots
+    std::vector<std::pair<uint64_t, Peer*>> ranked;
+    for (auto& [id, peer] : peers) {
+        if (peer.interested && !peer.optimistic) {
+            ranked.emplace_back(id, &peer);
+        } else if (!peer.interested && !peer.choked && upload_slots > 0) {
+            setChoked(id, peer, true);
+        }
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        if (a.second->rate != b.second->rate) {
+            return a.second->rate > b.second->rate;
+        }
+        return !a.second->choked && b.second->choked;
+    });
+    for (size_t i = 0; i < ranked.size(); i++) {
+        setChoked(ranked[i].first, *ranked[i].second, upload_slots > 0 && i >= upload_slots);
+    }
+
+    round_timer = loop.runAfter(ROUND_INTERVAL, [this]() { runRound(); });
+}
+
+void Choker::rotateOptimistic() {
+    if (upload_slots == 0) {
+        return;  // Nobody is choked
+    }
+    // The outgoing optimistic peers go to the back of the line and keep
+    // their unchoke only if the ranking gives them a regular slot
+    std::vector<std::pair<uint64_t, Peer*>> candidates;
+    for (auto& [id, peer] : peers) {
+        if (peer.interested && (peer.choked || peer.optimistic)) {
+            candidates.emplace_back(id, &peer);
+        }
+        peer.optimistic = false;
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+        return a.second->last_optimistic < b.second->last_optimistic;
+    });
+    auto now = EventLoop::Clock::now();
+    for (size_t i = 0; i < candidates.size() && i < optimistic_slots; i++) {
+        Peer& peer = *candidates[i].second;
+        peer.optimistic = true;
+        peer.last_optimistic = now;
+        stats.optimistic_unchokes++;
+        setChoked(candidates[i].first, peer, false);
+    }
+}
+
+void Choker::fillFreeSlots() {
+    size_t regular = regularUnchoked();
+    size_t optimistic = std::count_if(peers.begin(), peers.end(), [](const auto& entry) {
+        return entry.second.optimistic;
+    });
+    while (upload_slots == 0 || regular < upload_slots || optimistic < optimistic_slots) {
+        // The fastest of the waiting peers
+        uint64_t best_id = 0;
+        Peer* best = nullptr;
+        for (auto& [id, peer] : peers) {
+            if (peer.interested && peer.choked && (!best || peer.rate > best->rate)) {
+                best_id = id;
+                best = &peer;
+            }
+        }
+        if (!best) {
+            return;
+        }
+        if (upload_slots == 0 || regular < upload_slots) {
+            regular++;
+        } else {
+            best->optimistic = true;
+            best->last_optimistic = EventLoop::Clock::now();
+            stats.optimistic_unchokes++;
+            optimistic++;
+        }
+        setChoked(best_id, *best, false);
+    }
+}
+
+void Choker::setChoked(uint64_t id, Peer& peer, bool choked) {
+    if (peer.choked == choked) {
+        return;
+    }
+    peer.choked = choked;
+    if (choked) {
+        stats.chokes++;
+    } else {
+        stats.unchokes++;
+    }
+    set_choked(id, choked);
+}
+
+size_t Choker::regularUnchoked() const {
+    return std::count_if(peers.begin(), peers.end(), [](const auto& entry) {
+        const Peer& peer = entry.second;
+        return peer.interested && !peer.choked && !peer.optimistic;
+    });
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include "../net/EventLoop.hpp"
+
+// Decides which interested peers get upload slots. Every ROUND_INTERVAL the
+// regular slots go to the peers we sent the most to since the last round, so
+// slots stay with the fastest downloaders. (Tit-for-tat would rank by what
+// they sent us, but an upload-only owner requests nothing, and unrequested
+// data proves nothing.) Every
+// OPTIMISTIC_INTERVAL the optimistic slots move on to the choked peers that
+// went longest without one, which lets new peers show what they can do.
+// Slots freed between rounds are refilled at once. The owner reports traffic
+// and interest, and sends the CHOKE/UNCHOKE the callback asks for. Loop
+// thread only.
+class Choker {
+public:
+    static constexpr std::chrono::seconds ROUND_INTERVAL{10};
+    static constexpr std::chrono::seconds OPTIMISTIC_INTERVAL{30};
+
+    struct Stats {
+        uint64_t rounds = 0;
+        uint64_t unchokes = 0;
+        uint64_t chokes = 0;
+        uint64_t optimistic_unchokes = 0;
+    };
+
+    using ChokeCallback = std::function<void(uint64_t peer, bool choked)>;
+
+    // upload_slots 0: every interested peer is unchoked
+    Choker(EventLoop& loop, size_t upload_slots, size_t optimistic_slots, ChokeCallback set_choked);
+    ~Choker();
+    Choker(const Choker&) = delete;
+    Choker& operator=(const Choker&) = delete;
+
+    void start();  // Schedules the rounds
+
+    // Peers start choked and not interested
+    void addPeer(uint64_t peer);
+    void removePeer(uint64_t peer);
+    void setInterested(uint64_t peer, bool interested);
+    // Payload bytes, for the rates of the next round
+    void onUploaded(uint64_t peer, size_t bytes);
+
+    const Stats& getStats() const { return stats; }
+
+private:
+    struct Peer {
+        bool interested = false;
+        bool choked = true;
+        bool optimistic = false;
+        uint64_t uploaded = 0;    // Since the last round
+        double rate = 0;          // Bytes per second over the last round
+        EventLoop::Clock::time_point last_optimistic{};  // Never: first in line
+    };
+
+    void runRound();  // Reschedules itself
+    void rotateOptimistic();
+    void fillFreeSlots();  // Between rounds, for peers that left or lost interest
+    void setChoked(uint64_t id, Peer& peer, bool choked);
+    size_t regularUnchoked() const;
+
+    EventLoop& loop;
+    const size_t upload_slots;
+    const size_t optimistic_slots;
+    ChokeCallback set_choked;
+    std::unordered_map<uint64_t, Peer> peers;
+    EventLoop::Clock::time_point last_round;
+    int rounds_until_optimistic = 0;
+    EventLoop::TimerId round_timer = 0;
+    Stats stats;
+};
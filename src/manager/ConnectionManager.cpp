@@ -0,0 +1,142 @@
+#include "ConnectionManager.hpp"
+#include <algorithm>
+
+ConnectionManager::ConnectionManager(EventLoop& loop, size_t target, DialCallback dial)
+    : loop(loop), target(std::max<size_t>(target, 1)), dial(std::move(dial)) {
+}
+
+ConnectionManager::~ConnectionManager() {
+    for (auto& [key, candidate] : candidates) {
+        if (candidate.retry_timer != 0) {
+            loop.cancelTimer(candidate.retry_timer);
+        }
+    }
+}
+
+void ConnectionManager::addCandidates(const std::vector<PeerEndpoint>& peers) {
+    for (const auto& peer : peers) {
+        std::string key = peer.toString();
+        auto [it, added] = candidates.try_emplace(key);
+        if (added) {
+            it->second.peer = peer;
+            idle.push_back(key);
+        }
+    }
+    fill();
+}
+
+void ConnectionManager::addConnected(const PeerEndpoint& peer) {
+    auto [it, added] = candidates.try_emplace(peer.toString());
+    Candidate& candidate = it->second;
+    if (!added && candidate.state != State::IDLE) {
+        return;
+    }
+    candidate.peer = peer;
+    candidate.state = State::CONNECTED;
+    candidate.attempts = 1;
+    connected++;
+}
+
+void ConnectionManager::onConnected(const PeerEndpoint& peer) {
+    Candidate* candidate = find(peer);
+    if (!candidate || candidate->state != State::DIALLING) {
+        return;
+    }
+    dialling--;
+    connected++;
+    candidate->state = State::CONNECTED;
+}
+
+void ConnectionManager::onFailed(const PeerEndpoint& peer) {
+    Candidate* candidate = find(peer);
+    if (!candidate || candidate->state != State::DIALLING) {
+        return;
+    }
+    dialling--;
+    candidate->failures++;
+    retryLater(*candidate);
+    fill();
+}
+
+void ConnectionManager::onDisconnected(const PeerEndpoint& peer, bool useful) {
+    Candidate* candidate = find(peer);
+    if (!candidate || candidate->state != State::CONNECTED) {
+        return;
+    }
+    connected--;
+    if (useful) {
+        candidate->failures = 0;
+    }
+    candidate->failures++;
+    retryLater(*candidate);
+    fill();
+}
+
+void ConnectionManager::ban(const PeerEndpoint& peer) {
+    if (Candidate* candidate = find(peer)) {
+        candidate->banned = true;
+    }
+}
+
+bool ConnectionManager::hasWaitingCandidates() const {
+    return std::any_of(idle.begin(), idle.end(),
+        [this](const std::string& key) { return candidates.at(key).state == State::IDLE; });
+}
+
+bool ConnectionManager::exhausted(bool wait_for_retries) const {
+    if (connected > 0 || dialling > 0 || (wait_for_retries && waiting > 0)) {
+        return false;
+    }
+    return !hasWaitingCandidates();
+}
+
+void ConnectionManager::fill() {
+    // A dial can fail on the spot and land back here
+    if (filling) {
+        return;
+    }
+    filling = true;
+    while (connected + dialling < target && !idle.empty()) {
+        Candidate& candidate = candidates.at(idle.front());
+        idle.pop_front();
+        if (candidate.state != State::IDLE) {
+            continue;
+        }
+        candidate.state = State::DIALLING;
+        dialling++;
+        stats.dials++;
+        if (candidate.attempts > 0) {
+            stats.redials++;
+        }
+        candidate.attempts++;
+        dial(candidate.peer);
+    }
+    filling = false;
+}
+
+void ConnectionManager::retryLater(Candidate& candidate) {
+    if (candidate.banned || candidate.failures >= MAX_FAILURES || candidate.attempts >= MAX_ATTEMPTS) {
+        candidate.state = State::GIVEN_UP;
+        stats.given_up++;
+        return;
+    }
+    // 1 s, 2 s, 4 s... after each failure in a row
+    auto delay = std::min<std::chrono::milliseconds>(
+        INITIAL_BACKOFF * (1 << std::min(candidate.failures - 1, 16)), MAX_BACKOFF);
+    candidate.state = State::WAITING;
+    waiting++;
+    std::string key = candidate.peer.toString();
+    candidate.retry_timer = loop.runAfter(delay, [this, key]() {
+        Candidate& retry = candidates.at(key);
+        retry.retry_timer = 0;
+        retry.state = State::IDLE;
+        waiting--;
+        idle.push_back(key);
+        fill();
+    });
+}
+
+ConnectionManager::Candidate* ConnectionManager::find(const PeerEndpoint& peer) {
+    auto it = candidates.find(peer.toString());
+    return it == candidates.end() ? nullptr : &it->second;
+}
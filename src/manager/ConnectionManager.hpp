@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../net/EventLoop.hpp"
+#include "../net/PeerEndpoint.hpp"
+
+// Keeps a download at its target number of peer sessions from the candidates
+// it has been given. Failed dials and lost sessions are retried after an
+// exponential backoff, up to a cap per address, and any free slot goes to the
+// next candidate, so peers lost mid-download get replaced. The owner dials and
+// reports every outcome back. Loop thread only.
+class ConnectionManager {
+public:
+    static constexpr std::chrono::milliseconds INITIAL_BACKOFF{1000};
+    static constexpr std::chrono::milliseconds MAX_BACKOFF{60000};
+    static constexpr int MAX_FAILURES = 5;   // In a row, then the address is given up
+    static constexpr int MAX_ATTEMPTS = 20;  // Per address over the whole download
+
+    struct Stats {
+        uint64_t dials = 0;
+        uint64_t redials = 0;  // Of addresses dialled before
+        uint64_t given_up = 0;
+    };
+
+    using DialCallback = std::function<void(const PeerEndpoint& peer)>;
+
+    ConnectionManager(EventLoop& loop, size_t target, DialCallback dial);
+    ~ConnectionManager();
+    ConnectionManager(const ConnectionManager&) = delete;
+    ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+    // Dials what fits under the target; addresses already known are skipped
+    void addCandidates(const std::vector<PeerEndpoint>& peers);
+    // A session that exists already, e.g. the peer that served the metadata
+    void addConnected(const PeerEndpoint& peer);
+
+    // Outcomes, for the endpoints as they were dialled
+    void onConnected(const PeerEndpoint& peer);
+    void onFailed(const PeerEndpoint& peer);
+    // A session ended. One that delivered data forgives the failures before it.
+    void onDisconnected(const PeerEndpoint& peer, bool useful);
+    // Never dialled again, e.g. after sending corrupt data
+    void ban(const PeerEndpoint& peer);
+
+    // Given before, whatever became of it
+    bool knows(const PeerEndpoint& peer) const { return candidates.contains(peer.toString()); }
+    // Some candidate waits for a free slot, so a session could be replaced
+    bool hasWaitingCandidates() const;
+
+    // Nothing connected or being dialled, and no retry to wait for (or none
+    // wanted: before any peer has worked, a dead swarm fails fast)
+    bool exhausted(bool wait_for_retries) const;
+    const Stats& getStats() const { return stats; }
+
+private:
+    enum class State { IDLE, DIALLING, CONNECTED, WAITING, GIVEN_UP };
+
+    struct Candidate {
+        PeerEndpoint peer;
+        State state = State::IDLE;
+        int failures = 0;
+        int attempts = 0;
+        bool banned = false;
+        EventLoop::TimerId retry_timer = 0;
+    };
+
+    void fill();
+    void retryLater(Candidate& candidate);  // Backs off, or gives up past the caps
+    Candidate* find(const PeerEndpoint& peer);
+
+    EventLoop& loop;
+    const size_t target;
+    DialCallback dial;
+    std::unordered_map<std::string, Candidate> candidates;  // By ip:port
+    std::deque<std::string> idle;                           // Dialled in this order
+    size_t dialling = 0;
+    size_t connected = 0;
+    size_t waiting = 0;
+    bool filling = false;
+    Stats stats;
+};
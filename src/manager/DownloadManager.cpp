@@ -0,0 +1,742 @@
+#include "DownloadManager.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+const size_t MAX_PEER_STATS = 10;
+
+size_t diskThreads() {
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+}
+}
+
+DownloadManager::DownloadManager(PieceManager& piece_manager, std::vector<std::unique_ptr<PeerManager>>& peers,
+                                 const DownloadOptions& options)
+    : piece_manager(piece_manager), peers(peers), options(options),
+      download_limiter(&RateLimiter::global(RateLimiter::DOWNLOAD), options.limits.download),
+      upload_limiter(&RateLimiter::global(RateLimiter::UPLOAD), options.limits.upload),
+      limits(options.limits),
+      request_deadlines(loop, TIMEOUT_TICK, TIMEOUT_SLOTS,
+                        [this](const RequestDeadline& deadline) { onRequestTimeout(deadline); }),
+      disk_pool(diskThreads()) {
+    // Registered ahead of the transport's hook, so requests queued here are
+    // submitted in the same round
+    loop.addPrepareHook([this]() { processRound(); });
+    // Multishot receives can't be held back, so limits need the epoll transport;
+    // uTP paces itself and isn't metered either
+    bool limited = options.limits.any() || RateLimiter::global(RateLimiter::DOWNLOAD).getRate() > 0 ||
+                   RateLimiter::global(RateLimiter::UPLOAD).getRate() > 0;
+    if (options.io_uring && limited) {
+        std::cerr << "Rate limits need the epoll transport, not using io_uring" << std::endl;
+    }
+    if (options.utp && limited) {
+        std::cerr << "Rate limits need TCP, not using uTP" << std::endl;
+    }
+    transport = Transport::create(loop, options.io_uring && !limited);
+    if (options.utp && !limited) {
+        utp_transport = std::make_unique<UtpTransport>(loop);
+    }
+    connector = std::make_unique<PeerConnector>(
+        loop, options.max_half_open, options.connect_timeout,
+        [this](const PeerEndpoint& endpoint, const PeerEndpoint& address, int fd) {
+            onConnected(endpoint, address, fd, transport.get());
+        },
+        [this](const PeerEndpoint& endpoint, const std::string& reason) {
+            onConnectFailed(endpoint, reason);
+        });
+    pool = std::make_unique<ConnectionManager>(loop, options.max_peers,
+        [this](const PeerEndpoint& endpoint) { dial(endpoint); });
+}
+
+DownloadManager::~DownloadManager() {
+    stop();
+}
+
+void DownloadManager::addCandidates(const std::string& hash,
+                                    const std::vector<PeerEndpoint>& addresses) {
+    info_hash = hash;
+    candidates.insert(candidates.end(), addresses.begin(), addresses.end());
+}
+
+void DownloadManager::start() {
+    int sessions = 0;
+    for (auto& peer : peers) {
+        if (!peer->isConnected()) {
+            continue;
+        }
+        piece_manager.addPeerAvailability(peer->getAvailability());
+        startSession(*peer, transport.get());
+        pool->addConnected(peer->getEndpoint());
+        sessions++;
+    }
+
+    if (sessions == 0 && candidates.empty()) {
+        throw std::runtime_error("No peers available");
+    }
+    had_ready_peer = sessions > 0;
+
+    if (options.verbose) {
+        std::cout << "Transport: " << transport->name() << (utp_transport ? " and utp" : "") << ", "
+                  << sessions << " peers";
+        if (!candidates.empty()) {
+            std::cout << ", connecting to " << candidates.size() << " more";
+        }
+        std::cout << std::endl;
+    }
+    loop.post([this]() {
+        fillAllPipelines();
+        pool->addCandidates(candidates);
+        candidates.clear();
+        loop.runAfter(EVICTION_INTERVAL, [this]() { evictSlowPeer(); });
+        loop.runAfter(PEX_CHECK_INTERVAL, [this]() { exchangePeers(); });
+    });
+    loop_thread = std::thread([this]() {
+        try {
+            loop.run();
+        } catch (const std::exception& e) {
+            piece_manager.abortDownload(e.what());
+        }
+        loop_syscalls = SyscallCounter::threadSyscalls();
+    });
+}
+
+void DownloadManager::stop() {
+    if (loop_thread.joinable()) {
+        loop.stop();
+        loop_thread.join();
+    }
+    for (auto& peer : peers) {
+        peer->endSession();
+    }
+}
+
+void DownloadManager::dial(const PeerEndpoint& endpoint) {
+    if (utp_transport) {
+        connectUtp(endpoint);
+    } else {
+        connector->add(endpoint);
+    }
+}
+
+void DownloadManager::connectUtp(const PeerEndpoint& endpoint) {
+    utp_transport->connect(endpoint, options.connect_timeout,
+        [this, endpoint](int handle, const std::string& reason) {
+            if (handle >= 0) {
+                onConnected(endpoint, endpoint, handle, utp_transport.get());
+                return;
+            }
+            // Plenty of clients speak only TCP
+            if (options.verbose) {
+                std::cout << "Peer " << endpoint.toString() << " uTP connect failed: " << reason
+                          << ", trying TCP" << std::endl;
+            }
+            connector->add(endpoint);
+        });
+}
+
+void DownloadManager::onConnected(const PeerEndpoint& endpoint, const PeerEndpoint& address, int fd,
+                                  Transport* via) {
+    pool->onConnected(endpoint);
+    if (via == transport.get()) {
+        SocketAddress local;
+        local.length = sizeof(local.storage);
+        if (getsockname(fd, reinterpret_cast<sockaddr*>(&local.storage), &local.length) == 0) {
+            own_addresses.insert(PeerEndpoint::fromAddress(local.storage).toString());
+        }
+    }
+    peers.push_back(std::make_unique<PeerManager>(address.ip, address.port, info_hash));
+    PeerManager* peer = peers.back().get();
+    dialled_as[peer] = endpoint;
+    peer->adoptSocket(fd);
+    startSession(*peer, via);
+
+    // Accepting the connection is not answering the handshake
+    holdPeer(*peer);
+    loop.runAfter(options.connect_timeout, [this, peer]() {
+        releasePeer(*peer);
+        if (peer->isConnected() && !peer->isSessionReady()) {
+            std::cerr << "Peer " << peer->getPeerInfo() << " handshake timed out" << std::endl;
+            peer->disconnect();
+        }
+    });
+}
+
+void DownloadManager::startSession(PeerManager& peer, Transport* via) {
+    if (!via->supportsRateLimits()) {
+        peer.startSession(this, via);
+        return;
+    }
+    auto& limiters = peer_limiters[&peer];
+    limiters = std::make_unique<PeerLimiters>(&download_limiter, &upload_limiter, limits);
+    peer.startSession(this, via, &limiters->download, &limiters->upload);
+}
+
+void DownloadManager::setRateLimits(const RateLimits& new_limits) {
+    download_limiter.setRate(new_limits.download);
+    upload_limiter.setRate(new_limits.upload);
+    loop.post([this, new_limits]() {
+        limits = new_limits;
+        for (auto& [peer, limiters] : peer_limiters) {
+            limiters->download.setRate(limits.peer_download);
+            limiters->upload.setRate(limits.peer_upload);
+        }
+    });
+}
+
+void DownloadManager::onConnectFailed(const PeerEndpoint& endpoint, const std::string& reason) {
+    if (options.verbose) {
+        std::cout << "Peer " << endpoint.toString() << " connect failed: " << reason << std::endl;
+    }
+    pool->onFailed(endpoint);
+    checkPeersLeft();
+}
+
+void DownloadManager::onPeerReady(PeerManager& peer) {
+    piece_manager.addPeerAvailability(peer.getAvailability());
+    had_ready_peer = true;
+    ready_since[&peer] = EventLoop::Clock::now();
+    if (options.verbose) {
+        std::cout << "Peer " << peer.getPeerInfo() << " ready" << std::endl;
+    }
+    // Our handshake claimed nothing and a BITFIELD may only come first, so
+    // what completed before the peer joined goes out as HAVEs
+    bool queued = false;
+    for (int index = 0; index < piece_manager.getTotalPieces(); index++) {
+        if (piece_manager.isPieceComplete(index)) {
+            queued = queueHave(peer, index) || queued;
+        }
+    }
+    if (queued) {
+        peer.flushSendBuffer();
+    }
+}
+
+void DownloadManager::onPeerHave(PeerManager&, int index) {
+    piece_manager.addPieceAvailability(index);
+}
+
+void DownloadManager::onPeerExchange(PeerManager&, const PeerExchange& message) {
+    pex_received++;
+    // Dropped peers only left the sender; they may still take our connections,
+    // and the pool's backoff deals with those that don't
+    pex_dropped += message.dropped.size();
+
+    std::unordered_set<std::string> known = own_addresses;
+    for (const auto& peer : peers) {
+        known.insert(peer->getPeerInfo());
+    }
+    for (const auto& [peer, endpoint] : dialled_as) {
+        known.insert(endpoint.toString());
+    }
+    // A message may name at most MAX_PEERS; the rest of a longer one is ignored
+    std::vector<PeerEndpoint> fresh;
+    for (size_t i = 0; i < std::min(message.added.size(), PeerExchange::MAX_PEERS); ++i) {
+        const PeerEndpoint& endpoint = message.added[i];
+        if (endpoint.port > 0 && !pool->knows(endpoint) && known.insert(endpoint.toString()).second) {
+            fresh.push_back(endpoint);
+        }
+    }
+    pex_added += fresh.size();
+    pex_discarded += message.added.size() - fresh.size();
+    pool->addCandidates(fresh);
+}
+
+void DownloadManager::onBlockRequested(PeerManager& peer, int index, int begin,
+                                       std::chrono::steady_clock::time_point requested) {
+    holdPeer(peer);
+    request_deadlines.schedule(requested + peer.getRequestTimeout(), {&peer, index, begin, requested});
+}
+
+void DownloadManager::onRequestTimeout(const RequestDeadline& deadline) {
+    PeerManager& peer = *deadline.peer;
+    releasePeer(peer);
+    // Most deadlines pass long after their block arrived
+    if (!peer.isConnected() || !peer.isRequestOutstanding(deadline.index, deadline.begin, deadline.requested)) {
+        return;
+    }
+    request_timeouts++;
+    int timeouts = peer.snub();
+    if (timeouts >= MAX_CONSECUTIVE_TIMEOUTS) {
+        std::cerr << "Peer " << peer.getPeerInfo() << " stopped responding" << std::endl;
+        peer.disconnect();  // dropPeer keeps what it had delivered
+        return;
+    }
+    if (options.verbose) {
+        std::cout << "Peer " << peer.getPeerInfo() << " snubbed: block " << deadline.index << ":" << deadline.begin
+                  << " unanswered after " << peer.getRequestTimeout().count() << " ms" << std::endl;
+    }
+    releasePieces(peer, true);
+    fillAllPipelines();
+}
+
+void DownloadManager::onRequestRejected(PeerManager& peer, int index) {
+    // Another peer may have it without the wait; this one gets it back if none does
+    if (auto released = peer.releasePiece(index)) {
+        stashPiece(std::move(*released), &peer);
+    }
+    fillAllPipelines();
+}
+
+void DownloadManager::releasePieces(PeerManager& peer, bool stalled) {
+    for (auto& released : peer.releasePieces()) {
+        stashPiece(std::move(released), stalled ? &peer : nullptr);
+    }
+}
+
+void DownloadManager::stashPiece(PeerManager::ReleasedPiece released, PeerManager* stalled_peer) {
+    int index = released.index;
+    if (piece_manager.isPieceComplete(index) || partial_pieces.contains(index)) {
+        piece_manager.savePieceData(index, {});  // An endgame duplicate; nothing worth keeping
+        return;
+    }
+    partial_pieces.emplace(index, PartialPiece{std::move(released), stalled_peer});
+    piece_manager.savePieceData(index, {});  // Pending again, for whoever picks it next
+}
+
+bool DownloadManager::leaveToOthers(const PeerManager& peer, int index) const {
+    auto partial = partial_pieces.find(index);
+    if (partial == partial_pieces.end() || partial->second.stalled_peer != &peer) {
+        return false;
+    }
+    return std::any_of(peers.begin(), peers.end(), [&](const auto& other) {
+        return other.get() != &peer && other->isConnected() && other->isSessionReady() &&
+               !other->isSnubbed() && other->hasPiece(index);
+    });
+}
+
+void DownloadManager::onPeerActivity(PeerManager& peer) {
+    active_peers.push_back(&peer);
+}
+
+void DownloadManager::onPeerClosed(PeerManager& peer) {
+    closed_peers.push_back(&peer);
+}
+
+void DownloadManager::processRound() {
+    // Deferred so a peer never vanishes under the callback that noticed it
+    while (!closed_peers.empty()) {
+        PeerManager* peer = closed_peers.back();
+        closed_peers.pop_back();
+        dropPeer(*peer);
+    }
+    for (PeerManager* peer : active_peers) {
+        fillPipeline(*peer);
+    }
+    active_peers.clear();
+    if (!dropped_peers.empty()) {
+        reapPeers();
+    }
+}
+
+void DownloadManager::fillPipeline(PeerManager& peer) {
+    while (peer.isConnected() && peer.canTakePiece()) {
+        auto retry = EventLoop::Clock::time_point::max();
+        int index = piece_manager.getNextPiece(
+            [this, &peer](int i) {
+                return peer.hasPiece(i) && peer.canRequestPiece(i) && !peer.isDownloadingPiece(i) &&
+                       !leaveToOthers(peer, i);
+            },
+            schedulingRate(peer), &retry);
+        if (index == -1) {
+            if (retry != EventLoop::Clock::time_point::max()) {
+                scheduleRetry(retry);
+            }
+            break;
+        }
+        if (options.verbose) {
+            std::cout << "Peer " << peer.getPeerInfo() << " start piece " << index << std::endl;
+        }
+        auto partial = partial_pieces.find(index);
+        if (partial != partial_pieces.end()) {
+            // Another peer got part of the way; fetch only the rest
+            peer.resumePiece(std::move(partial->second.piece));
+            partial_pieces.erase(partial);
+        } else {
+            peer.addPiece(index, piece_manager.getPieceLength(index), piece_manager.acquireBuffer(index));
+        }
+    }
+}
+
+void DownloadManager::fillAllPipelines() {
+    for (auto& peer : peers) {
+        fillPipeline(*peer);
+    }
+}
+
+void DownloadManager::dropPeer(PeerManager& peer) {
+    if (peer.isSessionReady()) {
+        std::cout << "Peer " << peer.getPeerInfo() << " lost connection" << std::endl;
+
+        // Put its unfinished pieces back in the queue for the others, keeping the blocks that arrived
+        releasePieces(peer, false);
+        piece_manager.removePeerAvailability(peer.getAvailability());
+        fillAllPipelines();
+    }
+    pex_state.erase(&peer);
+
+    // Its slot goes to the next candidate; the address itself is retried after a backoff
+    auto dialled = dialled_as.find(&peer);
+    pool->onDisconnected(dialled != dialled_as.end() ? dialled->second : peer.getEndpoint(),
+                         peer.getBytesReceived() > 0 && !evicted.contains(&peer));
+    dropped_peers.push_back(&peer);
+    checkPeersLeft();
+}
+
+void DownloadManager::reapPeers() {
+    std::unordered_set<const PeerManager*> reaped;
+    std::erase_if(dropped_peers, [this, &reaped](PeerManager* peer) {
+        if (pending_callbacks[peer] > 0) {
+            return false;
+        }
+        if (peer->getBytesReceived() > 0 || peer->getRequestTimeouts() > 0 || peer->getBadPieces() > 0) {
+            reaped_summaries.push_back(summarize(*peer));  // Before its eviction is forgotten
+        }
+        pending_callbacks.erase(peer);
+        dialled_as.erase(peer);
+        ready_since.erase(peer);
+        evicted.erase(peer);
+        peer_limiters.erase(peer);
+        pex_state.erase(peer);
+        reaped.insert(peer);
+        return true;
+    });
+    if (reaped.empty()) {
+        return;
+    }
+    // A later peer may get the same address
+    for (auto& [index, partial] : partial_pieces) {
+        if (reaped.contains(partial.stalled_peer)) {
+            partial.stalled_peer = nullptr;
+        }
+    }
+    std::erase_if(peers, [this, &reaped](const auto& peer) {
+        if (!reaped.contains(peer.get())) {
+            return false;
+        }
+        reaped_blocks += peer->getSteadyStateBlocks();
+        reaped_allocations += peer->getSteadyStateAllocations();
+        return true;
+    });
+}
+
+void DownloadManager::checkPeersLeft() {
+    // Retries are only worth waiting for once the swarm has proved it works
+    if (!pool->exhausted(had_ready_peer)) {
+        return;
+    }
+    bool connected = std::any_of(peers.begin(), peers.end(),
+        [](const auto& peer) { return peer->isConnected(); });
+    if (!connected) {
+        piece_manager.abortDownload(had_ready_peer ? "All peers disconnected" : "No peers available");
+    }
+}
+
+void DownloadManager::onPieceReceived(PeerManager& peer, int index, PooledBuffer data, bool resumed) {
+    if (options.verbose) {
+        std::cout << "Peer " << peer.getPeerInfo() << " finish piece " << index
+                  << " (size: " << data->size() << ")" << std::endl;
+    }
+    piece_manager.markPieceDownloaded(index);
+
+    // std::function needs a copyable callable, so the buffer travels in a shared_ptr
+    auto buffer = std::make_shared<PooledBuffer>(std::move(data));
+    PeerManager* sender = &peer;
+    holdPeer(peer);
+    disk_pool.submit([this, index, buffer, sender, resumed]() {
+        PieceManager::SaveResult result = piece_manager.savePieceData(index, std::move(*buffer));
+        loop.post([this, index, result, sender, resumed]() { onPieceSaved(index, result, *sender, resumed); });
+    });
+}
+
+void DownloadManager::onPieceSaved(int index, PieceManager::SaveResult result, PeerManager& peer, bool resumed) {
+    releasePeer(peer);
+    bool saved = result == PieceManager::SaveResult::SAVED;
+    bool complete = piece_manager.isPieceComplete(index);
+    if (result == PieceManager::SaveResult::WRITE_FAILED) {
+        std::cout << "Failed to write piece " << index << std::endl;
+    } else if (result == PieceManager::SaveResult::HASH_MISMATCH) {
+        std::cout << "Piece " << index << " from " << peer.getPeerInfo() << " failed the hash check" << std::endl;
+        // A peer that keeps sending garbage goes. With blocks from several
+        // peers there is no telling whose were bad, so nobody is charged.
+        if (!resumed && peer.recordBadPiece() >= MAX_BAD_PIECES && peer.isConnected()) {
+            std::cerr << "Peer " << peer.getPeerInfo() << " sent " << peer.getBadPieces()
+                      << " corrupt pieces, banning it" << std::endl;
+            auto dialled = dialled_as.find(&peer);
+            pool->ban(dialled != dialled_as.end() ? dialled->second : peer.getEndpoint());
+            peer.disconnect();
+        }
+    } else if (saved && options.verbose) {
+        std::cout << "Successfully saved piece " << index << std::endl;
+    }
+
+    if (complete && saved) {
+        for (auto& other : peers) {
+            if (other->isConnected() && other->isSessionReady()) {
+                queueHave(*other, index);
+            }
+        }
+    }
+    if (complete) {
+        partial_pieces.erase(index);
+        // Endgame losers: cancel the duplicates still in flight
+        for (auto& other : peers) {
+            std::chrono::milliseconds projected;
+            if (other->isConnected() && other->cancelPiece(index, projected)) {
+                piece_manager.recordCancelledRequest(projected);
+                piece_manager.savePieceData(index, {});
+                if (options.verbose) {
+                    std::cout << "Peer " << other->getPeerInfo() << " cancelled piece " << index << std::endl;
+                }
+            }
+        }
+    }
+    fillAllPipelines();  // A failed piece is pending again
+    if (complete && saved) {
+        // The HAVEs no REQUEST carried along
+        for (auto& other : peers) {
+            other->flushSendBuffer();
+        }
+    }
+}
+
+bool DownloadManager::queueHave(PeerManager& peer, int index) {
+    if (options.suppress_have && peer.hasPiece(index)) {
+        haves_suppressed++;
+        return false;
+    }
+    peer.queueHave(index);
+    haves_sent++;
+    return true;
+}
+
+double DownloadManager::schedulingRate(const PeerManager& peer) const {
+    if (peer.isSnubbed() || peer.getBadPieces() > 0) {
+        return 1;  // Known, and too slow for any deadline
+    }
+    return peer.getDownloadRate();
+}
+
+void DownloadManager::evictSlowPeer() {
+    loop.runAfter(EVICTION_INTERVAL, [this]() { evictSlowPeer(); });
+    if (!pool->hasWaitingCandidates()) {
+        return;  // Nobody to take the slot
+    }
+
+    std::vector<double> rates;
+    PeerManager* slowest = nullptr;
+    auto now = EventLoop::Clock::now();
+    for (auto& peer : peers) {
+        if (!peer->isConnected() || !peer->isSessionReady()) {
+            continue;
+        }
+        rates.push_back(peer->getDownloadRate());
+        // Peers that were there from the start are ready before onPeerReady could see them
+        auto ready = ready_since.find(peer.get());
+        if (ready != ready_since.end() && now - ready->second < EVICTION_INTERVAL) {
+            continue;  // Not had the time to show its rate
+        }
+        // Snubbed peers first, then the lowest rate
+        if (!slowest || std::make_pair(!peer->isSnubbed(), peer->getDownloadRate()) <
+                            std::make_pair(!slowest->isSnubbed(), slowest->getDownloadRate())) {
+            slowest = peer.get();
+        }
+    }
+    if (!slowest || rates.size() < 2) {
+        return;
+    }
+    auto median = rates.begin() + rates.size() / 2;
+    std::nth_element(rates.begin(), median, rates.end());
+    if (!slowest->isSnubbed() && slowest->getDownloadRate() >= SLOW_PEER_FRACTION * *median) {
+        return;
+    }
+
+    std::cout << "Peer " << slowest->getPeerInfo() << " evicted: "
+              << static_cast<int64_t>(slowest->getDownloadRate() / 1024) << " KiB/s against a median of "
+              << static_cast<int64_t>(*median / 1024) << " KiB/s" << (slowest->isSnubbed() ? ", snubbed" : "")
+              << std::endl;
+    evicted.insert(slowest);
+    slowest->disconnect();  // dropPeer hands its pieces and its slot on
+}
+
+void DownloadManager::scheduleRetry(EventLoop::Clock::time_point when) {
+    if (retry_timer != 0) {
+        if (retry_at <= when) {
+            return;
+        }
+        loop.cancelTimer(retry_timer);
+    }
+    retry_at = when;
+    retry_timer = loop.runAt(when, [this]() {
+        retry_timer = 0;
+        fillAllPipelines();
+    });
+}
+
+void DownloadManager::printStats() const {
+    auto io = transport->getStats();
+    double megabytes = io.bytes_received / (1024.0 * 1024.0);
+    std::cout << "Transport: " << transport->name() << ", " << static_cast<int64_t>(megabytes) << " MiB in"
+              << ", " << loop_syscalls << " loop syscalls";
+    if (megabytes >= 1) {
+        std::cout << " (" << static_cast<int64_t>(loop_syscalls / megabytes) << " per MiB)";
+    }
+    if (io.zero_copy_sends > 0) {
+        std::cout << ", " << io.zero_copy_sends << " zero-copy sends";
+    }
+    std::cout << std::endl;
+    if (utp_transport) {
+        const auto& utp = utp_transport->getSocketStats();
+        std::cout << "uTP: " << utp.bytes_received / (1024 * 1024) << " MiB in, " << utp.packets_sent
+                  << " packets out, " << utp.packets_received << " in, " << utp.retransmits << " resent, "
+                  << utp.timeouts << " timeouts" << std::endl;
+    }
+
+    auto endgame = piece_manager.getEndgameStats();
+    if (endgame.entered) {
+        std::cout << "Endgame: entered after " << endgame.entered_after.count() << " ms"
+                  << ", lasted " << endgame.duration.count() << " ms"
+                  << ", duplicate requests " << endgame.duplicate_requests
+                  << ", cancelled " << endgame.cancelled_requests
+                  << ", estimated time saved " << endgame.estimated_saved.count() << " ms"
+                  << std::endl;
+    }
+
+    auto connections = pool->getStats();
+    if (connections.redials > 0 || connections.given_up > 0) {
+        std::cout << "Connections: " << connections.dials << " dialled, " << connections.redials << " redialled, "
+                  << connections.given_up << " addresses given up" << std::endl;
+    }
+
+    if (request_timeouts > 0) {
+        std::cout << "Request timeouts: " << request_timeouts << std::endl;
+    }
+    if (pex_received > 0 || pex_sent > 0) {
+        std::cout << "PEX: " << pex_received << " messages in (" << pex_added << " peers added, " << pex_discarded
+                  << " discarded, " << pex_dropped << " dropped), " << pex_sent << " out" << std::endl;
+    }
+    if (haves_sent > 0 || haves_suppressed > 0) {
+        std::cout << "HAVEs: " << haves_sent << " sent, " << haves_suppressed << " suppressed" << std::endl;
+    }
+
+    uint64_t blocks = reaped_blocks;
+    uint64_t allocations = reaped_allocations;
+    for (const auto& peer : peers) {
+        blocks += peer->getSteadyStateBlocks();
+        allocations += peer->getSteadyStateAllocations();
+    }
+    auto buffers = piece_manager.getBufferStats();
+    std::cout << "Buffers: " << buffers.allocated << " allocated, " << buffers.reused << " reused"
+              << "; steady-state heap allocations " << allocations << " over " << blocks << " blocks"
+              << std::endl;
+
+    printPeerTable();
+
+    auto streaming = piece_manager.getStreamingStats();
+    if (streaming.enabled) {
+        std::cout << "Streaming: first piece after " << streaming.time_to_first_byte.count() << " ms"
+                  << ", stalls " << streaming.stalls
+                  << ", stall time " << streaming.stall_time.count() << " ms"
+                  << ", reassigned " << streaming.reassigned << " (" << streaming.cancelled << " cancelled)"
+                  << std::endl;
+    }
+}
+
+void DownloadManager::exchangePeers() {
+    loop.runAfter(PEX_CHECK_INTERVAL, [this]() { exchangePeers(); });
+    std::unordered_map<std::string, PeerEndpoint> connected;
+    for (const auto& peer : peers) {
+        if (peer->isConnected() && peer->isSessionReady()) {
+            connected.emplace(peer->getEndpoint().toString(), peer->getEndpoint());
+        }
+    }
+
+    auto now = EventLoop::Clock::now();
+    for (auto& peer : peers) {
+        if (!peer->isConnected() || !peer->isSessionReady() || !peer->supportsPex()) {
+            continue;
+        }
+        PexState& state = pex_state[peer.get()];
+        if (state.sent && now - state.last_sent < PeerExchange::INTERVAL) {
+            continue;
+        }
+        PeerExchange message;
+        std::string self = peer->getEndpoint().toString();
+        for (const auto& [key, endpoint] : connected) {
+            if (message.added.size() < PeerExchange::MAX_PEERS && key != self && !state.told.contains(key)) {
+                message.added.push_back(endpoint);
+                state.told.emplace(key, endpoint);
+            }
+        }
+        for (auto it = state.told.begin(); it != state.told.end();) {
+            if (message.dropped.size() < PeerExchange::MAX_PEERS && !connected.contains(it->first)) {
+                message.dropped.push_back(it->second);
+                it = state.told.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (message.added.empty() && message.dropped.empty()) {
+            continue;
+        }
+        peer->sendPex(message);
+        state.sent = true;
+        state.last_sent = now;
+        pex_sent++;
+    }
+}
+
+DownloadManager::PeerSummary DownloadManager::summarize(const PeerManager& peer) const {
+    const char* state = evicted.contains(&peer) ? "evicted"
+                      : peer.getBadPieces() >= MAX_BAD_PIECES ? "banned"
+                      : peer.isSnubbed() ? "snubbed"
+                      : peer.isConnected() ? "active" : "gone";
+    return {peer.getPeerInfo(), peer.getBytesReceived(), peer.getDownloadRate(), peer.getRequestTimeouts(),
+            peer.getBadPieces(), state};
+}
+
+void DownloadManager::printPeerTable() const {
+    // The busiest peers, and any that misbehaved; freed ones have no live stats left
+    std::vector<std::pair<PeerSummary, const PeerManager*>> ranked;
+    for (const auto& peer : peers) {
+        if (peer->getBytesReceived() > 0 || peer->getRequestTimeouts() > 0 || peer->getBadPieces() > 0) {
+            ranked.emplace_back(summarize(*peer), peer.get());
+        }
+    }
+    for (const auto& summary : reaped_summaries) {
+        ranked.emplace_back(summary, nullptr);
+    }
+    if (ranked.empty()) {
+        return;
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.first.bytes_received > b.first.bytes_received;
+    });
+
+    std::cout << std::left << std::setw(24) << "Peer" << std::right << std::setw(10) << "KiB"
+              << std::setw(10) << "KiB/s" << std::setw(7) << "depth" << std::setw(9) << "rtt ms"
+              << std::setw(8) << "p50" << std::setw(8) << "p90" << std::setw(10) << "timeouts"
+              << std::setw(5) << "bad" << "  state" << std::endl;
+    for (size_t i = 0; i < std::min<size_t>(ranked.size(), MAX_PEER_STATS); ++i) {
+        const auto& [summary, peer] = ranked[i];
+        std::cout << std::left << std::setw(24) << summary.peer << std::right
+                  << std::setw(10) << summary.bytes_received / 1024
+                  << std::setw(10) << static_cast<int64_t>(summary.download_rate / 1024);
+        if (peer) {
+            std::cout << std::setw(7) << peer->getPipelineDepth()
+                      << std::setw(9) << std::fixed << std::setprecision(1) << peer->getRoundTripTime() * 1000
+                      << std::defaultfloat
+                      << std::setw(8) << peer->getLatencyPercentile(0.5).count()
+                      << std::setw(8) << peer->getLatencyPercentile(0.9).count();
+        } else {
+            std::cout << std::setw(7) << "-" << std::setw(9) << "-" << std::setw(8) << "-" << std::setw(8) << "-";
+        }
+        std::cout << std::setw(10) << summary.request_timeouts
+                  << std::setw(5) << summary.bad_pieces << "  " << summary.state << std::endl;
+    }
+    if (ranked.size() > MAX_PEER_STATS) {
+        std::cout << "... and " << ranked.size() - MAX_PEER_STATS << " more peers" << std::endl;
+    }
+}
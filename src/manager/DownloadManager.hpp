@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "PieceManager.hpp"
+#include "PeerManager.hpp"
+#include "ConnectionManager.hpp"
+#include "../net/EventLoop.hpp"
+#include "../net/Transport.hpp"
+#include "../net/PeerConnector.hpp"
+#include "../net/UtpTransport.hpp"
+#include "../net/TimerWheel.hpp"
+#include "../utils/ThreadPool.hpp"
+
+// Bytes per second, 0 for unlimited
+struct RateLimits {
+    double download = 0;  // The torrent's, under RateLimiter::global()
+    double upload = 0;
+    double peer_download = 0;  // Each peer's, under the torrent's
+    double peer_upload = 0;
+
+    bool any() const { return download > 0 || upload > 0 || peer_download > 0 || peer_upload > 0; }
+};
+
+struct DownloadOptions {
+    bool io_uring = false;  // Falls back to epoll when the kernel can't
+    bool utp = false;       // Candidates try uTP first and TCP when it gets no answer
+    bool verbose = true;    // Per-piece progress lines
+    std::chrono::milliseconds connect_timeout{5000};  // Per attempt, for the connect and again the handshake
+    size_t max_half_open = 64;  // Connection attempts in flight at once
+    size_t max_peers = 50;      // Sessions kept open; other candidates wait for a free slot
+    bool suppress_have = false;  // No HAVE for a piece to peers that have it already
+    RateLimits limits;          // Limits of any kind keep the transport on epoll and TCP
+};
+
+// Drives every peer of a download from a single event loop thread. Peers are
+// event-driven sessions on a shared transport; piece verification and disk
+// writes run on a small worker pool and post their results back to the loop.
+class DownloadManager : public PeerSessionListener {
+public:
+    DownloadManager(PieceManager& piece_manager, std::vector<std::unique_ptr<PeerManager>>& peers,
+                    const DownloadOptions& options = {});
+    ~DownloadManager();
+
+    // Connects to these in the background, up to max_peers at a time; each
+    // peer joins the download as soon as its handshake completes, and is
+    // redialled or replaced if it is lost. Call before start().
+    void addCandidates(const std::string& info_hash, const std::vector<PeerEndpoint>& candidates);
+    void start();  // Registers the connected peers and spawns the loop thread
+    void stop();   // Stops the loop and ends the sessions; peers stay inspectable
+    void printStats() const;
+    uint64_t getLoopSyscalls() const { return loop_syscalls; }  // Valid after stop()
+    const char* getTransportName() const { return transport->name(); }
+    // Takes effect within a loop round or so; thread-safe. Only sessions on a
+    // transport that supports limits are held to them: with none set at
+    // construction, io_uring and uTP may be in use.
+    void setRateLimits(const RateLimits& limits);
+
+    void onPieceReceived(PeerManager& peer, int index, PooledBuffer data, bool resumed) override;
+    void onPeerReady(PeerManager& peer) override;
+    void onPeerHave(PeerManager& peer, int index) override;
+    void onBlockRequested(PeerManager& peer, int index, int begin,
+                          std::chrono::steady_clock::time_point requested) override;
+    void onRequestRejected(PeerManager& peer, int index) override;
+    void onPeerActivity(PeerManager& peer) override;
+    void onPeerClosed(PeerManager& peer) override;
+    void onPeerExchange(PeerManager& peer, const PeerExchange& message) override;
+
+private:
+    // Granularity of the request deadlines; the wheel spans a minute
+    static constexpr std::chrono::milliseconds TIMEOUT_TICK{100};
+    static constexpr size_t TIMEOUT_SLOTS = 600;
+    static constexpr int MAX_CONSECUTIVE_TIMEOUTS = 3;  // Then the peer is dropped
+    static constexpr int MAX_BAD_PIECES = 3;  // Failed hash checks, then the peer is dropped for good
+    // While candidates wait for a slot, the slowest peer is replaced every
+    // interval if it runs below this fraction of the median rate
+    static constexpr std::chrono::seconds EVICTION_INTERVAL{10};
+    static constexpr double SLOW_PEER_FRACTION = 0.1;
+    // How often peers are checked for a ut_pex message due; each still gets
+    // one at most every PeerExchange::INTERVAL
+    static constexpr std::chrono::seconds PEX_CHECK_INTERVAL{5};
+
+    struct PeerLimiters {
+        RateLimiter download;
+        RateLimiter upload;
+        PeerLimiters(RateLimiter* download_parent, RateLimiter* upload_parent, const RateLimits& limits)
+            : download(download_parent, limits.peer_download), upload(upload_parent, limits.peer_upload) {}
+    };
+
+    // What a peer has been told over ut_pex
+    struct PexState {
+        std::unordered_map<std::string, PeerEndpoint> told;  // By ip:port
+        EventLoop::Clock::time_point last_sent;
+        bool sent = false;
+    };
+
+    // A row of the end-of-run peer table, kept for peers that were freed
+    struct PeerSummary {
+        std::string peer;
+        int64_t bytes_received;
+        double download_rate;
+        int request_timeouts;
+        int bad_pieces;
+        const char* state;
+    };
+
+    struct RequestDeadline {
+        PeerManager* peer;
+        int index;
+        int begin;
+        std::chrono::steady_clock::time_point requested;
+    };
+
+    // A piece a peer gave up on, waiting for another one to fetch what is missing
+    struct PartialPiece {
+        PeerManager::ReleasedPiece piece;
+        PeerManager* stalled_peer;  // Timed out on it or rejected it; null after a disconnect
+    };
+
+    void processRound();  // Prepare hook: drop closed peers, refill active ones, reap dropped ones
+    void fillPipeline(PeerManager& peer);
+    void fillAllPipelines();
+    void dropPeer(PeerManager& peer);
+    // A deadline, save or timer that will call back with the peer
+    void holdPeer(const PeerManager& peer) { pending_callbacks[&peer]++; }
+    void releasePeer(const PeerManager& peer) { pending_callbacks[&peer]--; }
+    void reapPeers();  // Frees the dropped peers nothing is pending for
+    void onRequestTimeout(const RequestDeadline& deadline);
+    void releasePieces(PeerManager& peer, bool stalled);
+    void stashPiece(PeerManager::ReleasedPiece released, PeerManager* stalled_peer);
+    // A peer leaves a piece it stalled on to any other peer that could take it
+    bool leaveToOthers(const PeerManager& peer, int index) const;
+    void dial(const PeerEndpoint& endpoint);
+    void connectUtp(const PeerEndpoint& endpoint);
+    // endpoint as dialled; address is what answered
+    void onConnected(const PeerEndpoint& endpoint, const PeerEndpoint& address, int fd, Transport* via);
+    void onConnectFailed(const PeerEndpoint& endpoint, const std::string& reason);
+    void checkPeersLeft();  // Aborts once no peer is connected and none is left to dial
+    void onPieceSaved(int index, PieceManager::SaveResult result, PeerManager& peer, bool resumed);
+    // Queues a HAVE to a ready peer; false when suppressed
+    bool queueHave(PeerManager& peer, int index);
+    // The rate a peer is trusted with for time-critical pieces: snubbed and
+    // corrupting peers get next to none, so urgent pieces go to proven ones
+    double schedulingRate(const PeerManager& peer) const;
+    void evictSlowPeer();  // Reschedules itself
+    // Sends each PEX peer the sessions that started and ended since its last
+    // message; reschedules itself
+    void exchangePeers();
+    PeerSummary summarize(const PeerManager& peer) const;
+    void printPeerTable() const;
+    // Starts a connected peer's session behind its own rate limiters
+    void startSession(PeerManager& peer, Transport* via);
+    void scheduleRetry(EventLoop::Clock::time_point when);
+
+    PieceManager& piece_manager;
+    std::vector<std::unique_ptr<PeerManager>>& peers;
+    const DownloadOptions options;
+    std::vector<PeerManager*> active_peers;  // Had input this round
+    std::vector<PeerManager*> closed_peers;  // Disconnected this round
+    std::vector<PeerManager*> dropped_peers;  // Waiting for their pending callbacks
+    std::unordered_map<const PeerManager*, int> pending_callbacks;
+    uint64_t reaped_blocks = 0;  // Steady-state counters of the freed peers
+    uint64_t reaped_allocations = 0;
+    std::vector<PeerSummary> reaped_summaries;  // Those worth a row in the peer table
+    std::string info_hash;  // Handshake of the peers we connect to
+    std::vector<PeerEndpoint> candidates;
+    bool had_ready_peer = false;
+    std::map<int, PartialPiece> partial_pieces;
+    uint64_t request_timeouts = 0;
+    uint64_t haves_sent = 0;
+    uint64_t haves_suppressed = 0;
+    std::unordered_map<const PeerManager*, PeerEndpoint> dialled_as;  // For the pool's bookkeeping
+    std::unordered_set<const PeerManager*> evicted;  // Go to the back of the queue when redialled
+    std::unordered_map<const PeerManager*, EventLoop::Clock::time_point> ready_since;
+    std::unordered_map<const PeerManager*, PexState> pex_state;
+    uint64_t pex_received = 0;
+    uint64_t pex_sent = 0;
+    uint64_t pex_added = 0;      // New candidates the received messages named
+    uint64_t pex_discarded = 0;  // Named, but known already, ours or past the cap
+    uint64_t pex_dropped = 0;
+    // Our side of the TCP sessions, which PEX senders may name back to us
+    std::unordered_set<std::string> own_addresses;
+
+    // Outlive the transport, which paces the sessions through them
+    RateLimiter download_limiter;
+    RateLimiter upload_limiter;
+    std::unordered_map<const PeerManager*, std::unique_ptr<PeerLimiters>> peer_limiters;
+    RateLimits limits;  // As last set, loop thread
+
+    // Destroyed bottom-up: pending saves may still post to the loop, and the
+    // transport unregisters from it
+    EventLoop loop;
+    std::unique_ptr<Transport> transport;
+    std::unique_ptr<UtpTransport> utp_transport;  // Only with options.utp
+    std::unique_ptr<PeerConnector> connector;
+    std::unique_ptr<ConnectionManager> pool;
+    TimerWheel<RequestDeadline> request_deadlines;
+    ThreadPool disk_pool;
+    std::thread loop_thread;
+    EventLoop::TimerId retry_timer = 0;
+    EventLoop::Clock::time_point retry_at;
+    uint64_t loop_syscalls = 0;
+};
@@ -1,12 +1,21 @@
 #include "PeerManager.hpp"
 #include "../protocol/PeerMessage.hpp"
+#include "../bencode/Bencode.hpp"
+#include "../utils/AllocationCounter.hpp"
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdexcept>
 #include <iostream>
 #include <queue>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
 
 PeerManager::PeerManager(const std::string& ip, int port, const std::string& info_hash)
     : ip(ip), port(port), info_hash(info_hash), peer_utils(nullptr) {
@@ -18,54 +27,29 @@ PeerManager::~PeerManager() {
 
 bool PeerManager::connect() {
     try {
-        // Create socket
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            std::cerr << "Failed to create socket for " << ip << std::endl;
-            return false;
-        }
-
-        // Connect to peer
-        struct sockaddr_in peer_addr;
-        peer_addr.sin_family = AF_INET;
-        peer_addr.sin_port = htons(port);
-        if (inet_pton(AF_INET, ip.c_str(), &peer_addr.sin_addr) <= 0) {
-            close(sock);
-            return false;
-        }
-
-        if (::connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0) {
-            close(sock);
-            return false;
-        }
+        // Either address family; a host name races its addresses. Nagle is off.
+        int sock = PeerConnector::connectBlocking({ip, port});
 
         // Initialize PeerUtils
         peer_utils = std::make_unique<PeerUtils>(sock);
+        sock_fd = sock;
+        peer_utils->setReceiveTimeout(getRequestTimeout());  // A silent peer must not hang us
 
         // Perform handshake
-        TorrentUtils::performHandshake(sock, info_hash);
-
-        // Receive and process bitfield
-        unsigned char msg_length_buf[4];
-        char msg_type;
-        std::vector<uint8_t> payload;
-        
-        peer_utils->receiveMessage(msg_length_buf, msg_type, payload);
+        std::vector<uint8_t> handshake = TorrentUtils::performHandshake(sock, info_hash);
+        fast_extension = TorrentUtils::supportsFastExtension(handshake.data());
+        have_all = false;
+        allowed_fast.clear();
 
-        if (msg_type != static_cast<char>(PeerMessageType::BITFIELD)) {
-            disconnect();
-            return false;
+        // The BITFIELD is optional, so interest goes out before waiting on anything.
+        // With the Fast Extension our first message must state what we have.
+        peer_utils->cork();
+        if (fast_extension) {
+            peer_utils->sendMessage(PeerMessageType::HAVE_NONE, {});
         }
-        
-        processBitfield(payload);
-
-        // Send interested message
         peer_utils->sendMessage(PeerMessageType::INTERESTED, {});
-
-        // Wait for unchoke
-        peer_utils->receiveMessage(msg_length_buf, msg_type, payload);
-
-        if (msg_type != static_cast<char>(PeerMessageType::UNCHOKE)) {
+        peer_utils->uncork();
+        if (!waitForUnchoke(true)) {
             disconnect();
             return false;
         }
@@ -79,28 +63,26 @@ bool PeerManager::connect() {
     }
 }
 
-bool PeerManager::magnetConnect(int sock, const std::vector<uint8_t>& bitfield) {
+bool PeerManager::magnetConnect(int sock, const HandshakeResult& handshake) {
     try {
         // Initialize PeerUtils
         peer_utils = std::make_unique<PeerUtils>(sock);
+        sock_fd = sock;
 
-        if (!bitfield.empty()) {
-            processBitfield(bitfield);
+        // HAVE_NONE went out with the extension handshake
+        fast_extension = handshake.fast_extension;
+        have_all = handshake.have_all;
+        pex_id = handshake.pex_id;
+        allowed_fast = handshake.allowed_fast;
+        if (!handshake.bitfield.empty()) {
+            processBitfield(handshake.bitfield);
         } else {
             piece_availability.clear();
         }
-        // Receive and process bitfield
-        unsigned char msg_length_buf[4];
-        char msg_type;
-        std::vector<uint8_t> payload;
-
         // Send interested message
         peer_utils->sendMessage(PeerMessageType::INTERESTED, {});
-
-        // Wait for unchoke
-        peer_utils->receiveMessage(msg_length_buf, msg_type, payload);
-
-        if (msg_type != static_cast<char>(PeerMessageType::UNCHOKE)) {
+        // The extension handshake already stood in for the BITFIELD
+        if (!waitForUnchoke(false)) {
             disconnect();
             return false;
         }
@@ -115,7 +97,115 @@ bool PeerManager::magnetConnect(int sock, const std::vector<uint8_t>& bitfield)
 
 }
 
-bool PeerManager::downloadPiece(int index, int length, std::vector<uint8_t>& data) {
+bool PeerManager::waitForUnchoke(bool bitfield_allowed) {
+    // Allowed-fast pieces can be fetched while choked
+    while (peer_choking && allowed_fast.empty()) {
+        FrameView frame = peer_utils->receiveFrame();
+        if (frame.length == 0) {
+            continue;  // Keep-alive
+        }
+        if (!(bitfield_allowed && handleAvailability(frame.type, frame.payload, frame.payload_length)) &&
+            !handlePeerState(frame.type, frame.payload, frame.payload_length)) {
+            return false;
+        }
+        bitfield_allowed = false;  // Only the first message may carry one
+    }
+    return true;
+}
+
+bool PeerManager::handleAvailability(uint8_t type, const uint8_t* payload, size_t length) {
+    switch (type) {
+        case PeerMessageType::BITFIELD:
+            processBitfield(std::vector<uint8_t>(payload, payload + length));
+            return true;
+        case PeerMessageType::HAVE_ALL:
+        case PeerMessageType::HAVE_NONE:
+            if (!fast_extension) {
+                return false;
+            }
+            // A seed needs no bitfield: hasPiece answers for every index
+            have_all = type == PeerMessageType::HAVE_ALL;
+            piece_availability.clear();
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool PeerManager::handlePeerState(uint8_t type, const uint8_t* payload, size_t length) {
+    switch (type) {
+        case PeerMessageType::CHOKE:
+            peer_choking = true;
+            break;
+        case PeerMessageType::UNCHOKE:
+            peer_choking = false;
+            break;
+        case PeerMessageType::HAVE:
+            if (length >= 4) {
+                setHave((payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3]);
+            }
+            break;
+        case PeerMessageType::BITFIELD:
+        case PeerMessageType::HAVE_ALL:
+        case PeerMessageType::HAVE_NONE:
+            std::cerr << "Peer " << getPeerInfo() << " sent its pieces after its first message" << std::endl;
+            return false;
+        case PeerMessageType::ALLOWED_FAST:
+            addAllowedFast(payload, length);
+            break;
+        default:
+            break;  // We don't upload, so interest and requests are ignored; SUGGEST_PIECE too
+    }
+    return true;
+}
+
+bool PeerManager::setHave(uint32_t index) {
+    if (have_all) {
+        return false;
+    }
+    if (index >= piece_availability.size()) {
+        if (index >= MAX_MESSAGE_LENGTH * 8) {
+            return false;  // More pieces than any bitfield could describe
+        }
+        piece_availability.resize(index + 1);
+    }
+    if (piece_availability[index]) {
+        return false;
+    }
+    piece_availability[index] = true;
+    return true;
+}
+
+void PeerManager::adoptSocket(int sock) {
+    peer_utils = std::make_unique<PeerUtils>(sock);
+    sock_fd = sock;
+    piece_availability.clear();
+    have_all = false;
+    pex_id = 0;
+    allowed_fast.clear();
+    handshake_pending = true;
+}
+
+void PeerManager::addAllowedFast(const uint8_t* payload, size_t length) {
+    if (!fast_extension || length < 4) {
+        return;
+    }
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+    if (index >= 0 && allowed_fast.size() < MAX_ALLOWED_FAST && !isAllowedFast(index)) {
+        allowed_fast.push_back(index);
+    }
+}
+
+bool PeerManager::isAllowedFast(int index) const {
+    return std::find(allowed_fast.begin(), allowed_fast.end(), index) != allowed_fast.end();
+}
+
+bool PeerManager::canRequestPiece(int index) const {
+    return !peer_choking || isAllowedFast(index);
+}
+
+bool PeerManager::downloadPiece(int index, int length, std::vector<uint8_t>& data,
+                                const std::function<bool()>& is_cancelled) {
     if (!peer_utils || !hasPiece(index)) {
         std::cout << "Peer " << getPeerInfo() << " can't download piece " 
                   << index << " (connected=" << (peer_utils != nullptr) 
@@ -123,63 +213,160 @@ bool PeerManager::downloadPiece(int index, int length, std::vector<uint8_t>& dat
         return false;
     }
 
-    const int BLOCK_SIZE = 16 * 1024;
-    const int MAX_PENDING_REQUESTS = 5;  // Pipeline 5 requests at once
-    data.clear();
-    data.resize(length);
+    data.resize(length);  // Pooled buffers already have the capacity
     
     try {
+
+        uint64_t allocations_before = AllocationCounter::threadAllocations();
+        int blocks = 0;
         int remaining_length = length;
         int offset = 0;
-        std::queue<int> pending_offsets;
-
-        while (remaining_length > 0 || !pending_offsets.empty()) {
-            // Send requests until pipeline is full
-            while (remaining_length > 0 && pending_offsets.size() < MAX_PENDING_REQUESTS) {
-                int block_length = std::min(BLOCK_SIZE, remaining_length);
-                
-                // Prepare and send request
-                std::vector<uint8_t> request_payload(12);
-                PeerUtils::addIntToPayload(request_payload, index, 0);
-                PeerUtils::addIntToPayload(request_payload, offset, 4);
-                PeerUtils::addIntToPayload(request_payload, block_length, 8);
-                peer_utils->sendMessage(PeerMessageType::REQUEST, request_payload);
-                
-                pending_offsets.push(offset);
-                offset += block_length;
-                remaining_length -= block_length;
-            }
+        bool resend_discarded = false;
+        int rejects = 0;
+        pending_blocks.clear();
 
-            // Receive one block
-            unsigned char msg_length_buf[4];
-            char msg_type;
-            std::vector<uint8_t> payload;
-            peer_utils->receiveMessage(msg_length_buf, msg_type, payload);
-
-            if (msg_type != static_cast<char>(PeerMessageType::PIECE)) {
-                std::cerr << "Unexpected message type: " << static_cast<int>(msg_type) << std::endl;
-                return false;
+        auto cancelPending = [this]() {
+            peer_utils->cork();
+            for (const auto& block : pending_blocks) {
+                if (block.requested != std::chrono::steady_clock::time_point()) {
+                    sendCancel(block.index, block.begin, block.length);
+                }
             }
+            peer_utils->uncork();
+            pending_blocks.clear();
+        };
 
-            // Validate response
-            if (payload.size() < 8) {  // At least need index and begin fields
-                std::cerr << "Invalid payload size" << std::endl;
+        while (remaining_length > 0 || !pending_blocks.empty()) {
+            // Another peer finished this piece first: cancel what is still in flight
+            if (is_cancelled && is_cancelled()) {
+                cancelPending();
                 return false;
             }
 
-            int recv_index = (payload[0] << 24) | (payload[1] << 16) |
-                           (payload[2] << 8) | payload[3];
-            int recv_begin = (payload[4] << 24) | (payload[5] << 16) |
-                           (payload[6] << 8) | payload[7];
+            if (canRequestPiece(index)) {
+                auto now = std::chrono::steady_clock::now();
+                // Blocks a CHOKE discarded or the peer rejected go out again first
+                if (resend_discarded) {
+                    for (auto& block : pending_blocks) {
+                        if (block.requested == std::chrono::steady_clock::time_point()) {
+                            block.requested = now;
+                            queueBlockMessage(PeerMessageType::REQUEST, block);
+                        }
+                    }
+                    resend_discarded = false;
+                }
 
-            if (recv_index != index || recv_begin != pending_offsets.front()) {
-                return false;
+                // Refill once half the pipeline has drained, so requests leave in
+                // batches; with the depth at twice the BDP the link never idles
+                bool refill = pending_blocks.size() <= pipeline_depth / 2;
+                while (refill && remaining_length > 0 && pending_blocks.size() < pipeline_depth) {
+                    BlockRequest block{index, offset, std::min(BLOCK_SIZE, remaining_length), now};
+                    queueBlockMessage(PeerMessageType::REQUEST, block);
+                    pending_blocks.push_back(block);
+                    offset += block.length;
+                    remaining_length -= block.length;
+                }
+                if (remaining_length == 0 && pending_blocks.size() < pipeline_depth) {
+                    window_app_limited = true;  // The piece ends before the pipeline fills
+                }
+                peer_utils->flush();
             }
 
-            // Copy block data to correct position
-            std::copy(payload.begin() + 8, payload.end(), 
-                     data.begin() + pending_offsets.front());
-            pending_offsets.pop();
+            // A read that waits longer than a request may has lost the peer
+            peer_utils->setReceiveTimeout(getRequestTimeout());
+
+            // Handle every message the last read brought in, waiting only for the first
+            do {
+                FrameView frame = peer_utils->receiveHeader();
+                if (frame.length == 0) {
+                    continue;  // Keep-alive
+                }
+                if (frame.type == PeerMessageType::REJECT_REQUEST && fast_extension) {
+                    if (frame.payload_length < 12) {
+                        continue;
+                    }
+                    const uint8_t* payload = frame.payload;
+                    int rejected_index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+                    int rejected_begin = (payload[4] << 24) | (payload[5] << 16) | (payload[6] << 8) | payload[7];
+                    auto block = std::find_if(pending_blocks.begin(), pending_blocks.end(),
+                        [&](const BlockRequest& r) { return r.index == rejected_index && r.begin == rejected_begin; });
+                    if (block == pending_blocks.end()) {
+                        cancelled_requests.erase({rejected_index, rejected_begin});  // Answers a CANCEL
+                        continue;
+                    }
+                    if (++rejects > MAX_REJECTS_PER_PIECE) {
+                        // Refusing over and over: better to ask another peer
+                        std::cerr << "Peer " << getPeerInfo() << " keeps rejecting piece " << index << std::endl;
+                        cancelPending();
+                        return false;
+                    }
+                    // Asked again right away, or once unchoked if the CHOKE dropped it
+                    block->requested = std::chrono::steady_clock::time_point();
+                    resend_discarded = true;
+                    if (peer_choking) {
+                        std::erase(allowed_fast, index);
+                    }
+                    continue;
+                }
+                if (frame.type != PeerMessageType::PIECE) {
+                    bool was_choking = peer_choking;
+                    if (!handlePeerState(frame.type, frame.payload, frame.payload_length)) {
+                        return false;
+                    }
+                    // With the Fast Extension the peer REJECTs what it drops instead
+                    if (peer_choking && !was_choking && !fast_extension) {
+                        // The peer dropped our requests; they go out again after the UNCHOKE
+                        for (auto& block : pending_blocks) {
+                            block.requested = std::chrono::steady_clock::time_point();
+                        }
+                        resend_discarded = !pending_blocks.empty();
+                        window_app_limited = true;
+                    }
+                    continue;
+                }
+
+                // Validate response
+                const uint8_t* payload = frame.payload;
+                if (frame.payload_length < 8) {  // At least need index and begin fields
+                    std::cerr << "Invalid payload size" << std::endl;
+                    return false;
+                }
+
+                int recv_index = (payload[0] << 24) | (payload[1] << 16) |
+                               (payload[2] << 8) | payload[3];
+                int recv_begin = (payload[4] << 24) | (payload[5] << 16) |
+                               (payload[6] << 8) | payload[7];
+                int block_length = static_cast<int>(frame.payload_length - 8);
+
+                // Blocks may come in any order; match them to the requests by (index, begin)
+                auto block = std::find_if(pending_blocks.begin(), pending_blocks.end(),
+                    [&](const BlockRequest& r) { return r.index == recv_index && r.begin == recv_begin; });
+                if (block == pending_blocks.end()) {
+                    // Sent before our CANCEL arrived, or a duplicate
+                    cancelled_requests.erase({recv_index, recv_begin});
+                    peer_utils->skipBlock();
+                    continue;
+                }
+                if (block_length != block->length) {
+                    peer_utils->skipBlock();
+                    std::cerr << "Unexpected block length " << block_length << std::endl;
+                    return false;
+                }
+
+                // Received in place: only what the header's read pulled in is copied
+                peer_utils->receiveBlock(data.data() + recv_begin);
+                bytes_received += block_length;
+                if (block->requested != std::chrono::steady_clock::time_point()) {
+                    recordDelivery(block->requested, block_length);
+                }
+                pending_blocks.erase(block);
+                blocks++;
+            } while (!pending_blocks.empty() && peer_utils->hasBufferedFrame());
+        }
+
+        if (pieces_downloaded++ > 0) {
+            steady_state_blocks += blocks;
+            steady_state_allocations += AllocationCounter::threadAllocations() - allocations_before;
         }
 
         return data.size() == length;
@@ -187,11 +374,89 @@ bool PeerManager::downloadPiece(int index, int length, std::vector<uint8_t>& dat
     } catch (const std::exception& e) {
         std::cerr << "Peer " << getPeerInfo() << " download piece " 
                   << index << " failed: " << e.what() << std::endl;
+        disconnect();  // The stream is no longer in a known state
         return false;
     }
 }
 
+std::chrono::milliseconds PeerManager::getRequestTimeout() const {
+    if (smoothed_rtt == 0) {
+        return INITIAL_REQUEST_TIMEOUT;
+    }
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double>(smoothed_rtt + 4 * rtt_variance));
+    return std::clamp(timeout, MIN_REQUEST_TIMEOUT, MAX_REQUEST_TIMEOUT);
+}
+
+void PeerManager::setRequestQueueLimit(int reqq) {
+    request_queue_limit = reqq > 0 ? std::min<size_t>(reqq, MAX_PIPELINE_DEPTH) : MAX_PIPELINE_DEPTH;
+    pipeline_depth = std::min(pipeline_depth, request_queue_limit);
+}
+
+void PeerManager::recordDelivery(std::chrono::steady_clock::time_point requested, int length) {
+    auto now = std::chrono::steady_clock::now();
+    double rtt = std::chrono::duration<double>(now - requested).count();
+    if (smoothed_rtt == 0) {
+        smoothed_rtt = rtt;
+        rtt_variance = rtt / 2;
+    } else {
+        rtt_variance = 0.75 * rtt_variance + 0.25 * std::abs(smoothed_rtt - rtt);
+        smoothed_rtt = 0.875 * smoothed_rtt + 0.125 * rtt;
+    }
+    // Bucket b holds latencies under 2^b ms
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now - requested).count();
+    size_t bucket = 0;
+    while (bucket + 1 < LATENCY_BUCKETS && micros >= (int64_t{1000} << bucket)) {
+        bucket++;
+    }
+    latency_histogram[bucket]++;
+    latency_samples++;
+
+    if (min_rtt == 0 || rtt <= min_rtt || now - min_rtt_stamp > MIN_RTT_LIFETIME) {
+        min_rtt = rtt;
+        min_rtt_stamp = now;
+    }
+
+    if (window_start == std::chrono::steady_clock::time_point()) {
+        window_start = now;  // The first block only opens the window
+        return;
+    }
+    window_bytes += length;
+    auto elapsed = now - window_start;
+    if (elapsed < MIN_RATE_WINDOW || std::chrono::duration<double>(elapsed).count() < smoothed_rtt) {
+        return;
+    }
+
+    // A window that ran dry only shows what we asked for, so it may raise the rate but not lower it
+    double sample = window_bytes / std::chrono::duration<double>(elapsed).count();
+    if (!window_app_limited || sample > download_rate) {
+        download_rate = download_rate == 0 ? sample : 0.7 * download_rate + 0.3 * sample;
+    }
+    window_start = now;
+    window_bytes = 0;
+    window_app_limited = false;
+
+    // While the pipe isn't full, rate * min_rtt is the current depth, so the
+    // gain doubles it every window; once the link saturates the rate stops
+    // growing and the depth settles at the gain times the real BDP
+    double bdp_blocks = download_rate * min_rtt / BLOCK_SIZE;
+    size_t target = static_cast<size_t>(std::ceil(PIPELINE_GAIN * bdp_blocks)) + 1;
+    pipeline_depth = std::min(std::max(target, MIN_PIPELINE_DEPTH), request_queue_limit);  // reqq wins
+}
+
+void PeerManager::sendCancel(int index, int begin, int length) {
+    std::vector<uint8_t> cancel_payload(12);
+    PeerUtils::addIntToPayload(cancel_payload, index, 0);
+    PeerUtils::addIntToPayload(cancel_payload, begin, 4);
+    PeerUtils::addIntToPayload(cancel_payload, length, 8);
+    peer_utils->sendMessage(PeerMessageType::CANCEL, cancel_payload);
+    cancelled_requests.insert({index, begin});
+}
+
 bool PeerManager::hasPiece(int index) const {
+    if (have_all) {
+        return index >= 0;
+    }
     if (index < 0 || index >= piece_availability.size()) {
         return false;
     }
@@ -200,7 +465,15 @@ bool PeerManager::hasPiece(int index) const {
 
 void PeerManager::disconnect() {
     if (peer_utils) {
+        if (transport) {
+            transport->detach(sock_fd);
+            transport = nullptr;
+        }
+        sock_fd = -1;
         peer_utils.reset();
+        if (listener) {
+            listener->onPeerClosed(*this);
+        }
     }
 }
 
@@ -214,3 +487,599 @@ void PeerManager::processBitfield(const std::vector<uint8_t>& bitfield) {
         }
     }
 }
+
+void PeerManager::startSession(PeerSessionListener* session_listener, Transport* session_transport,
+                               RateLimiter* download_limit, RateLimiter* upload_limit) {
+    listener = session_listener;
+    transport = session_transport;
+    int flags = fcntl(sock_fd, F_GETFL, 0);
+    fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
+    recv_buffer.resize(RECV_BUFFER_SIZE);
+    recv_end = 0;
+    session_ready = !handshake_pending;
+    transport->attach(sock_fd, this);
+    if (download_limit || upload_limit) {
+        transport->setRateLimits(sock_fd, download_limit, upload_limit);
+    }
+
+    if (handshake_pending) {
+        // Interest waits for the peer's handshake: with the Fast Extension, HAVE_NONE must precede it
+        std::vector<uint8_t> handshake = TorrentUtils::buildHandshake(info_hash, true);
+        peer_utils->writer().addRaw(handshake.data(), handshake.size());
+        flushSendBuffer();
+    } else {
+        // Whatever the blocking reads pulled in past the UNCHOKE
+        std::vector<uint8_t> buffered = peer_utils->takeBuffered();
+        if (!buffered.empty()) {
+            onReceive(buffered.data(), buffered.size());
+        }
+    }
+}
+
+void PeerManager::endSession() {
+    if (transport && peer_utils) {
+        transport->detach(sock_fd);
+    }
+    transport = nullptr;
+    listener = nullptr;
+}
+
+bool PeerManager::canTakePiece() const {
+    if (!peer_utils || !session_ready || (peer_choking && allowed_fast.empty()) ||
+        outstanding.size() >= pipeline_depth) {
+        return false;
+    }
+    for (const auto& piece : active_pieces) {
+        if (piece.next_offset < piece.length) {
+            return false;
+        }
+    }
+    return retry_blocks.empty();
+}
+
+void PeerManager::addPiece(int index, int length, PooledBuffer buffer) {
+    buffer->resize(length);  // Pooled buffers already have the capacity
+    active_pieces.push_back({index, length, std::move(buffer), 0, 0, std::chrono::steady_clock::now()});
+    queueRequests();
+    flushSendBuffer();
+}
+
+void PeerManager::queueHave(int index) {
+    uint8_t payload[4] = {static_cast<uint8_t>(index >> 24), static_cast<uint8_t>(index >> 16),
+                          static_cast<uint8_t>(index >> 8), static_cast<uint8_t>(index)};
+    queueMessage(PeerMessageType::HAVE, payload, sizeof(payload));
+}
+
+bool PeerManager::cancelPiece(int index, std::chrono::milliseconds& projected_remaining) {
+    auto piece = std::find_if(active_pieces.begin(), active_pieces.end(),
+        [index](const ActivePiece& p) { return p.index == index; });
+    if (piece == active_pieces.end()) {
+        return false;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - piece->started);
+    projected_remaining = piece->received > 0
+        ? elapsed * (piece->length - piece->received) / piece->received
+        : elapsed;
+
+    for (auto it = outstanding.begin(); it != outstanding.end();) {
+        if (it->index == index) {
+            queueBlockMessage(PeerMessageType::CANCEL, *it);
+            cancelled_requests.insert({it->index, it->begin});
+            it = outstanding.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::erase_if(retry_blocks, [index](const BlockRequest& block) { return block.index == index; });
+    if (incoming.index == index) {
+        incoming.destination = nullptr;  // The rest of the block is dropped with the buffer
+    }
+    active_pieces.erase(piece);
+
+    queueRequests();
+    flushSendBuffer();
+    return true;
+}
+
+PeerManager::ReleasedPiece PeerManager::takePiece(ActivePiece& piece) {
+    ReleasedPiece taken{piece.index, piece.length, std::move(piece.buffer), {}};
+    for (const auto& block : outstanding) {
+        if (block.index == piece.index) {
+            taken.missing.emplace_back(block.begin, block.length);
+            queueBlockMessage(PeerMessageType::CANCEL, block);
+            cancelled_requests.insert({block.index, block.begin});
+        }
+    }
+    for (const auto& block : retry_blocks) {
+        if (block.index == piece.index) {
+            taken.missing.emplace_back(block.begin, block.length);
+        }
+    }
+    if (incoming.destination && incoming.index == piece.index) {
+        taken.missing.emplace_back(incoming.begin, incoming.length);
+        incoming.destination = nullptr;  // The rest of it is dropped
+    }
+    for (int begin = piece.next_offset; begin < piece.length; begin += BLOCK_SIZE) {
+        taken.missing.emplace_back(begin, std::min(BLOCK_SIZE, piece.length - begin));
+    }
+    std::sort(taken.missing.begin(), taken.missing.end());
+    return taken;
+}
+
+std::vector<PeerManager::ReleasedPiece> PeerManager::releasePieces() {
+    std::vector<ReleasedPiece> released;
+    for (auto& piece : active_pieces) {
+        released.push_back(takePiece(piece));
+    }
+    active_pieces.clear();
+    outstanding.clear();
+    retry_blocks.clear();
+    flushSendBuffer();
+    return released;
+}
+
+std::optional<PeerManager::ReleasedPiece> PeerManager::releasePiece(int index) {
+    auto piece = std::find_if(active_pieces.begin(), active_pieces.end(),
+        [index](const ActivePiece& p) { return p.index == index; });
+    if (piece == active_pieces.end()) {
+        return std::nullopt;
+    }
+    ReleasedPiece taken = takePiece(*piece);
+    auto ofPiece = [index](const BlockRequest& block) { return block.index == index; };
+    std::erase_if(outstanding, ofPiece);
+    std::erase_if(retry_blocks, ofPiece);
+    active_pieces.erase(piece);
+    flushSendBuffer();
+    return taken;
+}
+
+void PeerManager::resumePiece(ReleasedPiece piece) {
+    int received = piece.length;
+    // retry_blocks is served from the back
+    for (auto it = piece.missing.rbegin(); it != piece.missing.rend(); ++it) {
+        retry_blocks.push_back({piece.index, it->first, it->second, {}});
+        received -= it->second;
+    }
+    active_pieces.push_back({piece.index, piece.length, std::move(piece.buffer), piece.length, received,
+                             std::chrono::steady_clock::now(), received > 0});
+    queueRequests();
+    flushSendBuffer();
+}
+
+bool PeerManager::isDownloadingPiece(int index) const {
+    return std::any_of(active_pieces.begin(), active_pieces.end(),
+        [index](const ActivePiece& p) { return p.index == index; });
+}
+
+bool PeerManager::isRequestOutstanding(int index, int begin, std::chrono::steady_clock::time_point requested) const {
+    return std::any_of(outstanding.begin(), outstanding.end(), [&](const BlockRequest& r) {
+        return r.index == index && r.begin == begin && r.requested == requested;
+    });
+}
+
+int PeerManager::snub() {
+    snubbed = true;
+    pipeline_depth = 1;
+    request_timeouts++;
+    return ++consecutive_timeouts;
+}
+
+std::chrono::milliseconds PeerManager::getLatencyPercentile(double fraction) const {
+    if (latency_samples == 0) {
+        return std::chrono::milliseconds(0);
+    }
+    uint64_t wanted = static_cast<uint64_t>(std::ceil(fraction * latency_samples));
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket + 1 < LATENCY_BUCKETS; bucket++) {
+        seen += latency_histogram[bucket];
+        if (seen >= wanted) {
+            break;
+        }
+    }
+    return std::chrono::milliseconds(int64_t{1} << bucket);
+}
+
+void PeerManager::queueRequests() {
+    if (!peer_utils || (peer_choking && allowed_fast.empty())) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    while (outstanding.size() < pipeline_depth) {
+        BlockRequest block;
+        auto retry = std::find_if(retry_blocks.rbegin(), retry_blocks.rend(),
+            [this](const BlockRequest& b) { return canRequestPiece(b.index); });
+        if (retry != retry_blocks.rend()) {
+            block = *retry;
+            retry_blocks.erase(std::next(retry).base());
+        } else {
+            auto piece = std::find_if(active_pieces.begin(), active_pieces.end(),
+                [this](const ActivePiece& p) { return p.next_offset < p.length && canRequestPiece(p.index); });
+            if (piece == active_pieces.end()) {
+                window_app_limited = true;
+                break;
+            }
+            block = {piece->index, piece->next_offset, std::min(BLOCK_SIZE, piece->length - piece->next_offset), now};
+            piece->next_offset += block.length;
+        }
+        block.requested = now;
+        queueBlockMessage(PeerMessageType::REQUEST, block);
+        outstanding.push_back(block);
+        if (listener) {
+            listener->onBlockRequested(*this, block.index, block.begin, now);
+        }
+    }
+}
+
+void PeerManager::queueMessage(PeerMessageType type, const uint8_t* payload, size_t length) {
+    if (peer_utils) {
+        peer_utils->writer().add(type, payload, length);
+    }
+}
+
+void PeerManager::queueBlockMessage(PeerMessageType type, const BlockRequest& block) {
+    if (peer_utils) {
+        peer_utils->writer().addBlockMessage(type, block.index, block.begin, block.length);
+    }
+}
+
+void PeerManager::flushSendBuffer() {
+    // Session messages are always encoded inline, so the queue is one buffer
+    if (transport && peer_utils && !peer_utils->writer().empty()) {
+        transport->send(sock_fd, peer_utils->writer().contiguous());
+    }
+}
+
+void PeerManager::onTransportError(const std::string& reason) {
+    closeSession(reason);
+}
+
+void PeerManager::onReceive(const uint8_t* data, size_t length) {
+    auto frameLength = [](const uint8_t* frame) {
+        return static_cast<uint32_t>((frame[0] << 24) | (frame[1] << 16) | (frame[2] << 8) | frame[3]);
+    };
+
+    if (handshake_pending) {
+        size_t take = std::min(HANDSHAKE_LENGTH - recv_end, length);
+        std::memcpy(recv_buffer.data() + recv_end, data, take);
+        recv_end += take;
+        data += take;
+        length -= take;
+        if (recv_end < HANDSHAKE_LENGTH) {
+            return;
+        }
+        recv_end = 0;
+        if (!TorrentUtils::checkHandshake(recv_buffer.data(), info_hash)) {
+            closeSession("handshake mismatch");
+            return;
+        }
+        handshake_pending = false;
+        fast_extension = TorrentUtils::supportsFastExtension(recv_buffer.data());
+        if (fast_extension) {
+            queueMessage(PeerMessageType::HAVE_NONE, nullptr, 0);
+        }
+        if (TorrentUtils::supportsExtensionProtocol(recv_buffer.data())) {
+            nlohmann::json extensions;
+            extensions["m"]["ut_pex"] = PeerExchange::LOCAL_ID;
+            std::string payload = std::string(1, '\0') + Bencode::encode(extensions);  // ID 0: the handshake
+            queueMessage(PeerMessageType::EXTENDED, reinterpret_cast<const uint8_t*>(payload.data()),
+                         payload.size());
+        }
+        queueMessage(PeerMessageType::INTERESTED, nullptr, 0);
+    }
+
+    while (length > 0 && peer_utils) {
+        // The rest of a block whose header came first
+        if (incoming.remaining > 0) {
+            size_t take = std::min(incoming.remaining, length);
+            receiveBlockData(data, take);
+            data += take;
+            length -= take;
+            continue;
+        }
+
+        // Whole frames are handled in place, and a PIECE as soon as its header is in
+        if (recv_end == 0 && length >= 4) {
+            uint32_t frame_length = frameLength(data);
+            if (frame_length > MAX_MESSAGE_LENGTH) {
+                closeSession("message length too large: " + std::to_string(frame_length));
+                return;
+            }
+            if (length >= 4 + frame_length) {
+                dispatchFrame(data + 4, frame_length);
+                data += 4 + frame_length;
+                length -= 4 + frame_length;
+                continue;
+            }
+            if (length >= PIECE_HEADER_LENGTH && data[4] == PeerMessageType::PIECE &&
+                frame_length >= PIECE_HEADER_LENGTH - 4) {
+                startBlock(data + 5, frame_length - (PIECE_HEADER_LENGTH - 4));
+                data += PIECE_HEADER_LENGTH;
+                length -= PIECE_HEADER_LENGTH;
+                continue;
+            }
+        }
+
+        // Gather a frame cut off by the receive: the length and type first,
+        // then the header of a PIECE or the whole of anything else
+        size_t wanted = 4;
+        uint32_t frame_length = 0;
+        bool piece = false;
+        if (recv_end >= 4) {
+            frame_length = frameLength(recv_buffer.data());
+            if (frame_length > MAX_MESSAGE_LENGTH) {
+                closeSession("message length too large: " + std::to_string(frame_length));
+                return;
+            }
+            wanted = 4 + frame_length;
+            if (recv_end < 5) {
+                wanted = std::min<size_t>(wanted, 5);
+            } else if (recv_buffer[4] == PeerMessageType::PIECE && frame_length >= PIECE_HEADER_LENGTH - 4) {
+                wanted = PIECE_HEADER_LENGTH;
+                piece = true;
+            }
+        }
+        if (recv_buffer.size() < wanted) {
+            recv_buffer.resize(wanted);  // Only bitfields outgrow the buffer
+        }
+        size_t take = std::min(wanted - recv_end, length);
+        std::memcpy(recv_buffer.data() + recv_end, data, take);
+        recv_end += take;
+        data += take;
+        length -= take;
+        if (recv_end < 4 || recv_end < wanted) {
+            continue;
+        }
+        if (piece) {
+            recv_end = 0;
+            startBlock(recv_buffer.data() + 5, frame_length - (PIECE_HEADER_LENGTH - 4));
+        } else if (recv_end == 4 + frameLength(recv_buffer.data())) {
+            recv_end = 0;
+            dispatchFrame(recv_buffer.data() + 4, frameLength(recv_buffer.data()));
+        }
+    }
+
+    if (!peer_utils) {
+        return;
+    }
+    flushSendBuffer();
+    listener->onPeerActivity(*this);
+}
+
+void PeerManager::dispatchFrame(const uint8_t* frame, uint32_t length) {
+    if (length == 0) {
+        return;  // Keep-alive
+    }
+    // Only the first message may be a BITFIELD, but the peer's extension
+    // handshake may come ahead of it; the availability is known after that
+    if (session_ready || !handleAvailability(frame[0], frame + 1, length - 1)) {
+        handleMessage(frame[0], frame + 1, length - 1);
+        if (frame[0] == PeerMessageType::EXTENDED) {
+            return;
+        }
+    }
+    if (!session_ready && peer_utils) {
+        session_ready = true;
+        listener->onPeerReady(*this);
+    }
+}
+
+void PeerManager::handleMessage(uint8_t type, const uint8_t* payload, size_t length) {
+    switch (type) {
+        case PeerMessageType::CHOKE:
+            peer_choking = true;
+            window_app_limited = true;
+            // Our requests are discarded; ask again once unchoked. With the
+            // Fast Extension they stand until served or REJECTed.
+            if (!fast_extension) {
+                retry_blocks.insert(retry_blocks.end(), outstanding.begin(), outstanding.end());
+                outstanding.clear();
+            }
+            break;
+        case PeerMessageType::UNCHOKE:
+            peer_choking = false;
+            queueRequests();
+            break;
+        case PeerMessageType::HAVE:
+            if (length >= 4) {
+                uint32_t index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+                if (setHave(index) && session_ready) {
+                    listener->onPeerHave(*this, static_cast<int>(index));
+                }
+            }
+            break;
+        case PeerMessageType::PIECE:
+            handleBlock(payload, length);
+            break;
+        case PeerMessageType::REJECT_REQUEST:
+            if (fast_extension && handleReject(payload, length) && !peer_choking) {
+                listener->onRequestRejected(*this, (payload[0] << 24) | (payload[1] << 16) |
+                                                   (payload[2] << 8) | payload[3]);
+            }
+            break;
+        case PeerMessageType::ALLOWED_FAST:
+            addAllowedFast(payload, length);
+            break;
+        case PeerMessageType::EXTENDED:
+            handleExtended(payload, length);
+            break;
+        default:
+            // We don't upload, so interest and requests are ignored; rarest-first
+            // outranks SUGGEST_PIECE, and a late BITFIELD changes nothing
+            break;
+    }
+}
+
+void PeerManager::handleExtended(const uint8_t* payload, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    // Extensions are optional: a malformed message is dropped, not the peer
+    try {
+        if (payload[0] == 0) {
+            std::string handshake(reinterpret_cast<const char*>(payload + 1), length - 1);
+            nlohmann::json extensions = Bencode::decode(handshake);
+            if (extensions.contains("m") && extensions["m"].contains("ut_pex") &&
+                extensions["m"]["ut_pex"].is_number_integer()) {
+                int id = extensions["m"]["ut_pex"].get<int>();
+                pex_id = id > 0 && id < 256 ? id : 0;  // 0 switches it off
+            }
+        } else if (payload[0] == PeerExchange::LOCAL_ID && session_ready) {
+            listener->onPeerExchange(*this, PeerExchange::decode(payload + 1, length - 1));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Peer " << getPeerInfo() << " sent a bad extension message: " << e.what() << std::endl;
+    }
+}
+
+void PeerManager::sendPex(const PeerExchange& message) {
+    if (!pex_id) {
+        return;
+    }
+    std::string encoded = message.encode();
+    std::string payload;
+    payload.reserve(1 + encoded.size());
+    payload.push_back(static_cast<char>(pex_id));
+    payload.append(encoded);
+    queueMessage(PeerMessageType::EXTENDED, reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+    flushSendBuffer();
+}
+
+bool PeerManager::handleReject(const uint8_t* payload, size_t length) {
+    if (length < 12) {
+        return false;
+    }
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+    int begin = (payload[4] << 24) | (payload[5] << 16) | (payload[6] << 8) | payload[7];
+    auto request = std::find_if(outstanding.begin(), outstanding.end(),
+        [&](const BlockRequest& r) { return r.index == index && r.begin == begin; });
+    if (request == outstanding.end()) {
+        cancelled_requests.erase({index, begin});  // The answer to a CANCEL
+        return false;
+    }
+    retry_blocks.push_back(*request);
+    outstanding.erase(request);
+    std::erase(allowed_fast, index);  // Not served while choked after all
+    return true;
+}
+
+void PeerManager::handleBlock(const uint8_t* payload, size_t length) {
+    if (length < 8) {
+        closeSession("invalid PIECE payload size");
+        return;
+    }
+    startBlock(payload, length - 8);
+    if (peer_utils) {
+        receiveBlockData(payload + 8, length - 8);
+    }
+}
+
+void PeerManager::startBlock(const uint8_t* header, size_t block_length) {
+    int index = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    int begin = (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+    incoming = IncomingBlock{};
+    incoming.remaining = block_length;
+    incoming.allocations_before = AllocationCounter::threadAllocations();
+
+    // Match against what we asked for; late blocks of cancelled requests are dropped
+    auto matches = [&](const BlockRequest& r) { return r.index == index && r.begin == begin; };
+    auto request = std::find_if(outstanding.begin(), outstanding.end(), matches);
+    auto retried = std::find_if(retry_blocks.begin(), retry_blocks.end(), matches);
+    if (request == outstanding.end() && retried == retry_blocks.end()) {
+        cancelled_requests.erase({index, begin});
+        return;
+    }
+    const BlockRequest& matched = request != outstanding.end() ? *request : *retried;
+    if (static_cast<size_t>(matched.length) != block_length) {
+        closeSession("unexpected block length");
+        return;
+    }
+    incoming.index = index;
+    incoming.begin = begin;
+    incoming.length = matched.length;
+    incoming.requested = matched.requested;
+    if (request != outstanding.end()) {
+        outstanding.erase(request);
+    } else {
+        retry_blocks.erase(retried);  // Served despite the CHOKE
+    }
+
+    auto piece = std::find_if(active_pieces.begin(), active_pieces.end(),
+        [index](const ActivePiece& p) { return p.index == index; });
+    incoming.destination = piece->buffer->data() + begin;
+    if (block_length == 0) {
+        finishBlock();
+    }
+}
+
+void PeerManager::receiveBlockData(const uint8_t* data, size_t length) {
+    if (incoming.destination) {
+        std::memcpy(incoming.destination, data, length);
+    }
+    onReceivedInto(length);
+}
+
+TransportHandler::ReceiveTarget PeerManager::receiveTarget() {
+    if (incoming.remaining == 0 || !incoming.destination) {
+        return {};
+    }
+    return {incoming.destination, incoming.remaining};
+}
+
+void PeerManager::onReceivedInto(size_t length) {
+    incoming.remaining -= length;
+    if (incoming.destination) {
+        incoming.destination += length;
+    }
+    if (incoming.remaining == 0) {
+        finishBlock();
+    }
+}
+
+void PeerManager::finishBlock() {
+    if (!incoming.destination) {
+        return;  // Dropped
+    }
+    int index = incoming.index;
+    int block_length = incoming.length;
+    incoming.destination = nullptr;
+
+    auto piece = std::find_if(active_pieces.begin(), active_pieces.end(),
+        [index](const ActivePiece& p) { return p.index == index; });
+    piece->received += block_length;
+    bytes_received += block_length;
+    consecutive_timeouts = 0;
+    if (snubbed) {
+        snubbed = false;  // Answering again; the pipeline regrows from the floor
+        pipeline_depth = std::min(MIN_PIPELINE_DEPTH, request_queue_limit);
+    }
+    // A block asked for before a REJECT or a hand-over carries no request time
+    if (incoming.requested != std::chrono::steady_clock::time_point()) {
+        recordDelivery(incoming.requested, block_length);
+    }
+
+    bool first_piece = pieces_downloaded == 0;
+    if (!first_piece) {
+        steady_state_blocks++;
+        steady_state_allocations += AllocationCounter::threadAllocations() - incoming.allocations_before;
+    }
+    if (piece->received < piece->length) {
+        queueRequests();
+        return;
+    }
+    pieces_downloaded++;
+
+    PooledBuffer data = std::move(piece->buffer);
+    bool resumed = piece->resumed;
+    active_pieces.erase(piece);
+    queueRequests();
+    listener->onPieceReceived(*this, index, std::move(data), resumed);
+}
+
+void PeerManager::closeSession(const std::string& reason) {
+    std::cerr << "Peer " << getPeerInfo() << " disconnected: " << reason << std::endl;
+    disconnect();
+}
@@ -1,28 +1,266 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <array>
 #include <memory>
+#include <set>
+#include <functional>
+#include <chrono>
+#include <optional>
 #include "../utils/PeerUtils.hpp"
 #include "../utils/TorrentUtils.hpp"
+#include "../utils/MagnetUtils.hpp"
+#include "../utils/BufferPool.hpp"
+#include "../net/Transport.hpp"
+#include "../net/PeerConnector.hpp"
+#include "../protocol/PeerExchange.hpp"
 
-class PeerManager {
+class PeerManager;
+
+// Receives the events of a PeerManager running as an event-driven session
+class PeerSessionListener {
+public:
+    virtual ~PeerSessionListener() = default;
+    // Every block of an assigned piece has arrived; resumed: some came from
+    // another peer's partial piece
+    virtual void onPieceReceived(PeerManager& peer, int index, PooledBuffer data, bool resumed) = 0;
+    // Handshake done and the first message handled, so the availability is known
+    virtual void onPeerReady(PeerManager& peer) = 0;
+    // A ready peer announced a piece it didn't have before
+    virtual void onPeerHave(PeerManager& peer, int index) = 0;
+    // A REQUEST was queued; its deadline is up to the listener
+    virtual void onBlockRequested(PeerManager& peer, int index, int begin,
+                                  std::chrono::steady_clock::time_point requested) = 0;
+    // The peer refused a block while unchoking us (Fast Extension); it is back
+    // with the piece's missing blocks, to be asked for again right away
+    virtual void onRequestRejected(PeerManager& peer, int index) = 0;
+    // A batch of input was handled; the pipeline may have room again
+    virtual void onPeerActivity(PeerManager& peer) = 0;
+    // A ready peer sent a ut_pex message
+    virtual void onPeerExchange(PeerManager& peer, const PeerExchange& message) = 0;
+    virtual void onPeerClosed(PeerManager& peer) = 0;
+};
+
+class PeerManager : public TransportHandler {
 public:
     PeerManager(const std::string& ip, int port, const std::string& info_hash);
     ~PeerManager();
 
     bool connect();
-    bool magnetConnect(int sock, const std::vector<uint8_t>& bitfield);
-    bool downloadPiece(int index, int length, std::vector<uint8_t>& data);
+    // Takes a socket MagnetUtils::performHandshake ran on
+    bool magnetConnect(int sock, const HandshakeResult& handshake);
+    // Takes a freshly connected socket; the handshake then runs inside the session
+    void adoptSocket(int sock);
+    // is_cancelled is polled between blocks; when it fires the outstanding
+    // requests are CANCELled and the download is abandoned
+    bool downloadPiece(int index, int length, std::vector<uint8_t>& data,
+                       const std::function<bool()>& is_cancelled = nullptr);
     bool hasPiece(int index) const;
+    // Unchoked, or choked but allowed to ask for this piece (ALLOWED_FAST)
+    bool canRequestPiece(int index) const;
     void disconnect();
     bool isConnected() const { return peer_utils != nullptr; }
-    std::string getPeerInfo() const { return ip + ":" + std::to_string(port); }
+    PeerEndpoint getEndpoint() const { return {ip, port}; }
+    std::string getPeerInfo() const { return getEndpoint().toString(); }
+    int64_t getBytesReceived() const { return bytes_received; }
+    double getDownloadRate() const { return download_rate; }  // bytes/s, 0 until measured
+    // Requests kept in flight, sized to the measured bandwidth-delay product
+    size_t getPipelineDepth() const { return pipeline_depth; }
+    double getRoundTripTime() const { return smoothed_rtt; }  // Seconds per block, 0 until measured
+    // Block latency below which this fraction of the samples fell, to the
+    // next power of two of a millisecond; 0 until measured
+    std::chrono::milliseconds getLatencyPercentile(double fraction) const;
+    // How long a request may go unanswered: the smoothed round trip plus four
+    // deviations, as for a TCP retransmission timer, within fixed bounds
+    std::chrono::milliseconds getRequestTimeout() const;
+    void setRequestQueueLimit(int reqq);  // From the extension handshake; 0 keeps the default
+    // Both extension handshakes offered ut_pex
+    bool supportsPex() const { return pex_id != 0; }
+    void sendPex(const PeerExchange& message);
+    const std::vector<bool>& getAvailability() const { return piece_availability; }
+    // Heap allocations on the block path, excluding each connection's first piece
+    uint64_t getSteadyStateBlocks() const { return steady_state_blocks; }
+    uint64_t getSteadyStateAllocations() const { return steady_state_allocations; }
+
+    // Event-driven session: the socket turns non-blocking and the transport
+    // feeds received bytes in on the loop thread. A protocol error disconnects
+    // the peer instead of throwing. The limiters, when given, pace the
+    // session's traffic from its first byte.
+    void startSession(PeerSessionListener* session_listener, Transport* session_transport,
+                      RateLimiter* download_limit = nullptr, RateLimiter* upload_limit = nullptr);
+    void endSession();  // Detaches from the transport, keeps the connection
+    bool isSessionReady() const { return session_ready; }
+    void onReceive(const uint8_t* data, size_t length) override;
+    void onTransportError(const std::string& reason) override;
+    ReceiveTarget receiveTarget() override;
+    void onReceivedInto(size_t length) override;
+    // Unchoked or holding allowed-fast pieces, pipeline not full and every block
+    // of the assigned pieces requested
+    bool canTakePiece() const;
+    void addPiece(int index, int length, PooledBuffer buffer);
+    // We completed a piece. Goes out with the session's next send, or the
+    // owner's flushSendBuffer().
+    void queueHave(int index);
+    void flushSendBuffer();
+    // Drops an assigned piece another peer already delivered and CANCELs its
+    // outstanding blocks; projected_remaining estimates what finishing would have taken
+    bool cancelPiece(int index, std::chrono::milliseconds& projected_remaining);
+    // An assigned piece taken back, with the blocks that arrived kept in its buffer
+    struct ReleasedPiece {
+        int index;
+        int length;
+        PooledBuffer buffer;
+        std::vector<std::pair<int, int>> missing;  // (begin, length) still to fetch
+    };
+    // Takes back every assigned piece, CANCELling what is in flight, so other
+    // peers can finish them; also used after a disconnect
+    std::vector<ReleasedPiece> releasePieces();
+    std::optional<ReleasedPiece> releasePiece(int index);  // Just this one
+    // Like addPiece for a piece another peer started: only its missing blocks are requested
+    void resumePiece(ReleasedPiece piece);
+    bool isDownloadingPiece(int index) const;
+    bool isRequestOutstanding(int index, int begin, std::chrono::steady_clock::time_point requested) const;
+    // A request outlived its deadline: one request at a time until a block
+    // arrives again. Returns the timeouts in a row.
+    int snub();
+    bool isSnubbed() const { return snubbed; }
+    int getRequestTimeouts() const { return request_timeouts; }
+    // A piece it sent failed the hash check; returns how many have
+    int recordBadPiece() { return ++bad_pieces; }
+    int getBadPieces() const { return bad_pieces; }
 
 private:
+    static constexpr int BLOCK_SIZE = 16 * 1024;
+    // Pipeline depth in blocks: starts at the floor, then tracks twice the
+    // bandwidth-delay product. Below 5 blocks a fast local peer idles between batches.
+    static constexpr size_t MIN_PIPELINE_DEPTH = 5;
+    static constexpr size_t MAX_PIPELINE_DEPTH = 250;  // Common reqq when a peer doesn't say
+    static constexpr double PIPELINE_GAIN = 2.0;
+    static constexpr std::chrono::milliseconds MIN_RATE_WINDOW{50};
+    static constexpr std::chrono::seconds MIN_RTT_LIFETIME{10};  // Lets a path change raise it
+    static constexpr std::chrono::milliseconds INITIAL_REQUEST_TIMEOUT{10000};  // Before any round trip
+    static constexpr std::chrono::milliseconds MIN_REQUEST_TIMEOUT{2000};
+    static constexpr std::chrono::milliseconds MAX_REQUEST_TIMEOUT{60000};
+    static constexpr size_t RECV_BUFFER_SIZE = 1024;  // Handshake and control frames; bitfields grow it
+    static constexpr uint32_t MAX_MESSAGE_LENGTH = 1 << 20;  // Bitfields of large torrents
+    static constexpr size_t HANDSHAKE_LENGTH = 68;
+    static constexpr size_t PIECE_HEADER_LENGTH = 13;  // Length, type, index and begin
+    static constexpr size_t MAX_ALLOWED_FAST = HandshakeResult::MAX_ALLOWED_FAST;
+    static constexpr int MAX_REJECTS_PER_PIECE = 8;  // Blocking path: then another peer may do better
+    static constexpr size_t LATENCY_BUCKETS = 17;  // Under 1 ms, then doubling up to 32 s and beyond
+
+    struct ActivePiece {
+        int index;
+        int length;
+        PooledBuffer buffer;
+        int next_offset = 0;  // First block not yet requested
+        int received = 0;     // Payload bytes stored so far
+        std::chrono::steady_clock::time_point started;
+        bool resumed = false;  // Holds blocks another peer sent
+    };
+
+    struct BlockRequest {
+        int index;
+        int begin;
+        int length;
+        std::chrono::steady_clock::time_point requested;
+    };
+
+    // A PIECE whose header has been read; its payload goes straight to the piece
+    struct IncomingBlock {
+        uint8_t* destination = nullptr;  // Null when the block is dropped
+        size_t remaining = 0;
+        int index = -1;
+        int begin = 0;
+        int length = 0;
+        std::chrono::steady_clock::time_point requested;
+        uint64_t allocations_before = 0;
+    };
+
+    void dispatchFrame(const uint8_t* frame, uint32_t length);
+    void queueRequests();
+    void queueMessage(PeerMessageType type, const uint8_t* payload, size_t length);
+    void queueBlockMessage(PeerMessageType type, const BlockRequest& block);
+    void handleMessage(uint8_t type, const uint8_t* payload, size_t length);
+    void handleBlock(const uint8_t* payload, size_t length);
+    void handleExtended(const uint8_t* payload, size_t length);
+    // Matches a PIECE header (index, begin) against our requests and sets up incoming
+    void startBlock(const uint8_t* header, size_t block_length);
+    void receiveBlockData(const uint8_t* data, size_t length);
+    void finishBlock();
+    void closeSession(const std::string& reason);
+    // Puts a REJECTed request back among the retries; true if it was ours
+    bool handleReject(const uint8_t* payload, size_t length);
+    void addAllowedFast(const uint8_t* payload, size_t length);
+    bool isAllowedFast(int index) const;
+    // Collects the missing blocks of an assigned piece and CANCELs those in flight
+    ReleasedPiece takePiece(ActivePiece& piece);
+
+    // Samples RTT and delivery rate from an arrived block and resizes the pipeline
+    void recordDelivery(std::chrono::steady_clock::time_point requested, int length);
     void processBitfield(const std::vector<uint8_t>& bitfield);
+    // Blocking path: handles messages until the peer unchokes us; false on a protocol error
+    bool waitForUnchoke(bool bitfield_allowed);
+    // BITFIELD, or HAVE_ALL and HAVE_NONE with the Fast Extension: only valid
+    // as the first message. False for anything else.
+    bool handleAvailability(uint8_t type, const uint8_t* payload, size_t length);
+    // CHOKE, UNCHOKE, HAVE, ALLOWED_FAST and the messages we ignore; false for
+    // a late BITFIELD, HAVE_ALL or HAVE_NONE
+    bool handlePeerState(uint8_t type, const uint8_t* payload, size_t length);
+    bool setHave(uint32_t index);  // True when the piece is new for this peer
+    void sendCancel(int index, int begin, int length);
     std::unique_ptr<PeerUtils> peer_utils;
+    int sock_fd = -1;
     std::string ip;
     int port;
     std::string info_hash;
     std::vector<bool> piece_availability;
+    bool fast_extension = false;  // Both handshakes set the BEP 6 bit
+    // Sent HAVE_ALL: every piece without a bitfield, so getAvailability stays
+    // empty and the peer leaves the rarest-first order as it is
+    bool have_all = false;
+    int pex_id = 0;  // The peer's ut_pex message ID
+    std::vector<int> allowed_fast;  // Pieces the peer serves even while choking us
+    std::set<std::pair<int, int>> cancelled_requests;  // (index, begin) still in flight after CANCEL
+    int64_t bytes_received = 0;
+    double download_rate = 0;  // Smoothed over rate windows
+
+    // Pipeline sizing
+    size_t pipeline_depth = MIN_PIPELINE_DEPTH;
+    size_t request_queue_limit = MAX_PIPELINE_DEPTH;
+    double smoothed_rtt = 0;
+    double rtt_variance = 0;
+    double min_rtt = 0;
+    std::chrono::steady_clock::time_point min_rtt_stamp;
+    std::chrono::steady_clock::time_point window_start;
+    int64_t window_bytes = 0;
+    bool window_app_limited = false;  // Ran out of blocks to ask for; the rate is a floor
+    std::array<uint32_t, LATENCY_BUCKETS> latency_histogram{};
+    uint32_t latency_samples = 0;
+
+    // Reused across blocks so the steady state doesn't touch the heap
+    // Outstanding requests of downloadPiece, matched by (index, begin). A default
+    // requested time marks a block a CHOKE discarded or the peer rejected, to be asked for again.
+    std::vector<BlockRequest> pending_blocks;
+    int pieces_downloaded = 0;
+    uint64_t steady_state_blocks = 0;
+    uint64_t steady_state_allocations = 0;
+
+    // Session state, owned by the loop thread
+    PeerSessionListener* listener = nullptr;
+    Transport* transport = nullptr;
+    bool handshake_pending = false;  // Adopted socket, peer's handshake not yet received
+    bool session_ready = false;
+    bool peer_choking = true;
+    std::vector<ActivePiece> active_pieces;
+    std::vector<BlockRequest> outstanding;   // Requested and not yet received
+    // Dropped by a CHOKE and re-requested after the UNCHOKE, or left over by another peer
+    std::vector<BlockRequest> retry_blocks;
+    bool snubbed = false;
+    int consecutive_timeouts = 0;
+    int request_timeouts = 0;
+    int bad_pieces = 0;
+    std::vector<uint8_t> recv_buffer;  // A frame split across receives, PIECEs only up to the header
+    size_t recv_end = 0;
+    IncomingBlock incoming;
 };
\ No newline at end of file
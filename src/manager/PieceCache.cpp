@@ -0,0 +1,33 @@
+#include "PieceCache.hpp"
+
+PieceCache::Piece PieceCache::find(uint64_t key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        stats.misses++;
+        return nullptr;
+    }
+    stats.hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->piece;
+}
+
+void PieceCache::insert(uint64_t key, Piece piece, size_t bytes) {
+    if (bytes > capacity) {
+        return;
+    }
+    auto existing = index.find(key);
+    if (existing != index.end()) {
+        size -= existing->second->bytes;
+        entries.erase(existing->second);
+        index.erase(existing);
+    }
+    while (!entries.empty() && size + bytes > capacity) {
+        size -= entries.back().bytes;
+        index.erase(entries.back().key);
+        entries.pop_back();
+        stats.evictions++;
+    }
+    size += bytes;
+    entries.push_front({key, std::move(piece), bytes});
+    index[key] = entries.begin();
+}
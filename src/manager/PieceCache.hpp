@@ -0,0 +1,47 @@
+#pragma once
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+// Least-recently-used whole pieces read for uploading. Peers ask for a piece
+// block by block, and several peers tend to ask for the same rare pieces, so
+// one disk read serves many REQUESTs. Entries are shared: a piece evicted
+// while blocks of it are still queued for sending stays alive until they
+// have gone. Loop thread only.
+class PieceCache {
+public:
+    using Piece = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    explicit PieceCache(size_t capacity) : capacity(capacity) {}
+
+    // Null on a miss; a hit becomes the most recently used
+    Piece find(uint64_t key);
+    // Evicts the least recently used pieces until it fits; a piece larger than
+    // the whole cache is not kept. bytes is what it counts for, when the data
+    // lives elsewhere, such as a marker for a piece in the page cache.
+    void insert(uint64_t key, Piece piece, size_t bytes);
+    void insert(uint64_t key, Piece piece) { size_t bytes = piece->size(); insert(key, std::move(piece), bytes); }
+    size_t getSize() const { return size; }
+    const Stats& getStats() const { return stats; }
+
+private:
+    struct Entry {
+        uint64_t key;
+        Piece piece;
+        size_t bytes;
+    };
+
+    size_t capacity;  // Bytes
+    size_t size = 0;
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    Stats stats;
+};
@@ -4,138 +4,501 @@
 #include <stdexcept>
 #include <iostream>
 #include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
 
-PieceManager::PieceManager(int total_pieces, int piece_length, int file_length, 
+PieceManager::PieceManager(int total_pieces, int piece_length, int64_t file_length, 
                           const std::string& info_hash, const std::string& pieces_hash)
     : total_pieces(total_pieces), piece_length(piece_length), file_length(file_length), 
-      info_hash(info_hash), pieces_hash(pieces_hash) {
+      info_hash(info_hash), pieces_hash(pieces_hash),
+      start_time(Clock::now()), selection_end(file_length) {
     if (pieces_hash.length() != total_pieces * 20) {
         throw std::invalid_argument("Invalid pieces hash length");
     }
+    pieces.resize(total_pieces);
     for (int i = 0; i < total_pieces; ++i) {
-        pending_pieces.push(i);
+        pending_pieces.insert(pickKey(i));
     }
+    remaining_pieces = total_pieces;
 }
 
-bool PieceManager::isDownloadComplete() const {
-    if (!pending_pieces.empty() || !downloading_pieces.empty()) {
-        return false;
+PieceManager::~PieceManager() {
+    if (output_fd >= 0) {
+        close(output_fd);
     }
-    
-    return pieces.size() == total_pieces &&
-           std::all_of(pieces.begin(), pieces.end(), 
-               [](const auto& p) { return p.second.state == PieceInfo::COMPLETED; });
 }
 
-int PieceManager::getNextPiece() {
+bool PieceManager::isDownloadComplete() const {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    return remaining_pieces == 0;
+}
+
+bool PieceManager::waitForCompletion() {
     std::unique_lock<std::mutex> lock(piece_mutex);
-    
-    if (isDownloadComplete()) {
-        piece_cv.notify_all();  // Wake up any remaining workers
+    piece_cv.wait(lock, [this]() { return isFinished(); });
+    return remaining_pieces == 0;
+}
+
+void PieceManager::abortDownload(const std::string& reason) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    if (!aborted && remaining_pieces > 0) {
+        aborted = true;
+        abort_reason = reason;
+        piece_cv.notify_all();
+    }
+}
+
+std::string PieceManager::getAbortReason() const {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    return abort_reason;
+}
+
+void PieceManager::assignPiece(int index, double peer_rate) {
+    auto& piece = pieces[index];
+    if (piece.state == PieceInfo::PENDING) {
+        pending_pieces.erase(pickKey(index));
+        downloading_pieces.insert(index);
+        piece.state = PieceInfo::DOWNLOADING;
+    }
+    piece.requesters++;
+    piece.holder_rate = std::max(piece.holder_rate, peer_rate);
+}
+
+int PieceManager::selectDeadlinePiece(const std::function<bool(int)>& can_download, double peer_rate,
+                                      Clock::time_point& wake_at) {
+    auto now = Clock::now();
+    int best = -1;
+    Clock::time_point best_deadline = Clock::time_point::max();
+
+    for (const auto& [index, deadline] : piece_deadlines) {
+        const auto& piece = pieces[index];
+        if (deadline >= best_deadline || piece.priority == PRIORITY_SKIP ||
+            (can_download && !can_download(index))) {
+            continue;
+        }
+
+        if (piece.state == PieceInfo::PENDING) {
+            // Leave the piece for a faster peer unless this one can still make it
+            if (peer_rate > 0 && deadline > now) {
+                auto needed = std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(getPieceLength(index) / peer_rate));
+                if (now + needed > deadline) {
+                    wake_at = std::min(wake_at, deadline);
+                    continue;
+                }
+            }
+        } else if (piece.state == PieceInfo::DOWNLOADING) {
+            // Move late pieces from slow holders to a clearly faster peer
+            if (deadline > now) {
+                wake_at = std::min(wake_at, deadline);
+                continue;
+            }
+            if (piece.requesters == 0 || piece.unverified > 0 || peer_rate <= 2 * piece.holder_rate) {
+                continue;
+            }
+        } else {
+            continue;
+        }
+
+        best = index;
+        best_deadline = deadline;
+    }
+
+    if (best != -1 && pieces[best].state == PieceInfo::DOWNLOADING) {
+        streaming.reassigned++;
+    }
+    return best;
+}
+
+int PieceManager::selectPiece(const std::function<bool(int)>& can_download, double peer_rate,
+                              Clock::time_point& wake_at) {
+    // Time-critical pieces first
+    int index = selectDeadlinePiece(can_download, peer_rate, wake_at);
+    if (index != -1) {
+        assignPiece(index, peer_rate);
+        return index;
+    }
+
+    // Normal mode: highest priority, then rarest piece the peer can serve
+    for (const auto& key : pending_pieces) {
+        int candidate = std::get<2>(key);
+        if (can_download && !can_download(candidate)) {
+            continue;
+        }
+        assignPiece(candidate, peer_rate);
+        return candidate;
+    }
+
+    if (!pending_pieces.empty() || downloading_pieces.empty()) {
         return -1;
     }
-    
-    piece_cv.wait(lock, [this]() {
-        return !pending_pieces.empty() || isDownloadComplete();
-    });
 
-    if (isDownloadComplete()) {
-        piece_cv.notify_all();  // Wake up any remaining workers
+    // Endgame: every remaining piece is already requested. Duplicate the
+    // in-flight piece with the fewest downloaders; the first copy to verify wins.
+    int best = -1;
+    for (int candidate : downloading_pieces) {
+        const auto& piece = pieces[candidate];
+        if (piece.requesters == 0 || piece.unverified > 0) {
+            continue;  // A copy is already waiting for verification
+        }
+        if (can_download && !can_download(candidate)) {
+            continue;
+        }
+        if (best == -1 || piece.requesters < pieces[best].requesters) {
+            best = candidate;
+        }
+    }
+    if (best == -1) {
         return -1;
     }
 
-    if (pending_pieces.empty()) {
+    if (!endgame.entered) {
+        endgame.entered = true;
+        endgame_start = Clock::now();
+        endgame.entered_after = std::chrono::duration_cast<std::chrono::milliseconds>(
+            endgame_start - start_time);
+    }
+    endgame.duplicate_requests++;
+    assignPiece(best, peer_rate);
+    return best;
+}
+
+int PieceManager::getNextPiece(const std::function<bool(int)>& can_download, double peer_rate,
+                               Clock::time_point* retry_at) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    if (isFinished()) {
         return -1;
     }
-    
-    // Get next piece if available
-    int next_piece = pending_pieces.front();
-    pending_pieces.pop();
-    downloading_pieces.insert(next_piece);
+
+    auto wake_at = Clock::time_point::max();
+    int next_piece = selectPiece(can_download, peer_rate, wake_at);
+    if (next_piece == -1 && retry_at) {
+        *retry_at = wake_at;
+    }
     return next_piece;
+}
+
+void PieceManager::markPieceDownloaded(int index) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    auto& piece = pieces[index];
+    piece.requesters--;
+    piece.unverified++;
+}
+
+void PieceManager::requeueIfAbandoned(int index) {
+    auto& piece = pieces[index];
+    if (piece.state != PieceInfo::DOWNLOADING || piece.requesters > 0 || piece.unverified > 0) {
+        return;
+    }
+    piece.state = PieceInfo::PENDING;
+    piece.holder_rate = 0;
+    downloading_pieces.erase(index);
+    if (piece.priority != PRIORITY_SKIP) {
+        pending_pieces.insert(pickKey(index));
+    }
+    piece_cv.notify_all();
+}
 
+PooledBuffer PieceManager::acquireBuffer(int index) {
+    return buffer_pool.acquire(getPieceLength(index));
 }
 
-bool PieceManager::savePieceData(int index, const std::vector<uint8_t>& data) {
+PieceManager::SaveResult PieceManager::savePieceData(int index, PooledBuffer data) {
     if (data.empty()) {
         std::lock_guard<std::mutex> lock(piece_mutex);
-        downloading_pieces.erase(index);
-        pending_pieces.push(index);
-        piece_cv.notify_one();
-        return false;
+        pieces[index].requesters--;
+        requeueIfAbandoned(index);
+        return SaveResult::FAILED;
     }
 
-    // Verify outside lock
-    bool is_valid = verifyPiece(index, data);
-    if (!is_valid) {
-        std::lock_guard<std::mutex> lock(piece_mutex);
-        downloading_pieces.erase(index);
-        pending_pieces.push(index);
-        piece_cv.notify_one();
-        return false;
+    // Verify and store outside lock; endgame duplicates are dropped first
+    SaveResult result = SaveResult::SAVED;
+    if (isPieceComplete(index)) {
+        result = SaveResult::DUPLICATE;
+    } else if (!verifyPiece(index, *data)) {
+        result = SaveResult::HASH_MISMATCH;
+    } else if (!writePiece(index, *data)) {
+        result = SaveResult::WRITE_FAILED;
     }
 
     // Minimal critical section
-    {
-        std::lock_guard<std::mutex> lock(piece_mutex);
-        pieces[index] = PieceInfo{
-            .state = PieceInfo::COMPLETED,
-            .data = data,
-            .verified = true
-        };
-        downloading_pieces.erase(index);
-        piece_cv.notify_one();
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    auto& piece = pieces[index];
+    piece.unverified--;
+
+    if (result == SaveResult::SAVED && piece.state == PieceInfo::COMPLETED) {
+        return SaveResult::DUPLICATE;  // Another peer won the endgame race
     }
 
-    return true;
+    if (result != SaveResult::SAVED) {
+        requeueIfAbandoned(index);
+        return result;
+    }
+
+    piece.state = PieceInfo::COMPLETED;
+    piece.verified = true;
+    downloading_pieces.erase(index);
+    completed_pieces++;
+    if (piece.priority != PRIORITY_SKIP && --remaining_pieces == 0) {
+        finish_time = Clock::now();
+    }
+
+    auto deadline = piece_deadlines.find(index);
+    if (deadline != piece_deadlines.end()) {
+        auto now = Clock::now();
+        if (now > deadline->second && (!sequential || index == playhead)) {
+            streaming.stalls++;
+            streaming.stall_time += std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - deadline->second);
+        }
+        piece_deadlines.erase(deadline);
+    }
+    if (sequential) {
+        advancePlayhead();
+    }
+    piece_cv.notify_all();
+
+    return SaveResult::SAVED;
 }
 
-bool PieceManager::verifyPiece(int index, const std::vector<uint8_t>& data) const {
-    if (index < 0 || index >= total_pieces) {
-        return false;
+bool PieceManager::isPieceComplete(int index) const {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    return pieces[index].state == PieceInfo::COMPLETED;
+}
+
+void PieceManager::recordCancelledRequest(std::chrono::milliseconds projected_remaining) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    if (!endgame.entered) {
+        streaming.cancelled++;  // A late piece's slow copy
+        return;
     }
-    // Calculate actual piece length (handle last piece)
-    int actual_piece_length = getPieceLength(index);
-    // Verify data length
-    if (data.size() != actual_piece_length) {
-        return false;
+    endgame.cancelled_requests++;
+    endgame.estimated_saved = std::max(endgame.estimated_saved, projected_remaining);
+}
+
+void PieceManager::updatePendingKey(int index, const std::function<void(PieceInfo&)>& update) {
+    bool is_pending = pieces[index].state == PieceInfo::PENDING &&
+                      pieces[index].priority != PRIORITY_SKIP;
+    if (is_pending) {
+        pending_pieces.erase(pickKey(index));
+    }
+    update(pieces[index]);
+    if (is_pending) {
+        pending_pieces.insert(pickKey(index));
+    }
+}
+
+void PieceManager::setPiecePriority(int index, int priority) {
+    if (index < 0 || index >= total_pieces) {
+        throw std::out_of_range("Invalid piece index");
     }
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    applyPriority(index, priority);
+    piece_cv.notify_all();
+}
 
-    auto hash = SHA1::calculate(std::string(data.begin(), data.end()));
-    std::string calculated_hash = std::string(reinterpret_cast<char*>(hash.data()), 20);
-    // Get expected hash from pieces_hash string (20 bytes per piece)
-    std::string expected_hash = pieces_hash.substr(index * 20, 20);
+void PieceManager::applyPriority(int index, int priority) {
+    priority = std::clamp(priority, PRIORITY_SKIP, PRIORITY_MAX);
+    auto& piece = pieces[index];
+    bool was_skipped = piece.priority == PRIORITY_SKIP;
+    bool skip = priority == PRIORITY_SKIP;
 
-    return calculated_hash == expected_hash;
+    // Skipped pieces never sit in the pending set
+    if (piece.state == PieceInfo::PENDING && !was_skipped) {
+        pending_pieces.erase(pickKey(index));
+    }
+    piece.priority = priority;
+    if (piece.state == PieceInfo::PENDING && !skip) {
+        pending_pieces.insert(pickKey(index));
+    }
+    if (piece.state != PieceInfo::COMPLETED && was_skipped != skip) {
+        remaining_pieces += skip ? -1 : 1;
+    }
 }
 
-bool PieceManager::verifyFullFile() const {
+void PieceManager::selectByteRange(int64_t start, int64_t end) {
+    if (start < 0 || end > file_length || start >= end) {
+        throw std::out_of_range("Invalid byte range");
+    }
+    int first = start / piece_length;
+    int last = (end - 1) / piece_length;
+
     std::lock_guard<std::mutex> lock(piece_mutex);
     for (int i = 0; i < total_pieces; ++i) {
-        auto it = pieces.find(i);
-        if (it == pieces.end() || 
-            it->second.state != PieceInfo::COMPLETED || 
-            !it->second.verified || 
-            !verifyPiece(i, it->second.data)) {
+        bool selected = i >= first && i <= last;
+        applyPriority(i, selected ? std::max(pieces[i].priority, PRIORITY_NORMAL) : PRIORITY_SKIP);
+    }
+    selection_start = start;
+    selection_end = end;
+    playhead = first;
+    piece_cv.notify_all();
+}
+
+void PieceManager::openOutputFile(const std::string& output_path, int64_t base) {
+    output_fd = open(output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        throw std::runtime_error("Cannot open output file: " + output_path);
+    }
+    output_base = base;
+    // Reserve the full size up front; unwritten regions stay holes
+    if (ftruncate(output_fd, selection_end - output_base) < 0) {
+        throw std::runtime_error("Cannot size output file: " + std::string(strerror(errno)));
+    }
+}
+
+bool PieceManager::writePiece(int index, const std::vector<uint8_t>& data) {
+    if (output_fd < 0) {
+        return true;
+    }
+    // Clip the piece to the selected bytes
+    int64_t piece_start = getPieceOffset(index);
+    int64_t start = std::max(piece_start, selection_start);
+    int64_t end = std::min(piece_start + static_cast<int64_t>(data.size()), selection_end);
+
+    int64_t written = 0;
+    while (start + written < end) {
+        ssize_t n = pwrite(output_fd, data.data() + (start - piece_start) + written,
+                           end - start - written, start + written - output_base);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Failed to write piece " << index << ": " << strerror(errno) << std::endl;
+            std::lock_guard<std::mutex> lock(piece_mutex);
+            output_error = true;
             return false;
         }
+        written += n;
     }
     return true;
 }
 
-bool PieceManager::writeToFile(const std::string& output_path) const {
-    std::ofstream file(output_path, std::ios::binary);
-    if (!file) {
+bool PieceManager::closeOutputFile() {
+    if (output_fd < 0) {
         return false;
     }
+    bool ok = !output_error && fsync(output_fd) == 0;
+    ok = close(output_fd) == 0 && ok;
+    output_fd = -1;
+    return ok;
+}
 
+void PieceManager::setPieceDeadline(int index, std::chrono::milliseconds deadline) {
+    if (index < 0 || index >= total_pieces) {
+        throw std::out_of_range("Invalid piece index");
+    }
     std::lock_guard<std::mutex> lock(piece_mutex);
-    for (int i = 0; i < total_pieces; i++) {
-        auto it = pieces.find(i);
-        if (it == pieces.end()) {
-            return false;
+    if (pieces[index].state != PieceInfo::COMPLETED) {
+        piece_deadlines[index] = Clock::now() + deadline;
+        piece_cv.notify_all();
+    }
+}
+
+void PieceManager::enableSequential(int window, std::chrono::milliseconds interval) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    sequential = true;
+    read_ahead = std::max(window, 1);
+    piece_interval = interval;
+    streaming.enabled = true;
+    advancePlayhead();
+    piece_cv.notify_all();
+}
+
+void PieceManager::advancePlayhead() {
+    int previous = playhead;
+    while (playhead < total_pieces &&
+           (pieces[playhead].state == PieceInfo::COMPLETED || pieces[playhead].priority == PRIORITY_SKIP)) {
+        playhead++;
+    }
+    if (streaming.time_to_first_byte.count() == 0 && playhead > previous &&
+        pieces[playhead - 1].state == PieceInfo::COMPLETED) {
+        streaming.time_to_first_byte = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now() - start_time);
+    }
+
+    // Slide the read-ahead window; pieces keep the deadline they entered with
+    auto now = Clock::now();
+    int window_end = std::min(playhead + read_ahead, total_pieces);
+    for (int i = playhead; i < window_end; ++i) {
+        if (pieces[i].state != PieceInfo::COMPLETED && pieces[i].priority != PRIORITY_SKIP &&
+            !piece_deadlines.contains(i)) {
+            piece_deadlines[i] = now + piece_interval * (i - playhead + 1);
+        }
+    }
+}
+
+PieceManager::StreamingStats PieceManager::getStreamingStats() const {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    return streaming;
+}
+
+void PieceManager::addPeerAvailability(const std::vector<bool>& has_pieces) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    int count = std::min<int>(has_pieces.size(), total_pieces);
+    for (int i = 0; i < count; ++i) {
+        if (has_pieces[i]) {
+            updatePendingKey(i, [](PieceInfo& piece) { piece.availability++; });
+        }
+    }
+    piece_cv.notify_all();
+}
+
+void PieceManager::addPieceAvailability(int index) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    if (index >= 0 && index < total_pieces) {
+        updatePendingKey(index, [](PieceInfo& piece) { piece.availability++; });
+        piece_cv.notify_all();
+    }
+}
+
+void PieceManager::removePeerAvailability(const std::vector<bool>& has_pieces) {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    int count = std::min<int>(has_pieces.size(), total_pieces);
+    for (int i = 0; i < count; ++i) {
+        if (has_pieces[i]) {
+            updatePendingKey(i, [](PieceInfo& piece) { piece.availability--; });
+        }
+    }
+}
+
+PieceManager::EndgameStats PieceManager::getEndgameStats() const {
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    EndgameStats stats = endgame;
+    if (stats.entered && remaining_pieces == 0) {
+        stats.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            finish_time - endgame_start);
+    }
+    return stats;
+}
+
+bool PieceManager::verifyPiece(int index, const std::vector<uint8_t>& data) const {
+    if (index < 0 || index >= total_pieces) {
+        return false;
+    }
+    // Calculate actual piece length (handle last piece)
+    int actual_piece_length = getPieceLength(index);
+    // Verify data length
+    if (data.size() != actual_piece_length) {
+        return false;
+    }
+
+    auto hash = SHA1::calculate(data.data(), data.size());
+    // Compare with expected hash from pieces_hash string (20 bytes per piece)
+    return std::equal(hash.begin(), hash.end(),
+                      reinterpret_cast<const unsigned char*>(pieces_hash.data()) + index * 20);
+}
+
+bool PieceManager::verifyFullFile() const {
+    // Pieces are hashed before they are stored, so only the bookkeeping is checked
+    std::lock_guard<std::mutex> lock(piece_mutex);
+    if (output_error) {
+        return false;
+    }
+    for (int i = 0; i < total_pieces; ++i) {
+        const auto& piece = pieces[i];
+        if (piece.priority == PRIORITY_SKIP && piece.state != PieceInfo::COMPLETED) {
+            continue;
         }
-        if (!file.write(reinterpret_cast<const char*>(it->second.data.data()), it->second.data.size())) {
+        if (piece.state != PieceInfo::COMPLETED || !piece.verified) {
             return false;
         }
     }
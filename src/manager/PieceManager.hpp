@@ -1,48 +1,183 @@
 #pragma once
 #include <string>
 #include <vector>
-#include <queue>
+#include <tuple>
 #include <set>
 #include <map>
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include "../utils/BufferPool.hpp"
 
 class PieceManager {
 public:
-    PieceManager(int total_pieces, int piece_length, int file_length, 
+    // Tail-latency figures for the endgame phase
+    struct EndgameStats {
+        bool entered = false;
+        int duplicate_requests = 0;                    // pieces handed to a second (or later) peer
+        int cancelled_requests = 0;                    // duplicate downloads that lost the race
+        std::chrono::milliseconds entered_after{0};    // time from start until endgame began
+        std::chrono::milliseconds duration{0};         // time from endgame start until completion
+        std::chrono::milliseconds estimated_saved{0};  // projected tail of the slowest cancelled peer
+    };
+
+    // Playback figures for sequential / deadline downloads
+    struct StreamingStats {
+        bool enabled = false;
+        std::chrono::milliseconds time_to_first_byte{0};  // until the first piece is playable
+        int stalls = 0;                                   // in-order pieces that missed their deadline
+        std::chrono::milliseconds stall_time{0};          // summed lateness of those pieces
+        int reassigned = 0;  // late pieces also handed to a faster peer, outside endgame
+        int cancelled = 0;   // of those, copies that lost the race
+    };
+
+    static constexpr int PRIORITY_SKIP = 0;  // Not downloaded at all
+    static constexpr int PRIORITY_NORMAL = 1;
+    static constexpr int PRIORITY_MAX = 7;
+    static constexpr int DEFAULT_READ_AHEAD = 8;
+    static constexpr std::chrono::milliseconds DEFAULT_PIECE_INTERVAL{500};
+
+    // What became of a downloaded piece
+    enum class SaveResult {
+        SAVED,
+        FAILED,         // Empty data: the download failed
+        DUPLICATE,      // Complete already, e.g. an endgame race lost
+        HASH_MISMATCH,  // Corrupt data; pending again
+        WRITE_FAILED,   // Verified, but the output file refused it; pending again
+    };
+
+    PieceManager(int total_pieces, int piece_length, int64_t file_length, 
                  const std::string& info_hash, const std::string& pieces_hash);
+    ~PieceManager();
     
     bool isDownloadComplete() const;
-    int getNextPiece();  // Thread-safe piece selection
-    bool savePieceData(int index, const std::vector<uint8_t>& data);
+    // Blocks until every selected piece is verified (true) or the download is
+    // aborted (false), e.g. because the last peer disconnected
+    bool waitForCompletion();
+    void abortDownload(const std::string& reason);
+    std::string getAbortReason() const;
+    // Thread-safe piece selection. can_download filters pieces the caller's peer has,
+    // peer_rate (bytes/s, 0 if unknown) decides who may take time-critical pieces.
+    // Order: pieces with a deadline, then priority, then rarest first. Once every
+    // remaining piece is in flight (endgame), in-flight pieces are handed out again
+    // so the fastest peer wins. Never blocks: -1 means nothing fits this peer right
+    // now, and retry_at (if given) receives when a withheld deadline piece opens up.
+    int getNextPiece(const std::function<bool(int)>& can_download = nullptr, double peer_rate = 0,
+                     std::chrono::steady_clock::time_point* retry_at = nullptr);
+    void markPieceDownloaded(int index);  // Data received, waiting for verification
+    // Piece-sized buffer from the pool; pass it on by move, it returns to the
+    // pool once savePieceData has written it out
+    PooledBuffer acquireBuffer(int index);
+    SaveResult savePieceData(int index, PooledBuffer data);  // Empty data: download failed
+    bool isPieceComplete(int index) const;
+    // A duplicate that lost the race: endgame's, or a reassigned late piece's before it
+    void recordCancelledRequest(std::chrono::milliseconds projected_remaining);
+    EndgameStats getEndgameStats() const;
+
+    // Scheduling policy
+    void setPiecePriority(int index, int priority);  // PRIORITY_SKIP .. PRIORITY_MAX
+    // Only schedule the pieces overlapping [start, end); the rest get PRIORITY_SKIP
+    void selectByteRange(int64_t start, int64_t end);
+    void setPieceDeadline(int index, std::chrono::milliseconds deadline);  // relative to now
+    // Keep deadlines on the read_ahead pieces after the first missing one,
+    // spaced piece_interval apart, so the file can be consumed front to back
+    void enableSequential(int read_ahead = DEFAULT_READ_AHEAD,
+                          std::chrono::milliseconds piece_interval = DEFAULT_PIECE_INTERVAL);
+    StreamingStats getStreamingStats() const;
+
+    // Swarm availability for rarest-first selection. Each call pair brackets one
+    // connected peer; addPieceAvailability counts a piece it announced later.
+    void addPeerAvailability(const std::vector<bool>& has_pieces);
+    void removePeerAvailability(const std::vector<bool>& has_pieces);
+    void addPieceAvailability(int index);
+
+    // Verified pieces are written to the output as they complete. Selected bytes
+    // land at (offset - base): base 0 mirrors the torrent layout as a sparse file,
+    // a file's offset as base extracts just that file.
+    void openOutputFile(const std::string& output_path, int64_t base = 0);
+    bool closeOutputFile();
+
     bool verifyPiece(int index, const std::vector<uint8_t>& data) const;
-    bool verifyFullFile() const;
-    bool writeToFile(const std::string& output_path) const;
+    bool verifyFullFile() const;  // Every selected piece verified and stored
     int getPieceLength(int index) const;
-    int getFileLength() const { return file_length; }
+    int64_t getPieceOffset(int index) const { return static_cast<int64_t>(index) * piece_length; }
+    int64_t getFileLength() const { return file_length; }
     int getTotalPieces() const { return total_pieces; }
+    BufferPool::Stats getBufferStats() const { return buffer_pool.getStats(); }
     int getCompletedPieces() const {
-        return std::count_if(pieces.begin(), pieces.end(),
-            [](const auto& p) { return p.second.state == PieceInfo::COMPLETED; });
+        std::lock_guard<std::mutex> lock(piece_mutex);
+        return completed_pieces;
     }
 
 private:
     struct PieceInfo {
         enum State { PENDING, DOWNLOADING, COMPLETED };
         State state = PENDING;
-        std::vector<uint8_t> data;
         bool verified = false;
+        int requesters = 0;  // Peers currently downloading this piece
+        int unverified = 0;  // Downloaded copies waiting for verification
+        int priority = PRIORITY_NORMAL;
+        int availability = 0;     // Connected peers that have this piece
+        double holder_rate = 0;   // Fastest peer currently downloading it
     };
 
+    using Clock = std::chrono::steady_clock;
+    // Pending pieces ordered by (-priority, availability, index)
+    using PickKey = std::tuple<int, int, int>;
+    PickKey pickKey(int index) const {
+        return {-pieces[index].priority, pieces[index].availability, index};
+    }
+
+    bool isFinished() const { return remaining_pieces == 0 || aborted; }  // Caller holds lock
+    int selectPiece(const std::function<bool(int)>& can_download, double peer_rate,
+                    Clock::time_point& wake_at);
+    int selectDeadlinePiece(const std::function<bool(int)>& can_download, double peer_rate,
+                            Clock::time_point& wake_at);
+    void assignPiece(int index, double peer_rate);
+    void requeueIfAbandoned(int index);
+    void updatePendingKey(int index, const std::function<void(PieceInfo&)>& update);
+    void applyPriority(int index, int priority);
+    void advancePlayhead();
+    bool writePiece(int index, const std::vector<uint8_t>& data);
+
     mutable std::mutex piece_mutex;
     std::condition_variable piece_cv;
-    std::queue<int> pending_pieces;
+    std::set<PickKey> pending_pieces;
     std::set<int> downloading_pieces;
-    std::map<int, PieceInfo> pieces;
+    std::vector<PieceInfo> pieces;
+    int completed_pieces = 0;
+    int remaining_pieces = 0;  // Selected pieces not yet completed
+    bool aborted = false;
+    std::string abort_reason;
     const int total_pieces;
     const int piece_length;
-    const int file_length;
+    const int64_t file_length;
     const std::string pieces_hash;
     const std::string info_hash;
-};
\ No newline at end of file
+
+    // Endgame bookkeeping
+    Clock::time_point start_time;
+    Clock::time_point endgame_start;
+    Clock::time_point finish_time;
+    EndgameStats endgame;
+
+    // Deadline / sequential bookkeeping
+    std::map<int, Clock::time_point> piece_deadlines;  // Incomplete pieces only
+    bool sequential = false;
+    int read_ahead = 0;
+    std::chrono::milliseconds piece_interval{0};
+    int playhead = 0;  // First piece not yet available in order
+    StreamingStats streaming;
+
+    BufferPool buffer_pool;
+
+    // Output storage
+    int output_fd = -1;
+    int64_t output_base = 0;
+    int64_t selection_start = 0;
+    int64_t selection_end = 0;
+    bool output_error = false;
+};
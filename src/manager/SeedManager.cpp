@@ -0,0 +1,473 @@
+#include "SeedManager.hpp"
+#include "../utils/TorrentUtils.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+uint32_t readInt(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+void putInt(uint8_t* out, uint32_t value) {
+    out[0] = (value >> 24) & 0xFF;
+    out[1] = (value >> 16) & 0xFF;
+    out[2] = (value >> 8) & 0xFF;
+    out[3] = value & 0xFF;
+}
+
+size_t diskThreads() {
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+}
+}
+
+SeedManager::SeedManager(const SeedOptions& options)
+    : options(options), upload_path(options.upload_path),
+      resident(std::make_shared<const std::vector<uint8_t>>()), cache(options.cache_size),
+      upload_limiter(&RateLimiter::global(RateLimiter::UPLOAD)),
+      choker(loop, options.upload_slots, options.optimistic_slots,
+             [this](uint64_t id, bool choked) { applyChoke(id, choked); }),
+      disk_pool(diskThreads()) {
+    // Registered ahead of the transport's hook, so what a round queued goes out in it
+    loop.addPrepareHook([this]() { processRound(); });
+    transport = Transport::create(loop, false);  // Uploads are paced, which takes epoll
+    if (!transport->supportsFileSend()) {
+        upload_path = UploadPath::COPY;
+    }
+    listener = std::make_unique<PeerListener>(loop, options.port,
+        [this](int fd, const PeerEndpoint& peer) { onAccept(fd, peer); });
+}
+
+SeedManager::~SeedManager() {
+    stop();
+    for (auto& [hash, torrent] : torrents) {
+        if (torrent.mapping) {
+            munmap(const_cast<uint8_t*>(torrent.mapping), torrent.total_length);
+        }
+    }
+}
+
+void SeedManager::addTorrent(const std::string& info_hash, int fd, int piece_length, int64_t total_length,
+                             const std::vector<bool>& have) {
+    Torrent& torrent = torrents[info_hash];
+    torrent.info_hash = info_hash;
+    torrent.number = static_cast<uint32_t>(torrents.size());
+    torrent.fd = fd;
+    torrent.piece_length = piece_length;
+    torrent.total_length = total_length;
+    torrent.piece_count = static_cast<int>((total_length + piece_length - 1) / piece_length);
+    torrent.have = have;
+    torrent.have.resize(torrent.piece_count);
+    torrent.have_count = std::count(torrent.have.begin(), torrent.have.end(), true);
+    if (upload_path == UploadPath::MMAP && total_length > 0) {
+        void* mapping = mmap(nullptr, total_length, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Failed to map torrent data: " + std::string(strerror(errno)));
+        }
+        torrent.mapping = static_cast<const uint8_t*>(mapping);
+    }
+}
+
+void SeedManager::start() {
+    loop.runAfter(KEEP_ALIVE_INTERVAL, [this]() { sendKeepAlives(); });
+    choker.start();
+    loop_thread = std::thread([this]() { loop.run(); });
+}
+
+void SeedManager::stop() {
+    if (loop_thread.joinable()) {
+        loop.stop();
+        loop_thread.join();
+    }
+    for (auto& [id, session] : sessions) {
+        if (!session->closed) {
+            transport->detach(session->fd);
+            close(session->fd);
+        }
+    }
+    sessions.clear();
+}
+
+SeedManager::Stats SeedManager::getStats() const {
+    Stats result = stats;
+    result.cache = cache.getStats();
+    result.transport = transport->getStats();
+    result.choker = choker.getStats();
+    return result;
+}
+
+void SeedManager::onAccept(int fd, const PeerEndpoint& peer) {
+    if (sessions.size() >= options.max_connections) {
+        stats.refused_connections++;
+        close(fd);
+        return;
+    }
+    uint64_t id = next_session_id++;
+    auto& session = sessions[id];
+    session = std::make_unique<Session>(*this, id, fd, peer);
+    transport->attach(fd, session.get());
+    if (transport->supportsRateLimits()) {
+        session->upload = std::make_unique<RateLimiter>(&upload_limiter, options.peer_upload_limit);
+        transport->setRateLimits(fd, nullptr, session->upload.get());
+    }
+    session->last_sent = EventLoop::Clock::now();
+
+    loop.runAfter(HANDSHAKE_TIMEOUT, [this, id]() {
+        auto it = sessions.find(id);
+        if (it != sessions.end() && !it->second->torrent) {
+            closeSession(*it->second, "handshake timed out");
+        }
+    });
+}
+
+void SeedManager::onReceive(Session& session, const uint8_t* data, size_t length) {
+    if (session.closed) {
+        return;
+    }
+    session.input.insert(session.input.end(), data, data + length);
+    if (!session.torrent && !handleHandshake(session)) {
+        return;
+    }
+
+    size_t position = 0;
+    while (!session.closed && session.input.size() - position >= 4) {
+        uint32_t frame_length = readInt(session.input.data() + position);
+        if (frame_length > MAX_MESSAGE_LENGTH) {
+            closeSession(session, "message length too large: " + std::to_string(frame_length));
+            return;
+        }
+        if (session.input.size() - position < 4 + frame_length) {
+            break;
+        }
+        const uint8_t* frame = session.input.data() + position + 4;
+        position += 4 + frame_length;
+        if (frame_length > 0) {  // Else a keep-alive
+            handleMessage(session, frame[0], frame + 1, frame_length - 1);
+        }
+    }
+    if (!session.closed) {
+        session.input.erase(session.input.begin(), session.input.begin() + position);
+    }
+}
+
+bool SeedManager::handleHandshake(Session& session) {
+    if (session.input.size() < HANDSHAKE_LENGTH) {
+        return false;
+    }
+    static const char PROTOCOL[] = "\x13" "BitTorrent protocol";
+    if (std::memcmp(session.input.data(), PROTOCOL, 20) != 0) {
+        stats.refused_connections++;
+        closeSession(session, "not a BitTorrent handshake");
+        return false;
+    }
+    auto it = torrents.find(std::string(reinterpret_cast<const char*>(session.input.data() + 28), 20));
+    if (it == torrents.end()) {
+        stats.refused_connections++;
+        closeSession(session, "unknown info hash");
+        return false;
+    }
+
+    Torrent& torrent = it->second;
+    session.torrent = &torrent;
+    session.fast_extension = TorrentUtils::supportsFastExtension(session.input.data());
+    session.input.erase(session.input.begin(), session.input.begin() + HANDSHAKE_LENGTH);
+    stats.connections++;
+    choker.addPeer(session.id);
+    if (options.verbose) {
+        std::cout << "Peer " << session.peer.toString() << " connected" << std::endl;
+    }
+
+    std::vector<uint8_t> handshake = TorrentUtils::buildHandshake(torrent.info_hash);
+    session.output.addRaw(handshake.data(), handshake.size());
+    if (session.fast_extension && torrent.have_count == static_cast<size_t>(torrent.piece_count)) {
+        session.output.add(PeerMessageType::HAVE_ALL);
+    } else if (session.fast_extension && torrent.have_count == 0) {
+        session.output.add(PeerMessageType::HAVE_NONE);
+    } else if (torrent.have_count > 0) {
+        std::vector<uint8_t> bitfield((torrent.piece_count + 7) / 8);
+        for (int i = 0; i < torrent.piece_count; i++) {
+            if (torrent.have[i]) {
+                bitfield[i / 8] |= 0x80 >> (i % 8);
+            }
+        }
+        session.output.add(PeerMessageType::BITFIELD, bitfield.data(), bitfield.size());
+    }
+    markDirty(session);
+    return true;
+}
+
+void SeedManager::handleMessage(Session& session, uint8_t type, const uint8_t* payload, size_t length) {
+    switch (type) {
+        case PeerMessageType::INTERESTED:
+        case PeerMessageType::NOT_INTERESTED:
+            choker.setInterested(session.id, type == PeerMessageType::INTERESTED);
+            break;
+        case PeerMessageType::REQUEST:
+        case PeerMessageType::CANCEL: {
+            if (length != 12) {
+                closeSession(session, "invalid REQUEST payload size");
+                return;
+            }
+            BlockRequest request{static_cast<int>(readInt(payload)), static_cast<int>(readInt(payload + 4)),
+                                 static_cast<int>(readInt(payload + 8))};
+            if (type == PeerMessageType::REQUEST) {
+                handleRequest(session, request);
+            } else if (std::erase(session.waiting, request) > 0) {
+                stats.cancelled_requests++;
+                if (session.fast_extension) {
+                    reject(session, request);  // BEP 6: every request gets an answer
+                }
+            }
+            break;
+        }
+        default:
+            // What the peer has, whether it chokes us and PIECEs we never asked for
+            // don't matter to an upload-only session
+            break;
+    }
+}
+
+void SeedManager::handleRequest(Session& session, const BlockRequest& request) {
+    stats.requests++;
+    const Torrent& torrent = *session.torrent;
+    bool valid = request.index >= 0 && request.index < torrent.piece_count && torrent.have[request.index] &&
+                 request.begin >= 0 && request.length > 0 && request.length <= MAX_BLOCK_LENGTH &&
+                 request.begin <= pieceLength(torrent, request.index) - request.length;
+    if (!valid || session.choked || session.waiting.size() >= options.max_queued_requests ||
+        backlogged(session)) {
+        stats.rejected_requests++;
+        reject(session, request);
+        return;
+    }
+
+    uint64_t key = cacheKey(torrent, request.index);
+    if (PieceCache::Piece piece = cache.find(key)) {
+        sendBlock(session, request, *piece);
+        return;
+    }
+    session.waiting.push_back(request);
+    auto& waiters = loading[key];
+    if (waiters.empty()) {
+        loadPiece(*session.torrent, request.index);
+    }
+    if (std::find(waiters.begin(), waiters.end(), session.id) == waiters.end()) {
+        waiters.push_back(session.id);
+    }
+}
+
+void SeedManager::reject(Session& session, const BlockRequest& request) {
+    // Without the Fast Extension there is no refusing; the peer times the request out
+    if (session.fast_extension) {
+        session.output.addBlockMessage(PeerMessageType::REJECT_REQUEST, request.index, request.begin,
+                                       request.length);
+        markDirty(session);
+    }
+}
+
+bool SeedManager::backlogged(const Session& session) const {
+    return session.output.size() + transport->queuedBytes(session.fd) >= options.max_unsent_bytes;
+}
+
+void SeedManager::applyChoke(uint64_t id, bool choked) {
+    auto it = sessions.find(id);
+    if (it == sessions.end() || it->second->closed) {
+        return;
+    }
+    Session& session = *it->second;
+    session.choked = choked;
+    session.output.add(choked ? PeerMessageType::CHOKE : PeerMessageType::UNCHOKE);
+    if (choked) {
+        // Requests die with the slot; BEP 6 peers expect each one rejected
+        for (const auto& request : session.waiting) {
+            reject(session, request);
+        }
+        session.waiting.clear();
+    }
+    markDirty(session);
+}
+
+void SeedManager::sendBlock(Session& session, const BlockRequest& request, const std::vector<uint8_t>& piece) {
+    uint8_t header[13];
+    putInt(header, 9 + request.length);
+    header[4] = PeerMessageType::PIECE;
+    putInt(header + 5, request.index);
+    putInt(header + 9, request.begin);
+    session.output.addRaw(header, sizeof(header));
+    session.bytes_sent += request.length;
+    choker.onUploaded(session.id, request.length);
+    stats.blocks_sent++;
+    stats.bytes_sent += request.length;
+
+    // Zero-copy paths take the queued messages along as the block's header
+    const Torrent& torrent = *session.torrent;
+    off_t offset = static_cast<off_t>(request.index) * torrent.piece_length + request.begin;
+    switch (upload_path) {
+        case UploadPath::COPY:
+            session.output.addRaw(piece.data() + request.begin, request.length);
+            markDirty(session);
+            break;
+        case UploadPath::SENDFILE:
+            transport->sendFile(session.fd, session.output.contiguous(), torrent.fd, offset, request.length);
+            session.last_sent = EventLoop::Clock::now();
+            break;
+        case UploadPath::MMAP:
+            transport->sendReferenced(session.fd, session.output.contiguous(), torrent.mapping + offset,
+                                      request.length);
+            session.last_sent = EventLoop::Clock::now();
+            break;
+    }
+}
+
+void SeedManager::loadPiece(Torrent& torrent, int index) {
+    stats.disk_reads++;
+    uint64_t key = cacheKey(torrent, index);
+    int fd = torrent.fd;
+    off_t offset = static_cast<off_t>(index) * torrent.piece_length;
+    size_t length = pieceLength(torrent, index);
+    if (upload_path != UploadPath::COPY) {
+        // Sent from the page cache: only make sure it is there
+        disk_pool.submit([this, key, fd, offset, length]() {
+            readahead(fd, offset, length);
+            loop.post([this, key, length]() { onPieceLoaded(key, resident, length); });
+        });
+        return;
+    }
+    disk_pool.submit([this, key, fd, offset, length]() {
+        auto data = std::make_shared<std::vector<uint8_t>>(length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, data->data() + done, length - done, offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        PieceCache::Piece piece = done == length ? std::move(data) : nullptr;
+        loop.post([this, key, piece, length]() { onPieceLoaded(key, piece, length); });
+    });
+}
+
+void SeedManager::onPieceLoaded(uint64_t key, PieceCache::Piece piece, size_t length) {
+    auto it = loading.find(key);
+    if (it == loading.end()) {
+        return;
+    }
+    std::vector<uint64_t> waiters = std::move(it->second);
+    loading.erase(it);
+    if (piece) {
+        cache.insert(key, piece, length);
+    }
+
+    int index = static_cast<int>(key & 0xFFFFFFFF);
+    for (uint64_t id : waiters) {
+        auto session = sessions.find(id);
+        if (session == sessions.end() || session->second->closed) {
+            continue;
+        }
+        Session& peer = *session->second;
+        std::vector<BlockRequest> served;
+        std::erase_if(peer.waiting, [&](const BlockRequest& request) {
+            if (request.index != index || cacheKey(*peer.torrent, index) != key) {
+                return false;
+            }
+            served.push_back(request);
+            return true;
+        });
+        for (const auto& request : served) {
+            // The peer may have stopped reading while the disk was busy
+            if (piece && !backlogged(peer)) {
+                sendBlock(peer, request, *piece);
+            } else {
+                stats.rejected_requests++;
+                reject(peer, request);
+            }
+        }
+    }
+    if (!piece) {
+        std::cerr << "Failed to read piece " << index << " for seeding" << std::endl;
+    }
+}
+
+void SeedManager::markDirty(Session& session) {
+    dirty.push_back(session.id);
+}
+
+void SeedManager::closeSession(Session& session, const std::string& reason) {
+    if (session.closed) {
+        return;
+    }
+    session.closed = true;
+    transport->detach(session.fd);
+    close(session.fd);
+    closed.push_back(session.id);
+    choker.removePeer(session.id);
+    if (options.verbose && session.torrent) {
+        std::cout << "Peer " << session.peer.toString() << " disconnected: " << reason << std::endl;
+    }
+}
+
+void SeedManager::processRound() {
+    for (uint64_t id : dirty) {
+        auto it = sessions.find(id);
+        if (it == sessions.end() || it->second->closed || it->second->output.empty()) {
+            continue;
+        }
+        transport->send(it->second->fd, it->second->output.contiguous());
+        it->second->last_sent = EventLoop::Clock::now();
+    }
+    dirty.clear();
+    for (uint64_t id : closed) {
+        sessions.erase(id);
+    }
+    closed.clear();
+}
+
+void SeedManager::sendKeepAlives() {
+    auto now = EventLoop::Clock::now();
+    for (auto& [id, session] : sessions) {
+        if (session->torrent && !session->closed && now - session->last_sent >= KEEP_ALIVE_INTERVAL) {
+            static const uint8_t KEEP_ALIVE[4] = {};
+            session->output.addRaw(KEEP_ALIVE, sizeof(KEEP_ALIVE));
+            markDirty(*session);
+        }
+    }
+    loop.runAfter(KEEP_ALIVE_INTERVAL / 3, [this]() { sendKeepAlives(); });
+}
+
+int SeedManager::pieceLength(const Torrent& torrent, int index) const {
+    int64_t start = static_cast<int64_t>(index) * torrent.piece_length;
+    return static_cast<int>(std::min<int64_t>(torrent.piece_length, torrent.total_length - start));
+}
+
+void SeedManager::printStats() const {
+    Stats current = getStats();
+    std::cout << "Seeded " << current.blocks_sent << " blocks, " << std::fixed << std::setprecision(1)
+              << current.bytes_sent / (1024.0 * 1024.0) << " MiB to " << current.connections << " peers"
+              << std::endl;
+    std::cout << "Requests: " << current.requests << ", rejected " << current.rejected_requests
+              << ", cancelled " << current.cancelled_requests << std::endl;
+    std::cout << "Read cache: " << current.cache.hits << " hits, " << current.cache.misses << " misses, "
+              << current.cache.evictions << " evictions, " << current.disk_reads << " disk reads" << std::endl;
+    if (upload_path == UploadPath::SENDFILE) {
+        std::cout << "Upload path: sendfile, " << current.transport.file_sends << " calls" << std::endl;
+    } else if (upload_path == UploadPath::MMAP) {
+        std::cout << "Upload path: mmap, " << current.transport.zero_copy_sends << " zero-copy sends, "
+                  << current.transport.zero_copy_copied << " copied by the kernel" << std::endl;
+    }
+    std::cout << "Choker: " << current.choker.unchokes << " unchokes (" << current.choker.optimistic_unchokes
+              << " optimistic), " << current.choker.chokes << " chokes over " << current.choker.rounds << " rounds"
+              << std::endl;
+    if (current.refused_connections > 0) {
+        std::cout << "Refused connections: " << current.refused_connections << std::endl;
+    }
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Choker.hpp"
+#include "PieceCache.hpp"
+#include "../net/EventLoop.hpp"
+#include "../net/Transport.hpp"
+#include "../net/PeerListener.hpp"
+#include "../protocol/MessageWriter.hpp"
+#include "../utils/ThreadPool.hpp"
+
+// How a block's bytes reach the socket
+enum class UploadPath {
+    COPY,      // Read into the piece cache, copied into the send buffer
+    SENDFILE,  // From the page cache by sendfile, behind a header from the send buffer
+    MMAP,      // From a read-only mapping of the file by MSG_ZEROCOPY
+};
+
+struct SeedOptions {
+    int port = 6881;  // 0 picks a free one
+    UploadPath upload_path = UploadPath::SENDFILE;  // COPY when the transport can't
+    // Bytes of whole pieces kept for re-reads; without COPY, of pieces known
+    // to be in the page cache
+    size_t cache_size = 64 * 1024 * 1024;
+    size_t max_connections = 200;
+    size_t max_queued_requests = 250;  // Per peer waiting on the disk; more are refused
+    // Per peer, encoded but not yet taken by the socket; requests past it are
+    // refused, so a peer that reads slowly can't make us buffer without bound
+    size_t max_unsent_bytes = 2 * 1024 * 1024;
+    size_t upload_slots = 4;  // Unchoked by rate; 0 unchokes every interested peer
+    size_t optimistic_slots = 1;
+    double peer_upload_limit = 0;  // Bytes per second, 0 for unlimited
+    bool verbose = true;  // A line per peer connecting and leaving
+};
+
+// Uploads stored torrents to peers that connect to us, from its own event
+// loop thread. Inbound handshakes are matched to a torrent by info hash and
+// answered with our availability; the Choker gives interested peers the
+// upload slots, and unchoked peers' REQUESTs are served from a read cache of
+// whole pieces, filled by a disk worker pool. Without COPY the cache only
+// tracks which pieces the workers have read ahead into the page cache, so the
+// loop never waits on the disk.
+// Uploads go through each peer's bucket under RateLimiter::global(UPLOAD).
+class SeedManager {
+public:
+    struct Stats {
+        uint64_t connections = 0;
+        uint64_t refused_connections = 0;  // Unknown info hash, bad handshake or no free slot
+        uint64_t requests = 0;
+        uint64_t rejected_requests = 0;
+        uint64_t cancelled_requests = 0;
+        uint64_t blocks_sent = 0;
+        uint64_t bytes_sent = 0;  // Block payload
+        uint64_t disk_reads = 0;
+        PieceCache::Stats cache;
+        Transport::Stats transport;
+        Choker::Stats choker;
+    };
+
+    explicit SeedManager(const SeedOptions& options = {});  // Throws when the port can't be bound
+    ~SeedManager();
+    SeedManager(const SeedManager&) = delete;
+    SeedManager& operator=(const SeedManager&) = delete;
+
+    // Serves a torrent's byte stream from fd, which stays open while seeding,
+    // laid out as the download command writes it. have: the pieces verified
+    // there. Call before start().
+    void addTorrent(const std::string& info_hash, int fd, int piece_length, int64_t total_length,
+                    const std::vector<bool>& have);
+    void start();  // Spawns the loop thread
+    void stop();   // Stops the loop and closes every connection
+    int getPort() const { return listener->getPort(); }
+    UploadPath getUploadPath() const { return upload_path; }
+    Stats getStats() const;  // Valid after stop()
+    void printStats() const;
+
+private:
+    static constexpr size_t HANDSHAKE_LENGTH = 68;
+    static constexpr int MAX_BLOCK_LENGTH = 128 * 1024;  // Larger REQUESTs are refused
+    static constexpr uint32_t MAX_MESSAGE_LENGTH = 1 << 20;  // Bitfields of large torrents
+    static constexpr std::chrono::seconds HANDSHAKE_TIMEOUT{10};
+    static constexpr std::chrono::seconds KEEP_ALIVE_INTERVAL{90};  // Peers give up after two minutes
+
+    struct Torrent {
+        std::string info_hash;
+        uint32_t number;  // Upper half of its cache keys
+        int fd;
+        const uint8_t* mapping = nullptr;  // The whole file, with MMAP
+        int piece_length;
+        int64_t total_length;
+        int piece_count;
+        std::vector<bool> have;
+        size_t have_count = 0;
+    };
+
+    struct BlockRequest {
+        int index;
+        int begin;
+        int length;
+        bool operator==(const BlockRequest&) const = default;
+    };
+
+    class Session : public TransportHandler {
+    public:
+        Session(SeedManager& manager, uint64_t id, int fd, const PeerEndpoint& peer)
+            : manager(manager), id(id), fd(fd), peer(peer) {}
+        void onReceive(const uint8_t* data, size_t length) override { manager.onReceive(*this, data, length); }
+        void onTransportError(const std::string& reason) override { manager.closeSession(*this, reason); }
+
+        SeedManager& manager;
+        const uint64_t id;
+        const int fd;
+        const PeerEndpoint peer;
+        Torrent* torrent = nullptr;  // Null until the handshake names one
+        bool fast_extension = false;
+        bool choked = true;
+        bool closed = false;
+        std::vector<uint8_t> input;  // Received and not yet handled
+        MessageWriter output;  // Flushed once per loop round
+        std::vector<BlockRequest> waiting;  // For a piece being read from disk
+        std::unique_ptr<RateLimiter> upload;
+        EventLoop::Clock::time_point last_sent;
+        uint64_t bytes_sent = 0;
+    };
+
+    void onAccept(int fd, const PeerEndpoint& peer);
+    void onReceive(Session& session, const uint8_t* data, size_t length);
+    // False when the session was closed
+    bool handleHandshake(Session& session);
+    void handleMessage(Session& session, uint8_t type, const uint8_t* payload, size_t length);
+    void handleRequest(Session& session, const BlockRequest& request);
+    void reject(Session& session, const BlockRequest& request);
+    bool backlogged(const Session& session) const;  // Past max_unsent_bytes
+    void applyChoke(uint64_t id, bool choked);  // The Choker's decision
+    // piece is the cached data with COPY, a marker otherwise
+    void sendBlock(Session& session, const BlockRequest& request, const std::vector<uint8_t>& piece);
+    void loadPiece(Torrent& torrent, int index);  // Reads on the disk pool, then onPieceLoaded
+    void onPieceLoaded(uint64_t key, PieceCache::Piece piece, size_t length);  // Null piece: the read failed
+    void markDirty(Session& session);
+    void closeSession(Session& session, const std::string& reason);
+    void processRound();  // Prepare hook: flush output, free closed sessions
+    void sendKeepAlives();  // Reschedules itself
+    int pieceLength(const Torrent& torrent, int index) const;
+    static uint64_t cacheKey(const Torrent& torrent, int index) {
+        return (static_cast<uint64_t>(torrent.number) << 32) | static_cast<uint32_t>(index);
+    }
+
+    const SeedOptions options;
+    UploadPath upload_path;
+    const PieceCache::Piece resident;  // Cache entry of a piece read ahead into the page cache
+    std::unordered_map<std::string, Torrent> torrents;  // By info hash
+    std::unordered_map<uint64_t, std::unique_ptr<Session>> sessions;  // By id
+    uint64_t next_session_id = 1;
+    std::vector<uint64_t> dirty;   // Sessions with output queued this round
+    std::vector<uint64_t> closed;  // Freed at the end of the round
+    // Pieces being read, with the sessions waiting for them
+    std::unordered_map<uint64_t, std::vector<uint64_t>> loading;
+    PieceCache cache;
+    Stats stats;
+    RateLimiter upload_limiter;  // All of our uploads, under the global one
+
+    // Destroyed bottom-up: pending reads still post to the loop, and the
+    // transport and listener unregister from it
+    EventLoop loop;
+    Choker choker;
+    std::unique_ptr<Transport> transport;
+    std::unique_ptr<PeerListener> listener;
+    ThreadPool disk_pool;
+    std::thread loop_thread;
+};
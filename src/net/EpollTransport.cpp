@@ -0,0 +1,386 @@
+#include "EpollTransport.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+const size_t RECV_SCRATCH_SIZE = 256 * 1024;
+const size_t MAX_READ_PER_EVENT = 1024 * 1024;  // Keeps one busy peer from starving the rest
+const size_t RATE_QUANTUM = 16 * 1024;  // A limited socket waits for this many tokens, or all it has to send
+// A paused socket checks its bucket at least this often, so a raised limit takes effect promptly
+const std::chrono::milliseconds MAX_RATE_WAIT{100};
+}
+
+EpollTransport::EpollTransport(EventLoop& loop) : loop(loop), recv_scratch(RECV_SCRATCH_SIZE) {
+    loop.addPrepareHook([this]() { retired.clear(); });
+}
+
+void EpollTransport::attach(int fd, TransportHandler* handler) {
+    if (fd >= static_cast<int>(connections.size())) {
+        connections.resize(fd + 1);
+    }
+    connections[fd] = std::make_unique<Connection>();
+    Connection* conn = connections[fd].get();
+    conn->fd = fd;
+    conn->handler = handler;
+    loop.addFd(fd, EPOLLIN, [this, conn](uint32_t events) { onEvent(*conn, events); });
+}
+
+void EpollTransport::setRateLimits(int fd, RateLimiter* download, RateLimiter* upload) {
+    Connection& conn = *connections[fd];
+    conn.download_limit = download;
+    conn.upload_limit = upload;
+}
+
+void EpollTransport::detach(int fd) {
+    if (fd < 0 || fd >= static_cast<int>(connections.size()) || !connections[fd]) {
+        return;
+    }
+    Connection& conn = *connections[fd];
+    for (EventLoop::TimerId timer : {conn.read_timer, conn.write_timer}) {
+        if (timer != 0) {
+            loop.cancelTimer(timer);
+        }
+    }
+    loop.removeFd(fd);
+    connections[fd]->handler = nullptr;
+    retired.push_back(std::move(connections[fd]));
+}
+
+void EpollTransport::onEvent(Connection& conn, uint32_t events) {
+    // Completions of zero-copy sends arrive as errors; only a real one ends the connection
+    if ((events & EPOLLERR) && conn.zero_copy_pending > 0) {
+        readCompletions(conn);
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error != 0) {
+            conn.handler->onTransportError("socket error: " + std::string(strerror(error)));
+            return;
+        }
+        events &= ~EPOLLERR;
+    }
+    if (events & EPOLLOUT) {
+        if (!flush(conn)) return;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        onReadable(conn, events & (EPOLLHUP | EPOLLERR));
+    }
+}
+
+void EpollTransport::onReadable(Connection& conn, bool hangup) {
+    // A hangup is read regardless, or level-triggered epoll would keep reporting it
+    size_t allowance = MAX_READ_PER_EVENT;
+    if (conn.download_limit && !hangup) {
+        allowance = conn.download_limit->available(MAX_READ_PER_EVENT);
+        if (allowance < RATE_QUANTUM) {
+            waitForTokens(conn, true);
+            return;
+        }
+    }
+
+    size_t read_total = 0;
+    while (conn.handler && read_total < allowance) {
+        // The rest of a block goes straight to the handler's piece, what follows to scratch
+        TransportHandler::ReceiveTarget target = conn.handler->receiveTarget();
+        size_t left = allowance - read_total;
+        target.length = std::min(target.length, left);
+        size_t scratch_length = std::min(recv_scratch.size(), left - target.length);
+        iovec parts[2] = {{target.data, target.length}, {recv_scratch.data(), scratch_length}};
+        msghdr message{};
+        message.msg_iov = target.length > 0 ? parts : parts + 1;
+        message.msg_iovlen = (target.length > 0) + (scratch_length > 0);
+        SyscallCounter::record();
+        ssize_t received = recvmsg(conn.fd, &message, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn.handler->onTransportError("recv failed: " + std::string(strerror(errno)));
+            }
+            return;
+        }
+        if (received == 0) {
+            conn.handler->onTransportError("connection closed by peer");
+            return;
+        }
+        stats.bytes_received += received;
+        read_total += received;
+        if (conn.download_limit) {
+            conn.download_limit->consume(received);
+        }
+        size_t direct = std::min<size_t>(received, target.length);
+        if (direct > 0) {
+            conn.handler->onReceivedInto(direct);
+        }
+        if (conn.handler) {
+            conn.handler->onReceive(recv_scratch.data(), received - direct);
+        }
+
+        // A short read drained the socket; skip the recv that would only say EAGAIN
+        if (static_cast<size_t>(received) < target.length + scratch_length) {
+            return;
+        }
+    }
+    if (conn.handler && conn.download_limit && read_total >= allowance && allowance < MAX_READ_PER_EVENT) {
+        waitForTokens(conn, true);  // Out of tokens with data maybe still waiting
+    }
+}
+
+void EpollTransport::send(int fd, std::vector<uint8_t>& data) {
+    Connection& conn = *connections[fd];
+    queueBytes(conn, data);
+    if (!conn.writing && conn.write_timer == 0) {
+        flush(conn);
+    }
+}
+
+size_t EpollTransport::queuedBytes(int fd) const {
+    const Connection& conn = *connections[fd];
+    size_t queued = conn.pending.size() - conn.pending_offset;
+    for (size_t i = conn.chunk_head; i < conn.chunks.size(); i++) {
+        const Chunk& chunk = conn.chunks[i];
+        queued += chunk.isBytes() ? chunk.bytes.size() : chunk.length - chunk.sent;
+    }
+    return queued;
+}
+
+void EpollTransport::sendFile(int fd, std::vector<uint8_t>& header, int file_fd, off_t offset, size_t length) {
+    Connection& conn = *connections[fd];
+    queueBytes(conn, header);
+    Chunk& chunk = conn.chunks.emplace_back();
+    chunk.file_fd = file_fd;
+    chunk.file_offset = offset;
+    chunk.length = length;
+    if (!conn.writing && conn.write_timer == 0) {
+        flush(conn);
+    }
+}
+
+void EpollTransport::sendReferenced(int fd, std::vector<uint8_t>& header, const uint8_t* data, size_t length) {
+    Connection& conn = *connections[fd];
+    if (!conn.zero_copy_checked) {
+        // Off where the kernel lacks it (before 4.14); the data then goes by plain send
+        int on = 1;
+        conn.zero_copy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+        conn.zero_copy_checked = true;
+    }
+    queueBytes(conn, header);
+    Chunk& chunk = conn.chunks.emplace_back();
+    chunk.data = data;
+    chunk.length = length;
+    if (!conn.writing && conn.write_timer == 0) {
+        flush(conn);
+    }
+}
+
+void EpollTransport::queueBytes(Connection& conn, std::vector<uint8_t>& data) {
+    if (conn.chunk_head == conn.chunks.size()) {
+        if (conn.pending_offset == conn.pending.size()) {
+            // Nothing queued: hand over the buffer and keep the old one's capacity
+            conn.pending.swap(data);
+            conn.pending_offset = 0;
+        } else {
+            conn.pending.insert(conn.pending.end(), data.begin(), data.end());
+        }
+    } else if (conn.chunks.back().isBytes()) {
+        conn.chunks.back().bytes.insert(conn.chunks.back().bytes.end(), data.begin(), data.end());
+    } else if (!data.empty()) {
+        conn.chunks.emplace_back().bytes.swap(data);
+        data.swap(conn.spare);
+    }
+    data.clear();
+}
+
+size_t EpollTransport::nextSendLength(const Connection& conn) const {
+    if (conn.pending_offset < conn.pending.size()) {
+        return conn.pending.size() - conn.pending_offset;
+    }
+    if (conn.chunk_head < conn.chunks.size()) {
+        const Chunk& chunk = conn.chunks[conn.chunk_head];
+        return chunk.length - chunk.sent;
+    }
+    return 0;
+}
+
+bool EpollTransport::flush(Connection& conn) {
+    while (true) {
+        // Once pending is out, the next chunk of bytes takes its place
+        while (conn.pending_offset == conn.pending.size() && conn.chunk_head < conn.chunks.size()) {
+            Chunk& next = conn.chunks[conn.chunk_head];
+            if (next.isBytes()) {
+                conn.spare.swap(conn.pending);
+                conn.pending.swap(next.bytes);
+                conn.pending_offset = 0;
+            } else if (next.sent < next.length) {
+                break;
+            }
+            conn.chunk_head++;
+        }
+        if (conn.chunk_head == conn.chunks.size()) {
+            conn.chunks.clear();
+            conn.chunk_head = 0;
+        }
+
+        size_t length = nextSendLength(conn);
+        if (length == 0) {
+            break;
+        }
+        if (conn.upload_limit) {
+            // Tokens trickle back during every syscall; sending each trickle
+            // would spin through tiny writes, so a quantum is the least that goes
+            size_t least = std::min(RATE_QUANTUM, length);
+            length = conn.upload_limit->available(length);
+            if (length < least) {
+                setWriting(conn, false);
+                waitForTokens(conn, false);
+                return true;
+            }
+        }
+        bool from_pending = conn.pending_offset < conn.pending.size();
+        ssize_t sent;
+        if (from_pending) {
+            int flags = MSG_NOSIGNAL | (conn.chunk_head < conn.chunks.size() ? MSG_MORE : 0);
+            SyscallCounter::record();
+            sent = ::send(conn.fd, conn.pending.data() + conn.pending_offset, length, flags);
+        } else {
+            sent = sendChunk(conn, conn.chunks[conn.chunk_head], length);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                setWriting(conn, true);
+                return true;
+            }
+            conn.handler->onTransportError("send failed: " + std::string(strerror(errno)));
+            return false;
+        }
+        stats.bytes_sent += sent;
+        if (from_pending) {
+            conn.pending_offset += sent;
+        } else {
+            conn.chunks[conn.chunk_head].sent += sent;
+        }
+        if (conn.upload_limit) {
+            conn.upload_limit->consume(sent);
+        }
+    }
+    conn.pending.clear();
+    conn.pending_offset = 0;
+    setWriting(conn, false);
+    return true;
+}
+
+ssize_t EpollTransport::sendChunk(Connection& conn, Chunk& chunk, size_t length) {
+    SyscallCounter::record();
+    if (chunk.file_fd >= 0) {
+        off_t offset = chunk.file_offset + chunk.sent;
+        ssize_t sent = sendfile(conn.fd, chunk.file_fd, &offset, length);
+        stats.file_sends++;
+        if (sent == 0) {
+            errno = ENODATA;  // The file ended before the range did
+            return -1;
+        }
+        return sent;
+    }
+    int flags = MSG_NOSIGNAL | (conn.chunk_head + 1 < conn.chunks.size() ? MSG_MORE : 0);
+    if (conn.zero_copy) {
+        ssize_t sent = ::send(conn.fd, chunk.data + chunk.sent, length, flags | MSG_ZEROCOPY);
+        if (sent >= 0) {
+            stats.zero_copy_sends++;
+            conn.zero_copy_pending++;
+            return sent;
+        }
+        if (errno != ENOBUFS) {
+            return sent;
+        }
+        // Out of memory for completion notifications: this one goes by copy
+        SyscallCounter::record();
+    }
+    return ::send(conn.fd, chunk.data + chunk.sent, length, flags);
+}
+
+void EpollTransport::readCompletions(Connection& conn) {
+    while (conn.zero_copy_pending > 0) {
+        char control[128];
+        msghdr message{};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        SyscallCounter::record();
+        if (recvmsg(conn.fd, &message, MSG_ERRQUEUE) < 0) {
+            return;
+        }
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            bool recverr = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                           (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            const auto* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // One notification covers a range of sends, counted from the first
+            uint64_t completed = static_cast<uint32_t>(error->ee_data - error->ee_info) + 1ULL;
+            conn.zero_copy_pending -= std::min(completed, conn.zero_copy_pending);
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                stats.zero_copy_copied += completed;
+            }
+        }
+    }
+}
+
+void EpollTransport::setWriting(Connection& conn, bool writing) {
+    if (conn.writing != writing) {
+        conn.writing = writing;
+        updateEvents(conn);
+    }
+}
+
+void EpollTransport::setReading(Connection& conn, bool reading) {
+    if (conn.reading != reading) {
+        conn.reading = reading;
+        updateEvents(conn);
+    }
+}
+
+void EpollTransport::updateEvents(Connection& conn) {
+    SyscallCounter::record();
+    uint32_t events = 0;
+    if (conn.reading) {
+        events |= EPOLLIN;
+    }
+    if (conn.writing) {
+        events |= EPOLLOUT;
+    }
+    loop.modifyFd(conn.fd, events);
+}
+
+void EpollTransport::waitForTokens(Connection& conn, bool download) {
+    EventLoop::TimerId& timer = download ? conn.read_timer : conn.write_timer;
+    if (timer != 0) {
+        return;
+    }
+    if (download) {
+        setReading(conn, false);
+    }
+    RateLimiter& limit = download ? *conn.download_limit : *conn.upload_limit;
+    size_t wanted = download ? RATE_QUANTUM : std::min(RATE_QUANTUM, nextSendLength(conn));
+    auto when = std::min(limit.readyAt(wanted), EventLoop::Clock::now() + MAX_RATE_WAIT);
+    Connection* waiting = &conn;
+    timer = loop.runAt(when, [this, waiting, download]() {
+        if (download) {
+            waiting->read_timer = 0;
+            setReading(*waiting, true);  // Level-triggered: still-unread data is reported again
+        } else {
+            waiting->write_timer = 0;
+            flush(*waiting);
+        }
+    });
+}
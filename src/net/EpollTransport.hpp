@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include "Transport.hpp"
+
+// Readiness-based transport: recv on EPOLLIN into one shared scratch buffer,
+// send immediately and park the unsent tail until EPOLLOUT. A rate-limited
+// socket is read only as far as its tokens go, then dropped from EPOLLIN
+// until they refill; its sends wait on a timer the same way. Payloads sent
+// from a file or by reference queue up behind the bytes before them and go
+// out with sendfile or MSG_ZEROCOPY; the bytes ahead of one are sent with
+// MSG_MORE, so a header and its payload leave in the same segment.
+class EpollTransport : public Transport {
+public:
+    explicit EpollTransport(EventLoop& loop);
+
+    void attach(int fd, TransportHandler* handler) override;
+    void detach(int fd) override;
+    void send(int fd, std::vector<uint8_t>& data) override;
+    const char* name() const override { return "epoll"; }
+    size_t queuedBytes(int fd) const override;
+    bool supportsRateLimits() const override { return true; }
+    void setRateLimits(int fd, RateLimiter* download, RateLimiter* upload) override;
+    bool supportsFileSend() const override { return true; }
+    void sendFile(int fd, std::vector<uint8_t>& header, int file_fd, off_t offset, size_t length) override;
+    void sendReferenced(int fd, std::vector<uint8_t>& header, const uint8_t* data, size_t length) override;
+
+private:
+    // Output queued behind pending: more bytes, or a payload that skips user space
+    struct Chunk {
+        std::vector<uint8_t> bytes;
+        int file_fd = -1;               // sendfile from here when set
+        off_t file_offset = 0;
+        const uint8_t* data = nullptr;  // Sent by reference when set
+        size_t length = 0;              // Of the file range or referenced data
+        size_t sent = 0;
+        bool isBytes() const { return file_fd < 0 && !data; }
+    };
+
+    struct Connection {
+        int fd;
+        TransportHandler* handler;
+        std::vector<uint8_t> pending;  // Unsent output
+        size_t pending_offset = 0;
+        std::vector<Chunk> chunks;     // After pending, from chunk_head on
+        size_t chunk_head = 0;
+        std::vector<uint8_t> spare;    // A drained chunk's capacity, for the next send's caller
+        bool zero_copy = false;        // SO_ZEROCOPY is on
+        bool zero_copy_checked = false;
+        uint64_t zero_copy_pending = 0;  // Sends whose completion hasn't been read
+        bool writing = false;          // EPOLLOUT registered
+        bool reading = true;           // EPOLLIN registered; off while out of download tokens
+        RateLimiter* download_limit = nullptr;
+        RateLimiter* upload_limit = nullptr;
+        EventLoop::TimerId read_timer = 0;   // Resumes reading
+        EventLoop::TimerId write_timer = 0;  // Resumes a send held back for tokens
+    };
+
+    void onEvent(Connection& conn, uint32_t events);
+    void onReadable(Connection& conn, bool hangup);
+    bool flush(Connection& conn);  // False once the connection failed
+    // One syscall for the chunk at the head of the queue; the bytes sent, or -1 with errno
+    ssize_t sendChunk(Connection& conn, Chunk& chunk, size_t length);
+    size_t nextSendLength(const Connection& conn) const;
+    void queueBytes(Connection& conn, std::vector<uint8_t>& data);
+    void readCompletions(Connection& conn);  // MSG_ZEROCOPY notifications on the error queue
+    void setWriting(Connection& conn, bool writing);
+    void setReading(Connection& conn, bool reading);
+    void updateEvents(Connection& conn);
+    void waitForTokens(Connection& conn, bool download);
+
+    EventLoop& loop;
+    std::vector<std::unique_ptr<Connection>> connections;  // Indexed by fd
+    std::vector<std::unique_ptr<Connection>> retired;      // Detached inside a callback
+    std::vector<uint8_t> recv_scratch;  // Handlers consume it synchronously
+};
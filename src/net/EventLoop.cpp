@@ -0,0 +1,186 @@
+#include "EventLoop.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        close(epoll_fd);
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
+    addFd(wake_fd, EPOLLIN, [this](uint32_t) {
+        uint64_t count;  // One read drains the whole counter
+        SyscallCounter::record();
+        ssize_t ignored = read(wake_fd, &count, sizeof(count));
+        (void)ignored;
+    });
+}
+
+EventLoop::~EventLoop() {
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::addFd(int fd, uint32_t events, FdCallback callback) {
+    if (fd >= static_cast<int>(handlers.size())) {
+        handlers.resize(fd + 1);
+    }
+    handlers[fd] = std::make_unique<Handler>(Handler{fd, std::move(callback)});
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = handlers[fd].get();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        handlers[fd].reset();
+        throw std::runtime_error("Failed to watch fd: " + std::string(strerror(errno)));
+    }
+}
+
+void EventLoop::modifyFd(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = handlers[fd].get();
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EventLoop::removeFd(int fd) {
+    if (fd < 0 || fd >= static_cast<int>(handlers.size()) || !handlers[fd]) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    // The handler may be the one running right now; keep it alive until the round ends
+    retired.push_back(std::move(handlers[fd]));
+}
+
+EventLoop::TimerId EventLoop::runAt(Clock::time_point when, Task task) {
+    TimerId id = next_timer_id++;
+    timers.push({when, id});
+    timer_tasks.emplace_back(id, std::move(task));  // Ids only grow, so this stays sorted
+    return id;
+}
+
+EventLoop::TimerId EventLoop::runAfter(Clock::duration delay, Task task) {
+    return runAt(Clock::now() + delay, std::move(task));
+}
+
+void EventLoop::cancelTimer(TimerId id) {
+    auto it = std::lower_bound(timer_tasks.begin(), timer_tasks.end(), id,
+        [](const auto& entry, TimerId value) { return entry.first < value; });
+    if (it != timer_tasks.end() && it->first == id) {
+        timer_tasks.erase(it);
+    }
+}
+
+void EventLoop::addPrepareHook(Task hook) {
+    prepare_hooks.push_back(std::move(hook));
+}
+
+void EventLoop::setWaiter(Waiter waiter) {
+    this->waiter = std::move(waiter);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        posted.push_back(std::move(task));
+    }
+    wake();
+}
+
+void EventLoop::stop() {
+    running = false;
+    wake();
+}
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    SyscallCounter::record();
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+int EventLoop::nextTimeoutMs() const {
+    if (timers.empty()) {
+        return -1;
+    }
+    auto delay = timers.top().when - Clock::now();
+    if (delay <= Clock::duration::zero()) {
+        return 0;
+    }
+    // Round up so a timer never fires early
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(delay).count());
+}
+
+void EventLoop::runTimers() {
+    auto now = Clock::now();
+    while (!timers.empty() && timers.top().when <= now) {
+        TimerId id = timers.top().id;
+        timers.pop();
+        auto it = std::lower_bound(timer_tasks.begin(), timer_tasks.end(), id,
+            [](const auto& entry, TimerId value) { return entry.first < value; });
+        if (it == timer_tasks.end() || it->first != id) {
+            continue;  // Cancelled
+        }
+        Task task = std::move(it->second);
+        timer_tasks.erase(it);
+        task();
+    }
+}
+
+void EventLoop::runPosted() {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        running_posted.swap(posted);
+    }
+    for (auto& task : running_posted) {
+        task();
+    }
+    running_posted.clear();
+}
+
+void EventLoop::run() {
+    const int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+    running = true;
+
+    while (running) {
+        for (auto& hook : prepare_hooks) {
+            hook();
+        }
+
+        int count = 0;
+        if (!waiter) {
+            SyscallCounter::record();
+            count = epoll_wait(epoll_fd, events, MAX_EVENTS, nextTimeoutMs());
+        } else if (waiter(epoll_fd, nextTimeoutMs())) {
+            SyscallCounter::record();
+            count = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+        }
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("epoll_wait failed: " + std::string(strerror(errno)));
+        }
+
+        for (int i = 0; i < count; ++i) {
+            auto* handler = static_cast<Handler*>(events[i].data.ptr);
+            // Skip handlers removed earlier in this round
+            if (handler->fd < static_cast<int>(handlers.size()) && handlers[handler->fd].get() == handler) {
+                handler->callback(events[i].events);
+            }
+        }
+        retired.clear();
+
+        runTimers();
+        runPosted();
+    }
+}
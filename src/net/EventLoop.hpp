@@ -0,0 +1,87 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+#include <queue>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Single-threaded epoll reactor: fd readiness callbacks, one-shot timers and
+// tasks posted from other threads (woken through an eventfd). Everything but
+// post() and stop() must be called on the loop thread.
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using FdCallback = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+    // Sleeps up to timeout_ms (-1: no limit) until epoll_fd may be readable,
+    // and says whether it is
+    using Waiter = std::function<bool(int epoll_fd, int timeout_ms)>;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void addFd(int fd, uint32_t events, FdCallback callback);
+    void modifyFd(int fd, uint32_t events);
+    void removeFd(int fd);
+
+    TimerId runAt(Clock::time_point when, Task task);
+    TimerId runAfter(Clock::duration delay, Task task);
+    void cancelTimer(TimerId id);
+
+    // Runs at the end of every round, before the loop sleeps; lets I/O backends
+    // batch what the round's callbacks queued into one submission
+    void addPrepareHook(Task hook);
+    // Takes over the loop's sleep, so a backend that enters the kernel each
+    // round anyway can wait there instead of paying for epoll_wait as well.
+    // epoll_wait then only runs, without blocking, when the waiter says so.
+    // At most one; nullptr restores the plain epoll_wait.
+    void setWaiter(Waiter waiter);
+
+    void post(Task task);  // Thread-safe
+    void run();            // Returns after stop()
+    void stop();           // Thread-safe
+
+private:
+    struct Handler {
+        int fd;
+        FdCallback callback;
+    };
+
+    struct Timer {
+        Clock::time_point when;
+        TimerId id;
+        bool operator>(const Timer& other) const {
+            return when != other.when ? when > other.when : id > other.id;
+        }
+    };
+
+    void wake();
+    void runTimers();
+    void runPosted();
+    int nextTimeoutMs() const;
+
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running{false};
+
+    std::vector<std::unique_ptr<Handler>> handlers;    // Indexed by fd
+    std::vector<std::unique_ptr<Handler>> retired;     // Freed after the current dispatch round
+
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::vector<std::pair<TimerId, Task>> timer_tasks;  // Sorted by id
+    TimerId next_timer_id = 1;
+
+    std::vector<Task> prepare_hooks;
+    Waiter waiter;
+
+    std::mutex posted_mutex;
+    std::vector<Task> posted;
+    std::vector<Task> running_posted;
+};
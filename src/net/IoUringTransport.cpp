@@ -0,0 +1,495 @@
+#include "IoUringTransport.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+
+namespace {
+const unsigned RING_ENTRIES = 256;
+const unsigned CQ_ENTRIES = 4096;          // Multishot RECV posts one CQE per chunk
+const unsigned BUFFER_COUNT = 256;         // Provided buffers; power of two
+const unsigned BUFFER_SIZE = 32 * 1024;
+const uint16_t BUFFER_GROUP = 0;
+const size_t MAX_CHAIN = 15;               // Segment index fits the user_data nibble
+const size_t COALESCE_LIMIT = 4096;        // Small frames are appended, not linked
+const size_t ZERO_COPY_THRESHOLD = 16 * 1024;  // Below this pinning pages costs more than copying
+const size_t MAX_SPARE_BUFFERS = 64;
+
+int ioUringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                 const void* arg = nullptr, size_t arg_size = 0) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+std::runtime_error systemError(const std::string& what, int error) {
+    return std::runtime_error(what + ": " + strerror(error));
+}
+}
+
+IoUringTransport::IoUringTransport(EventLoop& loop) : loop(loop) {
+    try {
+        setupRing();
+        setupBufferRing();
+    } catch (...) {
+        teardown();
+        throw;
+    }
+
+    loop.addPrepareHook([this]() { flushRound(); });
+    loop.setWaiter([this](int epoll_fd, int timeout_ms) { return wait(epoll_fd, timeout_ms); });
+}
+
+IoUringTransport::~IoUringTransport() {
+    // Sockets still attached are shut down so their RECVs terminate, then the
+    // ring is drained: the kernel must be done with our buffers before they go
+    for (auto& [fd, conn] : by_fd) {
+        conn->handler = nullptr;
+        shutdown(fd, SHUT_RDWR);
+    }
+    by_fd.clear();
+    submit();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    auto busy = [this]() {
+        return std::any_of(connections.begin(), connections.end(),
+            [](const auto& entry) { return entry.second->pending_cqes > 0; });
+    };
+    while (busy() && std::chrono::steady_clock::now() < deadline) {
+        __kernel_timespec timeout{0, 100 * 1000 * 1000};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        ioUringEnter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        reap();
+    }
+
+    loop.setWaiter(nullptr);
+    teardown();
+}
+
+void IoUringTransport::setupRing() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = CQ_ENTRIES;
+    ring_fd = ioUringSetup(RING_ENTRIES, &params);
+    if (ring_fd < 0) {
+        throw systemError("io_uring_setup failed", errno);
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        throw std::runtime_error("io_uring kernel features missing");
+    }
+
+    // SQ and CQ rings share one mapping
+    ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                         params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        ring = nullptr;
+        throw systemError("Failed to map io_uring", errno);
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQES);
+    if (sqe_map == MAP_FAILED) {
+        throw systemError("Failed to map io_uring SQEs", errno);
+    }
+    sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+    auto* base = static_cast<uint8_t*>(ring);
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = sq_submitted = *sq_tail;
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    // Opcodes this transport depends on
+    std::vector<uint8_t> probe_storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_storage.data());
+    if (ioUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        throw systemError("io_uring probe failed", errno);
+    }
+    auto supported = [probe](int op) {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+    if (!supported(IORING_OP_RECV) || !supported(IORING_OP_SEND)) {
+        throw std::runtime_error("io_uring lacks RECV/SEND");
+    }
+    if (!supported(IORING_OP_POLL_ADD)) {
+        throw std::runtime_error("io_uring lacks POLL_ADD");
+    }
+    zero_copy = supported(IORING_OP_SEND_ZC);
+}
+
+void IoUringTransport::setupBufferRing() {
+    buf_ring_size = BUFFER_COUNT * sizeof(io_uring_buf);
+    void* memory = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw systemError("Failed to allocate buffer ring", errno);
+    }
+    buf_ring = static_cast<io_uring_buf_ring*>(memory);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(memory);
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (ioUringRegister(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        throw systemError("Failed to register provided buffers", errno);
+    }
+
+    buffer_slab.resize(static_cast<size_t>(BUFFER_COUNT) * BUFFER_SIZE);
+    for (unsigned bid = 0; bid < BUFFER_COUNT; ++bid) {
+        recycleBuffer(bid);
+    }
+}
+
+void IoUringTransport::teardown() {
+    if (sqes) munmap(sqes, sqes_size);
+    if (ring) munmap(ring, ring_size);
+    if (buf_ring) munmap(buf_ring, buf_ring_size);
+    if (ring_fd >= 0) close(ring_fd);  // Unregisters the buffer ring
+    sqes = nullptr;
+    ring = nullptr;
+    buf_ring = nullptr;
+    ring_fd = -1;
+}
+
+io_uring_sqe* IoUringTransport::getSqe() {
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        submit();
+    }
+    unsigned slot = sq_local_tail & sq_mask;
+    io_uring_sqe* sqe = &sqes[slot];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[slot] = slot;
+    sq_local_tail++;
+    return sqe;
+}
+
+void IoUringTransport::submit() {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    while (sq_submitted != sq_local_tail) {
+        SyscallCounter::record();
+        int submitted = ioUringEnter(ring_fd, sq_local_tail - sq_submitted, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) return;  // CQ backlog; retried next round
+            throw systemError("io_uring_enter failed", errno);
+        }
+        sq_submitted += submitted;
+    }
+}
+
+void IoUringTransport::flushRound() {
+    for (Connection* conn : dirty) {
+        conn->dirty = false;
+        if (conn->handler && conn->in_flight.empty() && !conn->queued.empty()) {
+            submitChain(*conn);
+        }
+    }
+    dirty.clear();
+    // Submitted by wait(), in the call the loop sleeps in
+
+    // Detached connections go once the kernel has nothing left of theirs
+    std::erase_if(detached, [this](uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end() || it->second->pending_cqes == 0) {
+            if (it != connections.end()) {
+                recycleSegments(it->second->queued);
+                connections.erase(it);
+            }
+            return true;
+        }
+        return false;
+    });
+}
+
+bool IoUringTransport::wait(int epoll_fd, int timeout_ms) {
+    // One-shot, so re-arming checks the epoll instance's readiness afresh
+    if (!poll_armed) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epoll_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = userData(0, 0, OP_POLL);
+        poll_armed = true;
+    }
+
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail - sq_submitted;
+    bool reaped = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    bool sleep = timeout_ms != 0 && !reaped;
+    if (to_submit > 0 || sleep) {
+        __kernel_timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout_ms >= 0 ? reinterpret_cast<uint64_t>(&timeout) : 0;
+        SyscallCounter::record();
+        int submitted = ioUringEnter(ring_fd, to_submit, sleep ? 1 : 0,
+                                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (submitted >= 0) {
+            sq_submitted += submitted;
+        } else if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+            throw systemError("io_uring_enter failed", errno);
+        }
+        if (sq_submitted != sq_local_tail) {
+            submit();  // Cut short, e.g. by a CQ backlog
+        }
+    }
+
+    reap();
+    bool ready = epoll_ready;
+    epoll_ready = false;
+    return ready;
+}
+
+void IoUringTransport::reap() {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+        uint64_t id = cqe.user_data >> 8;
+        auto it = connections.find(id);
+        if ((cqe.user_data & 0xF) == OP_POLL) {
+            poll_armed = false;
+            epoll_ready = true;  // An error too: epoll_wait sorts it out
+        } else if (it == connections.end()) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+        } else if ((cqe.user_data & 0xF) == OP_RECV) {
+            onRecv(*it->second, cqe);
+        } else {
+            onSend(*it->second, cqe);
+        }
+
+        if (head == tail) {
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+void IoUringTransport::attach(int fd, TransportHandler* handler) {
+    uint64_t id = next_id++;
+    auto conn = std::make_unique<Connection>();
+    conn->id = id;
+    conn->fd = fd;
+    conn->handler = handler;
+    by_fd[fd] = conn.get();
+    armRecv(*conn);
+    connections[id] = std::move(conn);
+}
+
+void IoUringTransport::detach(int fd) {
+    auto it = by_fd.find(fd);
+    if (it == by_fd.end()) {
+        return;
+    }
+    Connection* conn = it->second;
+    by_fd.erase(it);
+    conn->handler = nullptr;
+    detached.push_back(conn->id);
+
+    // Unsubmitted SQEs name this fd, which the caller is about to close and the
+    // kernel may hand out again; and in-flight requests pin the socket open, so
+    // shut it down to make them complete
+    submit();
+    shutdown(fd, SHUT_RDWR);
+}
+
+void IoUringTransport::armRecv(Connection& conn) {
+    io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = userData(conn.id, 0, OP_RECV);
+    conn.pending_cqes++;
+}
+
+void IoUringTransport::onRecv(Connection& conn, const io_uring_cqe& cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn.pending_cqes--;  // Multishot ended
+    }
+
+    if (cqe.res > 0) {
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        stats.bytes_received += cqe.res;
+        if (conn.handler) {
+            conn.handler->onReceive(buffer_slab.data() + static_cast<size_t>(bid) * BUFFER_SIZE, cqe.res);
+        }
+        recycleBuffer(bid);
+        if (!more && conn.handler) {
+            armRecv(conn);
+        }
+    } else if (cqe.res == -ENOBUFS) {
+        // Every provided buffer was in use; they are back by now
+        if (!more && conn.handler) {
+            armRecv(conn);
+        }
+    } else if (conn.handler) {
+        conn.handler->onTransportError(cqe.res == 0 ? std::string("connection closed by peer")
+                                                    : "recv failed: " + std::string(strerror(-cqe.res)));
+    }
+}
+
+size_t IoUringTransport::queuedBytes(int fd) const {
+    const Connection& conn = *by_fd.at(fd);
+    size_t queued = 0;
+    for (const auto* segments : {&conn.in_flight, &conn.queued}) {
+        for (const Segment& segment : *segments) {
+            queued += segment.data.size() - segment.offset;
+        }
+    }
+    return queued;
+}
+
+void IoUringTransport::send(int fd, std::vector<uint8_t>& data) {
+    Connection& conn = *by_fd.at(fd);
+    if (!conn.queued.empty() && conn.queued.back().data.size() + data.size() <= COALESCE_LIMIT) {
+        auto& last = conn.queued.back().data;
+        last.insert(last.end(), data.begin(), data.end());
+        data.clear();
+    } else {
+        Segment& segment = conn.queued.emplace_back();
+        segment.data.swap(data);
+        if (!spare_buffers.empty()) {
+            data.swap(spare_buffers.back());
+            spare_buffers.pop_back();
+        }
+    }
+
+    if (!conn.dirty) {
+        conn.dirty = true;
+        dirty.push_back(&conn);
+    }
+}
+
+void IoUringTransport::submitChain(Connection& conn) {
+    size_t count = std::min(conn.queued.size(), MAX_CHAIN);
+    // A chain has to reach the kernel in one submission or its links break
+    if (sq_entries - (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) < count) {
+        submit();
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        conn.in_flight.push_back(std::move(conn.queued[i]));
+    }
+    conn.queued.erase(conn.queued.begin(), conn.queued.begin() + count);
+
+    for (size_t i = 0; i < count; ++i) {
+        Segment& segment = conn.in_flight[i];
+        size_t length = segment.data.size() - segment.offset;
+        bool use_zero_copy = zero_copy && length >= ZERO_COPY_THRESHOLD;
+
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = use_zero_copy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(segment.data.data() + segment.offset);
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;  // The kernel retries short sends
+        sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        sqe->user_data = userData(conn.id, i, OP_SEND);
+        conn.pending_cqes++;
+        conn.chain_cqes++;
+        if (use_zero_copy) {
+            stats.zero_copy_sends++;
+        }
+    }
+}
+
+void IoUringTransport::onSend(Connection& conn, const io_uring_cqe& cqe) {
+    // A request's last CQE is the one without F_MORE; SEND_ZC follows its
+    // result with a notification once the kernel let go of the pages
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        conn.pending_cqes--;
+        conn.chain_cqes--;
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_NOTIF)) {
+        Segment& segment = conn.in_flight[(cqe.user_data >> 4) & 0xF];
+        if (cqe.res > 0) {
+            segment.offset += cqe.res;
+            stats.bytes_sent += cqe.res;
+        } else if (cqe.res < 0 && cqe.res != -ECANCELED && conn.send_error.empty()) {
+            conn.send_error = strerror(-cqe.res);  // ECANCELED: an earlier link fell short
+        }
+    }
+
+    if (conn.chain_cqes == 0) {
+        finishChain(conn);
+    }
+}
+
+void IoUringTransport::finishChain(Connection& conn) {
+    if (!conn.send_error.empty()) {
+        std::string error = conn.send_error;
+        conn.send_error.clear();
+        recycleSegments(conn.in_flight);
+        if (conn.handler) {
+            conn.handler->onTransportError("send failed: " + error);
+        }
+        return;
+    }
+
+    // Whatever a broken link left unsent goes out first in the next chain
+    size_t unsent = 0;
+    for (auto& segment : conn.in_flight) {
+        if (segment.offset < segment.data.size()) {
+            conn.queued.insert(conn.queued.begin() + unsent++, std::move(segment));
+        }
+    }
+    recycleSegments(conn.in_flight);
+
+    if (conn.handler && !conn.queued.empty() && !conn.dirty) {
+        conn.dirty = true;
+        dirty.push_back(&conn);
+    }
+}
+
+void IoUringTransport::recycleSegments(std::vector<Segment>& segments) {
+    for (auto& segment : segments) {
+        if (segment.data.capacity() > 0 && spare_buffers.size() < MAX_SPARE_BUFFERS) {
+            segment.data.clear();
+            spare_buffers.push_back(std::move(segment.data));
+        }
+    }
+    segments.clear();
+}
+
+void IoUringTransport::recycleBuffer(uint16_t bid) {
+    // Entries start at offset 0; in C++ the uapi flex-array wrapper shifts `bufs` by 8
+    auto* entries = reinterpret_cast<io_uring_buf*>(buf_ring);
+    io_uring_buf& buf = entries[buf_ring_tail & (BUFFER_COUNT - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(buffer_slab.data() + static_cast<size_t>(bid) * BUFFER_SIZE);
+    buf.len = BUFFER_SIZE;
+    buf.bid = bid;
+    buf_ring_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <string>
+#include <linux/io_uring.h>
+#include "Transport.hpp"
+
+// Completion-based transport on a raw io_uring (no liburing). Every socket
+// keeps one multishot RECV armed that picks its buffers from a shared
+// provided-buffer ring, so the kernel fills pooled buffers without a syscall
+// per message. Output queued during a loop round goes out as one linked chain
+// of SENDs per socket (SEND_ZC for large buffers when the kernel has it), and
+// all sockets' submissions share a single io_uring_enter. That same call is
+// where the EventLoop sleeps: the transport is its waiter, and a POLL_ADD on
+// the loop's epoll instance wakes it for everything that isn't on the ring.
+class IoUringTransport : public Transport {
+public:
+    // Throws std::runtime_error if the kernel lacks what this transport needs
+    explicit IoUringTransport(EventLoop& loop);
+    ~IoUringTransport() override;
+
+    void attach(int fd, TransportHandler* handler) override;
+    void detach(int fd) override;
+    void send(int fd, std::vector<uint8_t>& data) override;
+    const char* name() const override { return "io_uring"; }
+    size_t queuedBytes(int fd) const override;
+
+private:
+    enum Op : uint64_t { OP_RECV = 1, OP_SEND = 2, OP_POLL = 3 };
+
+    struct Segment {
+        std::vector<uint8_t> data;
+        size_t offset = 0;  // Bytes already sent
+    };
+
+    struct Connection {
+        uint64_t id;
+        int fd;
+        TransportHandler* handler;
+        bool recv_armed = false;
+        int pending_cqes = 0;            // Outstanding completions of any kind
+        std::vector<Segment> queued;     // Waiting for the next chain
+        std::vector<Segment> in_flight;  // Current linked chain
+        int chain_cqes = 0;              // Completions the chain still owes
+        std::string send_error;          // First failure seen in the chain
+        bool dirty = false;              // On the submit list
+    };
+
+    void setupRing();
+    void setupBufferRing();
+    void teardown();
+    io_uring_sqe* getSqe();
+    void submit();
+    void flushRound();  // Prepare hook: one chain per dirty socket
+    bool wait(int epoll_fd, int timeout_ms);  // The loop's waiter: submits, sleeps and reaps in one call
+    void reap();
+    void armRecv(Connection& conn);
+    void submitChain(Connection& conn);
+    void onRecv(Connection& conn, const io_uring_cqe& cqe);
+    void onSend(Connection& conn, const io_uring_cqe& cqe);
+    void finishChain(Connection& conn);
+    void recycleSegments(std::vector<Segment>& segments);
+    void recycleBuffer(uint16_t bid);
+    // Connection id, segment index within the chain, operation
+    static uint64_t userData(uint64_t id, size_t segment, Op op) { return id << 8 | segment << 4 | op; }
+
+    EventLoop& loop;
+    int ring_fd = -1;
+    bool poll_armed = false;   // POLL_ADD on the loop's epoll instance pending
+    bool epoll_ready = false;  // It fired since the last wait
+    bool zero_copy = false;
+
+    // Submission / completion rings
+    void* ring = nullptr;  // SQ and CQ rings share one mapping
+    size_t ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;  // Prepared SQEs
+    unsigned sq_submitted = 0;   // Accepted by io_uring_enter
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    // Provided buffers for multishot RECV
+    io_uring_buf_ring* buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    uint16_t buf_ring_tail = 0;
+    std::vector<uint8_t> buffer_slab;
+
+    uint64_t next_id = 1;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;  // By id
+    std::unordered_map<int, Connection*> by_fd;                              // Attached only
+    std::vector<uint64_t> detached;  // Waiting for their last completion
+    std::vector<Connection*> dirty;
+    std::vector<std::vector<uint8_t>> spare_buffers;  // Recycled send capacity
+};
@@ -0,0 +1,277 @@
+#include "PeerConnector.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+// A non-blocking socket with a connect under way, or already connected when
+// in_progress comes back false. -1 with error set when the address can't be tried.
+int startConnect(const SocketAddress& address, bool& in_progress, std::string& error) {
+    int fd = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    SyscallCounter::record();
+    if (fd < 0) {
+        error = std::string("socket: ") + std::strerror(errno);
+        return -1;
+    }
+
+    // REQUESTs are tiny; don't let Nagle hold them back waiting for ACKs
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    int result = ::connect(fd, reinterpret_cast<const sockaddr*>(&address.storage), address.length);
+    SyscallCounter::record(2);
+    if (result < 0 && errno != EINPROGRESS) {
+        error = std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    in_progress = result < 0;
+    return fd;
+}
+
+// Outcome of a connect the socket reported writable for; empty when connected
+std::string connectError(int fd) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+    SyscallCounter::record();
+    return error == 0 ? "" : std::strerror(error);
+}
+}
+
+PeerConnector::PeerConnector(EventLoop& loop, size_t max_half_open, std::chrono::milliseconds timeout,
+                             ConnectedCallback on_connected, FailedCallback on_failed)
+    : loop(loop), max_half_open(std::max<size_t>(max_half_open, 1)), timeout(timeout),
+      on_connected(std::move(on_connected)), on_failed(std::move(on_failed)), resolver(loop) {
+}
+
+PeerConnector::~PeerConnector() {
+    takeRemaining();
+}
+
+void PeerConnector::add(const PeerEndpoint& peer) {
+    queued.push_back(peer);
+    startNext();
+}
+
+void PeerConnector::add(const std::vector<PeerEndpoint>& peers) {
+    queued.insert(queued.end(), peers.begin(), peers.end());
+    startNext();
+}
+
+std::vector<PeerEndpoint> PeerConnector::takeRemaining() {
+    std::vector<PeerEndpoint> remaining;
+    for (auto& [id, attempt] : attempts) {
+        for (const auto& [fd, index] : attempt.sockets) {
+            if (sockets.erase(fd)) {
+                loop.removeFd(fd);
+            }
+            close(fd);
+        }
+        loop.cancelTimer(attempt.timer);
+        if (attempt.next_timer != 0) {
+            loop.cancelTimer(attempt.next_timer);
+        }
+        remaining.push_back(attempt.peer);
+    }
+    attempts.clear();
+    remaining.insert(remaining.end(), queued.begin(), queued.end());
+    queued.clear();
+    return remaining;
+}
+
+void PeerConnector::startNext() {
+    // Callbacks may add candidates; the outer call picks them up
+    if (starting) {
+        return;
+    }
+    starting = true;
+    while (attempts.size() < max_half_open && !queued.empty()) {
+        PeerEndpoint peer = queued.front();
+        queued.pop_front();
+
+        // Holds its slot while a host name is looked up
+        uint64_t id = next_id++;
+        Attempt& attempt = attempts[id];
+        attempt.peer = peer;
+        attempt.timer = loop.runAfter(timeout, [this, id]() { finish(id, -1, "connect timed out"); });
+        resolver.resolve(peer, [this, id](std::vector<SocketAddress> addresses, const std::string& error) {
+            onResolved(id, std::move(addresses), error);
+        });
+    }
+    starting = false;
+}
+
+void PeerConnector::onResolved(uint64_t id, std::vector<SocketAddress> addresses, const std::string& error) {
+    auto it = attempts.find(id);
+    if (it == attempts.end()) {
+        return;  // Timed out or cancelled during the lookup
+    }
+    if (addresses.empty()) {
+        finish(id, -1, error);
+        return;
+    }
+    it->second.addresses = std::move(addresses);
+    startAddress(id);
+}
+
+void PeerConnector::startAddress(uint64_t id) {
+    Attempt& attempt = attempts.at(id);
+    attempt.next_timer = 0;
+    while (attempt.next_address < attempt.addresses.size()) {
+        size_t index = attempt.next_address++;
+        bool in_progress = false;
+        int fd = startConnect(attempt.addresses[index], in_progress, attempt.last_error);
+        if (fd < 0) {
+            continue;  // E.g. no route for this family: the next address goes at once
+        }
+        attempt.sockets.emplace_back(fd, index);
+        if (!in_progress) {
+            finish(id, fd, "");  // Loopback can connect on the spot
+            return;
+        }
+        sockets[fd] = id;
+        loop.addFd(fd, EPOLLOUT, [this, fd](uint32_t) { onWritable(fd); });
+        if (attempt.next_address < attempt.addresses.size()) {
+            attempt.next_timer = loop.runAfter(ATTEMPT_DELAY, [this, id]() { startAddress(id); });
+        }
+        return;
+    }
+    if (attempt.sockets.empty()) {
+        finish(id, -1, attempt.last_error);
+    }
+}
+
+void PeerConnector::onWritable(int fd) {
+    auto it = sockets.find(fd);
+    if (it == sockets.end()) {
+        return;
+    }
+    uint64_t id = it->second;
+    std::string error = connectError(fd);
+    if (error.empty()) {
+        finish(id, fd, "");
+        return;
+    }
+
+    // This address failed; the next one needn't wait out its delay
+    Attempt& attempt = attempts.at(id);
+    sockets.erase(it);
+    loop.removeFd(fd);
+    close(fd);
+    std::erase_if(attempt.sockets, [fd](const auto& socket) { return socket.first == fd; });
+    attempt.last_error = error;
+    if (attempt.next_timer != 0) {
+        loop.cancelTimer(attempt.next_timer);
+    }
+    startAddress(id);
+}
+
+void PeerConnector::finish(uint64_t id, int connected_fd, const std::string& error) {
+    auto it = attempts.find(id);
+    if (it == attempts.end()) {
+        return;
+    }
+    Attempt attempt = std::move(it->second);
+    attempts.erase(it);
+    loop.cancelTimer(attempt.timer);
+    if (attempt.next_timer != 0) {
+        loop.cancelTimer(attempt.next_timer);
+    }
+
+    // The losers of the race are closed
+    PeerEndpoint connected = attempt.peer;
+    for (const auto& [fd, index] : attempt.sockets) {
+        if (sockets.erase(fd)) {
+            loop.removeFd(fd);
+        }
+        if (fd == connected_fd) {
+            connected = PeerEndpoint::fromAddress(attempt.addresses[index].storage);
+        } else {
+            close(fd);
+        }
+    }
+
+    if (connected_fd >= 0) {
+        on_connected(attempt.peer, connected, connected_fd);
+    } else {
+        on_failed(attempt.peer, error);
+    }
+    startNext();
+}
+
+int PeerConnector::connectBlocking(const PeerEndpoint& peer, std::chrono::milliseconds timeout) {
+    using Clock = std::chrono::steady_clock;
+    std::string error;
+    std::vector<SocketAddress> addresses = peer.resolve(error);
+    auto deadline = Clock::now() + timeout;
+    auto next_start = Clock::now();
+    size_t next_address = 0;
+    std::vector<pollfd> pending;
+    int connected = -1;
+
+    while (connected < 0) {
+        auto now = Clock::now();
+        if (now >= deadline) {
+            error = "connect timed out";
+            break;
+        }
+        // The next address when its delay is up, or at once when nothing is in flight
+        if (next_address < addresses.size() && (now >= next_start || pending.empty())) {
+            bool in_progress = false;
+            int fd = startConnect(addresses[next_address++], in_progress, error);
+            if (fd >= 0 && !in_progress) {
+                connected = fd;
+            } else if (fd >= 0) {
+                pending.push_back({fd, POLLOUT, 0});
+                next_start = now + ATTEMPT_DELAY;
+            }
+            continue;
+        }
+        if (pending.empty()) {
+            break;  // Every address failed
+        }
+
+        auto wake = next_address < addresses.size() ? std::min(deadline, next_start) : deadline;
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+        SyscallCounter::record();
+        if (poll(pending.data(), pending.size(), static_cast<int>(wait.count())) < 0 && errno != EINTR) {
+            error = std::string("poll: ") + std::strerror(errno);
+            break;
+        }
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->revents == 0) {
+                ++it;
+                continue;
+            }
+            std::string result = connectError(it->fd);
+            if (result.empty() && connected < 0) {
+                connected = it->fd;
+            } else {
+                error = result.empty() ? error : result;
+                close(it->fd);
+                next_start = now;  // A failure hands over to the next address at once
+            }
+            it = pending.erase(it);
+        }
+    }
+    for (const auto& socket : pending) {
+        close(socket.fd);
+    }
+    if (connected < 0) {
+        throw std::runtime_error("Failed to connect to peer " + peer.toString() + ": " + error);
+    }
+
+    int flags = fcntl(connected, F_GETFL, 0);
+    fcntl(connected, F_SETFL, flags & ~O_NONBLOCK);  // The blocking paths read it directly
+    return connected;
+}
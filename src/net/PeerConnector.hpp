@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include "EventLoop.hpp"
+#include "PeerEndpoint.hpp"
+#include "Resolver.hpp"
+
+// Opens TCP connections to many peers at once from an event loop. Connects
+// are non-blocking; at most max_half_open peers are in flight and each one is
+// given up after the timeout, so dead addresses cost a slot, not the whole
+// startup. Host names are looked up off the loop, within the same timeout. A
+// peer with several addresses gets Happy Eyeballs: each address has a head
+// start on the next, and the first to connect wins.
+class PeerConnector {
+public:
+    // RFC 8305's Connection Attempt Delay
+    static constexpr std::chrono::milliseconds ATTEMPT_DELAY{250};
+    static constexpr std::chrono::milliseconds DEFAULT_TIMEOUT{5000};
+
+    // fd is connected, non-blocking and owned by the callee from here on. peer
+    // is as it was added; address is the one that answered, so host names
+    // come back resolved.
+    using ConnectedCallback = std::function<void(const PeerEndpoint& peer, const PeerEndpoint& address, int fd)>;
+    using FailedCallback = std::function<void(const PeerEndpoint& peer, const std::string& reason)>;
+
+    PeerConnector(EventLoop& loop, size_t max_half_open, std::chrono::milliseconds timeout,
+                  ConnectedCallback on_connected, FailedCallback on_failed);
+    ~PeerConnector();  // Closes the attempts still in flight
+    PeerConnector(const PeerConnector&) = delete;
+    PeerConnector& operator=(const PeerConnector&) = delete;
+
+    void add(const PeerEndpoint& peer);
+    // All queued before the first starts, so an early failure never finds the connector idle
+    void add(const std::vector<PeerEndpoint>& peers);
+    bool idle() const { return queued.empty() && attempts.empty(); }
+    // Cancels everything not yet connected and returns those peers
+    std::vector<PeerEndpoint> takeRemaining();
+
+    // The same race for the blocking paths; returns a connected blocking
+    // socket and throws when no address answers in time
+    static int connectBlocking(const PeerEndpoint& peer, std::chrono::milliseconds timeout = DEFAULT_TIMEOUT);
+
+private:
+    struct Attempt {
+        PeerEndpoint peer;
+        std::vector<SocketAddress> addresses;
+        size_t next_address = 0;
+        std::vector<std::pair<int, size_t>> sockets;  // Connects in flight: fd, address index
+        std::string last_error;
+        EventLoop::TimerId timer = 0;       // Gives up on the peer
+        EventLoop::TimerId next_timer = 0;  // Starts the next address
+    };
+
+    void startNext();
+    void onResolved(uint64_t id, std::vector<SocketAddress> addresses, const std::string& error);
+    void startAddress(uint64_t id);  // Connects to the next address, or fails the attempt when none is left
+    void onWritable(int fd);
+    void finish(uint64_t id, int connected_fd, const std::string& error);  // -1: failed with error
+
+    EventLoop& loop;
+    const size_t max_half_open;
+    const std::chrono::milliseconds timeout;
+    ConnectedCallback on_connected;
+    FailedCallback on_failed;
+    std::deque<PeerEndpoint> queued;
+    std::unordered_map<uint64_t, Attempt> attempts;
+    std::unordered_map<int, uint64_t> sockets;  // Connect in flight -> its attempt
+    uint64_t next_id = 1;
+    bool starting = false;
+    Resolver resolver;  // First to go: no lookup result outlives the attempts
+};
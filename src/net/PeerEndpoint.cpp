@@ -0,0 +1,150 @@
+#include "PeerEndpoint.hpp"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+std::string PeerEndpoint::toString() const {
+    std::string host = isV6() ? "[" + ip + "]" : ip;
+    return host + ":" + std::to_string(port);
+}
+
+bool PeerEndpoint::isHostName() const {
+    in6_addr address;
+    return !ip.empty() && inet_pton(AF_INET, ip.c_str(), &address) != 1 &&
+           inet_pton(AF_INET6, ip.c_str(), &address) != 1;
+}
+
+PeerEndpoint PeerEndpoint::fromAddress(const sockaddr_storage& address) {
+    char text[INET6_ADDRSTRLEN] = "";
+    if (address.ss_family == AF_INET6) {
+        const auto& v6 = reinterpret_cast<const sockaddr_in6&>(address);
+        if (IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr)) {
+            inet_ntop(AF_INET, v6.sin6_addr.s6_addr + 12, text, sizeof(text));
+        } else {
+            inet_ntop(AF_INET6, &v6.sin6_addr, text, sizeof(text));
+        }
+        return {text, ntohs(v6.sin6_port)};
+    }
+    const auto& v4 = reinterpret_cast<const sockaddr_in&>(address);
+    inet_ntop(AF_INET, &v4.sin_addr, text, sizeof(text));
+    return {text, ntohs(v4.sin_port)};
+}
+
+std::vector<SocketAddress> PeerEndpoint::resolve(std::string& error) const {
+    if (port <= 0 || port > 65535) {
+        error = "invalid port";
+        return {};
+    }
+
+    // Literals, which is all trackers hand out, skip the resolver
+    SocketAddress address;
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&address.storage);
+    if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        address.length = sizeof(sockaddr_in);
+        return {address};
+    }
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+    if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        address.length = sizeof(sockaddr_in6);
+        return {address};
+    }
+    if (ip.empty()) {
+        error = "invalid address";
+        return {};
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* results = nullptr;
+    int status = getaddrinfo(ip.c_str(), std::to_string(port).c_str(), &hints, &results);
+    if (status != 0) {
+        error = gai_strerror(status);
+        return {};
+    }
+    std::vector<SocketAddress> by_family[2];  // IPv6, IPv4
+    for (addrinfo* result = results; result; result = result->ai_next) {
+        if ((result->ai_family != AF_INET && result->ai_family != AF_INET6) ||
+            result->ai_addrlen > sizeof(sockaddr_storage)) {
+            continue;
+        }
+        SocketAddress resolved;
+        std::memcpy(&resolved.storage, result->ai_addr, result->ai_addrlen);
+        resolved.length = result->ai_addrlen;
+        by_family[result->ai_family == AF_INET6 ? 0 : 1].push_back(resolved);
+    }
+    freeaddrinfo(results);
+
+    std::vector<SocketAddress> addresses;
+    for (size_t i = 0; i < std::max(by_family[0].size(), by_family[1].size()); i++) {
+        for (const auto& family : by_family) {
+            if (i < family.size()) {
+                addresses.push_back(family[i]);
+            }
+        }
+    }
+    if (addresses.empty()) {
+        error = "no usable address";
+    }
+    return addresses;
+}
+
+PeerEndpoint PeerEndpoint::parse(const std::string& text) {
+    PeerEndpoint peer;
+    size_t colon_pos;
+    if (!text.empty() && text[0] == '[') {
+        size_t close_pos = text.find("]:");
+        if (close_pos == std::string::npos) {
+            throw std::runtime_error("Invalid peer address format. Expected: [<ipv6>]:<port>");
+        }
+        peer.ip = text.substr(1, close_pos - 1);
+        colon_pos = close_pos + 1;
+    } else {
+        colon_pos = text.find(':');
+        if (colon_pos == std::string::npos || text.find(':', colon_pos + 1) != std::string::npos) {
+            throw std::runtime_error("Invalid peer address format. Expected: <ip>:<port>");
+        }
+        peer.ip = text.substr(0, colon_pos);
+    }
+    peer.port = std::stoi(text.substr(colon_pos + 1));
+    return peer;
+}
+
+std::vector<PeerEndpoint> PeerEndpoint::parseCompact(const std::string& data, bool v6) {
+    const size_t address_length = v6 ? 16 : 4;
+    const size_t entry_length = address_length + 2;
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+
+    std::vector<PeerEndpoint> peers;
+    peers.reserve(data.size() / entry_length);
+    for (size_t offset = 0; offset + entry_length <= data.size(); offset += entry_length) {
+        char text[INET6_ADDRSTRLEN];
+        inet_ntop(v6 ? AF_INET6 : AF_INET, bytes + offset, text, sizeof(text));
+        int port = bytes[offset + address_length] << 8 | bytes[offset + address_length + 1];
+        peers.push_back({text, port});
+    }
+    return peers;
+}
+
+std::string PeerEndpoint::toCompact(const std::vector<PeerEndpoint>& peers, bool v6) {
+    const size_t address_length = v6 ? 16 : 4;
+    std::string data;
+    for (const auto& peer : peers) {
+        unsigned char entry[18];
+        if (peer.isV6() != v6 || peer.port <= 0 || peer.port > 65535 ||
+            inet_pton(v6 ? AF_INET6 : AF_INET, peer.ip.c_str(), entry) != 1) {
+            continue;
+        }
+        entry[address_length] = peer.port >> 8;
+        entry[address_length + 1] = peer.port & 0xFF;
+        data.append(reinterpret_cast<const char*>(entry), address_length + 2);
+    }
+    return data;
+}
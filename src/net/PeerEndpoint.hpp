@@ -0,0 +1,37 @@
+#pragma once
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+// One socket address of a peer, ready for connect()
+struct SocketAddress {
+    sockaddr_storage storage{};
+    socklen_t length = 0;
+    int family() const { return storage.ss_family; }
+};
+
+// Where a peer listens: an IPv4 or IPv6 literal, or a host name from a user
+// or a dictionary-model tracker response, and a port
+struct PeerEndpoint {
+    std::string ip;  // IPv6 without brackets
+    int port = 0;
+
+    bool isV6() const { return ip.find(':') != std::string::npos; }
+    bool isHostName() const;  // Not an address literal, so resolve() would ask the resolver
+    std::string toString() const;  // ip:port, IPv6 as [ip]:port
+    // The addresses to try: a literal as it is, a host name through the
+    // resolver with the families interleaved, IPv6 first (RFC 8305).
+    // Empty, with error set, when there is none.
+    std::vector<SocketAddress> resolve(std::string& error) const;
+
+    // What a socket call returned; IPv4-mapped IPv6 comes back as plain IPv4
+    static PeerEndpoint fromAddress(const sockaddr_storage& address);
+    // "ip:port", "[ipv6]:port" or "host:port"
+    static PeerEndpoint parse(const std::string& text);
+    // Compact tracker lists: 6 bytes per IPv4 peer ("peers"), 18 per IPv6 peer ("peers6")
+    static std::vector<PeerEndpoint> parseCompact(const std::string& data, bool v6);
+    // The reverse, for the peers of that family; host names are left out
+    static std::string toCompact(const std::vector<PeerEndpoint>& peers, bool v6);
+
+    bool operator==(const PeerEndpoint&) const = default;
+};
@@ -0,0 +1,89 @@
+#include "PeerListener.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+const int BACKLOG = 128;
+
+int bindListener(int family, int port) {
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_storage address{};
+    socklen_t length;
+    if (family == AF_INET6) {
+        int off = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        auto& v6 = reinterpret_cast<sockaddr_in6&>(address);
+        v6.sin6_family = AF_INET6;
+        v6.sin6_addr = in6addr_any;
+        v6.sin6_port = htons(port);
+        length = sizeof(v6);
+    } else {
+        auto& v4 = reinterpret_cast<sockaddr_in&>(address);
+        v4.sin_family = AF_INET;
+        v4.sin_addr.s_addr = htonl(INADDR_ANY);
+        v4.sin_port = htons(port);
+        length = sizeof(v4);
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), length) < 0 || listen(fd, BACKLOG) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+}
+
+PeerListener::PeerListener(EventLoop& loop, int port, AcceptCallback on_accept)
+    : loop(loop), on_accept(std::move(on_accept)) {
+    fd = bindListener(AF_INET6, port);
+    if (fd < 0 && (errno == EAFNOSUPPORT || errno == EADDRNOTAVAIL)) {
+        fd = bindListener(AF_INET, port);
+    }
+    if (fd < 0) {
+        throw std::runtime_error("Failed to listen on port " + std::to_string(port) + ": " + strerror(errno));
+    }
+
+    sockaddr_storage bound{};
+    socklen_t length = sizeof(bound);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&bound), &length);
+    this->port = PeerEndpoint::fromAddress(bound).port;
+    loop.addFd(fd, EPOLLIN, [this](uint32_t) { onReadable(); });
+}
+
+PeerListener::~PeerListener() {
+    loop.removeFd(fd);
+    close(fd);
+}
+
+void PeerListener::onReadable() {
+    while (true) {
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        SyscallCounter::record();
+        int peer_fd = accept4(fd, reinterpret_cast<sockaddr*>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (peer_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;  // EAGAIN, or out of descriptors until some close
+        }
+        int nodelay = 1;
+        setsockopt(peer_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        on_accept(peer_fd, PeerEndpoint::fromAddress(address));
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <functional>
+#include "EventLoop.hpp"
+#include "PeerEndpoint.hpp"
+
+// Accepts inbound peer connections on a TCP port from an event loop. Binds
+// dual-stack where the host has IPv6 and IPv4 only otherwise, so IPv4 peers
+// arrive as plain dotted addresses either way. Loop thread only.
+class PeerListener {
+public:
+    // fd is non-blocking, with Nagle off, and owned by the callee
+    using AcceptCallback = std::function<void(int fd, const PeerEndpoint& peer)>;
+
+    // Port 0 picks a free one; throws std::runtime_error when it can't bind
+    PeerListener(EventLoop& loop, int port, AcceptCallback on_accept);
+    ~PeerListener();
+    PeerListener(const PeerListener&) = delete;
+    PeerListener& operator=(const PeerListener&) = delete;
+
+    int getPort() const { return port; }
+
+private:
+    void onReadable();
+
+    EventLoop& loop;
+    AcceptCallback on_accept;
+    int fd = -1;
+    int port = 0;
+};
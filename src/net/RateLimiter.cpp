@@ -0,0 +1,84 @@
+#include "RateLimiter.hpp"
+#include <algorithm>
+
+namespace {
+double burstOf(double rate) {
+    return std::max(rate * std::chrono::duration<double>(RateLimiter::BURST).count(),
+                    static_cast<double>(RateLimiter::MIN_BURST));
+}
+}
+
+RateLimiter& RateLimiter::global(Direction direction) {
+    static RateLimiter download;
+    static RateLimiter upload;
+    return direction == DOWNLOAD ? download : upload;
+}
+
+RateLimiter::RateLimiter(RateLimiter* parent, double rate)
+    : parent(parent), rate(std::max(rate, 0.0)), tokens(burstOf(this->rate)), updated(Clock::now()) {
+}
+
+void RateLimiter::setRate(double bytes_per_second) {
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(Clock::now());
+    rate = std::max(bytes_per_second, 0.0);
+    tokens = std::min(tokens, burstOf(rate));
+}
+
+double RateLimiter::getRate() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rate;
+}
+
+size_t RateLimiter::available(size_t wanted) {
+    auto now = Clock::now();
+    for (RateLimiter* level = this; level && wanted > 0; level = level->parent) {
+        std::lock_guard<std::mutex> lock(level->mutex);
+        if (level->rate == 0) {
+            continue;
+        }
+        level->refill(now);
+        wanted = level->tokens <= 0 ? 0 : std::min<size_t>(wanted, static_cast<size_t>(level->tokens));
+    }
+    return wanted;
+}
+
+void RateLimiter::consume(size_t bytes) {
+    auto now = Clock::now();
+    for (RateLimiter* level = this; level; level = level->parent) {
+        std::lock_guard<std::mutex> lock(level->mutex);
+        level->consumed += bytes;
+        if (level->rate > 0) {
+            level->refill(now);
+            level->tokens -= bytes;
+        }
+    }
+}
+
+RateLimiter::Clock::time_point RateLimiter::readyAt(size_t bytes) {
+    auto now = Clock::now();
+    double wait = 0;  // Seconds
+    for (RateLimiter* level = this; level; level = level->parent) {
+        std::lock_guard<std::mutex> lock(level->mutex);
+        if (level->rate == 0) {
+            continue;
+        }
+        level->refill(now);
+        // More than a burst never collects; waiting for one is enough
+        double wanted = std::min(static_cast<double>(bytes), burstOf(level->rate));
+        wait = std::max(wait, (wanted - level->tokens) / level->rate);
+    }
+    return now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(wait));
+}
+
+uint64_t RateLimiter::getBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return consumed;
+}
+
+void RateLimiter::refill(Clock::time_point now) {
+    if (now > updated) {
+        tokens = std::min(tokens + rate * std::chrono::duration<double>(now - updated).count(), burstOf(rate));
+        updated = now;
+    }
+}
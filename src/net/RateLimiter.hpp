@@ -0,0 +1,47 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Token bucket for one direction of traffic, in bytes per second. Buckets
+// nest: what a peer's bucket lets through also comes out of its torrent's and
+// the global one, so the tightest level on the path decides. An unused bucket
+// keeps at most BURST worth of tokens, so a quiet link can't save up for a
+// spike. Rates may change at any time from any thread; 0 is unlimited.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::chrono::milliseconds BURST{100};
+    static constexpr size_t MIN_BURST = 16 * 1024;  // A whole block, however low the rate
+
+    enum Direction { DOWNLOAD, UPLOAD };
+    // Process-wide caps, parents of every torrent's buckets
+    static RateLimiter& global(Direction direction);
+
+    explicit RateLimiter(RateLimiter* parent = nullptr, double rate = 0);
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    void setRate(double bytes_per_second);
+    double getRate() const;
+    // Up to wanted bytes the whole chain lets through now
+    size_t available(size_t wanted);
+    // Takes bytes from the whole chain; a bucket may go into debt when
+    // several users raced for the same tokens, which the next ones pay off
+    void consume(size_t bytes);
+    // When the chain will have bytes, if nobody else takes any meanwhile
+    Clock::time_point readyAt(size_t bytes);
+    uint64_t getBytes() const;  // Consumed in total
+
+private:
+    void refill(Clock::time_point now);  // Caller holds mutex
+
+    RateLimiter* const parent;
+    mutable std::mutex mutex;
+    double rate;
+    double tokens = 0;
+    Clock::time_point updated;
+    uint64_t consumed = 0;
+};
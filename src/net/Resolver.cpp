@@ -0,0 +1,34 @@
+#include "Resolver.hpp"
+
+Resolver::Resolver(EventLoop& loop) : loop(loop), lifetime(std::make_shared<int>(0)) {
+}
+
+Resolver::~Resolver() {
+    lifetime.reset();  // Queued lookups are skipped, not waited for
+    lookups.reset();
+}
+
+void Resolver::resolve(const PeerEndpoint& peer, Callback callback) {
+    if (!peer.isHostName()) {
+        std::string error;
+        std::vector<SocketAddress> addresses = peer.resolve(error);
+        callback(std::move(addresses), error);
+        return;
+    }
+    if (!lookups) {
+        lookups = std::make_unique<ThreadPool>(LOOKUP_THREADS);
+    }
+    std::weak_ptr<int> alive = lifetime;
+    lookups->submit([this, alive, peer, callback = std::move(callback)]() {
+        if (alive.expired()) {
+            return;
+        }
+        std::string error;
+        std::vector<SocketAddress> addresses = peer.resolve(error);
+        loop.post([alive, callback, addresses = std::move(addresses), error]() {
+            if (!alive.expired()) {
+                callback(addresses, error);
+            }
+        });
+    });
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "EventLoop.hpp"
+#include "PeerEndpoint.hpp"
+#include "../utils/ThreadPool.hpp"
+
+// Turns peer endpoints into socket addresses without blocking the loop:
+// literals on the spot, host names through getaddrinfo on worker threads,
+// with the result posted back. Loop thread only.
+class Resolver {
+public:
+    static constexpr size_t LOOKUP_THREADS = 2;
+
+    // Empty addresses come with the reason
+    using Callback = std::function<void(std::vector<SocketAddress> addresses, const std::string& error)>;
+
+    explicit Resolver(EventLoop& loop);
+    ~Resolver();  // Waits for lookups under way; their results are dropped
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // Calls back before returning unless the peer is a host name
+    void resolve(const PeerEndpoint& peer, Callback callback);
+
+private:
+    EventLoop& loop;
+    std::shared_ptr<int> lifetime;  // Lookups that finish after it expires are dropped
+    std::unique_ptr<ThreadPool> lookups;  // Started by the first host name
+};
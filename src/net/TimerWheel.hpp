@@ -0,0 +1,86 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include "EventLoop.hpp"
+
+// Hashed timing wheel for deadlines that are numerous, short and mostly moot
+// by the time they come due, such as one per block request. Scheduling is
+// O(1) and never touches the heap once the slots have grown; nothing is
+// removed early, so the callback checks whether an entry still matters.
+// Deadlines past the wheel's span go round again. Loop thread only.
+template <typename Entry>
+class TimerWheel {
+public:
+    using Clock = EventLoop::Clock;
+    using ExpiredCallback = std::function<void(const Entry&)>;
+
+    TimerWheel(EventLoop& loop, Clock::duration tick, size_t slot_count, ExpiredCallback on_expired)
+        : loop(loop), tick(tick), slots(std::max<size_t>(slot_count, 2)), on_expired(std::move(on_expired)) {
+    }
+
+    ~TimerWheel() {
+        if (timer != 0) {
+            loop.cancelTimer(timer);
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    void schedule(Clock::time_point deadline, const Entry& entry) {
+        if (timer == 0 && !advancing) {
+            slot_start = Clock::now();
+            timer = loop.runAt(slot_start + tick, [this]() { advance(); });
+        }
+        // Never the current slot: it has already started expiring
+        auto ticks = (deadline - slot_start + tick - Clock::duration(1)) / tick;
+        size_t offset = std::clamp<decltype(ticks)>(ticks, 1, slots.size() - 1);
+        slots[(current + offset) % slots.size()].push_back({deadline, entry});
+        count++;
+    }
+
+    size_t size() const { return count; }
+
+private:
+    struct Scheduled {
+        Clock::time_point deadline;
+        Entry entry;
+    };
+
+    void advance() {
+        timer = 0;
+        advancing = true;
+        auto now = Clock::now();
+        // A busy loop may fire late; catch up on every slot that has passed
+        while (slot_start + tick <= now && count > 0) {
+            current = (current + 1) % slots.size();
+            slot_start += tick;
+            expiring.swap(slots[current]);
+            count -= expiring.size();
+            for (const auto& scheduled : expiring) {
+                if (scheduled.deadline > now) {
+                    schedule(scheduled.deadline, scheduled.entry);  // Beyond the span: another lap
+                } else {
+                    on_expired(scheduled.entry);
+                }
+            }
+            expiring.clear();
+        }
+        advancing = false;
+        if (count > 0) {
+            timer = loop.runAt(slot_start + tick, [this]() { advance(); });
+        }
+    }
+
+    EventLoop& loop;
+    const Clock::duration tick;
+    std::vector<std::vector<Scheduled>> slots;
+    std::vector<Scheduled> expiring;  // Swapped with a due slot, so capacities circulate
+    ExpiredCallback on_expired;
+    size_t current = 0;
+    size_t count = 0;
+    Clock::time_point slot_start;  // When the current slot began
+    EventLoop::TimerId timer = 0;
+    bool advancing = false;  // Callbacks may schedule; the timer is re-armed afterwards
+};
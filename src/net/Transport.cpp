@@ -0,0 +1,15 @@
+#include "Transport.hpp"
+#include "EpollTransport.hpp"
+#include "IoUringTransport.hpp"
+#include <iostream>
+
+std::unique_ptr<Transport> Transport::create(EventLoop& loop, bool prefer_io_uring) {
+    if (prefer_io_uring) {
+        try {
+            return std::make_unique<IoUringTransport>(loop);
+        } catch (const std::exception& e) {
+            std::cerr << "io_uring unavailable (" << e.what() << "), falling back to epoll" << std::endl;
+        }
+    }
+    return std::make_unique<EpollTransport>(loop);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+#include "EventLoop.hpp"
+#include "RateLimiter.hpp"
+
+// What a transport reports back to the session that owns a socket. Called on
+// the loop thread; a handler may detach itself from inside any callback.
+class TransportHandler {
+public:
+    virtual ~TransportHandler() = default;
+    virtual void onReceive(const uint8_t* data, size_t length) = 0;
+    virtual void onTransportError(const std::string& reason) = 0;
+
+    // Where the next bytes of the stream belong, when the handler already
+    // knows (the rest of a block). A transport that can receives them there,
+    // reports them with onReceivedInto, then passes whatever followed them to
+    // onReceive, possibly nothing.
+    struct ReceiveTarget {
+        uint8_t* data = nullptr;
+        size_t length = 0;
+    };
+    virtual ReceiveTarget receiveTarget() { return {}; }
+    virtual void onReceivedInto(size_t) {}
+};
+
+// Socket I/O for the peer sessions of one event loop. Sessions frame messages
+// into byte buffers; the transport decides how those reach the kernel.
+class Transport {
+public:
+    struct Stats {
+        uint64_t bytes_received = 0;
+        uint64_t bytes_sent = 0;
+        uint64_t zero_copy_sends = 0;
+        uint64_t zero_copy_copied = 0;  // Zero-copy sends the kernel copied after all, e.g. over loopback
+        uint64_t file_sends = 0;        // sendfile calls
+    };
+
+    virtual ~Transport() = default;
+
+    virtual void attach(int fd, TransportHandler* handler) = 0;
+    // Stops delivering callbacks for fd; the caller closes the socket afterwards
+    virtual void detach(int fd) = 0;
+    // Takes the contents of data, which is left empty (with recycled capacity).
+    // Bytes go out in call order.
+    virtual void send(int fd, std::vector<uint8_t>& data) = 0;
+    virtual const char* name() const = 0;
+    // Output queued for fd that the kernel hasn't taken yet, so senders can
+    // bound what a slow reader makes them hold
+    virtual size_t queuedBytes(int) const { return 0; }
+
+    // Bulk payloads that skip user space. Each queues header (taken like
+    // send's data) and then the payload, in call order with the other sends.
+    // sendFile sends length bytes of file_fd from offset out of the page
+    // cache; file_fd must stay open until fd is detached. sendReferenced
+    // sends data by reference, with MSG_ZEROCOPY where the socket allows;
+    // data must stay mapped and unchanged until fd is detached, as a read-only
+    // file mapping does.
+    virtual bool supportsFileSend() const { return false; }
+    virtual void sendFile(int, std::vector<uint8_t>&, int, off_t, size_t) {}
+    virtual void sendReferenced(int, std::vector<uint8_t>&, const uint8_t*, size_t) {}
+    virtual Stats getStats() const { return stats; }
+
+    // Paces fd's traffic through these buckets, either of which may be null.
+    // Reads stop while the download bucket is empty, so the peer's TCP window
+    // closes instead of data piling up here.
+    virtual bool supportsRateLimits() const { return false; }
+    virtual void setRateLimits(int, RateLimiter*, RateLimiter*) {}
+
+    // io_uring when requested and the kernel supports it, epoll otherwise
+    static std::unique_ptr<Transport> create(EventLoop& loop, bool prefer_io_uring);
+
+protected:
+    Stats stats;
+};
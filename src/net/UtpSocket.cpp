@@ -0,0 +1,1034 @@
+#include "UtpSocket.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+enum PacketType : uint8_t { ST_DATA = 0, ST_FIN = 1, ST_STATE = 2, ST_RESET = 3, ST_SYN = 4 };
+const uint8_t VERSION = 1;
+const uint8_t EXTENSION_SACK = 1;
+const size_t MAX_SACK_BYTES = 32;  // Covers the 256 packets past the cumulative ACK
+const size_t MAX_REORDER = 1024;   // Packets held past a gap, and so also in flight
+const size_t RECEIVE_BATCH = 32;
+const size_t DATAGRAM_CAPACITY = 2048;
+const int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+const double SLOW_START_PACING_GAIN = 2.0;
+const double PACING_GAIN = 1.25;
+const size_t PACING_BURST = 4 * UtpSocket::PACKET_SIZE;
+// Tokens kept for sends that wait on the loop's millisecond timers
+const std::chrono::duration<double> PACING_HORIZON{0.002};
+
+void put16(uint8_t* out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value & 0xff;
+}
+
+void put32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = (value >> 16) & 0xff;
+    out[2] = (value >> 8) & 0xff;
+    out[3] = value & 0xff;
+}
+
+uint16_t get16(const uint8_t* data) {
+    return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+uint32_t get32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+// Sequence numbers wrap at 16 bits, timestamps at 32
+bool seqBefore(uint16_t a, uint16_t b) {
+    return static_cast<int16_t>(a - b) < 0;
+}
+
+bool delayBefore(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) < 0;
+}
+
+uint32_t microseconds(EventLoop::Clock::time_point time) {
+    return static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count());
+}
+}
+
+void UtpSocket::DelayHistory::add(uint32_t sample, Clock::time_point now) {
+    if (base_filled == 0) {
+        base[0] = sample;
+        base_filled = 1;
+        minute_started = now;
+    } else if (now - minute_started >= std::chrono::minutes(1)) {
+        base_current = (base_current + 1) % BASE_HISTORY;
+        base[base_current] = sample;
+        base_filled = std::min(base_filled + 1, BASE_HISTORY);
+        minute_started = now;
+    } else if (delayBefore(sample, base[base_current])) {
+        base[base_current] = sample;
+    }
+    recent[recent_next] = sample;
+    recent_next = (recent_next + 1) % RECENT_DELAYS;
+    recent_filled = std::min(recent_filled + 1, RECENT_DELAYS);
+}
+
+uint32_t UtpSocket::DelayHistory::queuingDelay() const {
+    if (recent_filled == 0) {
+        return 0;
+    }
+    uint32_t lowest = base[0];
+    for (size_t i = 1; i < base_filled; ++i) {
+        lowest = delayBefore(base[i], lowest) ? base[i] : lowest;
+    }
+    uint32_t current = recent[0];
+    for (size_t i = 1; i < recent_filled; ++i) {
+        current = delayBefore(recent[i], current) ? recent[i] : current;
+    }
+    return delayBefore(lowest, current) ? current - lowest : 0;
+}
+
+UtpSocket::UtpSocket(EventLoop& loop, int requested_port)
+    : loop(loop), receive_buffers(RECEIVE_BATCH * DATAGRAM_CAPACITY) {
+    // Dual-stack where the host has IPv6, so one socket reaches peers of both families
+    SocketAddress local;
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        family = AF_INET6;
+        int v6_only = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+        auto* v6 = reinterpret_cast<sockaddr_in6*>(&local.storage);
+        v6->sin6_family = AF_INET6;
+        v6->sin6_addr = in6addr_any;
+        v6->sin6_port = htons(requested_port);
+        local.length = sizeof(sockaddr_in6);
+    } else {
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        family = AF_INET;
+        auto* v4 = reinterpret_cast<sockaddr_in*>(&local.storage);
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = htonl(INADDR_ANY);
+        v4->sin_port = htons(requested_port);
+        local.length = sizeof(sockaddr_in);
+    }
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&local.storage), local.length) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&local.storage), &local.length) < 0) {
+        std::string error = strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("Failed to open uTP socket: " + error);
+    }
+    port = PeerEndpoint::fromAddress(local.storage).port;
+
+    // Every peer shares these buffers; a window's worth of bursts must fit
+    int buffer_size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    // ICMP port unreachable fails a connect at once instead of at its timeout
+    int receive_errors = 1;
+    setsockopt(fd, IPPROTO_IP, IP_RECVERR, &receive_errors, sizeof(receive_errors));
+    if (family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_RECVERR, &receive_errors, sizeof(receive_errors));
+    }
+
+    loop.addFd(fd, EPOLLIN, [this](uint32_t events) {
+        if (events & EPOLLERR) {
+            onErrors();
+        }
+        onReadable();
+    });
+    loop.addPrepareHook([this]() { retired.clear(); });
+}
+
+UtpSocket::~UtpSocket() {
+    loop.removeFd(fd);
+    if (wake_timer != 0) {
+        loop.cancelTimer(wake_timer);
+    }
+    if (shim_timer != 0) {
+        loop.cancelTimer(shim_timer);
+    }
+    for (auto& [handle, conn] : connections) {
+        if (conn->connect_timer != 0) {
+            loop.cancelTimer(conn->connect_timer);
+        }
+        if (conn->state == State::SYN_SENT) {
+            ::close(handle);  // Never handed out
+        }
+    }
+    ::close(fd);
+}
+
+void UtpSocket::connect(const SocketAddress& remote, std::chrono::milliseconds timeout, ConnectCallback callback) {
+    SocketAddress address = normalize(remote);
+    if (address.length == 0) {
+        callback(-1, "address family not supported");
+        return;
+    }
+    int handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handle < 0) {
+        callback(-1, std::string("eventfd: ") + strerror(errno));
+        return;
+    }
+
+    auto owned = std::make_unique<Connection>();
+    Connection& conn = *owned;
+    conn.handle = handle;
+    conn.remote = address;
+    conn.on_connect = std::move(callback);
+    do {
+        conn.recv_id = static_cast<uint16_t>(random());
+        conn.route = routeKey(address, conn.recv_id);
+    } while (routes.contains(conn.route));
+    conn.send_id = conn.recv_id + 1;
+    conn.seq_nr = static_cast<uint16_t>(random());
+    routes[conn.route] = &conn;
+    connections[handle] = std::move(owned);
+
+    conn.connect_timer = loop.runAfter(timeout, [this, handle]() {
+        auto it = connections.find(handle);
+        if (it != connections.end() && it->second->state == State::SYN_SENT) {
+            it->second->connect_timer = 0;
+            finishConnect(*it->second, "connect timed out");
+        }
+    });
+    Packet& syn = conn.in_flight.emplace_back();
+    syn.seq = conn.seq_nr++;
+    syn.type = ST_SYN;
+    sendPacket(conn, syn, Clock::now());
+    arm(conn);
+}
+
+void UtpSocket::setHandler(int handle, TransportHandler* handler) {
+    auto it = connections.find(handle);
+    if (it == connections.end()) {
+        return;
+    }
+    it->second->handler = handler;
+    if (!it->second->unread.empty() || !it->second->error.empty()) {
+        // Not from inside the caller's attach
+        loop.post([this, handle]() { deliverPending(handle); });
+    }
+}
+
+void UtpSocket::deliverPending(int handle) {
+    auto it = connections.find(handle);
+    if (it == connections.end() || !it->second->handler) {
+        return;
+    }
+    Connection& conn = *it->second;
+    if (!conn.unread.empty()) {
+        std::vector<uint8_t> unread = std::move(conn.unread);
+        conn.unread.clear();
+        conn.handler->onReceive(unread.data(), unread.size());
+    }
+    if (conn.state == State::FAILED && conn.handler && !conn.error.empty()) {
+        conn.handler->onTransportError(conn.error);
+    }
+}
+
+void UtpSocket::send(int handle, const uint8_t* data, size_t length) {
+    auto it = connections.find(handle);
+    if (it == connections.end() || it->second->state != State::CONNECTED) {
+        return;
+    }
+    Connection& conn = *it->second;
+    conn.send_buffer.insert(conn.send_buffer.end(), data, data + length);
+    flush(conn);
+}
+
+void UtpSocket::close(int handle) {
+    auto it = connections.find(handle);
+    if (it == connections.end()) {
+        return;
+    }
+    Connection& conn = *it->second;
+    if (conn.state == State::CONNECTED) {
+        transmit(conn, ST_FIN, conn.seq_nr++, nullptr, 0);
+    }
+    if (conn.connect_timer != 0) {
+        loop.cancelTimer(conn.connect_timer);
+    }
+    retire(conn);
+}
+
+void UtpSocket::retire(Connection& conn) {
+    routes.erase(conn.route);
+    conn.state = State::CLOSED;
+    conn.handler = nullptr;
+    auto it = connections.find(conn.handle);
+    retired.push_back(std::move(it->second));
+    connections.erase(it);
+}
+
+void UtpSocket::onReadable() {
+    std::array<mmsghdr, RECEIVE_BATCH> messages;
+    std::array<iovec, RECEIVE_BATCH> parts;
+    std::array<sockaddr_storage, RECEIVE_BATCH> senders;
+    while (true) {
+        for (size_t i = 0; i < RECEIVE_BATCH; ++i) {
+            parts[i] = {receive_buffers.data() + i * DATAGRAM_CAPACITY, DATAGRAM_CAPACITY};
+            messages[i] = {};
+            messages[i].msg_hdr.msg_name = &senders[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            messages[i].msg_hdr.msg_iov = &parts[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        SyscallCounter::record();
+        int count = recvmmsg(fd, messages.data(), RECEIVE_BATCH, 0, nullptr);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return;  // Drained; a UDP socket has no error worth a connection
+        }
+
+        Clock::time_point now = Clock::now();
+        for (int i = 0; i < count; ++i) {
+            if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+            SocketAddress from;
+            std::memcpy(&from.storage, &senders[i], messages[i].msg_hdr.msg_namelen);
+            from.length = messages[i].msg_hdr.msg_namelen;
+            onDatagram(from, static_cast<uint8_t*>(parts[i].iov_base), messages[i].msg_len, now);
+        }
+
+        // One reply per connection for the whole batch: new data, or a bare ACK
+        for (Connection* conn : touched) {
+            conn->touched = false;
+            if (conn->state == State::CONNECTED) {
+                flush(*conn);
+            }
+        }
+        touched.clear();
+        if (count < static_cast<int>(RECEIVE_BATCH)) {
+            return;
+        }
+    }
+}
+
+void UtpSocket::onErrors() {
+    while (true) {
+        SocketAddress to;
+        uint8_t ignored[HEADER_SIZE];
+        iovec part{ignored, sizeof(ignored)};
+        alignas(cmsghdr) uint8_t control[512];
+        msghdr message{};
+        message.msg_name = &to.storage;
+        message.msg_namelen = sizeof(to.storage);
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        SyscallCounter::record();
+        if (recvmsg(fd, &message, MSG_ERRQUEUE) < 0) {
+            return;
+        }
+        to.length = message.msg_namelen;
+
+        bool refused = false;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if ((header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_RECVERR) ||
+                (header->cmsg_level == IPPROTO_IPV6 && header->cmsg_type == IPV6_RECVERR)) {
+                const auto* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+                refused = refused || error->ee_errno == ECONNREFUSED;
+            }
+        }
+        if (!refused) {
+            continue;
+        }
+        // Nothing listens there: no SYN to it will be answered. Established
+        // connections ride out what may be a passing hiccup.
+        std::string prefix = routeKey(to, 0);
+        prefix.resize(prefix.size() - 2);
+        std::vector<Connection*> refused_connects;
+        for (auto& [route, conn] : routes) {
+            if (conn->state == State::SYN_SENT && route.compare(0, prefix.size(), prefix) == 0) {
+                refused_connects.push_back(conn);
+            }
+        }
+        for (Connection* conn : refused_connects) {
+            finishConnect(*conn, "connection refused");
+        }
+    }
+}
+
+void UtpSocket::onDatagram(const SocketAddress& from, const uint8_t* data, size_t length, Clock::time_point now) {
+    if (length < HEADER_SIZE || (data[0] & 0x0f) != VERSION || (data[0] >> 4) > ST_SYN) {
+        return;
+    }
+    uint8_t type = data[0] >> 4;
+    uint8_t extension = data[1];
+    uint16_t id = get16(data + 2);
+    uint32_t timestamp = get32(data + 4);
+    uint32_t delay = get32(data + 8);
+    uint32_t window = get32(data + 12);
+    uint16_t seq = get16(data + 16);
+    uint16_t ack = get16(data + 18);
+
+    size_t offset = HEADER_SIZE;
+    const uint8_t* sack = nullptr;
+    size_t sack_length = 0;
+    while (extension != 0) {
+        if (offset + 2 > length || offset + 2 + data[offset + 1] > length) {
+            return;
+        }
+        if (extension == EXTENSION_SACK) {
+            sack = data + offset + 2;
+            sack_length = data[offset + 1];
+        }
+        extension = data[offset];
+        offset += 2 + data[offset + 1];
+    }
+    stats.packets_received++;
+
+    if (type == ST_SYN) {
+        onSyn(from, id, seq, timestamp, window, now);
+        return;
+    }
+    Connection* conn = find(from, id);
+    if (!conn && type == ST_RESET) {
+        // A reset may carry the id its sender received on, which is our send id
+        for (uint16_t neighbour : {static_cast<uint16_t>(id - 1), static_cast<uint16_t>(id + 1)}) {
+            Connection* candidate = find(from, neighbour);
+            if (candidate && candidate->send_id == id) {
+                conn = candidate;
+            }
+        }
+    }
+    if (!conn) {
+        if (type != ST_RESET) {
+            sendReset(from, id, seq);
+        }
+        return;
+    }
+    if (conn->state == State::FAILED) {
+        return;
+    }
+    conn->reply_delay = microseconds(now) - timestamp;
+    conn->peer_window = window;
+
+    if (type == ST_RESET) {
+        if (conn->state == State::SYN_SENT) {
+            finishConnect(*conn, "connection refused");
+        } else {
+            fail(*conn, "connection reset by peer");
+        }
+        return;
+    }
+    if (conn->state == State::SYN_SENT) {
+        if (type != ST_STATE) {
+            return;
+        }
+        // The peer's first data packet reuses the sequence number of this ACK
+        conn->ack_nr = seq - 1;
+        onAck(*conn, ack, sack, sack_length, delay, false, now);
+        finishConnect(*conn, "");
+        return;
+    }
+
+    onAck(*conn, ack, sack, sack_length, delay, type == ST_STATE, now);
+    if (type == ST_DATA) {
+        onData(*conn, seq, data + offset, length - offset);
+    } else if (type == ST_FIN) {
+        onFin(*conn, seq);
+    }
+    if (conn->state == State::CONNECTED && !conn->touched) {
+        conn->touched = true;
+        touched.push_back(conn);
+    }
+}
+
+void UtpSocket::onSyn(const SocketAddress& from, uint16_t id, uint16_t seq, uint32_t timestamp, uint32_t window,
+                      Clock::time_point now) {
+    // Our ACK of an earlier copy was lost
+    if (Connection* existing = find(from, id + 1)) {
+        if (existing->state == State::CONNECTED && !existing->touched) {
+            existing->ack_pending = true;
+            existing->touched = true;
+            touched.push_back(existing);
+        }
+        return;
+    }
+    if (!on_accept) {
+        sendReset(from, id, seq);
+        return;
+    }
+    int handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handle < 0) {
+        return;  // The peer retries its SYN
+    }
+
+    auto owned = std::make_unique<Connection>();
+    Connection& conn = *owned;
+    conn.handle = handle;
+    conn.remote = from;
+    conn.recv_id = id + 1;
+    conn.send_id = id;
+    conn.route = routeKey(from, conn.recv_id);
+    conn.state = State::CONNECTED;
+    conn.seq_nr = static_cast<uint16_t>(random());
+    conn.ack_nr = seq;
+    conn.peer_window = window;
+    conn.reply_delay = microseconds(now) - timestamp;
+    routes[conn.route] = &conn;
+    connections[handle] = std::move(owned);
+
+    transmit(conn, ST_STATE, conn.seq_nr, nullptr, 0);
+    on_accept(handle, PeerEndpoint::fromAddress(from.storage));
+}
+
+void UtpSocket::onAck(Connection& conn, uint16_t ack, const uint8_t* sack, size_t sack_length, uint32_t delay,
+                      bool duplicate_candidate, Clock::time_point now) {
+    if (delay != 0) {
+        conn.delays.add(delay, now);
+    }
+    if (seqBefore(conn.seq_nr - 1, ack)) {
+        return;  // Acknowledges something never sent
+    }
+
+    size_t flight_before = conn.bytes_in_flight;
+    size_t bytes_acked = 0;
+    Clock::time_point rtt_sent{};  // Newest first transmission acked, for an RTT sample
+    auto acknowledge = [&](Packet& packet) {
+        packet.acked = true;
+        bytes_acked += packet.payload.size();
+        if (!packet.lost) {
+            conn.bytes_in_flight -= packet.payload.size();
+        }
+        if (packet.transmissions == 1) {
+            rtt_sent = std::max(rtt_sent, packet.sent);  // Karn: resends are ambiguous
+        }
+        conn.latest_acked_sent = std::max(conn.latest_acked_sent, packet.sent);
+    };
+
+    bool progress = false;
+    while (!conn.in_flight.empty() && !seqBefore(ack, conn.in_flight.front().seq)) {
+        Packet& packet = conn.in_flight.front();
+        if (!packet.acked) {
+            acknowledge(packet);
+        }
+        conn.in_flight.pop_front();
+        progress = true;
+    }
+
+    if (sack && !conn.in_flight.empty()) {
+        uint16_t first = conn.in_flight.front().seq;
+        for (size_t bit = 0; bit < sack_length * 8; ++bit) {
+            if (!(sack[bit / 8] & (1 << (bit % 8)))) {
+                continue;
+            }
+            uint16_t index = static_cast<uint16_t>(ack + 2 + bit) - first;
+            if (index < conn.in_flight.size() && !conn.in_flight[index].acked) {
+                acknowledge(conn.in_flight[index]);
+            }
+        }
+        // Three packets past one got through, and after it was (re)sent: it was lost
+        int acked_after = 0;
+        for (auto it = conn.in_flight.rbegin(); it != conn.in_flight.rend(); ++it) {
+            if (it->acked) {
+                acked_after++;
+            } else if (acked_after >= DUPLICATE_ACKS && !it->lost && it->sent < conn.latest_acked_sent) {
+                markLost(conn, *it);
+            }
+        }
+    }
+
+    if (progress) {
+        conn.duplicate_acks = 0;
+        conn.timeouts = 0;
+        conn.timeout_at = conn.in_flight.empty() ? Clock::time_point{} : now + conn.timeout;
+        if (conn.in_recovery && !seqBefore(ack, conn.recovery_seq)) {
+            conn.in_recovery = false;
+        }
+    } else if (duplicate_candidate && ack == conn.last_ack && !conn.in_flight.empty() &&
+               ++conn.duplicate_acks == DUPLICATE_ACKS) {
+        Packet& oldest = conn.in_flight.front();
+        if (!oldest.acked && !oldest.lost) {
+            markLost(conn, oldest);
+        }
+    }
+    conn.last_ack = ack;
+
+    if (rtt_sent != Clock::time_point{}) {
+        updateRtt(conn, now - rtt_sent);
+    }
+    if (bytes_acked > 0) {
+        updateWindow(conn, bytes_acked, flight_before);
+    }
+}
+
+void UtpSocket::updateRtt(Connection& conn, Clock::duration sample) {
+    int64_t rtt = std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(sample).count(), 1);
+    if (conn.srtt == 0) {
+        conn.srtt = rtt;
+        conn.rttvar = rtt / 2;
+    } else {
+        conn.rttvar += (std::abs(conn.srtt - rtt) - conn.rttvar) / 4;
+        conn.srtt += (rtt - conn.srtt) / 8;
+    }
+    conn.timeout = std::clamp<Clock::duration>(std::chrono::microseconds(conn.srtt + 4 * conn.rttvar),
+                                               MIN_TIMEOUT, MAX_TIMEOUT);
+}
+
+void UtpSocket::updateWindow(Connection& conn, size_t bytes_acked, size_t flight_before) {
+    double queuing = conn.delays.queuingDelay();
+    if (conn.delays.recent_filled > 0) {
+        stats.delay_samples++;
+        stats.queuing_delay_total += static_cast<uint64_t>(queuing);
+    }
+
+    // LEDBAT: a full window's worth of ACKs moves the window by up to
+    // MAX_WINDOW_GAIN, in proportion to how far the delay is off target
+    double target = static_cast<double>(TARGET_DELAY.count());
+    double off_target = std::clamp((target - queuing) / target, -1.0, 1.0);
+    double window_factor = std::min<double>(bytes_acked, conn.window) / std::max<double>(conn.window, bytes_acked);
+    double gain = MAX_WINDOW_GAIN * off_target * window_factor;
+    // A window the sender isn't filling proves nothing about the path
+    if (gain > 0 && flight_before * 2 < conn.window) {
+        gain = 0;
+    }
+    double ledbat_window = conn.window + gain;
+
+    if (conn.slow_start) {
+        if (queuing > target * 0.9) {
+            conn.slow_start = false;
+            conn.slow_start_threshold = conn.window;
+            conn.window = ledbat_window;
+        } else {
+            if (flight_before * 2 >= conn.window) {
+                conn.window = std::max(conn.window + bytes_acked, ledbat_window);
+            }
+            conn.slow_start = conn.window < conn.slow_start_threshold;
+        }
+    } else {
+        conn.window = ledbat_window;
+    }
+    conn.window = std::clamp<double>(conn.window, MIN_WINDOW, MAX_WINDOW);
+}
+
+void UtpSocket::markLost(Connection& conn, Packet& packet) {
+    packet.lost = true;
+    conn.bytes_in_flight -= packet.payload.size();
+    onLoss(conn, packet.seq);
+}
+
+void UtpSocket::onLoss(Connection& conn, uint16_t seq) {
+    // Once per window: later losses among the packets already out are the same event
+    if (conn.in_recovery && seqBefore(seq, conn.recovery_seq)) {
+        return;
+    }
+    conn.in_recovery = true;
+    conn.recovery_seq = conn.seq_nr;
+    conn.window = std::max<double>(conn.window / 2, MIN_WINDOW);
+    conn.slow_start = false;
+    conn.slow_start_threshold = conn.window;
+}
+
+void UtpSocket::onTimeout(Connection& conn, Clock::time_point now) {
+    stats.timeouts++;
+    if (conn.state == State::CONNECTED && ++conn.timeouts > MAX_TIMEOUTS) {
+        fail(conn, "timed out");
+        return;
+    }
+    conn.timeout = std::min<Clock::duration>(conn.timeout * 2, MAX_TIMEOUT);
+    conn.slow_start_threshold = std::max<double>(conn.window / 2, MIN_WINDOW);
+    conn.window = MIN_WINDOW;
+    conn.slow_start = true;
+    conn.in_recovery = true;
+    conn.recovery_seq = conn.seq_nr;
+    for (Packet& packet : conn.in_flight) {
+        if (!packet.acked && !packet.lost) {
+            packet.lost = true;
+            conn.bytes_in_flight -= packet.payload.size();
+        }
+    }
+    conn.timeout_at = now + conn.timeout;
+    flush(conn);
+}
+
+void UtpSocket::onData(Connection& conn, uint16_t seq, const uint8_t* payload, size_t length) {
+    conn.ack_pending = true;  // Duplicates too: the peer missed our ACK
+    uint16_t ahead = seq - static_cast<uint16_t>(conn.ack_nr + 1);
+    if (ahead >= MAX_REORDER || (conn.fin_received && !seqBefore(seq, conn.fin_seq))) {
+        return;  // Already delivered, or beyond what we hold
+    }
+    if (ahead > 0) {
+        if (conn.out_of_order.try_emplace(seq, payload, payload + length).second) {
+            conn.out_of_order_bytes += length;
+        }
+        return;
+    }
+
+    conn.ack_nr = seq;
+    deliver(conn, payload, length);
+    while (conn.state == State::CONNECTED) {
+        auto it = conn.out_of_order.find(static_cast<uint16_t>(conn.ack_nr + 1));
+        if (it == conn.out_of_order.end()) {
+            break;
+        }
+        std::vector<uint8_t> next = std::move(it->second);
+        conn.out_of_order.erase(it);
+        conn.out_of_order_bytes -= next.size();
+        conn.ack_nr++;
+        deliver(conn, next.data(), next.size());
+    }
+}
+
+void UtpSocket::onFin(Connection& conn, uint16_t seq) {
+    conn.fin_received = true;
+    conn.fin_seq = seq;
+    conn.ack_pending = true;
+    if (seq == static_cast<uint16_t>(conn.ack_nr + 1)) {
+        closedByPeer(conn);
+    }
+}
+
+void UtpSocket::closedByPeer(Connection& conn) {
+    conn.ack_nr = conn.fin_seq;
+    transmit(conn, ST_STATE, conn.seq_nr, nullptr, 0);
+    fail(conn, "connection closed by peer");
+}
+
+void UtpSocket::deliver(Connection& conn, const uint8_t* data, size_t length) {
+    stats.bytes_received += length;
+    if (conn.handler) {
+        conn.handler->onReceive(data, length);
+    } else {
+        conn.unread.insert(conn.unread.end(), data, data + length);
+    }
+    // Data ahead of a FIN completes the stream
+    if (conn.state == State::CONNECTED && conn.fin_received &&
+        conn.fin_seq == static_cast<uint16_t>(conn.ack_nr + 1) && conn.out_of_order.empty()) {
+        closedByPeer(conn);
+    }
+}
+
+void UtpSocket::fail(Connection& conn, const std::string& reason) {
+    conn.state = State::FAILED;
+    conn.in_flight.clear();
+    conn.bytes_in_flight = 0;
+    conn.send_buffer.clear();
+    conn.send_offset = 0;
+    conn.out_of_order.clear();
+    if (conn.handler) {
+        conn.handler->onTransportError(reason);
+    } else {
+        conn.error = reason;
+    }
+}
+
+void UtpSocket::finishConnect(Connection& conn, const std::string& error) {
+    if (conn.connect_timer != 0) {
+        loop.cancelTimer(conn.connect_timer);
+        conn.connect_timer = 0;
+    }
+    ConnectCallback callback = std::move(conn.on_connect);
+    if (!error.empty()) {
+        int handle = conn.handle;
+        retire(conn);
+        ::close(handle);
+        callback(-1, error);
+        return;
+    }
+    conn.state = State::CONNECTED;
+    callback(conn.handle, "");
+}
+
+bool UtpSocket::canSend(Connection& conn, size_t length, Clock::time_point now) {
+    // One packet may always be out, so a tiny window still makes progress
+    size_t limit = std::min<size_t>(static_cast<size_t>(conn.window), conn.peer_window);
+    if (conn.bytes_in_flight > 0 && conn.bytes_in_flight + length > limit) {
+        return false;
+    }
+    if (conn.srtt == 0) {
+        return true;  // No round trip to pace over yet
+    }
+
+    // Pacing: tokens accrue at the window per round trip, a little faster so
+    // the window stays the limit
+    double gain = conn.slow_start ? SLOW_START_PACING_GAIN : PACING_GAIN;
+    double rate = conn.window * 1e6 / conn.srtt * gain;
+    double burst = std::max<double>(PACING_BURST, rate * PACING_HORIZON.count());
+    std::chrono::duration<double> elapsed = now - conn.tokens_updated;
+    conn.pacing_tokens = std::min(burst, conn.pacing_tokens + elapsed.count() * rate);
+    conn.tokens_updated = now;
+    if (conn.pacing_tokens < length) {
+        conn.paced_until = now + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>((length - conn.pacing_tokens) / rate));
+        return false;
+    }
+    conn.pacing_tokens -= length;
+    return true;
+}
+
+void UtpSocket::flush(Connection& conn) {
+    if (conn.state != State::CONNECTED && conn.state != State::SYN_SENT) {
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    conn.paced_until = {};
+
+    bool blocked = false;
+    for (Packet& packet : conn.in_flight) {
+        if (!packet.lost || packet.acked) {
+            continue;
+        }
+        if (!canSend(conn, packet.payload.size(), now)) {
+            blocked = true;
+            break;
+        }
+        packet.lost = false;
+        stats.retransmits++;
+        sendPacket(conn, packet, now);
+    }
+
+    while (!blocked && conn.state == State::CONNECTED && conn.send_offset < conn.send_buffer.size() &&
+           conn.in_flight.size() < MAX_REORDER) {
+        size_t length = std::min(MAX_PAYLOAD, conn.send_buffer.size() - conn.send_offset);
+        if (!canSend(conn, length, now)) {
+            break;
+        }
+        Packet& packet = conn.in_flight.emplace_back();
+        packet.seq = conn.seq_nr++;
+        packet.type = ST_DATA;
+        packet.payload.assign(conn.send_buffer.begin() + conn.send_offset,
+                              conn.send_buffer.begin() + conn.send_offset + length);
+        conn.send_offset += length;
+        sendPacket(conn, packet, now);
+    }
+    if (conn.send_offset == conn.send_buffer.size()) {
+        conn.send_buffer.clear();
+        conn.send_offset = 0;
+    } else if (conn.send_offset > conn.send_buffer.size() / 2) {
+        conn.send_buffer.erase(conn.send_buffer.begin(), conn.send_buffer.begin() + conn.send_offset);
+        conn.send_offset = 0;
+    }
+
+    if (conn.ack_pending && conn.state == State::CONNECTED) {
+        transmit(conn, ST_STATE, conn.seq_nr, nullptr, 0);
+    }
+    arm(conn);
+}
+
+void UtpSocket::sendPacket(Connection& conn, Packet& packet, Clock::time_point now) {
+    packet.sent = now;
+    packet.transmissions++;
+    conn.bytes_in_flight += packet.payload.size();
+    if (conn.timeout_at == Clock::time_point{}) {
+        conn.timeout_at = now + conn.timeout;
+    }
+    transmit(conn, packet.type, packet.seq, packet.payload.data(), packet.payload.size());
+}
+
+void UtpSocket::transmit(Connection& conn, uint8_t type, uint16_t seq, const uint8_t* payload, size_t length) {
+    uint8_t header[HEADER_SIZE + 2 + MAX_SACK_BYTES];
+    size_t header_length = HEADER_SIZE;
+    uint8_t extension = 0;
+    if (type == ST_STATE && !conn.out_of_order.empty()) {
+        // Bit i: packet ack_nr + 2 + i is here (ack_nr + 1 is the gap)
+        uint8_t* mask = header + HEADER_SIZE + 2;
+        std::memset(mask, 0, MAX_SACK_BYTES);
+        size_t used = 0;
+        for (const auto& [buffered, data] : conn.out_of_order) {
+            uint16_t bit = buffered - static_cast<uint16_t>(conn.ack_nr + 2);
+            if (bit < MAX_SACK_BYTES * 8) {
+                mask[bit / 8] |= 1 << (bit % 8);
+                used = std::max<size_t>(used, bit / 8 + 1);
+            }
+        }
+        if (used > 0) {
+            size_t mask_length = (used + 3) / 4 * 4;
+            header[HEADER_SIZE] = 0;
+            header[HEADER_SIZE + 1] = static_cast<uint8_t>(mask_length);
+            header_length += 2 + mask_length;
+            extension = EXTENSION_SACK;
+        }
+    }
+    header[0] = static_cast<uint8_t>(type << 4 | VERSION);
+    header[1] = extension;
+    put16(header + 2, type == ST_SYN ? conn.recv_id : conn.send_id);
+    put32(header + 4, microseconds(Clock::now()));
+    put32(header + 8, conn.reply_delay);
+    put32(header + 12, receiveWindow(conn));
+    put16(header + 16, seq);
+    put16(header + 18, conn.ack_nr);
+    sendDatagram(conn.remote, header, header_length, payload, length);
+    // Any packet carries the cumulative ACK; only a STATE carries the selective one
+    if (type == ST_STATE || conn.out_of_order.empty()) {
+        conn.ack_pending = false;
+    }
+}
+
+void UtpSocket::sendReset(const SocketAddress& to, uint16_t id, uint16_t ack) {
+    uint8_t header[HEADER_SIZE] = {};
+    header[0] = static_cast<uint8_t>(ST_RESET << 4 | VERSION);
+    put16(header + 2, id);
+    put32(header + 4, microseconds(Clock::now()));
+    put16(header + 16, static_cast<uint16_t>(random()));
+    put16(header + 18, ack);
+    sendDatagram(to, header, sizeof(header), nullptr, 0);
+}
+
+void UtpSocket::sendDatagram(const SocketAddress& to, const uint8_t* header, size_t header_length,
+                             const uint8_t* payload, size_t length) {
+    stats.packets_sent++;
+    stats.bytes_sent += length;
+
+    if (shim.delay.count() > 0 || shim.rate > 0 || shim.loss > 0) {
+        if (shim.loss > 0 && std::uniform_real_distribution<double>(0, 1)(random) < shim.loss) {
+            return;
+        }
+        Clock::time_point departs = Clock::now();
+        if (shim.rate > 0) {
+            link_free = std::max(link_free, departs) + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((header_length + length) / shim.rate));
+            departs = link_free;
+        }
+        DelayedDatagram& datagram = delayed.emplace_back();
+        datagram.when = departs + shim.delay;
+        datagram.to = to;
+        datagram.data.assign(header, header + header_length);
+        datagram.data.insert(datagram.data.end(), payload, payload + length);
+        if (shim_timer == 0) {
+            shim_timer = loop.runAt(delayed.front().when, [this]() {
+                shim_timer = 0;
+                releaseDelayed();
+            });
+        }
+        return;
+    }
+
+    iovec parts[2] = {{const_cast<uint8_t*>(header), header_length}, {const_cast<uint8_t*>(payload), length}};
+    msghdr message{};
+    message.msg_name = const_cast<sockaddr_storage*>(&to.storage);
+    message.msg_namelen = to.length;
+    message.msg_iov = parts;
+    message.msg_iovlen = length > 0 ? 2 : 1;
+    SyscallCounter::record();
+    // A full socket buffer drops the packet, as a congested network would
+    sendmsg(fd, &message, 0);
+}
+
+void UtpSocket::releaseDelayed() {
+    Clock::time_point now = Clock::now();
+    while (!delayed.empty() && delayed.front().when <= now) {
+        const DelayedDatagram& datagram = delayed.front();
+        SyscallCounter::record();
+        sendto(fd, datagram.data.data(), datagram.data.size(), 0,
+               reinterpret_cast<const sockaddr*>(&datagram.to.storage), datagram.to.length);
+        delayed.pop_front();
+    }
+    if (!delayed.empty()) {
+        shim_timer = loop.runAt(delayed.front().when, [this]() {
+            shim_timer = 0;
+            releaseDelayed();
+        });
+    }
+}
+
+void UtpSocket::arm(Connection& conn) {
+    Clock::time_point when = Clock::time_point::max();
+    if (!conn.in_flight.empty() && conn.timeout_at != Clock::time_point{}) {
+        when = conn.timeout_at;
+    }
+    if (conn.paced_until != Clock::time_point{}) {
+        when = std::min(when, conn.paced_until);
+    }
+    if (when != Clock::time_point::max()) {
+        wakeAt(when);
+    }
+}
+
+void UtpSocket::wakeAt(Clock::time_point when) {
+    if (wake_timer != 0) {
+        if (wake_at <= when) {
+            return;
+        }
+        loop.cancelTimer(wake_timer);
+    }
+    wake_at = when;
+    wake_timer = loop.runAt(when, [this]() {
+        wake_timer = 0;
+        onWake();
+    });
+}
+
+void UtpSocket::onWake() {
+    Clock::time_point now = Clock::now();
+    std::vector<Connection*> pending;
+    pending.reserve(connections.size());
+    for (auto& [handle, conn] : connections) {
+        pending.push_back(conn.get());
+    }
+    // Each one re-arms the timer for its next deadline
+    for (Connection* conn : pending) {
+        if (conn->state != State::CONNECTED && conn->state != State::SYN_SENT) {
+            continue;
+        }
+        if (!conn->in_flight.empty() && conn->timeout_at != Clock::time_point{} && conn->timeout_at <= now) {
+            onTimeout(*conn, now);
+        } else if (conn->paced_until != Clock::time_point{} && conn->paced_until <= now) {
+            flush(*conn);
+        } else {
+            arm(*conn);
+        }
+    }
+}
+
+UtpSocket::Connection* UtpSocket::find(const SocketAddress& from, uint16_t id) {
+    auto it = routes.find(routeKey(from, id));
+    return it == routes.end() ? nullptr : it->second;
+}
+
+std::string UtpSocket::routeKey(const SocketAddress& address, uint16_t id) const {
+    std::string key;
+    if (address.family() == AF_INET6) {
+        const auto* v6 = reinterpret_cast<const sockaddr_in6*>(&address.storage);
+        key.assign(reinterpret_cast<const char*>(&v6->sin6_addr), sizeof(v6->sin6_addr));
+        key.append(reinterpret_cast<const char*>(&v6->sin6_port), sizeof(v6->sin6_port));
+    } else {
+        const auto* v4 = reinterpret_cast<const sockaddr_in*>(&address.storage);
+        key.assign(reinterpret_cast<const char*>(&v4->sin_addr), sizeof(v4->sin_addr));
+        key.append(reinterpret_cast<const char*>(&v4->sin_port), sizeof(v4->sin_port));
+    }
+    key.push_back(static_cast<char>(id >> 8));
+    key.push_back(static_cast<char>(id & 0xff));
+    return key;
+}
+
+SocketAddress UtpSocket::normalize(const SocketAddress& address) const {
+    if (address.family() == family) {
+        return address;
+    }
+    SocketAddress converted;
+    if (family == AF_INET6 && address.family() == AF_INET) {
+        // IPv4 peers through the dual-stack socket, as ::ffff:a.b.c.d
+        const auto* v4 = reinterpret_cast<const sockaddr_in*>(&address.storage);
+        auto* v6 = reinterpret_cast<sockaddr_in6*>(&converted.storage);
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = v4->sin_port;
+        v6->sin6_addr.s6_addr[10] = 0xff;
+        v6->sin6_addr.s6_addr[11] = 0xff;
+        std::memcpy(v6->sin6_addr.s6_addr + 12, &v4->sin_addr, 4);
+        converted.length = sizeof(sockaddr_in6);
+    }
+    return converted;  // Length 0: IPv6 on an IPv4-only host
+}
+
+uint32_t UtpSocket::receiveWindow(const Connection& conn) const {
+    size_t held = conn.out_of_order_bytes + conn.unread.size();
+    return static_cast<uint32_t>(RECEIVE_WINDOW - std::min(held, RECEIVE_WINDOW));
+}
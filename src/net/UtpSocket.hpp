@@ -0,0 +1,232 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "EventLoop.hpp"
+#include "PeerEndpoint.hpp"
+#include "Transport.hpp"
+
+// uTP (BEP 29): reliable byte streams to any number of peers over one UDP
+// socket. Congestion control is LEDBAT: the window grows while the one-way
+// queuing delay stays under the 100 ms target and shrinks as it rises, so a
+// bulk transfer makes way for TCP and interactive traffic on the same link.
+// Losses are found from selective ACKs, duplicate ACKs and a retransmit timer;
+// sends are paced over the round trip instead of leaving in window-sized bursts.
+//
+// A connection has no kernel socket of its own, so each one is named by an
+// eventfd handle that sessions can key like a socket fd. Whoever a handle is
+// handed to closes it after close(). Everything runs on the loop thread.
+class UtpSocket {
+public:
+    static constexpr size_t PACKET_SIZE = 1400;  // Fits common path MTUs with the IP and UDP headers
+    static constexpr std::chrono::microseconds TARGET_DELAY{100000};
+
+    // handle is -1 when the connect failed, with the reason in error
+    using ConnectCallback = std::function<void(int handle, const std::string& error)>;
+    using AcceptCallback = std::function<void(int handle, const PeerEndpoint& peer)>;
+
+    // Test hook: holds back outgoing datagrams as a slow, distant link would
+    struct LinkShim {
+        std::chrono::microseconds delay{0};  // One way
+        double rate = 0;                     // Bytes per second through an unbounded queue; 0 is unlimited
+        double loss = 0;                     // Fraction dropped at random
+    };
+
+    struct Stats {
+        uint64_t packets_sent = 0;
+        uint64_t packets_received = 0;
+        uint64_t bytes_sent = 0;      // Payload handed to the socket, resends included
+        uint64_t bytes_received = 0;  // Payload delivered in order
+        uint64_t retransmits = 0;
+        uint64_t timeouts = 0;
+        uint64_t delay_samples = 0;
+        uint64_t queuing_delay_total = 0;  // Microseconds over all samples
+    };
+
+    explicit UtpSocket(EventLoop& loop, int port = 0);  // 0 binds an ephemeral port
+    ~UtpSocket();
+    UtpSocket(const UtpSocket&) = delete;
+    UtpSocket& operator=(const UtpSocket&) = delete;
+
+    int getPort() const { return port; }
+    void connect(const SocketAddress& remote, std::chrono::milliseconds timeout, ConnectCallback callback);
+    // Incoming connections go to callback; without one they are reset
+    void listen(AcceptCallback callback) { on_accept = std::move(callback); }
+
+    // Received bytes and errors of handle go to handler until close()
+    void setHandler(int handle, TransportHandler* handler);
+    void send(int handle, const uint8_t* data, size_t length);
+    // Sends FIN and forgets the connection, unsent data included
+    void close(int handle);
+
+    void setLinkShim(const LinkShim& link_shim) { shim = link_shim; }
+    const Stats& getStats() const { return stats; }
+
+private:
+    using Clock = EventLoop::Clock;
+
+    static constexpr size_t HEADER_SIZE = 20;
+    static constexpr size_t MAX_PAYLOAD = PACKET_SIZE - HEADER_SIZE;
+    static constexpr size_t MIN_WINDOW = PACKET_SIZE;
+    static constexpr size_t MAX_WINDOW = 1024 * 1024;
+    static constexpr size_t RECEIVE_WINDOW = 1024 * 1024;
+    static constexpr double MAX_WINDOW_GAIN = 3000;  // Bytes per round trip at zero queuing delay
+    static constexpr std::chrono::milliseconds INITIAL_TIMEOUT{1000};
+    static constexpr std::chrono::milliseconds MIN_TIMEOUT{500};
+    static constexpr std::chrono::milliseconds MAX_TIMEOUT{16000};
+    static constexpr int MAX_TIMEOUTS = 5;  // In a row, then the connection is dead
+    static constexpr int DUPLICATE_ACKS = 3;  // Or later packets selectively acked: the packet was lost
+    static constexpr size_t BASE_HISTORY = 10;  // Minutes of base delay kept
+    static constexpr size_t RECENT_DELAYS = 3;
+
+    enum class State { SYN_SENT, CONNECTED, FAILED, CLOSED };
+
+    struct Packet {
+        uint16_t seq;
+        uint8_t type;
+        std::vector<uint8_t> payload;
+        Clock::time_point sent;
+        int transmissions = 0;
+        bool acked = false;  // Selectively, ahead of the cumulative ACK
+        bool lost = false;   // Waiting to be resent; not counted in flight
+    };
+
+    // One-way delay samples of our packets as the peer measured them, clock
+    // offset included. The base is the lowest seen over the last minutes; the
+    // queuing delay is how far the last few samples sit above it.
+    struct DelayHistory {
+        std::array<uint32_t, BASE_HISTORY> base{};  // Lowest sample of each minute
+        size_t base_filled = 0;
+        size_t base_current = 0;
+        Clock::time_point minute_started;
+        std::array<uint32_t, RECENT_DELAYS> recent{};
+        size_t recent_filled = 0;
+        size_t recent_next = 0;
+
+        void add(uint32_t sample, Clock::time_point now);
+        uint32_t queuingDelay() const;  // Microseconds
+    };
+
+    struct Connection {
+        int handle = -1;
+        SocketAddress remote;
+        std::string route;  // Key in routes
+        uint16_t recv_id = 0;
+        uint16_t send_id = 0;
+        State state = State::SYN_SENT;
+        TransportHandler* handler = nullptr;
+        ConnectCallback on_connect;
+        EventLoop::TimerId connect_timer = 0;
+
+        // Sending
+        uint16_t seq_nr = 0;             // Next to use
+        std::deque<Packet> in_flight;    // Sent, not cumulatively acked, in sequence order
+        std::vector<uint8_t> send_buffer;
+        size_t send_offset = 0;          // Bytes of send_buffer already packetised
+        size_t bytes_in_flight = 0;
+        uint32_t peer_window = RECEIVE_WINDOW;
+        uint16_t last_ack = 0;
+        int duplicate_acks = 0;
+        Clock::time_point latest_acked_sent;  // Newest send time among acked packets
+        uint16_t recovery_seq = 0;       // Losses of packets sent before it were already answered
+        bool in_recovery = false;
+
+        // Congestion control
+        double window = 2 * PACKET_SIZE;
+        double slow_start_threshold = MAX_WINDOW;
+        bool slow_start = true;
+        DelayHistory delays;
+        int64_t srtt = 0;    // Microseconds; 0 until the first sample
+        int64_t rttvar = 0;
+        Clock::duration timeout = INITIAL_TIMEOUT;
+        int timeouts = 0;
+        Clock::time_point timeout_at;    // Valid while packets are in flight
+        double pacing_tokens = 0;        // Bytes that may leave now
+        Clock::time_point tokens_updated;
+        Clock::time_point paced_until;   // Set while sends wait for tokens
+
+        // Receiving
+        uint16_t ack_nr = 0;             // Last delivered in order
+        std::unordered_map<uint16_t, std::vector<uint8_t>> out_of_order;
+        size_t out_of_order_bytes = 0;
+        std::vector<uint8_t> unread;     // Arrived before a handler was set
+        std::string error;               // Failed before a handler was set
+        bool fin_received = false;
+        uint16_t fin_seq = 0;
+        uint32_t reply_delay = 0;        // Echoed as timestamp_difference_microseconds
+        bool ack_pending = false;
+        bool touched = false;            // Queued in this batch's touched list
+    };
+
+    struct DelayedDatagram {
+        Clock::time_point when;
+        SocketAddress to;
+        std::vector<uint8_t> data;
+    };
+
+    void onReadable();
+    void onErrors();  // Drains the ICMP errors queued on the socket
+    void onDatagram(const SocketAddress& from, const uint8_t* data, size_t length, Clock::time_point now);
+    void onSyn(const SocketAddress& from, uint16_t id, uint16_t seq, uint32_t timestamp, uint32_t window,
+               Clock::time_point now);
+    void onAck(Connection& conn, uint16_t ack, const uint8_t* sack, size_t sack_length, uint32_t delay,
+               bool duplicate_candidate, Clock::time_point now);
+    void onData(Connection& conn, uint16_t seq, const uint8_t* payload, size_t length);
+    void onFin(Connection& conn, uint16_t seq);
+    void closedByPeer(Connection& conn);  // Every byte before the FIN has arrived
+    void deliver(Connection& conn, const uint8_t* data, size_t length);
+    void fail(Connection& conn, const std::string& reason);
+    void finishConnect(Connection& conn, const std::string& error);  // Empty error: connected
+
+    void markLost(Connection& conn, Packet& packet);
+    void onLoss(Connection& conn, uint16_t seq);
+    void onTimeout(Connection& conn, Clock::time_point now);
+    void updateWindow(Connection& conn, size_t bytes_acked, size_t flight_before);
+    void updateRtt(Connection& conn, Clock::duration sample);
+    bool canSend(Connection& conn, size_t length, Clock::time_point now);
+
+    void flush(Connection& conn);  // Resends, new data, then an ACK if one is still owed
+    void sendPacket(Connection& conn, Packet& packet, Clock::time_point now);
+    void transmit(Connection& conn, uint8_t type, uint16_t seq, const uint8_t* payload, size_t length);
+    void sendDatagram(const SocketAddress& to, const uint8_t* header, size_t header_length,
+                      const uint8_t* payload, size_t length);
+    void sendReset(const SocketAddress& to, uint16_t id, uint16_t ack);
+    void releaseDelayed();
+    void deliverPending(int handle);  // What arrived before setHandler()
+
+    void arm(Connection& conn);  // Wakes for the connection's next timeout or paced send
+    void wakeAt(Clock::time_point when);
+    void onWake();
+
+    Connection* find(const SocketAddress& from, uint16_t id);
+    std::string routeKey(const SocketAddress& address, uint16_t id) const;
+    SocketAddress normalize(const SocketAddress& address) const;  // To the socket's family
+    uint32_t receiveWindow(const Connection& conn) const;
+    void retire(Connection& conn);
+
+    EventLoop& loop;
+    int fd = -1;
+    int family = 0;
+    int port = 0;
+    AcceptCallback on_accept;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;  // By handle
+    std::unordered_map<std::string, Connection*> routes;              // By remote address and receive id
+    std::vector<std::unique_ptr<Connection>> retired;  // Closed inside a callback
+    std::vector<Connection*> touched;                  // Owe a flush at the end of the batch
+    std::vector<uint8_t> receive_buffers;
+    EventLoop::TimerId wake_timer = 0;
+    Clock::time_point wake_at;
+    LinkShim shim;
+    std::deque<DelayedDatagram> delayed;
+    Clock::time_point link_free;  // When the shim's link finishes its queue
+    EventLoop::TimerId shim_timer = 0;
+    std::mt19937 random{std::random_device{}()};
+    Stats stats;
+};
@@ -0,0 +1,36 @@
+#include "UtpTransport.hpp"
+
+UtpTransport::UtpTransport(EventLoop& loop, int port) : socket(loop, port), resolver(loop) {
+}
+
+void UtpTransport::connect(const PeerEndpoint& peer, std::chrono::milliseconds timeout,
+                           UtpSocket::ConnectCallback callback) {
+    resolver.resolve(peer, [this, timeout, callback = std::move(callback)](
+                               std::vector<SocketAddress> addresses, const std::string& error) {
+        if (addresses.empty()) {
+            callback(-1, error);
+            return;
+        }
+        socket.connect(addresses.front(), timeout, callback);
+    });
+}
+
+void UtpTransport::attach(int fd, TransportHandler* handler) {
+    socket.setHandler(fd, handler);
+}
+
+void UtpTransport::detach(int fd) {
+    socket.close(fd);
+}
+
+void UtpTransport::send(int fd, std::vector<uint8_t>& data) {
+    socket.send(fd, data.data(), data.size());
+    stats.bytes_sent += data.size();
+    data.clear();
+}
+
+Transport::Stats UtpTransport::getStats() const {
+    Stats result = stats;
+    result.bytes_received = socket.getStats().bytes_received;
+    return result;
+}
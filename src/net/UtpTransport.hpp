@@ -0,0 +1,27 @@
+#pragma once
+#include <chrono>
+#include "Transport.hpp"
+#include "UtpSocket.hpp"
+#include "Resolver.hpp"
+
+// Peer sessions over uTP. The fds it attaches are the connection handles
+// connect() hands out; detach() closes the connection.
+class UtpTransport : public Transport {
+public:
+    explicit UtpTransport(EventLoop& loop, int port = 0);
+
+    // To the peer's first address, looked up off the loop for a host name;
+    // the callback gets a handle or the reason
+    void connect(const PeerEndpoint& peer, std::chrono::milliseconds timeout, UtpSocket::ConnectCallback callback);
+
+    void attach(int fd, TransportHandler* handler) override;
+    void detach(int fd) override;
+    void send(int fd, std::vector<uint8_t>& data) override;
+    const char* name() const override { return "utp"; }
+    Stats getStats() const override;
+    const UtpSocket::Stats& getSocketStats() const { return socket.getStats(); }
+
+private:
+    UtpSocket socket;
+    Resolver resolver;
+};
@@ -0,0 +1,121 @@
+#include "MessageWriter.hpp"
+#include "../utils/SyscallCounter.hpp"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+void putInt(uint8_t* out, uint32_t value) {
+    out[0] = (value >> 24) & 0xFF;
+    out[1] = (value >> 16) & 0xFF;
+    out[2] = (value >> 8) & 0xFF;
+    out[3] = value & 0xFF;
+}
+}
+
+uint8_t* MessageWriter::appendFrame(PeerMessageType type, size_t payload_length, size_t inline_length) {
+    size_t frame = buffer.size();
+    buffer.resize(frame + 5 + inline_length);
+    putInt(buffer.data() + frame, 1 + payload_length);
+    buffer[frame + 4] = type;
+    return buffer.data() + frame + 5;
+}
+
+void MessageWriter::add(PeerMessageType type, const uint8_t* payload, size_t length) {
+    uint8_t* out = appendFrame(type, length, length);
+    if (length > 0) {
+        std::memcpy(out, payload, length);
+    }
+}
+
+void MessageWriter::addBlockMessage(PeerMessageType type, int index, int begin, int length) {
+    uint8_t* out = appendFrame(type, 12, 12);
+    putInt(out, index);
+    putInt(out + 4, begin);
+    putInt(out + 8, length);
+}
+
+void MessageWriter::addHave(int index) {
+    putInt(appendFrame(PeerMessageType::HAVE, 4, 4), index);
+}
+
+void MessageWriter::addRaw(const uint8_t* data, size_t length) {
+    buffer.insert(buffer.end(), data, data + length);
+}
+
+void MessageWriter::addReferenced(PeerMessageType type, const uint8_t* header, size_t header_length,
+                                  const uint8_t* payload, size_t length) {
+    uint8_t* out = appendFrame(type, header_length + length, header_length);
+    if (header_length > 0) {
+        std::memcpy(out, header, header_length);
+    }
+    if (length > 0) {
+        referenced.push_back({buffer.size(), payload, length});
+    }
+}
+
+size_t MessageWriter::size() const {
+    size_t total = buffer.size();
+    for (const auto& reference : referenced) {
+        total += reference.length;
+    }
+    return total;
+}
+
+void MessageWriter::flushTo(int sock) {
+    if (empty()) {
+        return;
+    }
+
+    // Interleave the encoded bytes with the referenced payloads
+    segments.clear();
+    size_t position = 0;
+    for (const auto& reference : referenced) {
+        if (reference.offset > position) {
+            segments.push_back({buffer.data() + position, reference.offset - position});
+        }
+        segments.push_back({const_cast<uint8_t*>(reference.data), reference.length});
+        position = reference.offset;
+    }
+    if (buffer.size() > position) {
+        segments.push_back({buffer.data() + position, buffer.size() - position});
+    }
+
+    size_t first = 0;
+    while (first < segments.size()) {
+        msghdr message{};
+        message.msg_iov = segments.data() + first;
+        message.msg_iovlen = std::min<size_t>(segments.size() - first, IOV_MAX);
+        SyscallCounter::record();
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            clear();
+            throw std::runtime_error("Failed to send: " + std::string(std::strerror(errno)));
+        }
+
+        // Skip what went out; a short write resumes mid-segment
+        size_t remaining = sent;
+        while (first < segments.size() && remaining >= segments[first].iov_len) {
+            remaining -= segments[first].iov_len;
+            first++;
+        }
+        if (remaining > 0) {
+            segments[first].iov_base = static_cast<uint8_t*>(segments[first].iov_base) + remaining;
+            segments[first].iov_len -= remaining;
+        }
+    }
+    clear();
+}
+
+void MessageWriter::clear() {
+    buffer.clear();
+    referenced.clear();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "PeerMessageType.hpp"
+#include <sys/uio.h>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Outgoing peer messages of one connection, encoded straight into a
+// contiguous buffer. Bulk payloads such as PIECE data can be referenced
+// instead of copied; they go out in the same sendmsg as the headers around them.
+class MessageWriter {
+public:
+    void add(PeerMessageType type, const uint8_t* payload = nullptr, size_t length = 0);
+    // REQUEST and CANCEL
+    void addBlockMessage(PeerMessageType type, int index, int begin, int length);
+    void addHave(int index);
+    void addRaw(const uint8_t* data, size_t length);  // Pre-framed bytes, e.g. the handshake
+    // Encodes the header and references payload, which must outlive the next flush
+    void addReferenced(PeerMessageType type, const uint8_t* header, size_t header_length,
+                       const uint8_t* payload, size_t length);
+
+    bool empty() const { return buffer.empty() && referenced.empty(); }
+    size_t size() const;  // Bytes queued
+    // The encoded bytes when nothing is referenced, for transports that take one buffer
+    std::vector<uint8_t>& contiguous() { return buffer; }
+
+    // Writes everything to a blocking socket, one sendmsg unless the kernel takes less
+    void flushTo(int sock);
+    void clear();
+
+private:
+    // Spliced into the stream at buffer offset
+    struct Reference {
+        size_t offset;
+        const uint8_t* data;
+        size_t length;
+    };
+
+    uint8_t* appendFrame(PeerMessageType type, size_t payload_length, size_t inline_length);
+
+    std::vector<uint8_t> buffer;
+    std::vector<Reference> referenced;
+    std::vector<iovec> segments;  // Reused by flushTo
+};
@@ -0,0 +1,38 @@
+#include "PeerExchange.hpp"
+#include "../bencode/Bencode.hpp"
+#include <stdexcept>
+
+namespace {
+std::vector<PeerEndpoint> listOf(const nlohmann::json& message, const char* v4_key, const char* v6_key) {
+    std::vector<PeerEndpoint> peers;
+    for (auto [key, v6] : {std::pair{v4_key, false}, std::pair{v6_key, true}}) {
+        if (message.contains(key) && message[key].is_string()) {
+            auto parsed = PeerEndpoint::parseCompact(message[key].get<std::string>(), v6);
+            peers.insert(peers.end(), parsed.begin(), parsed.end());
+        }
+    }
+    return peers;
+}
+}
+
+std::string PeerExchange::encode() const {
+    nlohmann::json message = nlohmann::json::object();
+    for (bool v6 : {false, true}) {
+        std::string compact_added = PeerEndpoint::toCompact(added, v6);
+        std::string suffix = v6 ? "6" : "";
+        message["added" + suffix] = compact_added;
+        // No flags: we know nothing of their encryption or seeding
+        message["added" + suffix + ".f"] = std::string(compact_added.size() / (v6 ? 18 : 6), '\0');
+        message["dropped" + suffix] = PeerEndpoint::toCompact(dropped, v6);
+    }
+    return Bencode::encode(message);
+}
+
+PeerExchange PeerExchange::decode(const uint8_t* data, size_t length) {
+    std::string payload(reinterpret_cast<const char*>(data), length);
+    nlohmann::json message = Bencode::decode(payload);
+    if (!message.is_object()) {
+        throw std::runtime_error("ut_pex message is not a dictionary");
+    }
+    return {listOf(message, "added", "added6"), listOf(message, "dropped", "dropped6")};
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../net/PeerEndpoint.hpp"
+
+// A ut_pex message (BEP 11): the peers the sender connected to and lost
+// since its previous one, as compact IPv4 and IPv6 lists
+struct PeerExchange {
+    static constexpr uint8_t LOCAL_ID = 2;  // ut_pex in our extension handshakes
+    static constexpr size_t MAX_PEERS = 50;  // Per list and message
+    static constexpr std::chrono::seconds INTERVAL{60};  // At most one message per peer a minute
+
+    std::vector<PeerEndpoint> added;
+    std::vector<PeerEndpoint> dropped;
+
+    std::string encode() const;  // The bencoded payload, after the extension message ID
+    // Throws std::runtime_error on a malformed payload
+    static PeerExchange decode(const uint8_t* data, size_t length);
+};
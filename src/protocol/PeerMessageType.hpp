@@ -10,5 +10,12 @@ enum PeerMessageType : uint8_t {
     BITFIELD = 5,
     REQUEST = 6,
     PIECE = 7,
-    CANCEL = 8
-}; 
\ No newline at end of file
+    CANCEL = 8,
+    // Fast Extension (BEP 6)
+    SUGGEST_PIECE = 13,
+    HAVE_ALL = 14,
+    HAVE_NONE = 15,
+    REJECT_REQUEST = 16,
+    ALLOWED_FAST = 17,
+    EXTENDED = 20  // Extension protocol (BEP 10)
+};
@@ -0,0 +1,58 @@
+#include "AllocationCounter.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<uint64_t> total_allocations{0};
+thread_local uint64_t thread_allocations = 0;
+
+void* countedAlloc(std::size_t size) {
+    total_allocations.fetch_add(1, std::memory_order_relaxed);
+    thread_allocations++;
+    return std::malloc(size == 0 ? 1 : size);
+}
+}
+
+uint64_t AllocationCounter::totalAllocations() {
+    return total_allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCounter::threadAllocations() {
+    return thread_allocations;
+}
+
+void* operator new(std::size_t size) {
+    if (void* ptr = countedAlloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
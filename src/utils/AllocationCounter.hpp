@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+
+// Counts calls to the global operator new, in total and per thread
+class AllocationCounter {
+public:
+    static uint64_t totalAllocations();
+    static uint64_t threadAllocations();
+};
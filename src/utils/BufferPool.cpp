@@ -0,0 +1,69 @@
+#include "BufferPool.hpp"
+#include <bit>
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : pool(other.pool), storage(std::move(other.storage)) {
+    other.pool = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        storage = std::move(other.storage);
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+void PooledBuffer::release() {
+    if (pool && storage.capacity() > 0) {
+        pool->recycle(std::move(storage));
+    }
+    pool = nullptr;
+    storage = std::vector<uint8_t>();
+}
+
+size_t BufferPool::sizeClass(size_t size) {
+    return std::bit_ceil(std::max<size_t>(size, 16 * 1024));
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    size_t size_class = sizeClass(size);
+    std::vector<uint8_t> storage;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& free_list = free_lists[size_class];
+        if (!free_list.empty()) {
+            storage = std::move(free_list.back());
+            free_list.pop_back();
+            stats.reused++;
+            stats.idle--;
+        } else {
+            stats.allocated++;
+        }
+    }
+    if (storage.capacity() < size_class) {
+        storage.reserve(size_class);
+    }
+    storage.resize(size);
+    return PooledBuffer(this, std::move(storage));
+}
+
+void BufferPool::recycle(std::vector<uint8_t>&& storage) {
+    size_t size_class = sizeClass(storage.capacity());
+    if (size_class != storage.capacity()) {
+        return;  // Not one of ours (grown or shrunk by its user)
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& free_list = free_lists[size_class];
+    if (free_list.size() < max_idle_per_class) {
+        free_list.push_back(std::move(storage));
+        stats.idle++;
+    }
+}
+
+BufferPool::Stats BufferPool::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+class BufferPool;
+
+// Move-only handle to a pooled byte buffer; the storage goes back to its pool
+// when the handle is destroyed
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool* pool, std::vector<uint8_t>&& storage)
+        : pool(pool), storage(std::move(storage)) {}
+    ~PooledBuffer() { release(); }
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    std::vector<uint8_t>& operator*() { return storage; }
+    const std::vector<uint8_t>& operator*() const { return storage; }
+    std::vector<uint8_t>* operator->() { return &storage; }
+    const std::vector<uint8_t>* operator->() const { return &storage; }
+    bool empty() const { return storage.empty(); }
+    void release();
+
+private:
+    BufferPool* pool = nullptr;
+    std::vector<uint8_t> storage;
+};
+
+// Recycles piece-sized buffers. Requests are rounded up to power-of-two size
+// classes so the short last piece shares buffers with the regular ones.
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t allocated = 0;  // Buffers created from the heap
+        uint64_t reused = 0;     // Buffers handed out from a free list
+        size_t idle = 0;         // Buffers currently parked in the pool
+    };
+
+    explicit BufferPool(size_t max_idle_per_class = 64) : max_idle_per_class(max_idle_per_class) {}
+
+    PooledBuffer acquire(size_t size);
+    Stats getStats() const;
+
+private:
+    friend class PooledBuffer;
+    void recycle(std::vector<uint8_t>&& storage);
+    static size_t sizeClass(size_t size);
+
+    mutable std::mutex mutex;
+    std::map<size_t, std::vector<std::vector<uint8_t>>> free_lists;
+    const size_t max_idle_per_class;
+    Stats stats;
+};
@@ -0,0 +1,147 @@
+#include "FrameReader.hpp"
+#include "SyscallCounter.hpp"
+#include "../protocol/PeerMessageType.hpp"
+#include <sys/socket.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+const size_t PIECE_HEADER_LENGTH = 13;  // Length, type, index and begin
+
+uint32_t readLength(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+}
+
+FrameReader::FrameReader(int sock, size_t capacity) : sock(sock), buffer(capacity) {
+}
+
+FrameView FrameReader::next() {
+    fill(4);
+    uint32_t length = readLength(buffer.data() + head);
+    if (length > MAX_FRAME_LENGTH) {
+        throw std::runtime_error("Message length too large: " + std::to_string(length));
+    }
+    fill(4 + length);
+
+    FrameView frame;
+    frame.length = length;
+    if (length > 0) {
+        frame.type = buffer[head + 4];
+        frame.payload = buffer.data() + head + 5;
+        frame.payload_length = length - 1;
+    }
+    head += 4 + length;
+    return frame;
+}
+
+FrameView FrameReader::nextHeader() {
+    fill(4);
+    uint32_t length = readLength(buffer.data() + head);
+    if (length == 0 || length > MAX_FRAME_LENGTH) {
+        return next();
+    }
+    fill(5);
+    if (buffer[head + 4] != PeerMessageType::PIECE || length < PIECE_HEADER_LENGTH - 4) {
+        return next();
+    }
+    fill(PIECE_HEADER_LENGTH);
+
+    FrameView frame;
+    frame.length = length;
+    frame.type = PeerMessageType::PIECE;
+    frame.payload = buffer.data() + head + 5;
+    frame.payload_length = length - 1;
+    head += PIECE_HEADER_LENGTH;
+    block_remaining = length - (PIECE_HEADER_LENGTH - 4);
+    return frame;
+}
+
+void FrameReader::readBlock(uint8_t* destination) {
+    size_t buffered = std::min(block_remaining, tail - head);
+    std::memcpy(destination, buffer.data() + head, buffered);
+    head += buffered;
+    destination += buffered;
+    block_remaining -= buffered;
+    if (block_remaining == 0) {
+        return;
+    }
+
+    head = tail = 0;  // Everything buffered belonged to the block
+    while (block_remaining > 0) {
+        iovec parts[2] = {{destination, block_remaining}, {buffer.data() + tail, buffer.size() - tail}};
+        size_t received = receive(parts, 2);
+        size_t direct = std::min(received, block_remaining);
+        destination += direct;
+        block_remaining -= direct;
+        tail += received - direct;
+    }
+}
+
+void FrameReader::skipBlock() {
+    while (block_remaining > 0) {
+        if (head == tail) {
+            head = tail = 0;
+            iovec part{buffer.data(), buffer.size()};
+            tail = receive(&part, 1);
+        }
+        size_t skipped = std::min(block_remaining, tail - head);
+        head += skipped;
+        block_remaining -= skipped;
+    }
+}
+
+bool FrameReader::hasFrame() const {
+    size_t unread = tail - head;
+    return unread >= 4 && unread >= 4 + static_cast<size_t>(readLength(buffer.data() + head));
+}
+
+std::vector<uint8_t> FrameReader::takeBuffered() {
+    std::vector<uint8_t> rest(buffer.begin() + head, buffer.begin() + tail);
+    head = tail = 0;
+    return rest;
+}
+
+void FrameReader::fill(size_t wanted) {
+    if (tail - head >= wanted) {
+        return;
+    }
+    if (buffer.size() - head < wanted) {
+        // Slide the unread bytes to the front; grow only for oversized messages
+        std::memmove(buffer.data(), buffer.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+        if (buffer.size() < wanted) {
+            buffer.resize(wanted);
+        }
+    }
+    while (tail - head < wanted) {
+        iovec part{buffer.data() + tail, buffer.size() - tail};
+        tail += receive(&part, 1);
+    }
+}
+
+size_t FrameReader::receive(iovec* parts, size_t count) {
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = count;
+    while (true) {
+        SyscallCounter::record();
+        ssize_t received = recvmsg(sock, &message, 0);
+        if (received == 0) {
+            throw std::runtime_error("Connection closed by peer");
+        }
+        if (received > 0) {
+            return received;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            throw std::runtime_error("Timed out waiting for the peer");
+        }
+        if (errno != EINTR) {
+            throw std::runtime_error("Failed to receive message: " + std::string(std::strerror(errno)));
+        }
+    }
+}
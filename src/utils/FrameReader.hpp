@@ -0,0 +1,47 @@
+#pragma once
+#include <sys/uio.h>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// One peer wire message inside a FrameReader's buffer; valid until the next read
+struct FrameView {
+    uint32_t length = 0;  // Type byte plus payload; 0 for a keep-alive
+    uint8_t type = 0;
+    const uint8_t* payload = nullptr;
+    size_t payload_length = 0;
+};
+
+// Cuts a blocking socket's byte stream into length-prefixed peer messages.
+// Reads take whatever the kernel has, up to the free buffer space, so one recv
+// usually yields many messages. Consumed bytes are reclaimed by sliding the
+// unread tail to the front, which keeps every message contiguous.
+class FrameReader {
+public:
+    static constexpr uint32_t MAX_FRAME_LENGTH = 1 << 20;  // Bitfields of large torrents
+
+    explicit FrameReader(int sock, size_t capacity = 64 * 1024);
+
+    FrameView next();  // Blocks until a whole message is buffered; throws on EOF or error
+    // Like next(), but a PIECE returns as soon as its index and begin are in:
+    // payload_length still covers the block, of which only the first 8 bytes
+    // are buffered. Take the block with readBlock or skipBlock before reading on.
+    FrameView nextHeader();
+    // Receives the pending block into destination; bytes not yet buffered go
+    // straight from the socket, with whatever follows them landing in the buffer
+    void readBlock(uint8_t* destination);
+    void skipBlock();
+    bool hasFrame() const;  // A whole message is buffered already
+    // Bytes received past the last returned message, for whoever reads the socket next
+    std::vector<uint8_t> takeBuffered();
+
+private:
+    void fill(size_t wanted);  // Receives until wanted unread bytes are buffered
+    size_t receive(iovec* parts, size_t count);  // One recvmsg; throws on EOF or error
+
+    int sock;
+    std::vector<uint8_t> buffer;
+    size_t head = 0;  // First unread byte
+    size_t tail = 0;  // One past the last received byte
+    size_t block_remaining = 0;  // PIECE bytes after the header nextHeader returned
+};
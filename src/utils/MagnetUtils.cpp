@@ -1,5 +1,6 @@
 #include "MagnetUtils.hpp"
 #include <string>
+#include <algorithm>
 #include <iomanip>
 #include <cctype>
 #include <sstream>
@@ -7,12 +8,54 @@
 #include <vector>
 #include <iostream>
 #include <sys/socket.h>
+#include <cerrno>
 #include "../protocol/PeerMessageType.hpp"
+#include "../protocol/PeerExchange.hpp"
 #include "../utils/SHA1.hpp"
+#include "../utils/TorrentUtils.hpp"
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
 
+namespace {
+const uint32_t MAX_MESSAGE_LENGTH = 1 << 20;
+const uint8_t LOCAL_UT_METADATA_ID = 1;  // What our extension handshake advertises
+
+void receiveExact(int sock, uint8_t* data, size_t length, const std::string& what) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t n = recv(sock, data + received, length - received, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to receive " + what);
+        }
+        received += n;
+    }
+}
+
+// The next message other than a keep-alive; returns its type
+uint8_t receivePeerMessage(int sock, std::vector<uint8_t>& payload) {
+    while (true) {
+        uint8_t length_buf[4];
+        receiveExact(sock, length_buf, 4, "message length");
+        uint32_t length = (length_buf[0] << 24) | (length_buf[1] << 16) | (length_buf[2] << 8) | length_buf[3];
+        if (length == 0) {
+            continue;  // Keep-alive
+        }
+        if (length > MAX_MESSAGE_LENGTH) {
+            throw std::runtime_error("Message length too large: " + std::to_string(length));
+        }
+        uint8_t type;
+        receiveExact(sock, &type, 1, "message type");
+        payload.resize(length - 1);
+        receiveExact(sock, payload.data(), payload.size(), "message payload");
+        return type;
+    }
+}
+}
+
 size_t MagnetUtils::writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
     ((std::string*)userp)->append((char*)contents, size * nmemb);
     return size * nmemb;
@@ -111,10 +154,11 @@ HandshakeResult MagnetUtils::performHandshake(int sock, const std::string& info_
     handshake.push_back(19);
     handshake.insert(handshake.end(), protocol.begin(), protocol.end());
     
-    // Supported extensions
+    // Supported extensions: extension protocol and Fast Extension
     handshake.insert(handshake.end(), 5, 0x00);
     handshake.insert(handshake.end(), 0x10);
-    handshake.insert(handshake.end(), 2, 0x00);
+    handshake.insert(handshake.end(), 0x00);
+    handshake.insert(handshake.end(), 0x04);
     
     // Info hash
     handshake.insert(handshake.end(), info_hash.begin(), info_hash.end());
@@ -129,9 +173,7 @@ HandshakeResult MagnetUtils::performHandshake(int sock, const std::string& info_
     
     // Receive base handshake response
     std::vector<uint8_t> response(68);
-    if (recv(sock, response.data(), response.size(), 0) != response.size()) {
-        throw std::runtime_error("Failed to receive handshake");
-    }
+    receiveExact(sock, response.data(), response.size(), "handshake");
     
     // Extract and format peer ID from response
     std::string received_peer_id(response.begin() + 48, response.end());
@@ -146,110 +188,113 @@ HandshakeResult MagnetUtils::performHandshake(int sock, const std::string& info_
         std::cout << "Peer ID: " << ss.str() << std::endl;
     }
 
-    // TBD: send the bitfield message
-
-    
-    // Receive the bitfield message
-    uint8_t bitfield_length_buf[4];
-    if (recv(sock, bitfield_length_buf, 4, 0) != 4) {
-        throw std::runtime_error("Failed to receive bitfield length");
+    // Without the extension protocol there is no metadata to fetch
+    HandshakeResult result;
+    result.fast_extension = TorrentUtils::supportsFastExtension(response.data());
+    bool supports_extension = (response[25] & 0x10) != 0;
+    if (!supports_extension) {
+        return result;
     }
-    uint32_t bitfield_length = (bitfield_length_buf[0] << 24) | (bitfield_length_buf[1] << 16) | 
-                             (bitfield_length_buf[2] << 8) | bitfield_length_buf[3];
 
-    // Receive the bitfield message type
-    uint8_t msg_type;
-    if (recv(sock, &msg_type, 1, 0) != 1) {  
-        throw std::runtime_error("Failed to receive bitfield message type");
-    }
-    if (msg_type != static_cast<uint8_t>(PeerMessageType::BITFIELD)) {  
-        throw std::runtime_error("Expected bitfield message, got: " + std::to_string(msg_type));
-    }
+    // Create the extension handshake payload
+    nlohmann::json payload;
+    payload["m"] = nlohmann::json::object();
+    payload["m"]["ut_metadata"] = LOCAL_UT_METADATA_ID;
+    payload["m"]["ut_pex"] = PeerExchange::LOCAL_ID;
+    payload["metadata_size"] = 0;
+    
+    // Bencode the payload
+    std::string payload_str = Bencode::encode(payload);
+    
+    // Calculate the message length (payload size + 2 bytes for message IDs)
+    uint32_t message_length = payload_str.size() + 2;
+    
+    // Construct the complete extension handshake message
+    std::vector<uint8_t> extension_handshake;
+    extension_handshake.reserve(11 + payload_str.size());
 
-    std::vector<uint8_t> bitfield(bitfield_length - 1);
-    if (recv(sock, bitfield.data(), bitfield.size(), 0) != bitfield.size()) {
-        throw std::runtime_error("Failed to receive bitfield");
+    // With the Fast Extension our first message has to say what we have
+    if (result.fast_extension) {
+        const uint8_t have_none[] = {0, 0, 0, 1, PeerMessageType::HAVE_NONE};
+        extension_handshake.insert(extension_handshake.end(), have_none, have_none + 5);
     }
-
-    // Check extension bits
-    bool supports_extension = (response[25] & 0x10) != 0;
-    if (supports_extension) {
-        // Create the extension handshake payload
-        nlohmann::json payload;
-        payload["m"] = nlohmann::json::object();
-        payload["m"]["ut_metadata"] = 1;
-        payload["metadata_size"] = 0;
-        
-        // Bencode the payload
-        std::string payload_str = Bencode::encode(payload);
-        
-        // Calculate the message length (payload size + 2 bytes for message IDs)
-        uint32_t message_length = payload_str.size() + 2;
-        
-        // Construct the complete extension handshake message
-        std::vector<uint8_t> extension_handshake;
-        extension_handshake.reserve(6 + payload_str.size());
-        
-        // Add length prefix (4 bytes, big-endian)
-        extension_handshake.push_back((message_length >> 24) & 0xFF);
-        extension_handshake.push_back((message_length >> 16) & 0xFF);
-        extension_handshake.push_back((message_length >> 8) & 0xFF);
-        extension_handshake.push_back(message_length & 0xFF);
-        
-        // Add message ID (1 byte)
-        extension_handshake.push_back(20);  // 20 for extension protocol
-        
-        // Add extension message ID (1 byte)
-        extension_handshake.push_back(0);   // 0 for handshake
-        
-        // Add bencoded payload
-        extension_handshake.insert(extension_handshake.end(), 
-                                  payload_str.begin(), payload_str.end());
-        
-        // Send the extension handshake
-        if (send(sock, extension_handshake.data(), extension_handshake.size(), 0) != 
-                static_cast<ssize_t>(extension_handshake.size())) {
-            throw std::runtime_error("Failed to send extension handshake");
-        }
-
-        // Receive the extension handshake response
-        // First receive the message length (4 bytes)
-        uint8_t length_buf[4];
-        if (recv(sock, length_buf, 4, 0) != 4) {
-            throw std::runtime_error("Failed to receive extension handshake length");
-        }
-
-        uint32_t received_message_length = (length_buf[0] << 24) | (length_buf[1] << 16) | 
-                                 (length_buf[2] << 8) | length_buf[3];
-
-        // Receive message type (1 byte)
-        uint8_t message_type;
-        if (recv(sock, &message_type, 1, 0) != 1) {
-            throw std::runtime_error("Failed to receive extension message type");
+    
+    // Add length prefix (4 bytes, big-endian)
+    extension_handshake.push_back((message_length >> 24) & 0xFF);
+    extension_handshake.push_back((message_length >> 16) & 0xFF);
+    extension_handshake.push_back((message_length >> 8) & 0xFF);
+    extension_handshake.push_back(message_length & 0xFF);
+    
+    // Add message ID (1 byte)
+    extension_handshake.push_back(20);  // 20 for extension protocol
+    
+    // Add extension message ID (1 byte)
+    extension_handshake.push_back(0);   // 0 for handshake
+    
+    // Add bencoded payload
+    extension_handshake.insert(extension_handshake.end(), 
+                              payload_str.begin(), payload_str.end());
+    
+    // Send the extension handshake
+    if (send(sock, extension_handshake.data(), extension_handshake.size(), 0) != 
+            static_cast<ssize_t>(extension_handshake.size())) {
+        throw std::runtime_error("Failed to send extension handshake");
+    }
+
+    // The BITFIELD is optional and HAVEs or keep-alives may come in any order
+    // around the peer's extension handshake; collect the availability on the way
+    std::vector<uint8_t> received_payload_bytes;
+    std::vector<uint8_t>& bitfield = result.bitfield;
+    bool first_message = true;
+    while (true) {
+        uint8_t type = receivePeerMessage(sock, received_payload_bytes);
+        if (type == PeerMessageType::EXTENDED && !received_payload_bytes.empty() && received_payload_bytes[0] == 0) {
+            break;
         }
-        // Receive extension message ID (1 byte)
-        uint8_t ext_message_id;
-        if (recv(sock, &ext_message_id, 1, 0) != 1) {
-            throw std::runtime_error("Failed to receive extension message ID");
+        uint32_t index = 0;
+        if (received_payload_bytes.size() >= 4) {
+            index = (received_payload_bytes[0] << 24) | (received_payload_bytes[1] << 16) |
+                    (received_payload_bytes[2] << 8) | received_payload_bytes[3];
         }
-        // Receive payload (message_length - 2 bytes for the IDs)
-        std::vector<uint8_t> received_payload_bytes(received_message_length - 2);
-        if (recv(sock, received_payload_bytes.data(), received_payload_bytes.size(), 0) != received_payload_bytes.size()) {
-            throw std::runtime_error("Failed to receive extension handshake payload");
+        if (type == PeerMessageType::BITFIELD && first_message) {
+            bitfield = received_payload_bytes;
+        } else if (type == PeerMessageType::HAVE_ALL && first_message && result.fast_extension) {
+            result.have_all = true;
+        } else if (type == PeerMessageType::HAVE && received_payload_bytes.size() >= 4) {
+            if (index < MAX_MESSAGE_LENGTH * 8) {
+                if (index / 8 >= bitfield.size()) {
+                    bitfield.resize(index / 8 + 1);
+                }
+                bitfield[index / 8] |= 0x80 >> (index % 8);
+            }
+        } else if (type == PeerMessageType::ALLOWED_FAST && result.fast_extension &&
+                   received_payload_bytes.size() >= 4 && index < MAX_MESSAGE_LENGTH * 8 &&
+                   result.allowed_fast.size() < HandshakeResult::MAX_ALLOWED_FAST &&
+                   std::find(result.allowed_fast.begin(), result.allowed_fast.end(), index) ==
+                       result.allowed_fast.end()) {
+            result.allowed_fast.push_back(index);
         }
+        first_message = false;
+    }
+    received_payload_bytes.erase(received_payload_bytes.begin());  // Extension message ID
 
-        // Convert payload to string and decode
-        std::string received_payload_str(received_payload_bytes.begin(), received_payload_bytes.end());
-        nlohmann::json received_payload = Bencode::decode(received_payload_str);
-        if (received_payload.contains("m") && received_payload["m"].contains("ut_metadata")) {
-            int extension_id = received_payload["m"]["ut_metadata"].get<int>();
-            if (!silent) {
-                std::cout << "Peer Metadata Extension ID: " << extension_id << std::endl;
-            }
-            return HandshakeResult{extension_id, bitfield};
+    // Convert payload to string and decode
+    std::string received_payload_str(received_payload_bytes.begin(), received_payload_bytes.end());
+    nlohmann::json received_payload = Bencode::decode(received_payload_str);
+    if (received_payload.contains("m") && received_payload["m"].contains("ut_pex") &&
+        received_payload["m"]["ut_pex"].is_number_integer()) {
+        result.pex_id = received_payload["m"]["ut_pex"].get<int>();
+    }
+    if (received_payload.contains("m") && received_payload["m"].contains("ut_metadata")) {
+        result.extension_id = received_payload["m"]["ut_metadata"].get<int>();
+        if (received_payload.contains("reqq") && received_payload["reqq"].is_number_integer()) {
+            result.reqq = received_payload["reqq"].get<int>();
+        }
+        if (!silent) {
+            std::cout << "Peer Metadata Extension ID: " << result.extension_id << std::endl;
         }
     }
-    return HandshakeResult{-1, bitfield};
+    return result;
 }
 
 void MagnetUtils::requestMetadata(int sock, int extension_id) {
@@ -293,35 +338,12 @@ void MagnetUtils::requestMetadata(int sock, int extension_id) {
 }
 
 nlohmann::json MagnetUtils::receiveMetadata(int sock, const std::string& info_hash) {
-    // Receive message length (4 bytes)
-    uint8_t length_buf[4];
-    if (recv(sock, length_buf, 4, 0) != 4) {
-        throw std::runtime_error("Failed to receive data message length");
-    }
-
-    uint32_t received_message_length = (length_buf[0] << 24) | (length_buf[1] << 16) | 
-                                 (length_buf[2] << 8) | length_buf[3];
-
-    // Receive message id (1 byte)
-    uint8_t message_id;
-    if (recv(sock, &message_id, 1, 0) != 1) {
-        throw std::runtime_error("Failed to receive message id");
-    }
-    // Validate message id
-    if (message_id != 20) {
-        throw std::runtime_error("Received message ID is expected to be 20, but got " + std::to_string(message_id));
-    }
-    // Receive extension message ID (1 byte)
-    uint8_t ext_message_id;
-    if (recv(sock, &ext_message_id, 1, 0) != 1) {
-        throw std::runtime_error("Failed to receive extension message ID");
-    }
-
-    // Receive payload (message_length - 2 bytes for the IDs)
-    std::vector<uint8_t> received_payload_bytes(received_message_length - 2);
-    if (recv(sock, received_payload_bytes.data(), received_payload_bytes.size(), 0) != received_payload_bytes.size()) {
-        throw std::runtime_error("Failed to receive data message payload");
+    // Skip whatever else the peer sends until our ut_metadata answer
+    std::vector<uint8_t> received_payload_bytes;
+    while (receivePeerMessage(sock, received_payload_bytes) != PeerMessageType::EXTENDED ||
+           received_payload_bytes.empty() || received_payload_bytes[0] != LOCAL_UT_METADATA_ID) {
     }
+    received_payload_bytes.erase(received_payload_bytes.begin());  // Extension message ID
 
     // Seperate metadata from payload
     size_t dict_end = 0;
@@ -370,11 +392,11 @@ nlohmann::json MagnetUtils::receiveMetadata(int sock, const std::string& info_ha
     nlohmann::json metadata = Bencode::decode(metadata_str);
     if (!metadata.contains("pieces") || 
         !metadata.contains("piece length") || 
-        !metadata.contains("length")) {
+        (!metadata.contains("length") && !metadata.contains("files"))) {
         throw std::runtime_error("Received metadata does not contain pieces, piece length, or length");
     }
 
-    std::cout << "Length: " << metadata["length"].get<int>() << std::endl;
+    std::cout << "Length: " << TorrentUtils::getTotalLength(metadata) << std::endl;
     std::cout << "Info Hash: " << info_hash << std::endl;
     std::cout << "Piece Length: " << metadata["piece length"].get<int>() << std::endl;
     std::string pieces = metadata["pieces"].get<std::string>();
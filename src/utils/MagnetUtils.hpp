@@ -5,8 +5,15 @@
 
 // Add this struct to hold handshake results
 struct HandshakeResult {
-    int extension_id;
+    static constexpr size_t MAX_ALLOWED_FAST = 64;  // BEP 6 suggests sets of 10
+
+    int extension_id = -1;  // The peer's ut_metadata message ID, -1 without it
     std::vector<uint8_t> bitfield;
+    int reqq = 0;  // Requests the peer queues at most (extension handshake), 0 if unknown
+    bool fast_extension = false;  // Both sides set the BEP 6 bit; we have sent HAVE_NONE
+    bool have_all = false;  // HAVE_ALL instead of a bitfield
+    std::vector<int> allowed_fast;  // Pieces we may request while choked, at most MAX_ALLOWED_FAST
+    int pex_id = 0;  // The peer's ut_pex message ID, 0 without PEX
 };
 
 class MagnetUtils {
@@ -2,19 +2,48 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <chrono>
 #include "../protocol/PeerMessageType.hpp"
+#include "FrameReader.hpp"
+#include "../protocol/MessageWriter.hpp"
 
 class PeerUtils {
 public:
-    explicit PeerUtils(int socket_fd) : sock(socket_fd) {}
+    explicit PeerUtils(int socket_fd) : sock(socket_fd), reader(socket_fd) {}
+    ~PeerUtils();
+    PeerUtils(const PeerUtils&) = delete;
+    PeerUtils& operator=(const PeerUtils&) = delete;
     
-    static std::pair<std::string, int> parsePeerAddress(const std::string& peer_addr);
-    static std::pair<std::string, int> parsePeerAddress(const std::string& peers_data, int offset);
-    void receiveMessage(unsigned char* msg_length_buf, char& msg_type, std::vector<uint8_t>& payload);
+    // The next message in place, keep-alives included; valid until the next receive
+    FrameView receiveFrame() { return reader.next(); }
+    // The next message, but a PIECE only up to its header; the block follows
+    // through receiveBlock (straight into its destination) or skipBlock
+    FrameView receiveHeader() { return reader.nextHeader(); }
+    void receiveBlock(uint8_t* destination) { reader.readBlock(destination); }
+    void skipBlock() { reader.skipBlock(); }
+    bool hasBufferedFrame() const { return reader.hasFrame(); }
+    // Received bytes not yet returned as messages, e.g. when a session takes over
+    std::vector<uint8_t> takeBuffered() { return reader.takeBuffered(); }
+    // Bounds every blocking read; reads that wait longer throw
+    void setReceiveTimeout(std::chrono::milliseconds timeout);
+    // While corked, messages queue up and leave together in one sendmsg at uncork()
+    void cork() { corked = true; }
+    void uncork();
+    void flush() { outgoing.flushTo(sock); }  // Sends whatever was queued through writer()
+    // The connection's outgoing queue, for callers that encode or flush themselves
+    MessageWriter& writer() { return outgoing; }
     void sendMessage(PeerMessageType msg_type, const std::vector<uint8_t>& payload);
+    void sendMessage(PeerMessageType msg_type, const uint8_t* payload, size_t payload_length);
     
     // This could be static as it doesn't depend on socket
     static void addIntToPayload(std::vector<uint8_t>& payload, int value, int offset);
+    static void addIntToPayload(uint8_t* payload, int value, int offset);
 private:
-    int sock; 
+    static constexpr size_t INLINE_PAYLOAD = 64;
+
+    int sock;
+    FrameReader reader;
+    MessageWriter outgoing;
+    bool corked = false;
+    std::chrono::milliseconds receive_timeout{0};  // What the socket has; 0 waits forever
 };   
\ No newline at end of file
@@ -1,14 +1,18 @@
 #include "SHA1.hpp"
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <sstream>
 #include <iomanip>
+#include <stdexcept>
 
 std::array<unsigned char, 20> SHA1::calculate(const std::string& input) {
+    return calculate(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+}
+
+std::array<unsigned char, 20> SHA1::calculate(const uint8_t* data, size_t length) {
     std::array<unsigned char, 20> hash;
-    SHA_CTX context;
-    SHA1_Init(&context);
-    SHA1_Update(&context, input.c_str(), input.length());
-    SHA1_Final(hash.data(), &context);
+    if (EVP_Digest(data, length, hash.data(), nullptr, EVP_sha1(), nullptr) != 1) {
+        throw std::runtime_error("SHA1 digest failed");
+    }
     return hash;
 }
 
@@ -0,0 +1,13 @@
+#include "SyscallCounter.hpp"
+
+namespace {
+thread_local uint64_t thread_syscalls = 0;
+}
+
+void SyscallCounter::record(uint64_t count) {
+    thread_syscalls += count;
+}
+
+uint64_t SyscallCounter::threadSyscalls() {
+    return thread_syscalls;
+}
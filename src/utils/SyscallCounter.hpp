@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+
+// Counts network syscalls per thread. The I/O paths call record() next to each
+// recv, send, epoll_wait and io_uring_enter they issue.
+class SyscallCounter {
+public:
+    static void record(uint64_t count = 1);
+    static uint64_t threadSyscalls();
+};
@@ -7,6 +7,9 @@
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
 
 size_t TorrentUtils::writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
     ((std::string*)userp)->append((char*)contents, size * nmemb);
@@ -15,7 +18,7 @@ size_t TorrentUtils::writeCallback(void* contents, size_t size, size_t nmemb, vo
 
 std::string TorrentUtils::makeTrackerRequest(const std::string& announce_url, 
                                            const std::string& info_hash,
-                                           int64_t length) {
+                                           int64_t length, int port) {
     CURL* curl = curl_easy_init();
     std::string response;
     
@@ -25,7 +28,7 @@ std::string TorrentUtils::makeTrackerRequest(const std::string& announce_url,
         ss << announce_url
            << "?info_hash=" << urlEncode(reinterpret_cast<const unsigned char*>(info_hash.c_str()), 20)
            << "&peer_id=" << urlEncode(reinterpret_cast<const unsigned char*>(peer_id.c_str()), 20)
-           << "&port=6881"
+           << "&port=" << port
            << "&uploaded=0"
            << "&downloaded=0"
            << "&left=" << length
@@ -60,8 +63,7 @@ std::string TorrentUtils::urlEncode(const unsigned char* data, size_t len) {
     return ss.str();
 }
 
-void TorrentUtils::performHandshake(int sock, const std::string& info_hash) {
-    // Send handshake
+std::vector<uint8_t> TorrentUtils::buildHandshake(const std::string& info_hash, bool extension_protocol) {
     std::string protocol = "BitTorrent protocol";
     std::vector<uint8_t> handshake;
     handshake.reserve(68);  // Total handshake length
@@ -70,8 +72,12 @@ void TorrentUtils::performHandshake(int sock, const std::string& info_hash) {
     handshake.push_back(19);
     handshake.insert(handshake.end(), protocol.begin(), protocol.end());
     
-    // Reserved bytes
+    // Reserved bytes: Fast Extension, and the extension protocol if asked for
     handshake.insert(handshake.end(), 8, 0);
+    handshake.back() |= 0x04;
+    if (extension_protocol) {
+        handshake[20 + 5] |= 0x10;
+    }
     
     // Info hash
     handshake.insert(handshake.end(), info_hash.begin(), info_hash.end());
@@ -79,14 +85,25 @@ void TorrentUtils::performHandshake(int sock, const std::string& info_hash) {
     // Peer ID (random 20 bytes)
     std::string peer_id = "1a0e74aeaff2e16395e2";
     handshake.insert(handshake.end(), peer_id.begin(), peer_id.end());
-    
+    return handshake;
+}
+
+bool TorrentUtils::checkHandshake(const uint8_t* response, const std::string& info_hash) {
+    static const char protocol[] = "\x13" "BitTorrent protocol";
+    return std::memcmp(response, protocol, 20) == 0 &&
+           info_hash.size() == 20 && std::memcmp(response + 28, info_hash.data(), 20) == 0;
+}
+
+std::vector<uint8_t> TorrentUtils::performHandshake(int sock, const std::string& info_hash) {
+    // Send handshake
+    std::vector<uint8_t> handshake = buildHandshake(info_hash);
     if (send(sock, handshake.data(), handshake.size(), 0) != handshake.size()) {
         throw std::runtime_error("Failed to send handshake");
     }
     
     // Receive handshake response
     std::vector<uint8_t> response(68);
-    if (recv(sock, response.data(), response.size(), 0) != response.size()) {
+    if (recv(sock, response.data(), response.size(), MSG_WAITALL) != response.size()) {
         throw std::runtime_error("Failed to receive handshake");
     }
     
@@ -100,6 +117,29 @@ void TorrentUtils::performHandshake(int sock, const std::string& info_hash) {
     }
     
     std::cout << "Peer ID: " << ss.str() << std::endl;
+    return response;
+}
+
+std::vector<PeerEndpoint> TorrentUtils::parseTrackerPeers(const nlohmann::json& response) {
+    std::vector<PeerEndpoint> peers;
+    if (response.contains("peers")) {
+        const auto& list = response["peers"];
+        if (list.is_string()) {
+            peers = PeerEndpoint::parseCompact(list.get<std::string>(), false);
+        } else if (list.is_array()) {
+            for (const auto& entry : list) {
+                if (entry.is_object() && entry.contains("ip") && entry["ip"].is_string() &&
+                    entry.contains("port") && entry["port"].is_number_integer()) {
+                    peers.push_back({entry["ip"].get<std::string>(), entry["port"].get<int>()});
+                }
+            }
+        }
+    }
+    if (response.contains("peers6") && response["peers6"].is_string()) {
+        auto v6 = PeerEndpoint::parseCompact(response["peers6"].get<std::string>(), true);
+        peers.insert(peers.end(), v6.begin(), v6.end());
+    }
+    return peers;
 }
 
 std::string TorrentUtils::readTorrentFile(const std::string& filepath) {
@@ -111,4 +151,92 @@ std::string TorrentUtils::readTorrentFile(const std::string& filepath) {
     std::stringstream buffer;
     buffer << file.rdbuf();
     return buffer.str();
-} 
\ No newline at end of file
+} 
+
+std::vector<TorrentFile> TorrentUtils::getFiles(const nlohmann::json& info) {
+    std::vector<TorrentFile> files;
+    if (!info.contains("files")) {
+        files.push_back({info.value("name", ""), 0, info["length"].get<int64_t>()});
+        return files;
+    }
+
+    int64_t offset = 0;
+    for (const auto& entry : info["files"]) {
+        std::string path;
+        for (const auto& component : entry["path"]) {
+            if (!path.empty()) {
+                path += "/";
+            }
+            path += component.get<std::string>();
+        }
+        int64_t length = entry["length"].get<int64_t>();
+        files.push_back({path, offset, length});
+        offset += length;
+    }
+    return files;
+}
+
+int64_t TorrentUtils::getTotalLength(const nlohmann::json& info) {
+    if (info.contains("length")) {
+        return info["length"].get<int64_t>();
+    }
+    auto files = getFiles(info);
+    return files.empty() ? 0 : files.back().offset + files.back().length;
+}
+
+ByteSelection TorrentUtils::resolveSelection(const nlohmann::json& info,
+                                             const std::string& file,
+                                             const std::string& range) {
+    ByteSelection selection{0, getTotalLength(info), 0};
+
+    if (!file.empty()) {
+        auto files = getFiles(info);
+        auto it = std::find_if(files.begin(), files.end(),
+            [&file](const TorrentFile& f) { return f.path == file; });
+        if (it == files.end() && std::all_of(file.begin(), file.end(),
+                [](unsigned char c) { return std::isdigit(c); })) {
+            // Too long to be an index, it matches no file either
+            size_t index = file.size() < 10 ? std::stoul(file) : files.size();
+            it = index < files.size() ? files.begin() + index : files.end();
+        }
+        if (it == files.end()) {
+            throw std::runtime_error("No such file in torrent: " + file);
+        }
+        selection = {it->offset, it->offset + it->length, it->offset};
+    }
+
+    if (!range.empty()) {
+        size_t colon = range.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("Invalid range format. Expected: <start>:<end>");
+        }
+        int64_t length = selection.end - selection.start;
+        int64_t start = -1;
+        int64_t end = length;
+        try {
+            size_t used = 0;
+            start = std::stoll(range.substr(0, colon), &used);
+            if (used != colon) {
+                start = -1;
+            }
+            if (colon + 1 < range.size()) {
+                end = std::stoll(range.substr(colon + 1), &used);
+                if (used != range.size() - colon - 1) {
+                    start = -1;
+                }
+            }
+        } catch (const std::logic_error&) {
+            start = -1;  // Not a number, or out of range
+        }
+        if (start < 0 || end > length || start >= end) {
+            throw std::runtime_error("Invalid range " + range + " for 0:" + std::to_string(length));
+        }
+        selection.end = selection.start + end;
+        selection.start += start;
+    }
+
+    if (selection.start >= selection.end) {
+        throw std::runtime_error("Nothing selected to download");
+    }
+    return selection;
+}
\ No newline at end of file
@@ -1,14 +1,51 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <cstdint>
+#include <nlohmann/json.hpp>
+#include "../net/PeerEndpoint.hpp"
+
+// One file of a (possibly multi-file) torrent, placed in the torrent's byte stream
+struct TorrentFile {
+    std::string path;
+    int64_t offset;
+    int64_t length;
+};
+
+// Bytes of the torrent to download and where they go in the output file
+struct ByteSelection {
+    int64_t start;
+    int64_t end;          // exclusive
+    int64_t output_base;  // torrent offset that maps to output offset 0
+};
 
 class TorrentUtils {
 public:
+    // length: bytes left to download; port: where we accept peers
     static std::string makeTrackerRequest(const std::string& announce_url, 
                                         const std::string& info_hash,
-                                        int64_t length);
-    static void performHandshake(int sock, const std::string& info_hash);
+                                        int64_t length, int port = 6881);
+    // Returns the peer's 68-byte handshake
+    static std::vector<uint8_t> performHandshake(int sock, const std::string& info_hash);
+    // 68 bytes, advertising the Fast Extension in the reserved bits, and the
+    // extension protocol (BEP 10) for callers that send its handshake
+    static std::vector<uint8_t> buildHandshake(const std::string& info_hash, bool extension_protocol = false);
+    // Reserved bits of a received handshake (BEP 6, BEP 10); only in use when both sides set them
+    static bool supportsFastExtension(const uint8_t* handshake) { return handshake[27] & 0x04; }
+    static bool supportsExtensionProtocol(const uint8_t* handshake) { return handshake[25] & 0x10; }
+    // Protocol string and info hash of a received 68-byte handshake
+    static bool checkHandshake(const uint8_t* response, const std::string& info_hash);
+    // Every peer of a decoded announce response: compact "peers" (IPv4),
+    // compact "peers6" (IPv6, BEP 7) and the original list of dictionaries
+    static std::vector<PeerEndpoint> parseTrackerPeers(const nlohmann::json& response);
     static std::string urlEncode(const unsigned char* data, size_t len);
     static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp);
     static std::string readTorrentFile(const std::string& filepath);
+    static std::vector<TorrentFile> getFiles(const nlohmann::json& info);
+    static int64_t getTotalLength(const nlohmann::json& info);
+    // file: index or path of one file (empty for all); range: "start:end" in bytes,
+    // relative to the chosen file, end exclusive and optional (empty for everything)
+    static ByteSelection resolveSelection(const nlohmann::json& info,
+                                          const std::string& file,
+                                          const std::string& range);
 }; 
\ No newline at end of file